@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_COROUTINE_H
+#define TM_COROUTINE_H
+
+#include "tm_thread_pool.h"
+
+/**
+ * tm_coroutine_scheduler_t - Teemo coroutine scheduler data structure
+ *
+ * Coroutines have their own stack and run on workers of a thread pool. When
+ * one wait on tm_coroutine_sleep, tm_coroutine_queue_pop or
+ * tm_coroutine_group_wait, it give the worker back and is committed again
+ * once it can go on, maybe on another worker.
+ *
+ * @priv: Teemo coroutine scheduler private data
+ * */
+typedef struct tm_coroutine_scheduler_s {
+	void *priv;
+} tm_coroutine_scheduler_t;
+
+/**
+ * tm_coroutine_group_t - Teemo coroutine group data structure
+ *
+ * Count coroutines spawned into it, tm_coroutine_group_wait return when all
+ * of them are done.
+ *
+ * @priv: Teemo coroutine group private data
+ * */
+typedef struct tm_coroutine_group_s {
+	void *priv;
+} tm_coroutine_group_t;
+
+/**
+ * tm_coroutine_queue_t - Teemo coroutine queue data structure
+ *
+ * FIFO queue, tm_coroutine_queue_pop wait while it is empty.
+ *
+ * @priv: Teemo coroutine queue private data
+ * */
+typedef struct tm_coroutine_queue_s {
+	void *priv;
+} tm_coroutine_queue_t;
+
+/**
+ * tm_coroutine_entry_t - Coroutine entry function type
+ *
+ * @arg: Argument given to tm_coroutine_spawn
+ * */
+typedef void (*tm_coroutine_entry_t)(void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_coroutine_scheduler_init - Initialize a coroutine scheduler
+ *
+ * Stacks are mapped with a guard page below them, and kept for reuse after
+ * coroutine is done.
+ *
+ * @scheduler: Point to the scheduler
+ *
+ * @thread_pool: Thread pool to run coroutines, must be destroyed after
+ *		 @scheduler
+ *
+ * @stack_size: Stack size of each coroutine, 0 for 64KB
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_scheduler_init(tm_coroutine_scheduler_t *scheduler,
+				tm_thread_pool_t *thread_pool,
+				unsigned long stack_size);
+
+/**
+ * tm_coroutine_scheduler_destroy - Destroy a coroutine scheduler
+ *
+ * Wait until all coroutines are done.
+ *
+ * @scheduler: Point to the scheduler
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_scheduler_destroy(tm_coroutine_scheduler_t *scheduler);
+
+/**
+ * tm_coroutine_spawn - Create a coroutine and commit it
+ *
+ * @scheduler: Point to the scheduler
+ *
+ * @group: Group to count this coroutine in, NULL for none
+ *
+ * @entry: Coroutine entry function
+ *
+ * @arg: Argument of @entry
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_spawn(tm_coroutine_scheduler_t *scheduler,
+		       tm_coroutine_group_t *group,
+		       tm_coroutine_entry_t entry, void *arg);
+
+/**
+ * tm_coroutine_yield - Give the worker to other tasks and go on later
+ *
+ * Outside of coroutine it is thrd_yield.
+ * */
+void tm_coroutine_yield(void);
+
+/**
+ * tm_coroutine_sleep - Sleep without holding the worker
+ *
+ * Outside of coroutine it is thrd_sleep.
+ *
+ * @scheduler: Point to the scheduler
+ *
+ * @timeout: Milliseconds to sleep
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_sleep(tm_coroutine_scheduler_t *scheduler,
+		       unsigned long timeout);
+
+/**
+ * tm_coroutine_group_init - Initialize a coroutine group
+ *
+ * @group: Point to the group
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_group_init(tm_coroutine_group_t *group);
+
+/**
+ * tm_coroutine_group_wait - Wait for all coroutines of group
+ *
+ * Can be called from coroutine or normal thread.
+ *
+ * @group: Point to the group
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_group_wait(tm_coroutine_group_t *group);
+
+/**
+ * tm_coroutine_group_destroy - Destroy a coroutine group
+ *
+ * @group: Point to the group, should have no running coroutine
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_group_destroy(tm_coroutine_group_t *group);
+
+/**
+ * tm_coroutine_queue_init - Initialize a coroutine queue
+ *
+ * @queue: Point to the queue
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_queue_init(tm_coroutine_queue_t *queue);
+
+/**
+ * tm_coroutine_queue_push - Push one element and wake one waiter
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Pointer of the data
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_queue_push(tm_coroutine_queue_t *queue, void *data);
+
+/**
+ * tm_coroutine_queue_pop - Pop one element, wait while queue is empty
+ *
+ * Can be called from coroutine or normal thread.
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Where to save poped data
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_queue_pop(tm_coroutine_queue_t *queue, void **data);
+
+/**
+ * tm_coroutine_queue_destroy - Destroy a coroutine queue
+ *
+ * @queue: Point to the queue, should have no waiter
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_coroutine_queue_destroy(tm_coroutine_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_COROUTINE_H */
+
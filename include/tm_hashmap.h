@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_HASHMAP_H
+#define TM_HASHMAP_H
+
+/**
+ * tm_hashmap_t - Teemo hash map data structure
+ *
+ * @priv: Teemo hash map private data
+ * */
+typedef struct tm_hashmap_s {
+	void *priv;
+} tm_hashmap_t;
+
+/**
+ * enum tm_hashmap_option_e - Option when create a hash map
+ *
+ * All flags here can use "|" to combine each one of them.
+ *
+ * @TM_HASHMAP_OPTION_MULTI_THREAD: This hash map may access by different
+ *				    thread, each operation only lock the
+ *				    stripe the key belong to.
+ * */
+typedef enum tm_hashmap_option_e {
+	TM_HASHMAP_OPTION_MULTI_THREAD = 0x00000001u,
+
+	TM_HASHMAP_OPTION_MAX = 0x00000002u,
+} tm_hashmap_option_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_hashmap_get_option - Get current hash map option
+ *
+ * @map: Point to the hash map
+ *
+ * @option: Where to save option
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_hashmap_get_option(tm_hashmap_t *map, unsigned long *option);
+
+/**
+ * tm_hashmap_set_option - Set current hash map option
+ *
+ * @map: Point to the hash map
+ *
+ * @option: Option value
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_hashmap_set_option(tm_hashmap_t *map, unsigned long option);
+
+/**
+ * tm_hashmap_init - Initialize a hash map
+ *
+ * @map: Point to the hash map
+ *
+ * @option: Option of this hash map, see tm_hashmap_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_hashmap_init(tm_hashmap_t *map, unsigned long option);
+
+/**
+ * tm_hashmap_destroy - Destroy a hash map
+ *
+ * @map: Point to the hash map
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_hashmap_destroy(tm_hashmap_t *map);
+
+/**
+ * tm_hashmap_insert - Insert or update one element
+ *
+ * @map: Point to the hash map
+ *
+ * @key: Key of the element
+ *
+ * @data: Pointer of the data
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_hashmap_insert(tm_hashmap_t *map, unsigned long key, void *data);
+
+/**
+ * tm_hashmap_find - Find one element
+ *
+ * @map: Point to the hash map
+ *
+ * @key: Key of the element
+ *
+ * @data: Where to save data, can be NULL
+ *
+ * @return:  0 - found
+ *	    -1 - not found or error
+ * */
+int tm_hashmap_find(tm_hashmap_t *map, unsigned long key, void **data);
+
+/**
+ * tm_hashmap_erase - Erase one element
+ *
+ * @map: Point to the hash map
+ *
+ * @key: Key of the element
+ *
+ * @data: Where to save erased data, can be NULL
+ *
+ * @return:  0 - success
+ *	    -1 - not found or error
+ * */
+int tm_hashmap_erase(tm_hashmap_t *map, unsigned long key, void **data);
+
+/**
+ * tm_hashmap_get_size - Get number of elements
+ *
+ * @map: Point to the hash map
+ *
+ * @size: Where to save size
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_hashmap_get_size(tm_hashmap_t *map, unsigned long *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_HASHMAP_H */
+
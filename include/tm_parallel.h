@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_PARALLEL_H
+#define TM_PARALLEL_H
+
+#include "tm_thread_pool.h"
+
+/*
+ * Loops over [begin, end) run by workers of a thread pool and the calling
+ * thread together. Each of them own a range and take @grain indexes from its
+ * front at a time, one who run out steal the back half of the largest range
+ * left, so ranges are only split when someone is idle.
+ * */
+
+/**
+ * tm_parallel_for_entry_t - Loop body function type
+ *
+ * @begin: First index of chunk
+ *
+ * @end: One past the last index of chunk
+ *
+ * @ctx: Argument given to tm_parallel_for
+ * */
+typedef void (*tm_parallel_for_entry_t)(unsigned long begin,
+					unsigned long end, void *ctx);
+
+/**
+ * tm_parallel_reduce_entry_t - Reduce body function type
+ *
+ * @begin: First index of chunk
+ *
+ * @end: One past the last index of chunk
+ *
+ * @ctx: Argument given to tm_parallel_reduce
+ *
+ * @return: Partial result of chunk
+ * */
+typedef void* (*tm_parallel_reduce_entry_t)(unsigned long begin,
+					    unsigned long end, void *ctx);
+
+/**
+ * tm_parallel_combine_t - Combine function type
+ *
+ * Should be associative and commutative, chunks are not combined in index
+ * order.
+ *
+ * @left: One partial result
+ *
+ * @right: Another partial result
+ *
+ * @ctx: Argument given to tm_parallel_reduce
+ *
+ * @return: Combined result
+ * */
+typedef void* (*tm_parallel_combine_t)(void *left, void *right, void *ctx);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_parallel_for - Run @entry over [begin, end) in parallel
+ *
+ * Return after all indexes are done.
+ *
+ * @thread_pool: Thread pool to help, can be the pool this is called from
+ *
+ * @begin: First index
+ *
+ * @end: One past the last index
+ *
+ * @grain: Max number of indexes per call of @entry, 0 choose by itself
+ *
+ * @entry: Loop body
+ *
+ * @ctx: Argument of @entry
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_parallel_for(tm_thread_pool_t *thread_pool, unsigned long begin,
+		    unsigned long end, unsigned long grain,
+		    tm_parallel_for_entry_t entry, void *ctx);
+
+/**
+ * tm_parallel_reduce - Reduce [begin, end) in parallel
+ *
+ * @thread_pool: Thread pool to help, can be the pool this is called from
+ *
+ * @begin: First index
+ *
+ * @end: One past the last index
+ *
+ * @grain: Max number of indexes per call of @entry, 0 choose by itself
+ *
+ * @entry: Reduce body
+ *
+ * @combine: Combine two partial results
+ *
+ * @ctx: Argument of @entry and @combine
+ *
+ * @result: Where to save result, NULL if range is empty
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_parallel_reduce(tm_thread_pool_t *thread_pool, unsigned long begin,
+		       unsigned long end, unsigned long grain,
+		       tm_parallel_reduce_entry_t entry,
+		       tm_parallel_combine_t combine, void *ctx, void **result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_PARALLEL_H */
+
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_PARTITION_QUEUE_H
+#define TM_PARTITION_QUEUE_H
+
+#include "tm_thread_pool.h"
+
+/**
+ * tm_partition_queue_t - Teemo partitioned queue data structure
+ *
+ * Elements are hashed by key into one of several FIFO partitions. A
+ * partition is consumed by at most one consumer at a time, which hold its
+ * lease, so elements of the same key are processed in order while
+ * different partitions are processed in parallel.
+ *
+ * @priv: Teemo partitioned queue private data
+ * */
+typedef struct tm_partition_queue_s {
+	void *priv;
+} tm_partition_queue_t;
+
+/**
+ * tm_partition_queue_handler_t - Element handler of drain task
+ *
+ * @data: Element popped from partition
+ *
+ * @arg: Argument given to tm_partition_queue_set_thread_pool
+ * */
+typedef void (*tm_partition_queue_handler_t)(void *data, void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_partition_queue_init - Initialize a partitioned queue
+ *
+ * @queue: Point to the queue
+ *
+ * @partition_number: Number of partitions
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_partition_queue_init(tm_partition_queue_t *queue,
+			    unsigned long partition_number);
+
+/**
+ * tm_partition_queue_set_thread_pool - Drain partitions by thread pool
+ *
+ * Once a partition get an element, a drain task of it is committed to
+ * @thread_pool. The task hold the lease, pass up to @batch elements to
+ * @handler and commit itself again if more left, so a busy partition do not
+ * starve others. Partitions are not given by tm_partition_queue_acquire any
+ * more. Can only be set on an empty queue, @thread_pool must be destroyed
+ * before @queue.
+ *
+ * @queue: Point to the queue
+ *
+ * @thread_pool: Point to the thread pool
+ *
+ * @handler: Called for each element by drain task
+ *
+ * @arg: Argument of @handler
+ *
+ * @batch: Max number of elements per run of drain task
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_partition_queue_set_thread_pool(tm_partition_queue_t *queue,
+				       tm_thread_pool_t *thread_pool,
+				       tm_partition_queue_handler_t handler,
+				       void *arg, unsigned long batch);
+
+/**
+ * tm_partition_queue_destroy - Destroy a partitioned queue
+ *
+ * @queue: Point to the queue
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_partition_queue_destroy(tm_partition_queue_t *queue);
+
+/**
+ * tm_partition_queue_push - Push one element into partition of its key
+ *
+ * @queue: Point to the queue
+ *
+ * @key: Elements of same key keep FIFO order
+ *
+ * @data: Pointer of the data
+ *
+ * @return:  0 - success
+ *	    -1 - error, @data is not queued
+ * */
+int tm_partition_queue_push(tm_partition_queue_t *queue, unsigned long key,
+			    void *data);
+
+/**
+ * tm_partition_queue_acquire - Take lease of a non-empty partition
+ *
+ * @queue: Point to the queue
+ *
+ * @partition: Where to save partition index
+ *
+ * @return:  0 - success
+ *	    -1 - no partition ready or error
+ * */
+int tm_partition_queue_acquire(tm_partition_queue_t *queue,
+			       unsigned long *partition);
+
+/**
+ * tm_partition_queue_pop - Pop first element of a leased partition
+ *
+ * @queue: Point to the queue
+ *
+ * @partition: Partition index got from tm_partition_queue_acquire
+ *
+ * @data: Where to save poped data
+ *
+ * @return:  0 - success
+ *	    -1 - partition empty, not leased or error
+ * */
+int tm_partition_queue_pop(tm_partition_queue_t *queue,
+			   unsigned long partition, void **data);
+
+/**
+ * tm_partition_queue_release - Give lease of a partition back
+ *
+ * Elements left in partition can be acquired by anyone again.
+ *
+ * @queue: Point to the queue
+ *
+ * @partition: Partition index got from tm_partition_queue_acquire
+ *
+ * @return:  0 - success
+ *	    -1 - error, lease is kept
+ * */
+int tm_partition_queue_release(tm_partition_queue_t *queue,
+			       unsigned long partition);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_PARTITION_QUEUE_H */
+
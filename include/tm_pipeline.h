@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_PIPELINE_H
+#define TM_PIPELINE_H
+
+#include "tm_thread_pool.h"
+
+/**
+ * tm_pipeline_t - Teemo staged pipeline data structure
+ *
+ * A chain of stages, each stage have a bounded input queue and run its
+ * function on workers of a thread pool. Items go from one stage to the next
+ * in batches, a stage only take as many items as next stage have room for,
+ * so a slow stage push back all the way to tm_pipeline_push.
+ *
+ * @priv: Teemo pipeline private data
+ * */
+typedef struct tm_pipeline_s {
+	void *priv;
+} tm_pipeline_t;
+
+/**
+ * enum tm_pipeline_option_e - Option when create a pipeline
+ *
+ * All flags here can use "|" to combine each one of them.
+ *
+ * @TM_PIPELINE_OPTION_ADAPTIVE: Move workers from idle stages to the stage
+ *				 with most pending work, measured by queue
+ *				 depth and service time. Number of workers of
+ *				 each stage is between 1 and its concurrency,
+ *				 sum of them is limited by size of the pool.
+ *				 Stages start from an even share of the pool
+ *				 at first tm_pipeline_push.
+ * */
+typedef enum tm_pipeline_option_e {
+	TM_PIPELINE_OPTION_ADAPTIVE = 0x00000001u,
+
+	TM_PIPELINE_OPTION_MAX = 0x00000002u,
+} tm_pipeline_option_t;
+
+/**
+ * tm_pipeline_stage_entry_t - Stage function type
+ *
+ * @data: Item from previous stage or tm_pipeline_push
+ *
+ * @arg: Argument given to tm_pipeline_add_stage
+ *
+ * @return: Item for next stage, NULL drop it. Ignored for the last stage.
+ * */
+typedef void* (*tm_pipeline_stage_entry_t)(void *data, void *arg);
+
+/**
+ * tm_pipeline_stats_t - Statistics of one stage
+ *
+ * @processed: Number of items done by this stage
+ *
+ * @depth: Number of items waiting in queue of this stage
+ *
+ * @concurrency: Current max number of workers of this stage
+ *
+ * @throughput: Items per second over the last window of 64 batches of the
+ *		 pipeline, average since created until the first one is done
+ *
+ * @service_time: Average nanoseconds spent in stage function per item
+ *
+ * @latency: Average nanoseconds from entering queue of this stage to done
+ * */
+typedef struct tm_pipeline_stats_s {
+	unsigned long processed;
+	unsigned long depth;
+	unsigned long concurrency;
+	unsigned long throughput;
+	unsigned long service_time;
+	unsigned long latency;
+} tm_pipeline_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_pipeline_init - Initialize a pipeline
+ *
+ * @pipeline: Point to the pipeline
+ *
+ * @thread_pool: Thread pool to run stages, must be destroyed after
+ *		 @pipeline
+ *
+ * @option: Option of this pipeline, see tm_pipeline_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pipeline_init(tm_pipeline_t *pipeline, tm_thread_pool_t *thread_pool,
+		     unsigned long option);
+
+/**
+ * tm_pipeline_add_stage - Append a stage to the end of pipeline
+ *
+ * Stages are numbered from 0 in the order added, they can not be added
+ * after the first tm_pipeline_push.
+ *
+ * @pipeline: Point to the pipeline
+ *
+ * @entry: Stage function
+ *
+ * @arg: Argument of @entry
+ *
+ * @concurrency: Max number of workers run @entry at the same time
+ *
+ * @capacity: Max number of items in queue of this stage
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pipeline_add_stage(tm_pipeline_t *pipeline,
+			  tm_pipeline_stage_entry_t entry, void *arg,
+			  unsigned long concurrency, unsigned long capacity);
+
+/**
+ * tm_pipeline_push - Push one item into the first stage
+ *
+ * @pipeline: Point to the pipeline
+ *
+ * @data: Item
+ *
+ * @timeout: Milliseconds to wait while the first stage is full, 0 do not
+ *	     wait, negative wait forever
+ *
+ * @return:  0 - success
+ *	    -1 - timeout or error
+ * */
+int tm_pipeline_push(tm_pipeline_t *pipeline, void *data, long timeout);
+
+/**
+ * tm_pipeline_get_stats - Get statistics of one stage
+ *
+ * @pipeline: Point to the pipeline
+ *
+ * @stage: Stage number
+ *
+ * @stats: Where to save statistics
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pipeline_get_stats(tm_pipeline_t *pipeline, unsigned long stage,
+			  tm_pipeline_stats_t *stats);
+
+/**
+ * tm_pipeline_destroy - Destroy a pipeline
+ *
+ * Wait until all pushed items passed the last stage.
+ *
+ * @pipeline: Point to the pipeline
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pipeline_destroy(tm_pipeline_t *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_PIPELINE_H */
+
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_POOL_H
+#define TM_POOL_H
+
+/**
+ * tm_pool_t - Teemo object pool data structure
+ *
+ * @priv: Teemo object pool private data
+ * */
+typedef struct tm_pool_s {
+	void *priv;
+} tm_pool_t;
+
+/**
+ * enum tm_pool_option_e - Option when create a pool
+ *
+ * All flags here can use "|" to combine each one of them.
+ *
+ * @TM_POOL_OPTION_GROW: Allocate one more slab of objects when pool is
+ *			 exhausted, otherwise tm_pool_alloc fail.
+ *
+ * @TM_POOL_OPTION_HUGEPAGE: Back slabs with huge pages, fallback to
+ *			     transparent huge page hint and then normal pages.
+ * */
+typedef enum tm_pool_option_e {
+	TM_POOL_OPTION_GROW = 0x00000001u,
+	TM_POOL_OPTION_HUGEPAGE = 0x00000002u,
+
+	TM_POOL_OPTION_MAX = 0x00000004u,
+} tm_pool_option_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_pool_init - Initialize a pool
+ *
+ * All objects of one slab are allocated in one region at once.
+ *
+ * @pool: Point to the pool
+ *
+ * @object_size: Size of each object
+ *
+ * @object_number: Number of objects per slab
+ *
+ * @option: Option of this pool, see tm_pool_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pool_init(tm_pool_t *pool, unsigned long object_size,
+		 unsigned long object_number, unsigned long option);
+
+/**
+ * tm_pool_destroy - Destroy a pool
+ *
+ * All objects are released, no matter freed or not.
+ *
+ * @pool: Point to the pool
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pool_destroy(tm_pool_t *pool);
+
+/**
+ * tm_pool_alloc - Get one object from pool
+ *
+ * @pool: Point to the pool
+ *
+ * @object: Where to save object address, 16 bytes aligned
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pool_alloc(tm_pool_t *pool, void **object);
+
+/**
+ * tm_pool_free - Give one object back to pool
+ *
+ * Any thread can free an object allocated by another thread.
+ *
+ * @pool: Point to the pool
+ *
+ * @object: Object address
+ *
+ * @return:  0 - success
+ *	    -1 - not an allocated object of this pool or error
+ * */
+int tm_pool_free(tm_pool_t *pool, void *object);
+
+/**
+ * tm_pool_get_stats - Get capacity and utilization
+ *
+ * @pool: Point to the pool
+ *
+ * @capacity: Where to save number of objects, can be NULL
+ *
+ * @used: Where to save number of allocated objects, can be NULL
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_pool_get_stats(tm_pool_t *pool, unsigned long *capacity,
+		      unsigned long *used);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_POOL_H */
+
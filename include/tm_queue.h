@@ -23,13 +23,79 @@ typedef struct tm_queue_s {
  * @TM_queue_FLAG_MULTI_THREAD: This queue may access by different thread,
  *				lower layer should make sure each operation
  *				is thread safe.
+ *
+ * @TM_QUEUE_OPTION_MPSC: Multi producer single consumer queue, any thread
+ *			  can push without lock while only one thread may
+ *			  pop at a time. Pop may fail on a non-empty queue
+ *			  while a push is half way done. Nodes are reused
+ *			  from a queue local arena instead of a malloc for
+ *			  every push, consumer give freed nodes back to
+ *			  producer threads in batches. Take one thread
+ *			  specific storage key like tm_pool. Can only be
+ *			  set at tm_queue_init.
+ *
+ * @TM_QUEUE_OPTION_EVENTFD: Queue own an eventfd got by tm_queue_get_fd, it
+ *			     become readable when queue turn non-empty and
+ *			     is reset by the pop that find queue empty, so a
+ *			     burst of push write it only once. Can only be set
+ *			     at tm_queue_init, not with TM_QUEUE_OPTION_MPSC.
+ *
+ * @TM_QUEUE_OPTION_COMPACT: Keep elements in a chunked node arena inside the
+ *			     queue and link them by 32 bits index, 12 bytes
+ *			     each instead of a malloc for every push. Can
+ *			     only be set at tm_queue_init, not with
+ *			     TM_QUEUE_OPTION_MPSC, spill or journal.
  * */
-enum tm_queue_option_e {
+typedef enum tm_queue_option_e {
 	TM_QUEUE_OPTION_MULTI_THREAD = 0x00000001u,
+	TM_QUEUE_OPTION_MPSC = 0x00000002u,
+	TM_QUEUE_OPTION_EVENTFD = 0x00000004u,
+	TM_QUEUE_OPTION_COMPACT = 0x00000008u,
 
-	TM_QUEUE_OPTION_MAX = 0x00000002u,
+	TM_QUEUE_OPTION_MAX = 0x00000010u,
 } tm_queue_option_t;
 
+/**
+ * tm_queue_codec_t - Convert element to and from bytes
+ *
+ * @encode: Save @data into @buf which have @size bytes, return number of
+ *	    bytes needed. When it is more than @size, nothing should be
+ *	    written beyond @size and it will be called again with a bigger
+ *	    buffer.
+ *
+ * @decode: Rebuild element from @buf which have @size bytes into @data,
+ *	    return 0 on success.
+ *
+ * @release: Release @data after it is encoded, can be NULL.
+ * */
+typedef struct tm_queue_codec_s {
+	unsigned long (*encode)(void *data, void *buf, unsigned long size);
+	int (*decode)(const void *buf, unsigned long size, void **data);
+	void (*release)(void *data);
+} tm_queue_codec_t;
+
+/**
+ * enum tm_queue_journal_sync_e - When journal is flushed to disk
+ *
+ * @TM_QUEUE_JOURNAL_SYNC_OPERATION: Push and pop return after their record
+ *				     is on disk, records of concurrent
+ *				     operations share one fdatasync.
+ *
+ * @TM_QUEUE_JOURNAL_SYNC_BATCH: Flush once every interval records, the
+ *				 last batch may be lost by a crash.
+ *
+ * @TM_QUEUE_JOURNAL_SYNC_TIME: Flush every interval milliseconds by a
+ *				background thread, records within the last
+ *				interval may be lost by a crash.
+ * */
+typedef enum tm_queue_journal_sync_e {
+	TM_QUEUE_JOURNAL_SYNC_OPERATION = 0,
+	TM_QUEUE_JOURNAL_SYNC_BATCH = 1,
+	TM_QUEUE_JOURNAL_SYNC_TIME = 2,
+
+	TM_QUEUE_JOURNAL_SYNC_MAX = 3,
+} tm_queue_journal_sync_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -70,6 +136,99 @@ int tm_queue_set_option(tm_queue_t *queue, unsigned long option);
  * */
 int tm_queue_init(tm_queue_t *queue, unsigned long option);
 
+/**
+ * tm_queue_init_bounded - Initialize a queue with limited length
+ *
+ * Once @capacity elements are in queue, tm_queue_push fail at once, while
+ * tm_queue_push_timeout wait for a pop and tm_queue_push_drop drop the
+ * oldest element. Not for TM_QUEUE_OPTION_MPSC queue, can not be used with
+ * spill. Elements restored from journal are not limited.
+ *
+ * @queue: Point to the queue
+ *
+ * @option: Option of this queue, see tm_queue_option_t.
+ *
+ * @capacity: Max number of elements, more than 0
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_queue_init_bounded(tm_queue_t *queue, unsigned long option,
+			  unsigned long capacity);
+
+/**
+ * tm_queue_set_spill - Spill elements to disk when queue is too long
+ *
+ * Once @threshold elements are in memory, following elements are encoded
+ * into append-only memory mapped segment files under @directory, until the
+ * consumer drained all of them, so FIFO order is kept. Segment files are
+ * unlinked at once and released when drained. Elements still on disk are
+ * dropped by tm_queue_destroy. Can not be changed while elements are on
+ * disk. Not for TM_QUEUE_OPTION_MPSC or TM_QUEUE_OPTION_COMPACT queue, can
+ * not be used with journal.
+ *
+ * @queue: Point to the queue
+ *
+ * @directory: Where to create segment files, NULL to disable spill when
+ *	       nothing is on disk
+ *
+ * @threshold: Max number of elements in memory
+ *
+ * @codec: Element codec, copied
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_queue_set_spill(tm_queue_t *queue, const char *directory,
+		       unsigned long threshold, const tm_queue_codec_t *codec);
+
+/**
+ * tm_queue_set_journal - Keep queue content in a write-ahead journal
+ *
+ * Each push and pop append a record to "journal" under @directory, which is
+ * compacted into "snapshot" by a background thread once it grows too big.
+ * Compaction hold the queue only while elements are encoded in memory, but
+ * no record is flushed until the snapshot is on disk, so operations of
+ * TM_QUEUE_JOURNAL_SYNC_OPERATION wait for it. On an empty queue, the
+ * snapshot is mapped and the journal tail is replayed to restore elements
+ * of the last run, a torn record at the end of journal is cut off. Elements
+ * left by tm_queue_destroy stay in journal. When a record can not be
+ * written, the operation itself is still done but returns -1. Not for
+ * TM_QUEUE_OPTION_MPSC or TM_QUEUE_OPTION_COMPACT queue, can not be used
+ * with spill.
+ *
+ * @queue: Point to the queue
+ *
+ * @directory: Where to save journal, created if not exist, NULL to flush
+ *	       and detach current journal
+ *
+ * @sync: When records are flushed, see tm_queue_journal_sync_t
+ *
+ * @interval: Records of TM_QUEUE_JOURNAL_SYNC_BATCH or milliseconds of
+ *	      TM_QUEUE_JOURNAL_SYNC_TIME, ignored otherwise
+ *
+ * @codec: Element codec, copied, @release is used to drop replayed
+ *	   elements popped later in journal
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_queue_set_journal(tm_queue_t *queue, const char *directory,
+			 unsigned long sync, unsigned long interval,
+			 const tm_queue_codec_t *codec);
+
+/**
+ * tm_queue_compact_journal - Write snapshot and truncate journal now
+ *
+ * Queue is locked until snapshot is on disk.
+ *
+ * @queue: Point to the queue
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_queue_compact_journal(tm_queue_t *queue);
+
 /**
  * tm_queue_destroy - Destroy a queue
  *
@@ -88,10 +247,41 @@ int tm_queue_destroy(tm_queue_t *queue);
  * @data: Pointer of the data
  *
  * @return:  0 - success
- *	    -1 - error
+ *	    -1 - bounded queue full or error
  * */
 int tm_queue_push(tm_queue_t *queue, void *data);
 
+/**
+ * tm_queue_push_timeout - Push one element, wait while queue is full
+ *
+ * Same as tm_queue_push for a queue not bounded.
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Pointer of the data
+ *
+ * @timeout: Milliseconds to wait, 0 do not wait, negative wait forever
+ *
+ * @return:  0 - success
+ *	    -1 - timeout or error
+ * */
+int tm_queue_push_timeout(tm_queue_t *queue, void *data, long timeout);
+
+/**
+ * tm_queue_push_drop - Push one element, drop the oldest while queue is full
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Pointer of the data
+ *
+ * @dropped: Where to save dropped element, NULL if nothing dropped. It is
+ *	     out of queue even if push itself fail later.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_queue_push_drop(tm_queue_t *queue, void *data, void **dropped);
+
 /**
  * tm_queue_pop - Pop top element out of queue
  *
@@ -104,6 +294,40 @@ int tm_queue_push(tm_queue_t *queue, void *data);
  * */
 int tm_queue_pop(tm_queue_t *queue, void **data);
 
+/**
+ * tm_queue_pop_batch - Pop up to @max elements at once
+ *
+ * Elements in memory are taken under one lock.
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Where to save poped data, room for @max elements
+ *
+ * @max: Max number of elements
+ *
+ * @number: Where to save number of poped elements, 0 if queue is empty
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_queue_pop_batch(tm_queue_t *queue, void **data, unsigned long max,
+		       unsigned long *number);
+
+/**
+ * tm_queue_get_fd - Get eventfd of TM_QUEUE_OPTION_EVENTFD queue
+ *
+ * Poll it for EPOLLIN, then pop until queue is empty. Do not read it, it is
+ * reset by pop.
+ *
+ * @queue: Point to the queue
+ *
+ * @fd: Where to save file descriptor
+ *
+ * @return:  0 - success
+ *	    -1 - not TM_QUEUE_OPTION_EVENTFD queue or error
+ * */
+int tm_queue_get_fd(tm_queue_t *queue, int *fd);
+
 #ifdef __cplusplus
 }
 #endif
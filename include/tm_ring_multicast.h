@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_RING_MULTICAST_H
+#define TM_RING_MULTICAST_H
+
+/**
+ * tm_ring_multicast_t - Teemo multicast ring data structure
+ *
+ * Every consumer see every element, element is only overwritten after all
+ * consumers have committed it.
+ *
+ * @priv: Teemo multicast ring private data
+ * */
+typedef struct tm_ring_multicast_s {
+	void *priv;
+} tm_ring_multicast_t;
+
+/**
+ * enum tm_ring_multicast_option_e - Option when create a multicast ring
+ *
+ * All flags here can use "|" to combine each one of them. Without any wait
+ * flag, waiting thread busy spin.
+ *
+ * @TM_RING_MULTICAST_OPTION_MULTI_PRODUCER: More than one thread may publish
+ *					     at the same time.
+ *
+ * @TM_RING_MULTICAST_OPTION_WAIT_YIELD: Waiting thread yield its CPU.
+ *
+ * @TM_RING_MULTICAST_OPTION_WAIT_BLOCK: Waiting thread sleep on a condition
+ *					 variable.
+ * */
+typedef enum tm_ring_multicast_option_e {
+	TM_RING_MULTICAST_OPTION_MULTI_PRODUCER = 0x00000001u,
+	TM_RING_MULTICAST_OPTION_WAIT_YIELD = 0x00000002u,
+	TM_RING_MULTICAST_OPTION_WAIT_BLOCK = 0x00000004u,
+
+	TM_RING_MULTICAST_OPTION_MAX = 0x00000008u,
+} tm_ring_multicast_option_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_ring_multicast_init - Initialize a multicast ring
+ *
+ * @ring: Point to the ring
+ *
+ * @size: Number of slots, must be power of 2
+ *
+ * @option: Option of this ring, see tm_ring_multicast_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_ring_multicast_init(tm_ring_multicast_t *ring, unsigned long size,
+			   unsigned long option);
+
+/**
+ * tm_ring_multicast_destroy - Destroy a multicast ring
+ *
+ * @ring: Point to the ring
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_ring_multicast_destroy(tm_ring_multicast_t *ring);
+
+/**
+ * tm_ring_multicast_add_consumer - Add a consumer
+ *
+ * All consumers should be added before the first publish. A consumer only
+ * see an element after all consumers in @depend have committed it, which
+ * build a sequence barrier, eg. replicate only after journal is written.
+ *
+ * @ring: Point to the ring
+ *
+ * @depend: Consumers this consumer depend on, can be NULL
+ *
+ * @depend_number: Number of @depend
+ *
+ * @consumer: Where to save consumer id
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_ring_multicast_add_consumer(tm_ring_multicast_t *ring,
+				   const int *depend, int depend_number,
+				   int *consumer);
+
+/**
+ * tm_ring_multicast_publish - Publish one element to all consumers
+ *
+ * Wait when the slot is still not committed by the slowest consumer.
+ *
+ * @ring: Point to the ring
+ *
+ * @data: Pointer of the data
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_ring_multicast_publish(tm_ring_multicast_t *ring, void *data);
+
+/**
+ * tm_ring_multicast_consume - Get a batch of elements
+ *
+ * Wait until at least one element is available, then read up to the
+ * available sequence. Elements are not released until
+ * tm_ring_multicast_commit.
+ *
+ * @ring: Point to the ring
+ *
+ * @consumer: Consumer id
+ *
+ * @data: Where to save elements
+ *
+ * @max: Size of @data
+ *
+ * @number: Where to save number of elements saved into @data
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_ring_multicast_consume(tm_ring_multicast_t *ring, int consumer,
+			      void **data, unsigned long max,
+			      unsigned long *number);
+
+/**
+ * tm_ring_multicast_commit - Mark elements as processed
+ *
+ * @ring: Point to the ring
+ *
+ * @consumer: Consumer id
+ *
+ * @number: Number of elements, no more than last consumed
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_ring_multicast_commit(tm_ring_multicast_t *ring, int consumer,
+			     unsigned long number);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_RING_MULTICAST_H */
+
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_SHM_QUEUE_H
+#define TM_SHM_QUEUE_H
+
+/**
+ * tm_shm_queue_t - Teemo shared memory queue data structure
+ *
+ * A bounded ring of variable length records in a shared memory region, it
+ * can be mapped by several processes at the same time. Any process can push
+ * while only one process may pop at a time.
+ *
+ * @priv: Teemo shared memory queue private data
+ * */
+typedef struct tm_shm_queue_s {
+	void *priv;
+} tm_shm_queue_t;
+
+/**
+ * enum tm_shm_queue_option_e - Option when create a shared memory queue
+ *
+ * All flags here can use "|" to combine each one of them.
+ *
+ * @TM_SHM_QUEUE_OPTION_CREATE: Create and initialize the region, otherwise
+ *				attach an existing one.
+ *
+ * @TM_SHM_QUEUE_OPTION_SINGLE_PRODUCER: Only one process push, producers
+ *					 do not take the shared lock. Only
+ *					 used with TM_SHM_QUEUE_OPTION_CREATE.
+ * */
+typedef enum tm_shm_queue_option_e {
+	TM_SHM_QUEUE_OPTION_CREATE = 0x00000001u,
+	TM_SHM_QUEUE_OPTION_SINGLE_PRODUCER = 0x00000002u,
+
+	TM_SHM_QUEUE_OPTION_MAX = 0x00000004u,
+} tm_shm_queue_option_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_shm_queue_init - Create or attach a shared memory queue by name
+ *
+ * @queue: Point to the queue
+ *
+ * @name: shm_open(3) name like "/name", NULL create an anonymous memfd which
+ *	  can be shared by fork(2) or passed with tm_shm_queue_get_fd
+ *
+ * @capacity: Ring size in bytes, rounded up to power of 2, ignored when
+ *	      attach
+ *
+ * @option: Option of this queue, see tm_shm_queue_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_shm_queue_init(tm_shm_queue_t *queue, const char *name,
+		      unsigned long capacity, unsigned long option);
+
+/**
+ * tm_shm_queue_init_fd - Attach a shared memory queue by file descriptor
+ *
+ * @queue: Point to the queue
+ *
+ * @fd: File descriptor got from tm_shm_queue_get_fd, eg. in another process
+ *	via SCM_RIGHTS, it is duplicated
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_shm_queue_init_fd(tm_shm_queue_t *queue, int fd);
+
+/**
+ * tm_shm_queue_get_fd - Get file descriptor of the region
+ *
+ * @queue: Point to the queue
+ *
+ * @fd: Where to save file descriptor, still owned by @queue
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_shm_queue_get_fd(tm_shm_queue_t *queue, int *fd);
+
+/**
+ * tm_shm_queue_destroy - Detach a shared memory queue
+ *
+ * Name of a region is removed by the process which created it.
+ *
+ * @queue: Point to the queue
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_shm_queue_destroy(tm_shm_queue_t *queue);
+
+/**
+ * tm_shm_queue_push - Copy one record into queue
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Record data
+ *
+ * @length: Record length, no more than a quarter of capacity
+ *
+ * @return:  0 - success
+ *	    -1 - queue full or error
+ * */
+int tm_shm_queue_push(tm_shm_queue_t *queue, const void *data,
+		      unsigned long length);
+
+/**
+ * tm_shm_queue_pop - Copy one record out of queue
+ *
+ * Records of producers which died half way are skipped.
+ *
+ * @queue: Point to the queue
+ *
+ * @data: Where to save record data
+ *
+ * @length: Size of @data as input, record length as output, on error it is
+ *	    the length needed or 0 when queue is empty
+ *
+ * @return:  0 - success
+ *	    -1 - queue empty, @data too small or error
+ * */
+int tm_shm_queue_pop(tm_shm_queue_t *queue, void *data,
+		     unsigned long *length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_SHM_QUEUE_H */
+
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_SKIPLIST_H
+#define TM_SKIPLIST_H
+
+/**
+ * tm_skiplist_t - Teemo skip list data structure
+ *
+ * Ordered map of unsigned long keys, any thread can use it at any time
+ * without a global lock. Insert and erase are lock free, find never write
+ * shared memory. Towers are kept in pools by height shared by all lists,
+ * erased nodes go back to pool once no operation started before erase is
+ * still running.
+ *
+ * @priv: Teemo skip list private data
+ * */
+typedef struct tm_skiplist_s {
+	void *priv;
+} tm_skiplist_t;
+
+/**
+ * tm_skiplist_scan_entry_t - Range scan callback function type
+ *
+ * Can insert into or erase from the same skip list.
+ *
+ * @key: Key of element
+ *
+ * @data: Data of element
+ *
+ * @arg: Argument given to tm_skiplist_scan
+ *
+ * @return: 0 to go on, others to stop scan
+ * */
+typedef int (*tm_skiplist_scan_entry_t)(unsigned long key, void *data,
+					void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * tm_skiplist_init - Initialize a skip list
+ *
+ * @list: Point to the skip list
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_skiplist_init(tm_skiplist_t *list);
+
+/**
+ * tm_skiplist_destroy - Destroy a skip list
+ *
+ * @list: Point to the skip list, should have no operation running
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_skiplist_destroy(tm_skiplist_t *list);
+
+/**
+ * tm_skiplist_insert - Insert or update one element
+ *
+ * @list: Point to the skip list
+ *
+ * @key: Key of the element
+ *
+ * @data: Pointer of the data
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_skiplist_insert(tm_skiplist_t *list, unsigned long key, void *data);
+
+/**
+ * tm_skiplist_find - Find one element
+ *
+ * @list: Point to the skip list
+ *
+ * @key: Key of the element
+ *
+ * @data: Where to save data, can be NULL
+ *
+ * @return:  0 - found
+ *	    -1 - not found or error
+ * */
+int tm_skiplist_find(tm_skiplist_t *list, unsigned long key, void **data);
+
+/**
+ * tm_skiplist_erase - Erase one element
+ *
+ * @list: Point to the skip list
+ *
+ * @key: Key of the element
+ *
+ * @data: Where to save erased data, can be NULL
+ *
+ * @return:  0 - success
+ *	    -1 - not found or error
+ * */
+int tm_skiplist_erase(tm_skiplist_t *list, unsigned long key, void **data);
+
+/**
+ * tm_skiplist_scan - Call @entry on elements of [first, last] in key order
+ *
+ * Elements inserted or erased during scan may or may not be seen, the
+ * others are seen exactly once. Erased nodes are not reused until scan
+ * return, so keep it short.
+ *
+ * @list: Point to the skip list
+ *
+ * @first: Smallest key to visit
+ *
+ * @last: Largest key to visit
+ *
+ * @entry: Callback of each element
+ *
+ * @arg: Argument of @entry
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_skiplist_scan(tm_skiplist_t *list, unsigned long first,
+		     unsigned long last, tm_skiplist_scan_entry_t entry,
+		     void *arg);
+
+/**
+ * tm_skiplist_get_size - Get number of elements
+ *
+ * @list: Point to the skip list
+ *
+ * @size: Where to save size
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_skiplist_get_size(tm_skiplist_t *list, unsigned long *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TM_SKIPLIST_H */
@@ -23,11 +23,28 @@ typedef struct tm_stack_s {
  * @TM_STACK_FLAG_MULTI_THREAD: This stack may access by different thread,
  *				lower layer should make sure each operation
  *				is thread safe.
+ *
+ * @TM_STACK_OPTION_ELIMINATION: When the stack lock is busy, push and pop
+ *				 try to meet an opposite operation in a small
+ *				 collision array and cancel out without
+ *				 touching top. Width of the array follow the
+ *				 contention seen. Can only be set at
+ *				 tm_stack_init.
+ *
+ * @TM_STACK_OPTION_COMPACT: Keep elements in a chunked node arena inside the
+ *			     stack and link them by 32 bits index, 12 bytes
+ *			     each instead of a malloc for every push. Top
+ *			     carry an ABA tag beside the index, so push and
+ *			     pop are lock free and elimination is tried when
+ *			     they lose the race on top. Can only be set at
+ *			     tm_stack_init.
  * */
-enum tm_stack_option_e {
+typedef enum tm_stack_option_e {
 	TM_STACK_OPTION_MULTI_THREAD = 0x00000001u,
+	TM_STACK_OPTION_ELIMINATION = 0x00000002u,
+	TM_STACK_OPTION_COMPACT = 0x00000004u,
 
-	TM_STACK_OPTION_MAX = 0x00000002u,
+	TM_STACK_OPTION_MAX = 0x00000008u,
 } tm_stack_option_t;
 
 #ifdef __cplusplus
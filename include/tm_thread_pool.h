@@ -15,7 +15,10 @@
  *					 intensive casese.
  *
  * @TM_THREAD_POOL_OPTION_INTENSIVE_IO: This thread pool is used in IO
- *					intensive casese.
+ *					intensive casese, file operations
+ *					committed by tm_thread_pool_io_commit
+ *					will be driven by io_uring when kernel
+ *					support it.
  * */
 typedef enum tm_thread_pool_option_e {
 	TM_THREAD_POOL_OPTION_INTENSIVE_CPU = 0x00000001u,
@@ -42,7 +45,7 @@ typedef struct tm_thread_pool_s {
  * @return: This entry function should return a "void*" type of value, which
  *	    will be retrived via tm_thread_pool_task_event_t callback.
  * */
-typedef void* (tm_thread_pool_task_entry_t *)(void *arg);
+typedef void* (*tm_thread_pool_task_entry_t)(void *arg);
 
 /**
  * enum tm_thread_pool_event_e - Task event callback type
@@ -66,36 +69,282 @@ typedef enum tm_thread_pool_event_e {
  *
  * @task_status: Task return value
  * */
-typedef void (tm_thread_pool_task_event_t *)(unsigned long event,
-					     void *task_status);
+typedef void (*tm_thread_pool_task_event_t)(unsigned long event,
+					    void *task_status);
 
+/**
+ * enum tm_thread_pool_task_option_e - Option when create a task
+ *
+ * @TM_THREAD_POOL_TASK_OPTION_NO_RETURN: Task return value is ignored, event
+ *					  callback always get NULL.
+ * */
 typedef enum tm_thread_pool_task_option_e {
 	TM_THREAD_POOL_TASK_OPTION_NO_RETURN = 0x00000001,
 
-	TM_THREAD_POOL_TASK_OPTION_MAX = 0x00000001,
+	TM_THREAD_POOL_TASK_OPTION_MAX = 0x00000002,
 } tm_thread_pool_task_option_t;
 
+/**
+ * tm_thread_pool_task_t - Teemo thread pool task data structure
+ *
+ * @priv: Teemo thread pool task private data
+ * */
 typedef struct tm_thread_pool_task_s {
 	void *priv;
 } tm_thread_pool_task_t;
 
+/**
+ * tm_thread_pool_cq_t - Teemo thread pool completion queue
+ *
+ * Ring of finished tasks, filled by any worker and reaped by one thread at a
+ * time, usually the one who commit these tasks.
+ *
+ * @priv: Teemo thread pool completion queue private data
+ * */
+typedef struct tm_thread_pool_cq_s {
+	void *priv;
+} tm_thread_pool_cq_t;
+
+/**
+ * tm_thread_pool_cq_entry_t - One finished task
+ *
+ * @tag: Tag given to tm_thread_pool_task_set_cq
+ *
+ * @status: Task return value, NULL with TM_THREAD_POOL_TASK_OPTION_NO_RETURN
+ * */
+typedef struct tm_thread_pool_cq_entry_s {
+	void *tag;
+	void *status;
+} tm_thread_pool_cq_entry_t;
+
+/**
+ * enum tm_thread_pool_io_opcode_e - Asynchronous file operation type
+ *
+ * @TM_THREAD_POOL_IO_OPCODE_READ: pread(2) like operation
+ *
+ * @TM_THREAD_POOL_IO_OPCODE_WRITE: pwrite(2) like operation
+ *
+ * @TM_THREAD_POOL_IO_OPCODE_FSYNC: fsync(2) like operation, @buf, @length
+ *				    and @offset are ignored
+ * */
+typedef enum tm_thread_pool_io_opcode_e {
+	TM_THREAD_POOL_IO_OPCODE_READ = 1,
+	TM_THREAD_POOL_IO_OPCODE_WRITE = 2,
+	TM_THREAD_POOL_IO_OPCODE_FSYNC = 3,
+} tm_thread_pool_io_opcode_t;
+
+/**
+ * tm_thread_pool_io_t - Asynchronous file operation request
+ *
+ * This structure is owned by user and must stay valid until the continuation
+ * task of this request is started.
+ *
+ * @opcode: One of tm_thread_pool_io_opcode_t
+ *
+ * @fd: File descriptor
+ *
+ * @buf: Data buffer
+ *
+ * @length: Length of @buf
+ *
+ * @offset: File offset
+ *
+ * @result: Filled before continuation start, bytes transferred or -errno
+ *
+ * @priv: Teemo thread pool private data, do not touch
+ * */
+typedef struct tm_thread_pool_io_s {
+	unsigned long opcode;
+	int fd;
+	void *buf;
+	unsigned long length;
+	long long offset;
+	long result;
+	void *priv;
+} tm_thread_pool_io_t;
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int tm_thread_pool_init(tm_thread_pool_t *thread_pool, int thread_pool_size)
+/**
+ * tm_thread_pool_init - Initialize a thread pool
+ *
+ * @thread_pool: Point to the thread pool
+ *
+ * @thread_pool_size: Number of worker threads
+ *
+ * @option: Option of this thread pool, see tm_thread_pool_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_init(tm_thread_pool_t *thread_pool, int thread_pool_size,
+			unsigned long option);
 
+/**
+ * tm_thread_pool_task_init - Initialize a task
+ *
+ * @task: Point to the task
+ *
+ * @entry: Task entry function
+ *
+ * @arg: Argument of @entry
+ *
+ * @event: Event callback, can be NULL
+ *
+ * @option: Option of this task, see tm_thread_pool_task_option_t.
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
 int tm_thread_pool_task_init(tm_thread_pool_task_t *task,
 			     tm_thread_pool_task_entry_t entry,
+			     void *arg,
 			     tm_thread_pool_task_event_t event,
 			     unsigned long option);
 
+/**
+ * tm_thread_pool_task_commit - Commit a task to thread pool
+ *
+ * A task can be committed again after its TM_THREAD_POOL_EVENT_END event,
+ * also from inside the event callback, worker do not touch it any more.
+ *
+ * @thread_pool: Point to the thread pool
+ *
+ * @task: Point to the task
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
 int tm_thread_pool_task_commit(tm_thread_pool_t *thread_pool,
 			       tm_thread_pool_task_t *task);
 
-int tm_thread_pool_task_destroy(tm_thread_pool_task_t *task)
+/**
+ * tm_thread_pool_task_set_cq - Report completion of a task into @cq
+ *
+ * Instead of TM_THREAD_POOL_EVENT_END callback, an entry of @tag and task
+ * return value is added to @cq when task is finished, the task can be
+ * committed again once its entry is reaped. TM_THREAD_POOL_EVENT_START is
+ * still called. Do not change it while the task is committed.
+ *
+ * @task: Point to the task
+ *
+ * @cq: Completion queue, NULL to use event callback again
+ *
+ * @tag: User tag of this task, copied into each entry
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_task_set_cq(tm_thread_pool_task_t *task,
+			       tm_thread_pool_cq_t *cq, void *tag);
+
+/**
+ * tm_thread_pool_task_destroy - Destroy a task
+ *
+ * @task: Point to the task
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_task_destroy(tm_thread_pool_task_t *task);
+
+/**
+ * tm_thread_pool_io_commit - Commit an asynchronous file operation
+ *
+ * No worker is blocked while the operation is in flight when the pool was
+ * created with TM_THREAD_POOL_OPTION_INTENSIVE_IO and io_uring is usable,
+ * otherwise, or when io_uring completion queue is full, the operation is done
+ * by a worker right before @task.
+ *
+ * @thread_pool: Point to the thread pool
+ *
+ * @io: Point to the request, @io->result is valid when @task start
+ *
+ * @task: Continuation, committed to this pool once @io is completed
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_io_commit(tm_thread_pool_t *thread_pool,
+			     tm_thread_pool_io_t *io,
+			     tm_thread_pool_task_t *task);
+
+/**
+ * tm_thread_pool_cq_init - Initialize a completion queue
+ *
+ * Worker wait while the ring is full, so reap often or make it big enough
+ * for all tasks in flight.
+ *
+ * @cq: Point to the completion queue
+ *
+ * @entries: Number of entries, round up to power of 2
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_cq_init(tm_thread_pool_cq_t *cq, unsigned long entries);
+
+/**
+ * tm_thread_pool_cq_reap - Take finished tasks out of completion queue
+ *
+ * Entries come out in the order workers claimed their slot. Only one thread
+ * may reap a completion queue at a time.
+ *
+ * @cq: Point to the completion queue
+ *
+ * @entries: Where to save entries, room for @max entries
+ *
+ * @max: Max number of entries
+ *
+ * @min_wait: Wait until at least this number of entries are reaped, 0 do
+ *	      not wait, not more than @max
+ *
+ * @number: Where to save number of reaped entries
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_cq_reap(tm_thread_pool_cq_t *cq,
+			   tm_thread_pool_cq_entry_t *entries,
+			   unsigned long max, unsigned long min_wait,
+			   unsigned long *number);
 
+/**
+ * tm_thread_pool_cq_destroy - Destroy a completion queue
+ *
+ * @cq: Point to the completion queue, no task should report into it any more
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_cq_destroy(tm_thread_pool_cq_t *cq);
+
+/**
+ * tm_thread_pool_get_size - Get number of worker threads
+ *
+ * @thread_pool: Point to the thread pool
+ *
+ * @size: Where to save number of worker threads
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
+int tm_thread_pool_get_size(tm_thread_pool_t *thread_pool, int *size);
+
+/**
+ * tm_thread_pool_destroy - Destroy a thread pool
+ *
+ * All committed tasks and in flight file operations are finished before
+ * worker threads exit.
+ *
+ * @thread_pool: Point to the thread pool
+ *
+ * @return:  0 - success
+ *	    -1 - error
+ * */
 int tm_thread_pool_destroy(tm_thread_pool_t *thread_pool);
 
 #ifdef __cplusplus
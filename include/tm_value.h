@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_VALUE_H
+#define TM_VALUE_H
+
+#include <stdlib.h>
+
+#include <threads.h>
+
+#include "tm_queue.h"
+#include "tm_stack.h"
+
+/*
+ * Queue and stack which save values instead of pointers, generated for one
+ * element type at compile time. Values are copied by assignment into
+ * segments of about TM_VALUE_SEGMENT_SIZE bytes, so no allocation is needed
+ * per element and size of each copy is known by compiler.
+ *
+ * TM_QUEUE_DEFINE(name, type) generates:
+ *
+ *	name##_t
+ *	int name##_init(name##_t *queue, unsigned long option);
+ *	int name##_destroy(name##_t *queue);
+ *	int name##_push(name##_t *queue, const type *value);
+ *	int name##_pop(name##_t *queue, type *value);
+ *	int name##_get_size(name##_t *queue, unsigned long *size);
+ *
+ * TM_STACK_DEFINE(name, type) generates the same set for a stack. @option
+ * is TM_QUEUE_OPTION_MULTI_THREAD or TM_STACK_OPTION_MULTI_THREAD, all of
+ * them return 0 on success and -1 on error, pop fail when empty. Value
+ * given to pop can be NULL to drop the element.
+ * */
+
+/* Bytes of values per segment */
+#define TM_VALUE_SEGMENT_SIZE		4096ul
+
+/* Number of values per segment, at least 8 for big types */
+#define TM_VALUE_SEGMENT_NUMBER(type)					\
+	(sizeof(type) < TM_VALUE_SEGMENT_SIZE / 8 ?			\
+	 TM_VALUE_SEGMENT_SIZE / sizeof(type) : 8ul)
+
+#define TM_QUEUE_DEFINE(name, type)					\
+									\
+typedef struct name##_segment_s {					\
+	struct name##_segment_s *next;					\
+	type value[TM_VALUE_SEGMENT_NUMBER(type)];			\
+} name##_segment_t;							\
+									\
+typedef struct name##_s {						\
+	unsigned long option;						\
+	mtx_t lock;							\
+	name##_segment_t *head;						\
+	name##_segment_t *tail;						\
+	name##_segment_t *spare;					\
+	unsigned long read;						\
+	unsigned long write;						\
+	unsigned long count;						\
+} name##_t;								\
+									\
+static inline int name##_init(name##_t *queue, unsigned long option)	\
+{									\
+	if (NULL == queue) {						\
+		return -1;						\
+	}								\
+									\
+	if (option & ~(unsigned long)TM_QUEUE_OPTION_MULTI_THREAD) {	\
+		return -1;						\
+	}								\
+									\
+	if (thrd_success != mtx_init(&queue->lock, mtx_plain)) {	\
+		return -1;						\
+	}								\
+									\
+	queue->option = option;						\
+	queue->head = NULL;						\
+	queue->tail = NULL;						\
+	queue->spare = NULL;						\
+	queue->read = 0;						\
+	queue->write = 0;						\
+	queue->count = 0;						\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_destroy(name##_t *queue)			\
+{									\
+	name##_segment_t *segment;					\
+									\
+	if (NULL == queue) {						\
+		return -1;						\
+	}								\
+									\
+	while (NULL != queue->head) {					\
+		segment = queue->head;					\
+		queue->head = segment->next;				\
+		free(segment);						\
+	}								\
+									\
+	free(queue->spare);						\
+									\
+	mtx_destroy(&queue->lock);					\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_push(name##_t *queue, const type *value)	\
+{									\
+	name##_segment_t *segment;					\
+									\
+	if (NULL == queue || NULL == value) {				\
+		return -1;						\
+	}								\
+									\
+	if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {		\
+		mtx_lock(&queue->lock);					\
+	}								\
+									\
+	/* Tail segment is full, link a new one */			\
+	if (NULL == queue->tail ||					\
+	    TM_VALUE_SEGMENT_NUMBER(type) == queue->write) {		\
+		segment = queue->spare;					\
+		queue->spare = NULL;					\
+									\
+		if (NULL == segment) {					\
+			segment = (name##_segment_t*)malloc(		\
+					sizeof(name##_segment_t));	\
+		}							\
+									\
+		if (NULL == segment) {					\
+			if (queue->option &				\
+			    TM_QUEUE_OPTION_MULTI_THREAD) {		\
+				mtx_unlock(&queue->lock);		\
+			}						\
+			return -1;					\
+		}							\
+									\
+		segment->next = NULL;					\
+									\
+		if (NULL == queue->tail) {				\
+			queue->head = segment;				\
+			queue->read = 0;				\
+		} else {						\
+			queue->tail->next = segment;			\
+		}							\
+									\
+		queue->tail = segment;					\
+		queue->write = 0;					\
+	}								\
+									\
+	queue->tail->value[queue->write++] = *value;			\
+	queue->count++;							\
+									\
+	if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {		\
+		mtx_unlock(&queue->lock);				\
+	}								\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_pop(name##_t *queue, type *value)		\
+{									\
+	name##_segment_t *segment;					\
+									\
+	if (NULL == queue) {						\
+		return -1;						\
+	}								\
+									\
+	if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {		\
+		mtx_lock(&queue->lock);					\
+	}								\
+									\
+	if (0 == queue->count) {					\
+		if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {	\
+			mtx_unlock(&queue->lock);			\
+		}							\
+		return -1;						\
+	}								\
+									\
+	segment = queue->head;						\
+									\
+	if (NULL != value) {						\
+		*value = segment->value[queue->read];			\
+	}								\
+									\
+	queue->read++;							\
+	queue->count--;							\
+									\
+	if (0 == queue->count) {					\
+		/* Empty, start over in the same segment */		\
+		queue->read = 0;					\
+		queue->write = 0;					\
+	} else if (TM_VALUE_SEGMENT_NUMBER(type) == queue->read) {	\
+		/* Head segment drained, keep one for next push */	\
+		queue->head = segment->next;				\
+		queue->read = 0;					\
+									\
+		if (NULL == queue->spare) {				\
+			queue->spare = segment;				\
+		} else {						\
+			free(segment);					\
+		}							\
+	}								\
+									\
+	if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {		\
+		mtx_unlock(&queue->lock);				\
+	}								\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_get_size(name##_t *queue,			\
+				  unsigned long *size)			\
+{									\
+	if (NULL == queue || NULL == size) {				\
+		return -1;						\
+	}								\
+									\
+	if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {		\
+		mtx_lock(&queue->lock);					\
+	}								\
+									\
+	*size = queue->count;						\
+									\
+	if (queue->option & TM_QUEUE_OPTION_MULTI_THREAD) {		\
+		mtx_unlock(&queue->lock);				\
+	}								\
+									\
+	return 0;							\
+}
+
+#define TM_STACK_DEFINE(name, type)					\
+									\
+typedef struct name##_segment_s {					\
+	struct name##_segment_s *prev;					\
+	type value[TM_VALUE_SEGMENT_NUMBER(type)];			\
+} name##_segment_t;							\
+									\
+typedef struct name##_s {						\
+	unsigned long option;						\
+	mtx_t lock;							\
+	name##_segment_t *top;						\
+	name##_segment_t *spare;					\
+	unsigned long index;						\
+	unsigned long count;						\
+} name##_t;								\
+									\
+static inline int name##_init(name##_t *stack, unsigned long option)	\
+{									\
+	if (NULL == stack) {						\
+		return -1;						\
+	}								\
+									\
+	if (option >= TM_STACK_OPTION_MAX) {				\
+		return -1;						\
+	}								\
+									\
+	if (thrd_success != mtx_init(&stack->lock, mtx_plain)) {	\
+		return -1;						\
+	}								\
+									\
+	stack->option = option;						\
+	stack->top = NULL;						\
+	stack->spare = NULL;						\
+	stack->index = 0;						\
+	stack->count = 0;						\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_destroy(name##_t *stack)			\
+{									\
+	name##_segment_t *segment;					\
+									\
+	if (NULL == stack) {						\
+		return -1;						\
+	}								\
+									\
+	while (NULL != stack->top) {					\
+		segment = stack->top;					\
+		stack->top = segment->prev;				\
+		free(segment);						\
+	}								\
+									\
+	free(stack->spare);						\
+									\
+	mtx_destroy(&stack->lock);					\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_push(name##_t *stack, const type *value)	\
+{									\
+	name##_segment_t *segment;					\
+									\
+	if (NULL == stack || NULL == value) {				\
+		return -1;						\
+	}								\
+									\
+	if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {		\
+		mtx_lock(&stack->lock);					\
+	}								\
+									\
+	/* Top segment is full, stack a new one */			\
+	if (NULL == stack->top ||					\
+	    TM_VALUE_SEGMENT_NUMBER(type) == stack->index) {		\
+		segment = stack->spare;					\
+		stack->spare = NULL;					\
+									\
+		if (NULL == segment) {					\
+			segment = (name##_segment_t*)malloc(		\
+					sizeof(name##_segment_t));	\
+		}							\
+									\
+		if (NULL == segment) {					\
+			if (stack->option &				\
+			    TM_STACK_OPTION_MULTI_THREAD) {		\
+				mtx_unlock(&stack->lock);		\
+			}						\
+			return -1;					\
+		}							\
+									\
+		segment->prev = stack->top;				\
+		stack->top = segment;					\
+		stack->index = 0;					\
+	}								\
+									\
+	stack->top->value[stack->index++] = *value;			\
+	stack->count++;							\
+									\
+	if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {		\
+		mtx_unlock(&stack->lock);				\
+	}								\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_pop(name##_t *stack, type *value)		\
+{									\
+	name##_segment_t *segment;					\
+									\
+	if (NULL == stack) {						\
+		return -1;						\
+	}								\
+									\
+	if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {		\
+		mtx_lock(&stack->lock);					\
+	}								\
+									\
+	if (0 == stack->count) {					\
+		if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {	\
+			mtx_unlock(&stack->lock);			\
+		}							\
+		return -1;						\
+	}								\
+									\
+	stack->index--;							\
+	stack->count--;							\
+									\
+	if (NULL != value) {						\
+		*value = stack->top->value[stack->index];		\
+	}								\
+									\
+	/* Top segment drained, keep it for next push */		\
+	if (0 == stack->index && NULL != stack->top->prev) {		\
+		segment = stack->top;					\
+		stack->top = segment->prev;				\
+		stack->index = TM_VALUE_SEGMENT_NUMBER(type);		\
+									\
+		free(stack->spare);					\
+		stack->spare = segment;					\
+	}								\
+									\
+	if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {		\
+		mtx_unlock(&stack->lock);				\
+	}								\
+									\
+	return 0;							\
+}									\
+									\
+static inline int name##_get_size(name##_t *stack,			\
+				  unsigned long *size)			\
+{									\
+	if (NULL == stack || NULL == size) {				\
+		return -1;						\
+	}								\
+									\
+	if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {		\
+		mtx_lock(&stack->lock);					\
+	}								\
+									\
+	*size = stack->count;						\
+									\
+	if (stack->option & TM_STACK_OPTION_MULTI_THREAD) {		\
+		mtx_unlock(&stack->lock);				\
+	}								\
+									\
+	return 0;							\
+}
+
+#endif /* TM_VALUE_H */
+
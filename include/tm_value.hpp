@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_VALUE_HPP
+#define TM_VALUE_HPP
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "tm_queue.h"
+#include "tm_stack.h"
+
+/*
+ * C++ version of tm_value.h, elements are constructed in place inside
+ * segments so types with constructors, destructors or move only types work
+ * as well. Return value follow the C API, 0 on success and -1 on error.
+ * Need C++11, std::launder is used when the library has it (C++17).
+ * */
+
+namespace teemo {
+
+namespace internal {
+
+/* Number of values per segment, same as TM_VALUE_SEGMENT_NUMBER */
+template <typename T>
+constexpr std::size_t segment_number()
+{
+	return sizeof(T) < 4096 / 8 ? 4096 / sizeof(T) : 8;
+}
+
+/* Raw storage of segment_number<T>() values */
+template <typename T>
+struct segment {
+	segment *link;
+	alignas(T) unsigned char storage[segment_number<T>() * sizeof(T)];
+
+	T *at(std::size_t index)
+	{
+#ifdef __cpp_lib_launder
+		return std::launder(reinterpret_cast<T*>(storage) + index);
+#else
+		return reinterpret_cast<T*>(storage) + index;
+#endif
+	}
+
+	void *raw(std::size_t index)
+	{
+		return storage + index * sizeof(T);
+	}
+};
+
+/* Lock only when option ask for it */
+class guard {
+public:
+	guard(std::mutex &mutex, bool enable) : mutex_(enable ? &mutex : nullptr)
+	{
+		if (nullptr != mutex_) {
+			mutex_->lock();
+		}
+	}
+
+	~guard()
+	{
+		if (nullptr != mutex_) {
+			mutex_->unlock();
+		}
+	}
+
+	guard(const guard &) = delete;
+	guard &operator=(const guard &) = delete;
+
+private:
+	std::mutex *mutex_;
+};
+
+} /* namespace internal */
+
+/**
+ * value_queue - FIFO queue of values
+ *
+ * @option: TM_QUEUE_OPTION_MULTI_THREAD or 0
+ * */
+template <typename T>
+class value_queue {
+public:
+	explicit value_queue(unsigned long option = 0) :
+		multi_thread_(option & TM_QUEUE_OPTION_MULTI_THREAD)
+	{
+	}
+
+	~value_queue()
+	{
+		while (0 == pop_locked(nullptr));
+
+		release(head_);
+		delete spare_;
+	}
+
+	value_queue(const value_queue &) = delete;
+	value_queue &operator=(const value_queue &) = delete;
+
+	int push(const T &value)
+	{
+		return emplace(value);
+	}
+
+	int push(T &&value)
+	{
+		return emplace(std::move(value));
+	}
+
+	/* Construct element in place, exception of constructor is passed on */
+	template <typename... Args>
+	int emplace(Args &&...args)
+	{
+		internal::guard guard(mutex_, multi_thread_);
+
+		if (nullptr == tail_ || internal::segment_number<T>() == write_) {
+			segment_t *segment = spare_;
+
+			spare_ = nullptr;
+			if (nullptr == segment) {
+				segment = new (std::nothrow) segment_t;
+				if (nullptr == segment) {
+					return -1;
+				}
+			}
+
+			segment->link = nullptr;
+			if (nullptr == tail_) {
+				head_ = segment;
+				read_ = 0;
+			} else {
+				tail_->link = segment;
+			}
+			tail_ = segment;
+			write_ = 0;
+		}
+
+		new (tail_->raw(write_)) T(std::forward<Args>(args)...);
+
+		write_++;
+		count_++;
+
+		return 0;
+	}
+
+	/* Element is moved into @value, nullptr drop it */
+	int pop(T *value)
+	{
+		internal::guard guard(mutex_, multi_thread_);
+
+		return pop_locked(value);
+	}
+
+	std::size_t size()
+	{
+		internal::guard guard(mutex_, multi_thread_);
+
+		return count_;
+	}
+
+private:
+	typedef internal::segment<T> segment_t;
+
+	int pop_locked(T *value)
+	{
+		segment_t *segment = head_;
+		T *element;
+
+		if (0 == count_) {
+			return -1;
+		}
+
+		element = segment->at(read_);
+		if (nullptr != value) {
+			*value = std::move(*element);
+		}
+		element->~T();
+
+		read_++;
+		count_--;
+
+		if (0 == count_) {
+			read_ = 0;
+			write_ = 0;
+		} else if (internal::segment_number<T>() == read_) {
+			head_ = segment->link;
+			read_ = 0;
+
+			if (nullptr == spare_) {
+				spare_ = segment;
+			} else {
+				delete segment;
+			}
+		}
+
+		return 0;
+	}
+
+	static void release(segment_t *segment)
+	{
+		while (nullptr != segment) {
+			segment_t *link = segment->link;
+
+			delete segment;
+			segment = link;
+		}
+	}
+
+	bool multi_thread_;
+	std::mutex mutex_;
+	segment_t *head_ = nullptr;
+	segment_t *tail_ = nullptr;
+	segment_t *spare_ = nullptr;
+	std::size_t read_ = 0;
+	std::size_t write_ = 0;
+	std::size_t count_ = 0;
+};
+
+/**
+ * value_stack - LIFO stack of values
+ *
+ * @option: TM_STACK_OPTION_MULTI_THREAD or 0
+ * */
+template <typename T>
+class value_stack {
+public:
+	explicit value_stack(unsigned long option = 0) :
+		multi_thread_(option & TM_STACK_OPTION_MULTI_THREAD)
+	{
+	}
+
+	~value_stack()
+	{
+		while (0 == pop_locked(nullptr));
+
+		delete top_;
+		delete spare_;
+	}
+
+	value_stack(const value_stack &) = delete;
+	value_stack &operator=(const value_stack &) = delete;
+
+	int push(const T &value)
+	{
+		return emplace(value);
+	}
+
+	int push(T &&value)
+	{
+		return emplace(std::move(value));
+	}
+
+	/* Construct element in place, exception of constructor is passed on */
+	template <typename... Args>
+	int emplace(Args &&...args)
+	{
+		internal::guard guard(mutex_, multi_thread_);
+
+		if (nullptr == top_ || internal::segment_number<T>() == index_) {
+			segment_t *segment = spare_;
+
+			spare_ = nullptr;
+			if (nullptr == segment) {
+				segment = new (std::nothrow) segment_t;
+				if (nullptr == segment) {
+					return -1;
+				}
+			}
+
+			/* Link point to the older segment */
+			segment->link = top_;
+			top_ = segment;
+			index_ = 0;
+		}
+
+		new (top_->raw(index_)) T(std::forward<Args>(args)...);
+
+		index_++;
+		count_++;
+
+		return 0;
+	}
+
+	/* Element is moved into @value, nullptr drop it */
+	int pop(T *value)
+	{
+		internal::guard guard(mutex_, multi_thread_);
+
+		return pop_locked(value);
+	}
+
+	std::size_t size()
+	{
+		internal::guard guard(mutex_, multi_thread_);
+
+		return count_;
+	}
+
+private:
+	typedef internal::segment<T> segment_t;
+
+	int pop_locked(T *value)
+	{
+		T *element;
+
+		if (0 == count_) {
+			return -1;
+		}
+
+		index_--;
+		count_--;
+
+		element = top_->at(index_);
+		if (nullptr != value) {
+			*value = std::move(*element);
+		}
+		element->~T();
+
+		if (0 == index_ && nullptr != top_->link) {
+			segment_t *segment = top_;
+
+			top_ = segment->link;
+			index_ = internal::segment_number<T>();
+
+			delete spare_;
+			spare_ = segment;
+		}
+
+		return 0;
+	}
+
+	bool multi_thread_;
+	std::mutex mutex_;
+	segment_t *top_ = nullptr;
+	segment_t *spare_ = nullptr;
+	std::size_t index_ = 0;
+	std::size_t count_ = 0;
+};
+
+} /* namespace teemo */
+
+#endif /* TM_VALUE_HPP */
+
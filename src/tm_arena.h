@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#ifndef TM_ARENA_H
+#define TM_ARENA_H
+
+/*
+ * Internal node arena of compact containers, not installed.
+ *
+ * Nodes are numbered and linked by "index + 1" in 32 bits, 0 is NULL. Each
+ * node is one element pointer and one link kept in two arrays, so it cost
+ * 12 bytes with no allocator header. Chunks double in size and are never
+ * freed until tm_arena_destroy, so a stale reference always point to valid
+ * memory. Free nodes are linked by their link, the free list head keep an
+ * ABA tag in its high 32 bits like tm_pool.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <threads.h>
+
+/* Nodes of the first chunk, 1 << TM_ARENA_CHUNK_SHIFT */
+#define TM_ARENA_CHUNK_SHIFT	10u
+
+/* Max number of chunks, about 2^31 nodes in total */
+#define TM_ARENA_CHUNK_MAX	21u
+
+/**
+ * struct tm_arena_s - Node arena
+ *
+ * @lock: Serialize growing
+ *
+ * @chunk_number: Number of chunks allocated
+ *
+ * @item: Element pointer arrays of each chunk
+ *
+ * @link: Link arrays of each chunk
+ *
+ * @free: Free list head, tag << 32 | reference, 0 is empty
+ * */
+typedef struct tm_arena_s {
+	mtx_t lock;
+	unsigned int chunk_number;
+	void **item[TM_ARENA_CHUNK_MAX];
+	_Atomic(uint32_t) *link[TM_ARENA_CHUNK_MAX];
+	_Alignas(64) _Atomic(uint64_t) free;
+} tm_arena_t;
+
+/* Chunk k hold references of [1024 * (2^k - 1), 1024 * (2^(k+1) - 1)) + 1 */
+static inline void tm_arena_locate(uint32_t reference, unsigned int *chunk,
+				   uint64_t *offset)
+{
+	uint64_t i = (uint64_t)reference - 1 + (1ull << TM_ARENA_CHUNK_SHIFT);
+
+	*chunk = 63 - __builtin_clzll(i) - TM_ARENA_CHUNK_SHIFT;
+	*offset = i - (1ull << (*chunk + TM_ARENA_CHUNK_SHIFT));
+}
+
+static inline void **tm_arena_item(tm_arena_t *arena, uint32_t reference)
+{
+	unsigned int chunk;
+	uint64_t offset;
+
+	tm_arena_locate(reference, &chunk, &offset);
+
+	return &arena->item[chunk][offset];
+}
+
+static inline _Atomic(uint32_t) *tm_arena_link(tm_arena_t *arena,
+					       uint32_t reference)
+{
+	unsigned int chunk;
+	uint64_t offset;
+
+	tm_arena_locate(reference, &chunk, &offset);
+
+	return &arena->link[chunk][offset];
+}
+
+/* Push references linked from @first to @last onto free list */
+static inline void tm_arena_release(tm_arena_t *arena, uint32_t first,
+				    uint32_t last)
+{
+	uint64_t old;
+	uint64_t new;
+
+	old = atomic_load_explicit(&arena->free, memory_order_relaxed);
+
+	do {
+		atomic_store_explicit(tm_arena_link(arena, last),
+				      (uint32_t)old, memory_order_relaxed);
+
+		new = ((old >> 32) + 1) << 32 | first;
+	} while (!atomic_compare_exchange_weak_explicit(&arena->free, &old,
+							new,
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+static inline void tm_arena_free(tm_arena_t *arena, uint32_t reference)
+{
+	tm_arena_release(arena, reference, reference);
+}
+
+/* Caller should hold arena->lock */
+static inline int tm_arena_grow(tm_arena_t *arena)
+{
+	uint64_t i;
+	uint64_t size;
+	uint32_t first;
+	unsigned int chunk = arena->chunk_number;
+
+	if (TM_ARENA_CHUNK_MAX == chunk) {
+		return -1;
+	}
+
+	size = 1ull << (chunk + TM_ARENA_CHUNK_SHIFT);
+
+	arena->item[chunk] = (void**)malloc(size * sizeof(void*));
+	arena->link[chunk] = (_Atomic(uint32_t)*)malloc(
+					size * sizeof(_Atomic(uint32_t)));
+	if (NULL == arena->item[chunk] || NULL == arena->link[chunk]) {
+		free(arena->item[chunk]);
+		free(arena->link[chunk]);
+		return -1;
+	}
+
+	/* Reference of first node of this chunk */
+	first = (uint32_t)(size - (1ull << TM_ARENA_CHUNK_SHIFT) + 1);
+
+	for (i = 0; i + 1 < size; i++) {
+		atomic_init(&arena->link[chunk][i], first + i + 1);
+	}
+
+	arena->chunk_number++;
+
+	/* Publish the chunk together with its nodes */
+	tm_arena_release(arena, first, first + size - 1);
+
+	return 0;
+}
+
+/* Grow by one chunk unless someone else refilled free list meanwhile */
+static inline int tm_arena_refill(tm_arena_t *arena)
+{
+	int ret = 0;
+
+	mtx_lock(&arena->lock);
+
+	if (0 == (uint32_t)atomic_load(&arena->free)) {
+		ret = tm_arena_grow(arena);
+	}
+
+	mtx_unlock(&arena->lock);
+
+	return ret;
+}
+
+/* Get a free node, grow by one chunk when none left */
+static inline int tm_arena_alloc(tm_arena_t *arena, uint32_t *reference)
+{
+	uint64_t old;
+	uint64_t new;
+	uint32_t next;
+
+	while (true) {
+		old = atomic_load_explicit(&arena->free, memory_order_acquire);
+
+		while (0 != (uint32_t)old) {
+			/*
+			 * Node may be taken and reused by others at the same
+			 * time, then @next is garbage but tag changed and CAS
+			 * fail.
+			 * */
+			next = atomic_load_explicit(
+					tm_arena_link(arena, (uint32_t)old),
+					memory_order_relaxed);
+
+			new = ((old >> 32) + 1) << 32 | next;
+
+			if (atomic_compare_exchange_weak_explicit(&arena->free,
+							&old, new,
+							memory_order_acquire,
+							memory_order_acquire)) {
+				*reference = (uint32_t)old;
+				return 0;
+			}
+		}
+
+		if (0 != tm_arena_refill(arena)) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Take the whole free list at once, linked from @first and ended by 0. No
+ * link is read before the CAS, so nothing can be garbage.
+ * */
+static inline int tm_arena_take(tm_arena_t *arena, uint32_t *first)
+{
+	uint64_t old;
+
+	while (true) {
+		old = atomic_load_explicit(&arena->free, memory_order_acquire);
+
+		while (0 != (uint32_t)old) {
+			if (atomic_compare_exchange_weak_explicit(&arena->free,
+							&old,
+							((old >> 32) + 1) << 32,
+							memory_order_acquire,
+							memory_order_acquire)) {
+				*first = (uint32_t)old;
+				return 0;
+			}
+		}
+
+		if (0 != tm_arena_refill(arena)) {
+			return -1;
+		}
+	}
+}
+
+static inline tm_arena_t *tm_arena_create(void)
+{
+	tm_arena_t *arena;
+
+	arena = (tm_arena_t*)aligned_alloc(_Alignof(tm_arena_t),
+					   sizeof(tm_arena_t));
+	if (NULL == arena) {
+		return NULL;
+	}
+
+	mtx_init(&arena->lock, mtx_plain);
+	arena->chunk_number = 0;
+	atomic_init(&arena->free, 0);
+
+	return arena;
+}
+
+static inline void tm_arena_destroy(tm_arena_t *arena)
+{
+	unsigned int i;
+
+	for (i = 0; i < arena->chunk_number; i++) {
+		free(arena->item[i]);
+		free(arena->link[i]);
+	}
+
+	mtx_destroy(&arena->lock);
+	free(arena);
+}
+
+#endif /* TM_ARENA_H */
@@ -0,0 +1,1071 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <threads.h>
+
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "tm_pool.h"
+#include "tm_stack.h"
+#include "tm_queue.h"
+#include "tm_thread_pool.h"
+#include "tm_coroutine.h"
+
+/* Default stack size of coroutine */
+#define TM_COROUTINE_STACK_SIZE		(64ul * 1024)
+
+/* Max number of free stacks kept for reuse */
+#define TM_COROUTINE_STACK_CACHE	256ul
+
+/* Number of coroutines per slab of coroutine pool */
+#define TM_COROUTINE_NUMBER		1024ul
+
+/* Milliseconds between commits of a woken coroutine the pool refused */
+#define TM_COROUTINE_RETRY_INTERVAL	1ul
+
+/**
+ * enum tm_coroutine_state_e - State of coroutine
+ *
+ * A coroutine about to wait set TM_COROUTINE_STATE_SUSPENDING before it
+ * publish itself to a waker, the worker park it after it switched back. A
+ * wake up come in between turn it into TM_COROUTINE_STATE_NOTIFIED, then
+ * the worker commit it again instead of parking it.
+ *
+ * @TM_COROUTINE_STATE_RUNNING: Committed or running
+ *
+ * @TM_COROUTINE_STATE_SUSPENDING: About to give the worker back
+ *
+ * @TM_COROUTINE_STATE_PARKED: Waiting, no worker hold it
+ *
+ * @TM_COROUTINE_STATE_NOTIFIED: Woken before worker parked it
+ *
+ * @TM_COROUTINE_STATE_DONE: Entry returned
+ * */
+typedef enum tm_coroutine_state_e {
+	TM_COROUTINE_STATE_RUNNING = 0,
+	TM_COROUTINE_STATE_SUSPENDING = 1,
+	TM_COROUTINE_STATE_PARKED = 2,
+	TM_COROUTINE_STATE_NOTIFIED = 3,
+	TM_COROUTINE_STATE_DONE = 4,
+} tm_coroutine_state_t;
+
+/**
+ * struct tm_coroutine_priv_s - Private structure of coroutine
+ *
+ * @context: Saved context of coroutine
+ *
+ * @caller: Context of the worker currently running it
+ *
+ * @scheduler: Scheduler this coroutine belong to
+ *
+ * @group: Group this coroutine counted in, NULL for none
+ *
+ * @entry: User specified entry function
+ *
+ * @arg: User specified argument
+ *
+ * @stack: Mapping of stack, guard page included
+ *
+ * @state: See tm_coroutine_state_t
+ *
+ * @task: Task to run coroutine on thread pool
+ *
+ * @next: Next waiter in wait list, or next one in retry list once woken
+ * */
+typedef struct tm_coroutine_priv_s {
+	ucontext_t context;
+	ucontext_t *caller;
+	struct tm_coroutine_scheduler_priv_s *scheduler;
+	struct tm_coroutine_group_priv_s *group;
+	tm_coroutine_entry_t entry;
+	void *arg;
+	void *stack;
+	atomic_int state;
+	tm_thread_pool_task_t task;
+	struct tm_coroutine_priv_s *next;
+} tm_coroutine_priv_t;
+
+/**
+ * struct tm_coroutine_timer_s - Sleeping coroutine
+ *
+ * @deadline: When to wake, nanoseconds of TIME_UTC
+ *
+ * @coroutine: Coroutine to wake
+ * */
+typedef struct tm_coroutine_timer_s {
+	uint64_t deadline;
+	tm_coroutine_priv_t *coroutine;
+} tm_coroutine_timer_t;
+
+/**
+ * struct tm_coroutine_scheduler_priv_s - Private structure of scheduler
+ *
+ * @thread_pool: Where coroutines run
+ *
+ * @page_size: Size of guard page
+ *
+ * @stack_size: Usable stack size, multiple of @page_size
+ *
+ * @coroutine_pool: Private structures of coroutines
+ *
+ * @stack_cache: Free stacks
+ *
+ * @cached: Number of stacks in @stack_cache
+ *
+ * @lock: Protect @live
+ *
+ * @idle: Signaled when @live drop to 0
+ *
+ * @live: Number of coroutines not done yet
+ *
+ * @timer_lock: Protect fields below
+ *
+ * @timer_cond: Signaled when earliest deadline changed or shutdown
+ *
+ * @timer: Min heap of sleeping coroutines
+ *
+ * @timer_number: Number of entries in @timer
+ *
+ * @timer_capacity: Size of @timer
+ *
+ * @retry: Woken coroutines thread pool failed to take, committed again by
+ *	   timer thread. They stay TM_COROUTINE_STATE_RUNNING, so no other
+ *	   wake up can commit them twice.
+ *
+ * @shutdown: Timer thread should exit
+ *
+ * @timer_thread: Thread wake sleeping coroutines
+ * */
+typedef struct tm_coroutine_scheduler_priv_s {
+	tm_thread_pool_t *thread_pool;
+	unsigned long page_size;
+	unsigned long stack_size;
+	tm_pool_t coroutine_pool;
+	tm_stack_t stack_cache;
+	atomic_ulong cached;
+
+	mtx_t lock;
+	cnd_t idle;
+	unsigned long live;
+
+	mtx_t timer_lock;
+	cnd_t timer_cond;
+	tm_coroutine_timer_t *timer;
+	unsigned long timer_number;
+	unsigned long timer_capacity;
+	tm_coroutine_priv_t *retry;
+	bool shutdown;
+	thrd_t timer_thread;
+} tm_coroutine_scheduler_priv_t;
+
+/**
+ * struct tm_coroutine_group_priv_s - Private structure of group
+ *
+ * @lock: Protect fields below
+ *
+ * @cond: Threads wait here
+ *
+ * @count: Number of coroutines not done yet
+ *
+ * @waiter: Coroutines wait for @count drop to 0
+ * */
+typedef struct tm_coroutine_group_priv_s {
+	mtx_t lock;
+	cnd_t cond;
+	unsigned long count;
+	tm_coroutine_priv_t *waiter;
+} tm_coroutine_group_priv_t;
+
+/**
+ * struct tm_coroutine_queue_priv_s - Private structure of queue
+ *
+ * @lock: Protect fields below
+ *
+ * @cond: Threads wait here
+ *
+ * @queue: Elements
+ *
+ * @waiters: Number of threads waiting on @cond
+ *
+ * @head: First waiting coroutine
+ *
+ * @tail: Last waiting coroutine
+ * */
+typedef struct tm_coroutine_queue_priv_s {
+	mtx_t lock;
+	cnd_t cond;
+	tm_queue_t queue;
+	unsigned long waiters;
+	tm_coroutine_priv_t *head;
+	tm_coroutine_priv_t *tail;
+} tm_coroutine_queue_priv_t;
+
+/* Coroutine running on this thread */
+static thread_local tm_coroutine_priv_t *tm_coroutine_current;
+
+
+/*
+ * A coroutine may resume on another thread, keep compiler from caching
+ * address of thread local variable across the switch.
+ * */
+static __attribute__((noinline)) tm_coroutine_priv_t *
+tm_coroutine_internal_self(void)
+{
+	return tm_coroutine_current;
+}
+
+static inline uint64_t tm_coroutine_internal_now(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Switch back to the worker, return when committed again */
+static void tm_coroutine_internal_suspend(tm_coroutine_priv_t *co)
+{
+	swapcontext(&co->context, co->caller);
+}
+
+static int tm_coroutine_internal_commit(tm_coroutine_priv_t *co)
+{
+	atomic_store(&co->state, TM_COROUTINE_STATE_RUNNING);
+
+	return tm_thread_pool_task_commit(co->scheduler->thread_pool,
+					  &co->task);
+}
+
+/* Commit a woken coroutine, leave it to timer thread if pool refuse */
+static void tm_coroutine_internal_resume(tm_coroutine_priv_t *co)
+{
+	tm_coroutine_scheduler_priv_t *priv = co->scheduler;
+
+	if (0 == tm_coroutine_internal_commit(co)) {
+		return;
+	}
+
+	mtx_lock(&priv->timer_lock);
+	co->next = priv->retry;
+	priv->retry = co;
+	cnd_signal(&priv->timer_cond);
+	mtx_unlock(&priv->timer_lock);
+}
+
+/* Caller should have removed @co from the wait list it was on */
+static void tm_coroutine_internal_wake(tm_coroutine_priv_t *co)
+{
+	int state = atomic_load(&co->state);
+
+	while (true) {
+		if (TM_COROUTINE_STATE_PARKED == state) {
+			if (atomic_compare_exchange_weak(&co->state, &state,
+						TM_COROUTINE_STATE_RUNNING)) {
+				tm_coroutine_internal_resume(co);
+				return;
+			}
+		} else if (TM_COROUTINE_STATE_SUSPENDING == state) {
+			if (atomic_compare_exchange_weak(&co->state, &state,
+						TM_COROUTINE_STATE_NOTIFIED)) {
+				return;
+			}
+		} else {
+			return;
+		}
+	}
+}
+
+static void tm_coroutine_internal_stack_free(
+					tm_coroutine_scheduler_priv_t *priv,
+					void *stack)
+{
+	if (atomic_fetch_add(&priv->cached, 1) < TM_COROUTINE_STACK_CACHE &&
+	    0 == tm_stack_push(&priv->stack_cache, stack)) {
+		return;
+	}
+
+	atomic_fetch_sub(&priv->cached, 1);
+	munmap(stack, priv->page_size + priv->stack_size);
+}
+
+static void *tm_coroutine_internal_stack_alloc(
+					tm_coroutine_scheduler_priv_t *priv)
+{
+	void *stack;
+
+	if (0 == tm_stack_pop(&priv->stack_cache, &stack)) {
+		atomic_fetch_sub(&priv->cached, 1);
+		return stack;
+	}
+
+	stack = mmap(NULL, priv->page_size + priv->stack_size,
+		     PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (MAP_FAILED == stack) {
+		return NULL;
+	}
+
+	/* Stack grow down, overflow hit the guard page */
+	if (0 != mprotect(stack, priv->page_size, PROT_NONE)) {
+		munmap(stack, priv->page_size + priv->stack_size);
+		return NULL;
+	}
+
+	return stack;
+}
+
+static void tm_coroutine_internal_trampoline(void)
+{
+	tm_coroutine_priv_t *co = tm_coroutine_internal_self();
+
+	co->entry(co->arg);
+
+	atomic_store(&co->state, TM_COROUTINE_STATE_DONE);
+	setcontext(co->caller);
+}
+
+/* Run coroutine until it wait or return */
+static void *tm_coroutine_internal_task_entry(void *arg)
+{
+	ucontext_t caller;
+	tm_coroutine_priv_t *co = arg;
+
+	co->caller = &caller;
+	tm_coroutine_current = co;
+
+	swapcontext(&caller, &co->context);
+
+	tm_coroutine_current = NULL;
+
+	return co;
+}
+
+static void tm_coroutine_internal_group_leave(tm_coroutine_group_priv_t *group)
+{
+	tm_coroutine_priv_t *waiter;
+
+	if (NULL == group) {
+		return;
+	}
+
+	mtx_lock(&group->lock);
+	if (0 == --group->count) {
+		while (NULL != group->waiter) {
+			waiter = group->waiter;
+			group->waiter = waiter->next;
+			tm_coroutine_internal_wake(waiter);
+		}
+		cnd_broadcast(&group->cond);
+	}
+	mtx_unlock(&group->lock);
+}
+
+/* Last touch of scheduler, @co should be gone already */
+static void tm_coroutine_internal_live_leave(
+					tm_coroutine_scheduler_priv_t *priv)
+{
+	mtx_lock(&priv->lock);
+	if (0 == --priv->live) {
+		cnd_broadcast(&priv->idle);
+	}
+	mtx_unlock(&priv->lock);
+}
+
+static void tm_coroutine_internal_finish(tm_coroutine_priv_t *co)
+{
+	tm_coroutine_scheduler_priv_t *priv = co->scheduler;
+
+	tm_coroutine_internal_stack_free(priv, co->stack);
+
+	tm_coroutine_internal_group_leave(co->group);
+
+	/* Worker do not touch the task after its end event */
+	tm_thread_pool_task_destroy(&co->task);
+	tm_pool_free(&priv->coroutine_pool, co);
+
+	tm_coroutine_internal_live_leave(priv);
+}
+
+/* Worker switched back, park coroutine or commit it again */
+static void tm_coroutine_internal_task_event(unsigned long event,
+					     void *task_status)
+{
+	int state = TM_COROUTINE_STATE_SUSPENDING;
+	tm_coroutine_priv_t *co = task_status;
+
+	if (TM_THREAD_POOL_EVENT_END != event) {
+		return;
+	}
+
+	if (TM_COROUTINE_STATE_DONE == atomic_load(&co->state)) {
+		tm_coroutine_internal_finish(co);
+		return;
+	}
+
+	if (atomic_compare_exchange_strong(&co->state, &state,
+					   TM_COROUTINE_STATE_PARKED)) {
+		return;
+	}
+
+	/* Woken or yielded while switching back */
+	tm_coroutine_internal_resume(co);
+}
+
+static void tm_coroutine_internal_timer_push(
+					tm_coroutine_scheduler_priv_t *priv,
+					tm_coroutine_timer_t *timer)
+{
+	unsigned long i = priv->timer_number++;
+	unsigned long parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (priv->timer[parent].deadline <= timer->deadline) {
+			break;
+		}
+		priv->timer[i] = priv->timer[parent];
+		i = parent;
+	}
+
+	priv->timer[i] = *timer;
+}
+
+static void tm_coroutine_internal_timer_pop(
+					tm_coroutine_scheduler_priv_t *priv)
+{
+	unsigned long i = 0;
+	unsigned long child;
+	tm_coroutine_timer_t last = priv->timer[--priv->timer_number];
+
+	while ((child = i * 2 + 1) < priv->timer_number) {
+		if (child + 1 < priv->timer_number &&
+		    priv->timer[child + 1].deadline <
+		    priv->timer[child].deadline) {
+			child++;
+		}
+		if (last.deadline <= priv->timer[child].deadline) {
+			break;
+		}
+		priv->timer[i] = priv->timer[child];
+		i = child;
+	}
+
+	priv->timer[i] = last;
+}
+
+/* Caller should hold priv->timer_lock */
+static void tm_coroutine_internal_retry(tm_coroutine_scheduler_priv_t *priv)
+{
+	tm_coroutine_priv_t *co;
+	tm_coroutine_priv_t *list = priv->retry;
+
+	priv->retry = NULL;
+
+	while (NULL != list) {
+		co = list;
+		list = co->next;
+
+		if (0 != tm_coroutine_internal_commit(co)) {
+			co->next = priv->retry;
+			priv->retry = co;
+		}
+	}
+}
+
+static int tm_coroutine_internal_timer_entry(void *arg)
+{
+	uint64_t now;
+	uint64_t wake;
+	struct timespec deadline;
+	tm_coroutine_priv_t *co;
+	tm_coroutine_scheduler_priv_t *priv = arg;
+
+	mtx_lock(&priv->timer_lock);
+
+	while (!priv->shutdown) {
+		tm_coroutine_internal_retry(priv);
+
+		if (0 == priv->timer_number && NULL == priv->retry) {
+			cnd_wait(&priv->timer_cond, &priv->timer_lock);
+			continue;
+		}
+
+		now = tm_coroutine_internal_now();
+		if (0 != priv->timer_number &&
+		    priv->timer[0].deadline <= now) {
+			co = priv->timer[0].coroutine;
+			tm_coroutine_internal_timer_pop(priv);
+
+			/* A refused commit come back to @retry under lock */
+			mtx_unlock(&priv->timer_lock);
+			tm_coroutine_internal_wake(co);
+			mtx_lock(&priv->timer_lock);
+			continue;
+		}
+
+		wake = UINT64_MAX;
+		if (0 != priv->timer_number) {
+			wake = priv->timer[0].deadline;
+		}
+		if (NULL != priv->retry &&
+		    now + TM_COROUTINE_RETRY_INTERVAL * 1000000ull < wake) {
+			wake = now + TM_COROUTINE_RETRY_INTERVAL * 1000000ull;
+		}
+
+		deadline.tv_sec = wake / 1000000000ull;
+		deadline.tv_nsec = wake % 1000000000ull;
+		cnd_timedwait(&priv->timer_cond, &priv->timer_lock, &deadline);
+	}
+
+	mtx_unlock(&priv->timer_lock);
+
+	return 0;
+}
+
+static int tm_coroutine_internal_scheduler_init(
+					tm_coroutine_scheduler_priv_t **priv,
+					tm_thread_pool_t *thread_pool,
+					unsigned long stack_size)
+{
+	unsigned long page_size = sysconf(_SC_PAGESIZE);
+
+	if (0 == stack_size) {
+		stack_size = TM_COROUTINE_STACK_SIZE;
+	}
+
+	(*priv) = (tm_coroutine_scheduler_priv_t*)malloc(
+					sizeof(tm_coroutine_scheduler_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->thread_pool = thread_pool;
+	(*priv)->page_size = page_size;
+	(*priv)->stack_size = (stack_size + page_size - 1) / page_size *
+			      page_size;
+	(*priv)->live = 0;
+	(*priv)->timer = NULL;
+	(*priv)->timer_number = 0;
+	(*priv)->timer_capacity = 0;
+	(*priv)->retry = NULL;
+	(*priv)->shutdown = false;
+
+	atomic_init(&(*priv)->cached, 0);
+
+	if (0 != tm_pool_init(&(*priv)->coroutine_pool,
+			      sizeof(tm_coroutine_priv_t), TM_COROUTINE_NUMBER,
+			      TM_POOL_OPTION_GROW)) {
+		goto err_pool;
+	}
+
+	if (0 != tm_stack_init(&(*priv)->stack_cache,
+			       TM_STACK_OPTION_MULTI_THREAD)) {
+		goto err_stack;
+	}
+
+	mtx_init(&(*priv)->lock, mtx_plain);
+	cnd_init(&(*priv)->idle);
+	mtx_init(&(*priv)->timer_lock, mtx_plain);
+	cnd_init(&(*priv)->timer_cond);
+
+	if (thrd_success != thrd_create(&(*priv)->timer_thread,
+					tm_coroutine_internal_timer_entry,
+					*priv)) {
+		goto err_thread;
+	}
+
+	return 0;
+
+err_thread:
+	cnd_destroy(&(*priv)->timer_cond);
+	mtx_destroy(&(*priv)->timer_lock);
+	cnd_destroy(&(*priv)->idle);
+	mtx_destroy(&(*priv)->lock);
+	tm_stack_destroy(&(*priv)->stack_cache);
+err_stack:
+	tm_pool_destroy(&(*priv)->coroutine_pool);
+err_pool:
+	free(*priv);
+	*priv = NULL;
+	return -1;
+}
+
+static int tm_coroutine_internal_scheduler_destroy(
+					tm_coroutine_scheduler_priv_t **priv)
+{
+	void *stack;
+
+	mtx_lock(&(*priv)->lock);
+	while (0 != (*priv)->live) {
+		cnd_wait(&(*priv)->idle, &(*priv)->lock);
+	}
+	mtx_unlock(&(*priv)->lock);
+
+	mtx_lock(&(*priv)->timer_lock);
+	(*priv)->shutdown = true;
+	cnd_signal(&(*priv)->timer_cond);
+	mtx_unlock(&(*priv)->timer_lock);
+
+	thrd_join((*priv)->timer_thread, NULL);
+
+	while (0 == tm_stack_pop(&(*priv)->stack_cache, &stack)) {
+		munmap(stack, (*priv)->page_size + (*priv)->stack_size);
+	}
+
+	tm_stack_destroy(&(*priv)->stack_cache);
+	tm_pool_destroy(&(*priv)->coroutine_pool);
+
+	cnd_destroy(&(*priv)->timer_cond);
+	mtx_destroy(&(*priv)->timer_lock);
+	cnd_destroy(&(*priv)->idle);
+	mtx_destroy(&(*priv)->lock);
+
+	free((*priv)->timer);
+	free(*priv);
+	*priv = NULL;
+
+	return 0;
+}
+
+static int tm_coroutine_internal_spawn(tm_coroutine_scheduler_priv_t **priv,
+				       tm_coroutine_group_priv_t *group,
+				       tm_coroutine_entry_t entry, void *arg)
+{
+	tm_coroutine_priv_t *co;
+
+	if (NULL == entry) {
+		return -1;
+	}
+
+	if (0 != tm_pool_alloc(&(*priv)->coroutine_pool, (void**)&co)) {
+		return -1;
+	}
+
+	co->stack = tm_coroutine_internal_stack_alloc(*priv);
+	if (NULL == co->stack) {
+		goto err_stack;
+	}
+
+	if (0 != tm_thread_pool_task_init(&co->task,
+					  tm_coroutine_internal_task_entry, co,
+					  tm_coroutine_internal_task_event, 0)) {
+		goto err_task;
+	}
+
+	getcontext(&co->context);
+	co->context.uc_stack.ss_sp = (char*)co->stack + (*priv)->page_size;
+	co->context.uc_stack.ss_size = (*priv)->stack_size;
+	co->context.uc_link = NULL;
+	makecontext(&co->context, tm_coroutine_internal_trampoline, 0);
+
+	co->caller = NULL;
+	co->scheduler = *priv;
+	co->group = group;
+	co->entry = entry;
+	co->arg = arg;
+	co->next = NULL;
+	atomic_init(&co->state, TM_COROUTINE_STATE_RUNNING);
+
+	mtx_lock(&(*priv)->lock);
+	(*priv)->live++;
+	mtx_unlock(&(*priv)->lock);
+
+	if (NULL != group) {
+		mtx_lock(&group->lock);
+		group->count++;
+		mtx_unlock(&group->lock);
+	}
+
+	if (0 != tm_coroutine_internal_commit(co)) {
+		tm_coroutine_internal_group_leave(group);
+		tm_thread_pool_task_destroy(&co->task);
+		tm_coroutine_internal_stack_free(*priv, co->stack);
+		tm_pool_free(&(*priv)->coroutine_pool, co);
+		tm_coroutine_internal_live_leave(*priv);
+		return -1;
+	}
+
+	return 0;
+
+err_task:
+	tm_coroutine_internal_stack_free(*priv, co->stack);
+err_stack:
+	tm_pool_free(&(*priv)->coroutine_pool, co);
+	return -1;
+}
+
+static int tm_coroutine_internal_sleep(tm_coroutine_scheduler_priv_t **priv,
+				       unsigned long timeout)
+{
+	unsigned long capacity;
+	tm_coroutine_timer_t timer;
+	tm_coroutine_timer_t *array;
+	tm_coroutine_priv_t *co = tm_coroutine_internal_self();
+
+	if (NULL == co) {
+		thrd_sleep(&(struct timespec){
+				.tv_sec = timeout / 1000,
+				.tv_nsec = (timeout % 1000) * 1000000,
+			   }, NULL);
+		return 0;
+	}
+
+	timer.deadline = tm_coroutine_internal_now() + timeout * 1000000ull;
+	timer.coroutine = co;
+
+	mtx_lock(&(*priv)->timer_lock);
+
+	if ((*priv)->timer_number == (*priv)->timer_capacity) {
+		capacity = (*priv)->timer_capacity ?
+			   (*priv)->timer_capacity * 2 : 64;
+		array = (tm_coroutine_timer_t*)realloc((*priv)->timer,
+					capacity * sizeof(tm_coroutine_timer_t));
+		if (NULL == array) {
+			mtx_unlock(&(*priv)->timer_lock);
+			return -1;
+		}
+		(*priv)->timer = array;
+		(*priv)->timer_capacity = capacity;
+	}
+
+	atomic_store(&co->state, TM_COROUTINE_STATE_SUSPENDING);
+	tm_coroutine_internal_timer_push(*priv, &timer);
+
+	/* Earliest deadline changed */
+	if (co == (*priv)->timer[0].coroutine) {
+		cnd_signal(&(*priv)->timer_cond);
+	}
+
+	mtx_unlock(&(*priv)->timer_lock);
+
+	tm_coroutine_internal_suspend(co);
+
+	return 0;
+}
+
+static int tm_coroutine_internal_group_wait(tm_coroutine_group_priv_t **priv)
+{
+	tm_coroutine_priv_t *co;
+
+	mtx_lock(&(*priv)->lock);
+
+	while (0 != (*priv)->count) {
+		co = tm_coroutine_internal_self();
+		if (NULL == co) {
+			cnd_wait(&(*priv)->cond, &(*priv)->lock);
+			continue;
+		}
+
+		co->next = (*priv)->waiter;
+		(*priv)->waiter = co;
+		atomic_store(&co->state, TM_COROUTINE_STATE_SUSPENDING);
+
+		mtx_unlock(&(*priv)->lock);
+		tm_coroutine_internal_suspend(co);
+		mtx_lock(&(*priv)->lock);
+	}
+
+	mtx_unlock(&(*priv)->lock);
+
+	return 0;
+}
+
+static int tm_coroutine_internal_queue_push(tm_coroutine_queue_priv_t **priv,
+					    void *data)
+{
+	tm_coroutine_priv_t *co;
+
+	mtx_lock(&(*priv)->lock);
+
+	if (0 != tm_queue_push(&(*priv)->queue, data)) {
+		mtx_unlock(&(*priv)->lock);
+		return -1;
+	}
+
+	if (NULL != (*priv)->head) {
+		co = (*priv)->head;
+		(*priv)->head = co->next;
+		if (NULL == (*priv)->head) {
+			(*priv)->tail = NULL;
+		}
+		tm_coroutine_internal_wake(co);
+	} else if (0 != (*priv)->waiters) {
+		cnd_signal(&(*priv)->cond);
+	}
+
+	mtx_unlock(&(*priv)->lock);
+
+	return 0;
+}
+
+static int tm_coroutine_internal_queue_pop(tm_coroutine_queue_priv_t **priv,
+					   void **data)
+{
+	tm_coroutine_priv_t *co;
+
+	mtx_lock(&(*priv)->lock);
+
+	while (0 != tm_queue_pop(&(*priv)->queue, data)) {
+		co = tm_coroutine_internal_self();
+		if (NULL == co) {
+			(*priv)->waiters++;
+			cnd_wait(&(*priv)->cond, &(*priv)->lock);
+			(*priv)->waiters--;
+			continue;
+		}
+
+		co->next = NULL;
+		if (NULL == (*priv)->tail) {
+			(*priv)->head = co;
+		} else {
+			(*priv)->tail->next = co;
+		}
+		(*priv)->tail = co;
+		atomic_store(&co->state, TM_COROUTINE_STATE_SUSPENDING);
+
+		mtx_unlock(&(*priv)->lock);
+		tm_coroutine_internal_suspend(co);
+		mtx_lock(&(*priv)->lock);
+	}
+
+	mtx_unlock(&(*priv)->lock);
+
+	return 0;
+}
+
+
+int tm_coroutine_scheduler_init(tm_coroutine_scheduler_t *scheduler,
+				tm_thread_pool_t *thread_pool,
+				unsigned long stack_size)
+{
+	if (NULL == scheduler || NULL == thread_pool) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_scheduler_init(
+			(tm_coroutine_scheduler_priv_t**)&scheduler->priv,
+			thread_pool, stack_size);
+}
+
+int tm_coroutine_scheduler_destroy(tm_coroutine_scheduler_t *scheduler)
+{
+	if (NULL == scheduler) {
+		return -1;
+	}
+
+	if (NULL == scheduler->priv) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_scheduler_destroy(
+			(tm_coroutine_scheduler_priv_t**)&scheduler->priv);
+}
+
+int tm_coroutine_spawn(tm_coroutine_scheduler_t *scheduler,
+		       tm_coroutine_group_t *group,
+		       tm_coroutine_entry_t entry, void *arg)
+{
+	if (NULL == scheduler) {
+		return -1;
+	}
+
+	if (NULL == scheduler->priv) {
+		return -1;
+	}
+
+	if (NULL != group && NULL == group->priv) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_spawn(
+			(tm_coroutine_scheduler_priv_t**)&scheduler->priv,
+			NULL == group ? NULL : group->priv, entry, arg);
+}
+
+void tm_coroutine_yield(void)
+{
+	tm_coroutine_priv_t *co = tm_coroutine_internal_self();
+
+	if (NULL == co) {
+		thrd_yield();
+		return;
+	}
+
+	/* Worker commit it again right after switched back */
+	atomic_store(&co->state, TM_COROUTINE_STATE_NOTIFIED);
+	tm_coroutine_internal_suspend(co);
+}
+
+int tm_coroutine_sleep(tm_coroutine_scheduler_t *scheduler,
+		       unsigned long timeout)
+{
+	if (NULL == scheduler) {
+		return -1;
+	}
+
+	if (NULL == scheduler->priv) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_sleep(
+			(tm_coroutine_scheduler_priv_t**)&scheduler->priv,
+			timeout);
+}
+
+int tm_coroutine_group_init(tm_coroutine_group_t *group)
+{
+	tm_coroutine_group_priv_t *priv;
+
+	if (NULL == group) {
+		return -1;
+	}
+
+	priv = (tm_coroutine_group_priv_t*)malloc(
+					sizeof(tm_coroutine_group_priv_t));
+	if (NULL == priv) {
+		return -1;
+	}
+
+	mtx_init(&priv->lock, mtx_plain);
+	cnd_init(&priv->cond);
+	priv->count = 0;
+	priv->waiter = NULL;
+
+	group->priv = priv;
+
+	return 0;
+}
+
+int tm_coroutine_group_wait(tm_coroutine_group_t *group)
+{
+	if (NULL == group) {
+		return -1;
+	}
+
+	if (NULL == group->priv) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_group_wait(
+			(tm_coroutine_group_priv_t**)&group->priv);
+}
+
+int tm_coroutine_group_destroy(tm_coroutine_group_t *group)
+{
+	tm_coroutine_group_priv_t *priv;
+
+	if (NULL == group) {
+		return -1;
+	}
+
+	if (NULL == group->priv) {
+		return -1;
+	}
+
+	priv = group->priv;
+
+	cnd_destroy(&priv->cond);
+	mtx_destroy(&priv->lock);
+	free(priv);
+
+	group->priv = NULL;
+
+	return 0;
+}
+
+int tm_coroutine_queue_init(tm_coroutine_queue_t *queue)
+{
+	tm_coroutine_queue_priv_t *priv;
+
+	if (NULL == queue) {
+		return -1;
+	}
+
+	priv = (tm_coroutine_queue_priv_t*)malloc(
+					sizeof(tm_coroutine_queue_priv_t));
+	if (NULL == priv) {
+		return -1;
+	}
+
+	/* Already serialized by priv->lock */
+	if (0 != tm_queue_init(&priv->queue, 0)) {
+		free(priv);
+		return -1;
+	}
+
+	mtx_init(&priv->lock, mtx_plain);
+	cnd_init(&priv->cond);
+	priv->waiters = 0;
+	priv->head = NULL;
+	priv->tail = NULL;
+
+	queue->priv = priv;
+
+	return 0;
+}
+
+int tm_coroutine_queue_push(tm_coroutine_queue_t *queue, void *data)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_queue_push(
+			(tm_coroutine_queue_priv_t**)&queue->priv, data);
+}
+
+int tm_coroutine_queue_pop(tm_coroutine_queue_t *queue, void **data)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_coroutine_internal_queue_pop(
+			(tm_coroutine_queue_priv_t**)&queue->priv, data);
+}
+
+int tm_coroutine_queue_destroy(tm_coroutine_queue_t *queue)
+{
+	tm_coroutine_queue_priv_t *priv;
+
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	priv = queue->priv;
+
+	tm_queue_destroy(&priv->queue);
+	cnd_destroy(&priv->cond);
+	mtx_destroy(&priv->lock);
+	free(priv);
+
+	queue->priv = NULL;
+
+	return 0;
+}
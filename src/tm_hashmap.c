@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <threads.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tm_hashmap.h"
+
+/* Slots probed at once, one SSE2 register of control bytes */
+#define TM_HASHMAP_GROUP_WIDTH		16u
+
+/* Number of stripes, each stripe is a table with its own lock */
+#define TM_HASHMAP_STRIPE_SHIFT		6u
+#define TM_HASHMAP_STRIPE_NUMBER	(1u << TM_HASHMAP_STRIPE_SHIFT)
+
+/* Groups moved from old table on each insert/erase while resizing */
+#define TM_HASHMAP_MIGRATE_GROUP	2u
+
+/*
+ * Control byte of each slot, full slot save the low 7 bits of hash, so the
+ * sign bit tell if a slot is free.
+ * */
+#define TM_HASHMAP_CTRL_EMPTY		((signed char)-128)
+#define TM_HASHMAP_CTRL_DELETED		((signed char)-2)
+
+/**
+ * struct tm_hashmap_attribute_s - Hash map attribute
+ *
+ * @option: Option of this hash map
+ * */
+typedef struct tm_hashmap_attribute_s {
+	unsigned long option;
+} tm_hashmap_attribute_t;
+
+/**
+ * struct tm_hashmap_entry_s - Slot structure to save elements
+ *
+ * @key: Key of element
+ *
+ * @data: Element address
+ * */
+typedef struct tm_hashmap_entry_s {
+	unsigned long key;
+	void *data;
+} tm_hashmap_entry_t;
+
+/**
+ * struct tm_hashmap_table_s - Open addressing table
+ *
+ * @ctrl: Control bytes, one per slot, kept apart from @entry so a group of
+ *	  them fit in one cache line
+ *
+ * @entry: Slots
+ *
+ * @capacity: Number of slots, power of 2 and no less than a group
+ *
+ * @size: Number of full slots
+ *
+ * @deleted: Number of deleted slots
+ * */
+typedef struct tm_hashmap_table_s {
+	signed char *ctrl;
+	tm_hashmap_entry_t *entry;
+	unsigned long capacity;
+	unsigned long size;
+	unsigned long deleted;
+} tm_hashmap_table_t;
+
+/**
+ * struct tm_hashmap_stripe_s - Stripe of hash map
+ *
+ * Resize is incremental, the new @table is used at once while groups of
+ * @old are moved a few at a time by later insert/erase.
+ *
+ * @lock: Mutex lock of this stripe
+ *
+ * @table: Current table
+ *
+ * @old: Table being migrated, capacity 0 when no resize in progress
+ *
+ * @migrate: Next group of @old to migrate
+ * */
+typedef struct tm_hashmap_stripe_s {
+	_Alignas(64) mtx_t lock;
+	tm_hashmap_table_t table;
+	tm_hashmap_table_t old;
+	unsigned long migrate;
+} tm_hashmap_stripe_t;
+
+/**
+ * struct tm_hashmap_priv_s - Private structure of hash map
+ *
+ * @attribute: Attribute of this hash map
+ *
+ * @stripe: Stripes, chosen by high bits of hash
+ * */
+typedef struct tm_hashmap_priv_s {
+	tm_hashmap_attribute_t *attribute;
+	tm_hashmap_stripe_t *stripe;
+} tm_hashmap_priv_t;
+
+
+/* Finalizer of MurmurHash3, keys are often sequential ids */
+static inline uint64_t tm_hashmap_internal_hash(unsigned long key)
+{
+	uint64_t h = key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* Bit mask of slots in group whose control byte equal to @ctrl */
+static inline unsigned tm_hashmap_internal_match(const signed char *group,
+						 signed char ctrl)
+{
+#ifdef __SSE2__
+	__m128i g = _mm_load_si128((const __m128i*)group);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(ctrl)));
+#else
+	unsigned i;
+	unsigned mask = 0;
+
+	for (i = 0; i < TM_HASHMAP_GROUP_WIDTH; i++) {
+		if (group[i] == ctrl) {
+			mask |= 1u << i;
+		}
+	}
+
+	return mask;
+#endif
+}
+
+/* Bit mask of empty or deleted slots in group */
+static inline unsigned tm_hashmap_internal_match_free(const signed char *group)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+	unsigned i;
+	unsigned mask = 0;
+
+	for (i = 0; i < TM_HASHMAP_GROUP_WIDTH; i++) {
+		if (group[i] < 0) {
+			mask |= 1u << i;
+		}
+	}
+
+	return mask;
+#endif
+}
+
+static int tm_hashmap_internal_table_init(tm_hashmap_table_t *table,
+					  unsigned long capacity)
+{
+	table->ctrl = (signed char*)aligned_alloc(TM_HASHMAP_GROUP_WIDTH,
+						  capacity);
+	if (NULL == table->ctrl) {
+		return -1;
+	}
+
+	table->entry = (tm_hashmap_entry_t*)malloc(sizeof(tm_hashmap_entry_t) *
+						   capacity);
+	if (NULL == table->entry) {
+		free(table->ctrl);
+		return -1;
+	}
+
+	memset(table->ctrl, TM_HASHMAP_CTRL_EMPTY, capacity);
+
+	table->capacity = capacity;
+	table->size = 0;
+	table->deleted = 0;
+
+	return 0;
+}
+
+static void tm_hashmap_internal_table_destroy(tm_hashmap_table_t *table)
+{
+	free(table->ctrl);
+	free(table->entry);
+
+	table->ctrl = NULL;
+	table->entry = NULL;
+	table->capacity = 0;
+	table->size = 0;
+	table->deleted = 0;
+}
+
+/* Slot index of @key, -1 if not found */
+static long tm_hashmap_internal_table_find(tm_hashmap_table_t *table,
+					   unsigned long key, uint64_t hash)
+{
+	unsigned i;
+	unsigned mask;
+	unsigned long base;
+	unsigned long group;
+	unsigned long group_mask;
+
+	if (0 == table->capacity) {
+		return -1;
+	}
+
+	group_mask = table->capacity / TM_HASHMAP_GROUP_WIDTH - 1;
+	group = (hash >> 7) & group_mask;
+
+	/* Triangular probing visit every group once */
+	for (i = 0; i <= group_mask; i++) {
+		base = group * TM_HASHMAP_GROUP_WIDTH;
+
+		mask = tm_hashmap_internal_match(&table->ctrl[base],
+						 (signed char)(hash & 0x7f));
+		while (0 != mask) {
+			if (table->entry[base + __builtin_ctz(mask)].key == key) {
+				return base + __builtin_ctz(mask);
+			}
+			mask &= mask - 1;
+		}
+
+		/* Probe chain stop at a group with empty slot */
+		if (0 != tm_hashmap_internal_match(&table->ctrl[base],
+						   TM_HASHMAP_CTRL_EMPTY)) {
+			return -1;
+		}
+
+		group = (group + i + 1) & group_mask;
+	}
+
+	return -1;
+}
+
+/* Caller make sure @key is not in @table and there is a free slot */
+static void tm_hashmap_internal_table_insert(tm_hashmap_table_t *table,
+					     unsigned long key, void *data,
+					     uint64_t hash)
+{
+	unsigned i;
+	unsigned mask;
+	unsigned long base;
+	unsigned long index;
+	unsigned long group;
+	unsigned long group_mask;
+
+	group_mask = table->capacity / TM_HASHMAP_GROUP_WIDTH - 1;
+	group = (hash >> 7) & group_mask;
+
+	for (i = 0; i <= group_mask; i++) {
+		base = group * TM_HASHMAP_GROUP_WIDTH;
+
+		mask = tm_hashmap_internal_match_free(&table->ctrl[base]);
+		if (0 != mask) {
+			index = base + __builtin_ctz(mask);
+
+			if (TM_HASHMAP_CTRL_DELETED == table->ctrl[index]) {
+				table->deleted--;
+			}
+
+			table->ctrl[index] = (signed char)(hash & 0x7f);
+			table->entry[index].key = key;
+			table->entry[index].data = data;
+			table->size++;
+
+			return;
+		}
+
+		group = (group + i + 1) & group_mask;
+	}
+}
+
+static void tm_hashmap_internal_table_erase(tm_hashmap_table_t *table,
+					    unsigned long index)
+{
+	unsigned long base = index & ~(TM_HASHMAP_GROUP_WIDTH - 1ul);
+
+	/*
+	 * No probe chain go through a group which still have an empty slot,
+	 * so no need to leave a tombstone there.
+	 * */
+	if (0 != tm_hashmap_internal_match(&table->ctrl[base],
+					   TM_HASHMAP_CTRL_EMPTY)) {
+		table->ctrl[index] = TM_HASHMAP_CTRL_EMPTY;
+	} else {
+		table->ctrl[index] = TM_HASHMAP_CTRL_DELETED;
+		table->deleted++;
+	}
+
+	table->size--;
+}
+
+/* Move up to @number groups from old table to current table */
+static void tm_hashmap_internal_migrate(tm_hashmap_stripe_t *stripe,
+					unsigned long number)
+{
+	unsigned mask;
+	unsigned long i;
+	unsigned long base;
+	unsigned long index;
+	unsigned long group_number;
+	tm_hashmap_entry_t *entry;
+	tm_hashmap_table_t *old = &stripe->old;
+
+	if (0 == old->capacity) {
+		return;
+	}
+
+	group_number = old->capacity / TM_HASHMAP_GROUP_WIDTH;
+
+	for (i = 0; i < number && stripe->migrate < group_number; i++) {
+		base = stripe->migrate * TM_HASHMAP_GROUP_WIDTH;
+
+		mask = ~tm_hashmap_internal_match_free(&old->ctrl[base]) &
+		       ((1u << TM_HASHMAP_GROUP_WIDTH) - 1);
+		while (0 != mask) {
+			index = base + __builtin_ctz(mask);
+			entry = &old->entry[index];
+
+			tm_hashmap_internal_table_insert(&stripe->table,
+				entry->key, entry->data,
+				tm_hashmap_internal_hash(entry->key));
+
+			old->ctrl[index] = TM_HASHMAP_CTRL_DELETED;
+			old->size--;
+
+			mask &= mask - 1;
+		}
+
+		stripe->migrate++;
+	}
+
+	if (stripe->migrate == group_number || 0 == old->size) {
+		tm_hashmap_internal_table_destroy(old);
+		stripe->migrate = 0;
+	}
+}
+
+/* Make sure current table have room for one more element */
+static int tm_hashmap_internal_reserve(tm_hashmap_stripe_t *stripe)
+{
+	unsigned long capacity;
+	tm_hashmap_table_t *table = &stripe->table;
+
+	/* Max load factor 7/8 */
+	if ((table->size + table->deleted + 1) * 8 <= table->capacity * 7) {
+		return 0;
+	}
+
+	/* Rare, previous resize is still in progress */
+	tm_hashmap_internal_migrate(stripe, (unsigned long)-1);
+
+	/* Mostly tombstones, rehash with the same capacity */
+	capacity = table->capacity;
+	if ((table->size + 1) * 16 > table->capacity * 7) {
+		capacity *= 2;
+	}
+
+	stripe->old = *table;
+	stripe->migrate = 0;
+
+	if (0 != tm_hashmap_internal_table_init(table, capacity)) {
+		*table = stripe->old;
+		stripe->old.capacity = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline void tm_hashmap_internal_lock(tm_hashmap_priv_t **priv,
+					    tm_hashmap_stripe_t *stripe)
+{
+	if ((*priv)->attribute->option & TM_HASHMAP_OPTION_MULTI_THREAD) {
+		mtx_lock(&stripe->lock);
+	}
+}
+
+static inline void tm_hashmap_internal_unlock(tm_hashmap_priv_t **priv,
+					      tm_hashmap_stripe_t *stripe)
+{
+	if ((*priv)->attribute->option & TM_HASHMAP_OPTION_MULTI_THREAD) {
+		mtx_unlock(&stripe->lock);
+	}
+}
+
+static inline tm_hashmap_stripe_t *tm_hashmap_internal_stripe(
+					tm_hashmap_priv_t **priv,
+					uint64_t hash)
+{
+	return &(*priv)->stripe[hash >> (64 - TM_HASHMAP_STRIPE_SHIFT)];
+}
+
+static int tm_hashmap_internal_get_option(tm_hashmap_priv_t **priv,
+					  unsigned long *option)
+{
+	if (NULL == option) {
+		return -1;
+	}
+
+	*option = (*priv)->attribute->option;
+
+	return 0;
+}
+
+static int tm_hashmap_internal_set_option(tm_hashmap_priv_t **priv,
+					  unsigned long option)
+{
+	if (option >= TM_HASHMAP_OPTION_MAX) {
+		return -1;
+	}
+
+	(*priv)->attribute->option = option;
+
+	return 0;
+}
+
+static int tm_hashmap_internal_insert(tm_hashmap_priv_t **priv,
+				      unsigned long key, void *data)
+{
+	int ret = 0;
+	long index;
+	uint64_t hash = tm_hashmap_internal_hash(key);
+	tm_hashmap_stripe_t *stripe = tm_hashmap_internal_stripe(priv, hash);
+
+	tm_hashmap_internal_lock(priv, stripe);
+
+	index = tm_hashmap_internal_table_find(&stripe->table, key, hash);
+	if (index >= 0) {
+		/* Update */
+		stripe->table.entry[index].data = data;
+		goto out;
+	}
+
+	index = tm_hashmap_internal_table_find(&stripe->old, key, hash);
+	if (index >= 0) {
+		/* Not migrated yet, update in place */
+		stripe->old.entry[index].data = data;
+		goto out;
+	}
+
+	ret = tm_hashmap_internal_reserve(stripe);
+	if (0 != ret) {
+		goto out;
+	}
+
+	tm_hashmap_internal_table_insert(&stripe->table, key, data, hash);
+
+out:
+	tm_hashmap_internal_migrate(stripe, TM_HASHMAP_MIGRATE_GROUP);
+
+	tm_hashmap_internal_unlock(priv, stripe);
+
+	return ret;
+}
+
+static int tm_hashmap_internal_find(tm_hashmap_priv_t **priv,
+				    unsigned long key, void **data)
+{
+	int ret = 0;
+	long index;
+	uint64_t hash = tm_hashmap_internal_hash(key);
+	tm_hashmap_stripe_t *stripe = tm_hashmap_internal_stripe(priv, hash);
+	tm_hashmap_table_t *table = &stripe->table;
+
+	tm_hashmap_internal_lock(priv, stripe);
+
+	index = tm_hashmap_internal_table_find(table, key, hash);
+	if (index < 0) {
+		table = &stripe->old;
+		index = tm_hashmap_internal_table_find(table, key, hash);
+	}
+
+	if (index < 0) {
+		ret = -1;
+	} else if (NULL != data) {
+		*data = table->entry[index].data;
+	}
+
+	tm_hashmap_internal_unlock(priv, stripe);
+
+	return ret;
+}
+
+static int tm_hashmap_internal_erase(tm_hashmap_priv_t **priv,
+				     unsigned long key, void **data)
+{
+	int ret = 0;
+	long index;
+	uint64_t hash = tm_hashmap_internal_hash(key);
+	tm_hashmap_stripe_t *stripe = tm_hashmap_internal_stripe(priv, hash);
+	tm_hashmap_table_t *table = &stripe->table;
+
+	tm_hashmap_internal_lock(priv, stripe);
+
+	index = tm_hashmap_internal_table_find(table, key, hash);
+	if (index < 0) {
+		table = &stripe->old;
+		index = tm_hashmap_internal_table_find(table, key, hash);
+	}
+
+	if (index < 0) {
+		ret = -1;
+	} else {
+		if (NULL != data) {
+			*data = table->entry[index].data;
+		}
+		tm_hashmap_internal_table_erase(table, index);
+	}
+
+	tm_hashmap_internal_migrate(stripe, TM_HASHMAP_MIGRATE_GROUP);
+
+	tm_hashmap_internal_unlock(priv, stripe);
+
+	return ret;
+}
+
+static int tm_hashmap_internal_get_size(tm_hashmap_priv_t **priv,
+					unsigned long *size)
+{
+	unsigned i;
+	tm_hashmap_stripe_t *stripe;
+
+	if (NULL == size) {
+		return -1;
+	}
+
+	*size = 0;
+
+	for (i = 0; i < TM_HASHMAP_STRIPE_NUMBER; i++) {
+		stripe = &(*priv)->stripe[i];
+
+		tm_hashmap_internal_lock(priv, stripe);
+		*size += stripe->table.size + stripe->old.size;
+		tm_hashmap_internal_unlock(priv, stripe);
+	}
+
+	return 0;
+}
+
+static int tm_hashmap_internal_destroy(tm_hashmap_priv_t **priv)
+{
+	unsigned i;
+	tm_hashmap_stripe_t *stripe;
+
+	for (i = 0; i < TM_HASHMAP_STRIPE_NUMBER; i++) {
+		stripe = &(*priv)->stripe[i];
+
+		if (0 != stripe->old.capacity) {
+			tm_hashmap_internal_table_destroy(&stripe->old);
+		}
+		tm_hashmap_internal_table_destroy(&stripe->table);
+
+		mtx_destroy(&stripe->lock);
+	}
+
+	free((*priv)->stripe);
+	free((*priv)->attribute);
+	free(*priv);
+
+	(*priv) = NULL;
+
+	return 0;
+}
+
+static int tm_hashmap_internal_init(tm_hashmap_priv_t **priv,
+				    unsigned long option)
+{
+	unsigned i;
+	tm_hashmap_stripe_t *stripe;
+
+	if (option >= TM_HASHMAP_OPTION_MAX) {
+		return -1;
+	}
+
+	(*priv) = (tm_hashmap_priv_t*)malloc(sizeof(tm_hashmap_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->attribute =
+		(tm_hashmap_attribute_t*)malloc(sizeof(tm_hashmap_attribute_t));
+	if (NULL == (*priv)->attribute) {
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->attribute->option = option;
+
+	(*priv)->stripe = (tm_hashmap_stripe_t*)aligned_alloc(
+				_Alignof(tm_hashmap_stripe_t),
+				sizeof(tm_hashmap_stripe_t) *
+				TM_HASHMAP_STRIPE_NUMBER);
+	if (NULL == (*priv)->stripe) {
+		free((*priv)->attribute);
+		free(*priv);
+		return -1;
+	}
+
+	for (i = 0; i < TM_HASHMAP_STRIPE_NUMBER; i++) {
+		stripe = &(*priv)->stripe[i];
+
+		if (0 != tm_hashmap_internal_table_init(&stripe->table,
+						TM_HASHMAP_GROUP_WIDTH)) {
+			break;
+		}
+
+		memset(&stripe->old, 0, sizeof(stripe->old));
+		stripe->migrate = 0;
+
+		mtx_init(&stripe->lock, mtx_plain);
+	}
+
+	if (i != TM_HASHMAP_STRIPE_NUMBER) {
+		while (i-- > 0) {
+			tm_hashmap_internal_table_destroy(
+					&(*priv)->stripe[i].table);
+			mtx_destroy(&(*priv)->stripe[i].lock);
+		}
+		free((*priv)->stripe);
+		free((*priv)->attribute);
+		free(*priv);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int tm_hashmap_get_option(tm_hashmap_t *map, unsigned long *option)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_get_option((tm_hashmap_priv_t**)&map->priv,
+					      option);
+}
+
+int tm_hashmap_set_option(tm_hashmap_t *map, unsigned long option)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_set_option((tm_hashmap_priv_t**)&map->priv,
+					      option);
+}
+
+int tm_hashmap_init(tm_hashmap_t *map, unsigned long option)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	map->priv = NULL;
+
+	return tm_hashmap_internal_init((tm_hashmap_priv_t**)&map->priv,
+					option);
+}
+
+int tm_hashmap_destroy(tm_hashmap_t *map)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_destroy((tm_hashmap_priv_t**)&map->priv);
+}
+
+int tm_hashmap_insert(tm_hashmap_t *map, unsigned long key, void *data)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_insert((tm_hashmap_priv_t**)&map->priv,
+					  key, data);
+}
+
+int tm_hashmap_find(tm_hashmap_t *map, unsigned long key, void **data)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_find((tm_hashmap_priv_t**)&map->priv,
+					key, data);
+}
+
+int tm_hashmap_erase(tm_hashmap_t *map, unsigned long key, void **data)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_erase((tm_hashmap_priv_t**)&map->priv,
+					 key, data);
+}
+
+int tm_hashmap_get_size(tm_hashmap_t *map, unsigned long *size)
+{
+	if (NULL == map) {
+		return -1;
+	}
+
+	if (NULL == map->priv) {
+		return -1;
+	}
+
+	return tm_hashmap_internal_get_size((tm_hashmap_priv_t**)&map->priv,
+					    size);
+}
+
@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <threads.h>
+
+#include "tm_thread_pool.h"
+#include "tm_parallel.h"
+
+/* Chunks per participant when grain is chosen by us */
+#define TM_PARALLEL_CHUNK_FACTOR	32ul
+
+/**
+ * struct tm_parallel_slot_s - Range owned by one participant
+ *
+ * @lock: Protect @begin and @end, thieves take the back half
+ *
+ * @begin: First index not taken yet
+ *
+ * @end: One past the last index
+ *
+ * @partial: Partial result of chunks done by owner
+ *
+ * @has_partial: @partial is valid
+ * */
+typedef struct tm_parallel_slot_s {
+	_Alignas(64) mtx_t lock;
+	unsigned long begin;
+	unsigned long end;
+	void *partial;
+	bool has_partial;
+} tm_parallel_slot_t;
+
+/**
+ * struct tm_parallel_job_s - One call of tm_parallel_for or reduce
+ *
+ * Helpers are committed as tasks and may start after the caller is done,
+ * so job is freed by whoever drop the last reference.
+ *
+ * @for_entry: Loop body, NULL for reduce
+ *
+ * @reduce_entry: Reduce body, NULL for for
+ *
+ * @combine: Combine function of reduce
+ *
+ * @ctx: User argument
+ *
+ * @grain: Max indexes per chunk
+ *
+ * @lock: Protect @closed, @active and @joined
+ *
+ * @cond: Signaled when @active drop to 0
+ *
+ * @closed: Caller is done, late helpers just leave
+ *
+ * @active: Number of helpers working
+ *
+ * @joined: Number of slots handed out, slot 0 is the caller
+ *
+ * @ref: Reference count, caller and each committed helper
+ *
+ * @slot_number: Number of slots
+ *
+ * @slot: Ranges
+ *
+ * @task: Helper tasks, @slot_number - 1 of them
+ * */
+typedef struct tm_parallel_job_s {
+	tm_parallel_for_entry_t for_entry;
+	tm_parallel_reduce_entry_t reduce_entry;
+	tm_parallel_combine_t combine;
+	void *ctx;
+	unsigned long grain;
+
+	mtx_t lock;
+	cnd_t cond;
+	bool closed;
+	unsigned long active;
+	unsigned long joined;
+	atomic_ulong ref;
+
+	unsigned long slot_number;
+	tm_parallel_slot_t *slot;
+	tm_thread_pool_task_t *task;
+} tm_parallel_job_t;
+
+
+static void tm_parallel_internal_job_free(tm_parallel_job_t *job)
+{
+	unsigned long i;
+
+	for (i = 0; i + 1 < job->slot_number; i++) {
+		if (NULL != job->task[i].priv) {
+			tm_thread_pool_task_destroy(&job->task[i]);
+		}
+	}
+
+	for (i = 0; i < job->slot_number; i++) {
+		mtx_destroy(&job->slot[i].lock);
+	}
+
+	cnd_destroy(&job->cond);
+	mtx_destroy(&job->lock);
+
+	free(job->task);
+	free(job->slot);
+	free(job);
+}
+
+static void tm_parallel_internal_job_put(tm_parallel_job_t *job)
+{
+	if (1 == atomic_fetch_sub(&job->ref, 1)) {
+		tm_parallel_internal_job_free(job);
+	}
+}
+
+/* Take back half of the largest range left, false if none worth it */
+static bool tm_parallel_internal_steal(tm_parallel_job_t *job,
+				       tm_parallel_slot_t *own)
+{
+	unsigned long i;
+	unsigned long size;
+	unsigned long best_size;
+	unsigned long middle;
+	tm_parallel_slot_t *slot;
+	tm_parallel_slot_t *best;
+
+	while (true) {
+		best = NULL;
+		best_size = job->grain;
+
+		for (i = 0; i < job->slot_number; i++) {
+			slot = &job->slot[i];
+			if (slot == own) {
+				continue;
+			}
+
+			mtx_lock(&slot->lock);
+			size = slot->end - slot->begin;
+			mtx_unlock(&slot->lock);
+
+			if (size > best_size) {
+				best = slot;
+				best_size = size;
+			}
+		}
+
+		/* Everything left is a chunk being worked on */
+		if (NULL == best) {
+			return false;
+		}
+
+		mtx_lock(&best->lock);
+		size = best->end - best->begin;
+		if (size > job->grain) {
+			middle = best->begin + size / 2;
+
+			mtx_lock(&own->lock);
+			own->begin = middle;
+			own->end = best->end;
+			mtx_unlock(&own->lock);
+
+			best->end = middle;
+			mtx_unlock(&best->lock);
+
+			return true;
+		}
+		mtx_unlock(&best->lock);
+	}
+}
+
+/* Work on own range, then on stolen ones until nothing is left */
+static void tm_parallel_internal_run(tm_parallel_job_t *job,
+				     tm_parallel_slot_t *own)
+{
+	unsigned long begin;
+	unsigned long end;
+	void *partial;
+
+	do {
+		while (true) {
+			mtx_lock(&own->lock);
+			begin = own->begin;
+			end = own->end;
+			if (end - begin > job->grain) {
+				end = begin + job->grain;
+			}
+			own->begin = end;
+			mtx_unlock(&own->lock);
+
+			if (begin == end) {
+				break;
+			}
+
+			if (NULL != job->for_entry) {
+				job->for_entry(begin, end, job->ctx);
+				continue;
+			}
+
+			partial = job->reduce_entry(begin, end, job->ctx);
+			if (own->has_partial) {
+				partial = job->combine(own->partial, partial,
+						       job->ctx);
+			}
+			own->partial = partial;
+			own->has_partial = true;
+		}
+	} while (tm_parallel_internal_steal(job, own));
+}
+
+static void *tm_parallel_internal_helper_entry(void *arg)
+{
+	tm_parallel_slot_t *own;
+	tm_parallel_job_t *job = arg;
+
+	mtx_lock(&job->lock);
+	if (job->closed) {
+		mtx_unlock(&job->lock);
+		return job;
+	}
+	own = &job->slot[job->joined++];
+	job->active++;
+	mtx_unlock(&job->lock);
+
+	tm_parallel_internal_run(job, own);
+
+	mtx_lock(&job->lock);
+	if (0 == --job->active) {
+		cnd_signal(&job->cond);
+	}
+	mtx_unlock(&job->lock);
+
+	return job;
+}
+
+/* Worker do not touch the task after this, safe to free the job */
+static void tm_parallel_internal_helper_event(unsigned long event,
+					      void *task_status)
+{
+	if (TM_THREAD_POOL_EVENT_END == event) {
+		tm_parallel_internal_job_put(task_status);
+	}
+}
+
+static int tm_parallel_internal_job_init(tm_parallel_job_t **job,
+					 tm_thread_pool_t *thread_pool,
+					 unsigned long begin,
+					 unsigned long end,
+					 unsigned long grain)
+{
+	int size;
+	unsigned long i;
+	unsigned long chunks;
+	unsigned long helpers;
+
+	if (0 != tm_thread_pool_get_size(thread_pool, &size)) {
+		return -1;
+	}
+
+	if (0 == grain) {
+		grain = (end - begin) / ((size + 1) * TM_PARALLEL_CHUNK_FACTOR);
+		if (0 == grain) {
+			grain = 1;
+		}
+	}
+
+	/* No more helpers than chunks to give them */
+	chunks = (end - begin) / grain + (0 != (end - begin) % grain);
+	helpers = chunks > (unsigned long)size ? (unsigned long)size : chunks - 1;
+
+	(*job) = (tm_parallel_job_t*)calloc(1, sizeof(tm_parallel_job_t));
+	if (NULL == (*job)) {
+		return -1;
+	}
+
+	(*job)->slot_number = helpers + 1;
+	(*job)->slot = (tm_parallel_slot_t*)aligned_alloc(
+				_Alignof(tm_parallel_slot_t),
+				sizeof(tm_parallel_slot_t) * (helpers + 1));
+	(*job)->task = (tm_thread_pool_task_t*)calloc(helpers + 1,
+						sizeof(tm_thread_pool_task_t));
+	if (NULL == (*job)->slot || NULL == (*job)->task) {
+		free((*job)->slot);
+		free((*job)->task);
+		free(*job);
+		return -1;
+	}
+
+	for (i = 0; i < (*job)->slot_number; i++) {
+		mtx_init(&(*job)->slot[i].lock, mtx_plain);
+		(*job)->slot[i].begin = end;
+		(*job)->slot[i].end = end;
+		(*job)->slot[i].partial = NULL;
+		(*job)->slot[i].has_partial = false;
+	}
+
+	/* Caller start with everything, helpers steal from it */
+	(*job)->slot[0].begin = begin;
+
+	(*job)->grain = grain;
+	(*job)->closed = false;
+	(*job)->active = 0;
+	(*job)->joined = 1;
+	atomic_init(&(*job)->ref, 1);
+
+	mtx_init(&(*job)->lock, mtx_plain);
+	cnd_init(&(*job)->cond);
+
+	for (i = 0; i < helpers; i++) {
+		if (0 != tm_thread_pool_task_init(&(*job)->task[i],
+					tm_parallel_internal_helper_entry,
+					*job,
+					tm_parallel_internal_helper_event, 0)) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void tm_parallel_internal_job_do(tm_parallel_job_t *job,
+					tm_thread_pool_t *thread_pool)
+{
+	unsigned long i;
+
+	for (i = 0; i + 1 < job->slot_number; i++) {
+		if (NULL == job->task[i].priv) {
+			break;
+		}
+
+		atomic_fetch_add(&job->ref, 1);
+		if (0 != tm_thread_pool_task_commit(thread_pool,
+						    &job->task[i])) {
+			atomic_fetch_sub(&job->ref, 1);
+			break;
+		}
+	}
+
+	tm_parallel_internal_run(job, &job->slot[0]);
+
+	/* Wait for chunks still being worked on */
+	mtx_lock(&job->lock);
+	job->closed = true;
+	while (0 != job->active) {
+		cnd_wait(&job->cond, &job->lock);
+	}
+	mtx_unlock(&job->lock);
+}
+
+
+int tm_parallel_for(tm_thread_pool_t *thread_pool, unsigned long begin,
+		    unsigned long end, unsigned long grain,
+		    tm_parallel_for_entry_t entry, void *ctx)
+{
+	tm_parallel_job_t *job;
+
+	if (NULL == thread_pool || NULL == entry || begin > end) {
+		return -1;
+	}
+
+	if (begin == end) {
+		return 0;
+	}
+
+	if (0 != tm_parallel_internal_job_init(&job, thread_pool, begin, end,
+					       grain)) {
+		return -1;
+	}
+
+	job->for_entry = entry;
+	job->ctx = ctx;
+
+	tm_parallel_internal_job_do(job, thread_pool);
+	tm_parallel_internal_job_put(job);
+
+	return 0;
+}
+
+int tm_parallel_reduce(tm_thread_pool_t *thread_pool, unsigned long begin,
+		       unsigned long end, unsigned long grain,
+		       tm_parallel_reduce_entry_t entry,
+		       tm_parallel_combine_t combine, void *ctx, void **result)
+{
+	unsigned long i;
+	bool has_result = false;
+	tm_parallel_job_t *job;
+
+	if (NULL == thread_pool || NULL == entry || NULL == combine ||
+	    NULL == result || begin > end) {
+		return -1;
+	}
+
+	*result = NULL;
+
+	if (begin == end) {
+		return 0;
+	}
+
+	if (0 != tm_parallel_internal_job_init(&job, thread_pool, begin, end,
+					       grain)) {
+		return -1;
+	}
+
+	job->reduce_entry = entry;
+	job->combine = combine;
+	job->ctx = ctx;
+
+	tm_parallel_internal_job_do(job, thread_pool);
+
+	for (i = 0; i < job->slot_number; i++) {
+		if (!job->slot[i].has_partial) {
+			continue;
+		}
+
+		if (has_result) {
+			*result = combine(*result, job->slot[i].partial, ctx);
+		} else {
+			*result = job->slot[i].partial;
+			has_result = true;
+		}
+	}
+
+	tm_parallel_internal_job_put(job);
+
+	return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <threads.h>
+
+#include "tm_queue.h"
+#include "tm_thread_pool.h"
+#include "tm_partition_queue.h"
+
+/**
+ * struct tm_partition_queue_item_s - Item structure to save elements
+ *
+ * @item: Item address
+ *
+ * @next: Link to next item structure
+ * */
+typedef struct tm_partition_queue_item_s {
+	void *item;
+	struct tm_partition_queue_item_s *next;
+} tm_partition_queue_item_t;
+
+/**
+ * struct tm_partition_queue_partition_s - One FIFO partition
+ *
+ * Each partition sit in its own cache line, producers of different keys do
+ * not bounce each other.
+ *
+ * @lock: Protect all fields below
+ *
+ * @head: First element
+ *
+ * @tail: Last element
+ *
+ * @count: Number of elements
+ *
+ * @leased: Some consumer hold this partition
+ *
+ * @ready: Partition is in priv->ready
+ *
+ * @scheduled: Drain task is committed or running
+ *
+ * @queue: Queue this partition belong to
+ *
+ * @task: Drain task of this partition
+ * */
+typedef struct tm_partition_queue_partition_s {
+	_Alignas(64) mtx_t lock;
+	tm_partition_queue_item_t *head;
+	tm_partition_queue_item_t *tail;
+	unsigned long count;
+	bool leased;
+	bool ready;
+	bool scheduled;
+	struct tm_partition_queue_priv_s *queue;
+	tm_thread_pool_task_t task;
+} tm_partition_queue_partition_t;
+
+/**
+ * struct tm_partition_queue_priv_s - Private structure of partitioned queue
+ *
+ * Lock order is partition->lock, then lock of @ready.
+ *
+ * @number: Number of partitions
+ *
+ * @partition: Partitions
+ *
+ * @ready: Index of partitions which are not empty and not leased, a
+ *	   partition is in it at most once
+ *
+ * @thread_pool: Where to commit drain task, NULL if not set
+ *
+ * @handler: Element handler of drain task
+ *
+ * @arg: Argument of @handler
+ *
+ * @batch: Max number of elements per run of drain task
+ * */
+typedef struct tm_partition_queue_priv_s {
+	unsigned long number;
+	tm_partition_queue_partition_t *partition;
+	tm_queue_t ready;
+	tm_thread_pool_t *thread_pool;
+	tm_partition_queue_handler_t handler;
+	void *arg;
+	unsigned long batch;
+} tm_partition_queue_priv_t;
+
+
+/* Finalizer of MurmurHash3, keys are often sequential ids */
+static inline uint64_t tm_partition_queue_internal_hash(unsigned long key)
+{
+	uint64_t h = key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* Caller should hold partition->lock */
+static void *tm_partition_queue_internal_take(
+				tm_partition_queue_partition_t *partition)
+{
+	void *data;
+	tm_partition_queue_item_t *item;
+
+	item = partition->head;
+
+	partition->head = item->next;
+	if (NULL == partition->head) {
+		partition->tail = NULL;
+	}
+	partition->count--;
+
+	data = item->item;
+	free(item);
+
+	return data;
+}
+
+/*
+ * Drain task entry, return the partition itself when elements are left so
+ * END event commit it again at the tail of pool.
+ * */
+static void *tm_partition_queue_internal_drain(void *arg)
+{
+	void *data;
+	bool again;
+	unsigned long i;
+	tm_partition_queue_partition_t *partition = arg;
+	tm_partition_queue_priv_t *priv = partition->queue;
+
+	mtx_lock(&partition->lock);
+	partition->leased = true;
+
+	for (i = 0; i < priv->batch && 0 != partition->count; i++) {
+		data = tm_partition_queue_internal_take(partition);
+
+		mtx_unlock(&partition->lock);
+		priv->handler(data, priv->arg);
+		mtx_lock(&partition->lock);
+	}
+
+	partition->leased = false;
+
+	again = 0 != partition->count;
+	if (!again) {
+		partition->scheduled = false;
+	}
+
+	mtx_unlock(&partition->lock);
+
+	return again ? partition : NULL;
+}
+
+static void tm_partition_queue_internal_drain_event(unsigned long event,
+						    void *task_status)
+{
+	tm_partition_queue_partition_t *partition = task_status;
+
+	if (TM_THREAD_POOL_EVENT_END != event || NULL == partition) {
+		return;
+	}
+
+	/* Worker do not touch the task after this, commit it again is fine */
+	if (0 != tm_thread_pool_task_commit(partition->queue->thread_pool,
+					    &partition->task)) {
+		/* Next push schedule it again */
+		mtx_lock(&partition->lock);
+		partition->scheduled = false;
+		mtx_unlock(&partition->lock);
+	}
+}
+
+static int tm_partition_queue_internal_init(tm_partition_queue_priv_t **priv,
+					    unsigned long number)
+{
+	unsigned long i;
+	tm_partition_queue_partition_t *partition;
+
+	if (0 == number) {
+		return -1;
+	}
+
+	(*priv) = (tm_partition_queue_priv_t*)malloc(
+					sizeof(tm_partition_queue_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->partition = (tm_partition_queue_partition_t*)aligned_alloc(
+				_Alignof(tm_partition_queue_partition_t),
+				sizeof(tm_partition_queue_partition_t) * number);
+	if (NULL == (*priv)->partition) {
+		free(*priv);
+		return -1;
+	}
+
+	if (0 != tm_queue_init(&(*priv)->ready, TM_QUEUE_OPTION_MULTI_THREAD)) {
+		free((*priv)->partition);
+		free(*priv);
+		return -1;
+	}
+
+	for (i = 0; i < number; i++) {
+		partition = &(*priv)->partition[i];
+
+		mtx_init(&partition->lock, mtx_plain);
+		partition->head = NULL;
+		partition->tail = NULL;
+		partition->count = 0;
+		partition->leased = false;
+		partition->ready = false;
+		partition->scheduled = false;
+		partition->queue = *priv;
+		partition->task.priv = NULL;
+	}
+
+	(*priv)->number = number;
+	(*priv)->thread_pool = NULL;
+	(*priv)->handler = NULL;
+	(*priv)->arg = NULL;
+	(*priv)->batch = 0;
+
+	return 0;
+}
+
+static int tm_partition_queue_internal_set_thread_pool(
+				tm_partition_queue_priv_t **priv,
+				tm_thread_pool_t *thread_pool,
+				tm_partition_queue_handler_t handler,
+				void *arg, unsigned long batch)
+{
+	unsigned long i;
+	tm_partition_queue_partition_t *partition;
+
+	if (NULL != (*priv)->thread_pool || NULL == handler || 0 == batch) {
+		return -1;
+	}
+
+	for (i = 0; i < (*priv)->number; i++) {
+		if (0 != (*priv)->partition[i].count) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < (*priv)->number; i++) {
+		partition = &(*priv)->partition[i];
+
+		if (0 != tm_thread_pool_task_init(&partition->task,
+				tm_partition_queue_internal_drain, partition,
+				tm_partition_queue_internal_drain_event, 0)) {
+			while (i-- > 0) {
+				tm_thread_pool_task_destroy(
+						&(*priv)->partition[i].task);
+			}
+			return -1;
+		}
+	}
+
+	(*priv)->handler = handler;
+	(*priv)->arg = arg;
+	(*priv)->batch = batch;
+	(*priv)->thread_pool = thread_pool;
+
+	return 0;
+}
+
+static int tm_partition_queue_internal_destroy(
+				tm_partition_queue_priv_t **priv)
+{
+	unsigned long i;
+	tm_partition_queue_partition_t *partition;
+
+	for (i = 0; i < (*priv)->number; i++) {
+		partition = &(*priv)->partition[i];
+
+		while (0 != partition->count) {
+			tm_partition_queue_internal_take(partition);
+		}
+
+		if (NULL != partition->task.priv) {
+			tm_thread_pool_task_destroy(&partition->task);
+		}
+
+		mtx_destroy(&partition->lock);
+	}
+
+	tm_queue_destroy(&(*priv)->ready);
+
+	free((*priv)->partition);
+	free(*priv);
+	*priv = NULL;
+
+	return 0;
+}
+
+static int tm_partition_queue_internal_push(tm_partition_queue_priv_t **priv,
+					    unsigned long key, void *data)
+{
+	int ret = 0;
+	tm_partition_queue_item_t *item;
+	tm_partition_queue_partition_t *partition;
+
+	partition = &(*priv)->partition[
+		tm_partition_queue_internal_hash(key) % (*priv)->number];
+
+	item = (tm_partition_queue_item_t*)malloc(
+					sizeof(tm_partition_queue_item_t));
+	if (NULL == item) {
+		return -1;
+	}
+
+	item->item = data;
+	item->next = NULL;
+
+	mtx_lock(&partition->lock);
+
+	/*
+	 * Nobody is taking care of this partition yet. Schedule it before the
+	 * element is linked, drain task or consumer wait for the lock, so a
+	 * failure leave nothing behind.
+	 * */
+	if (!partition->leased && !partition->ready && !partition->scheduled) {
+		if (NULL != (*priv)->thread_pool) {
+			ret = tm_thread_pool_task_commit((*priv)->thread_pool,
+							 &partition->task);
+			partition->scheduled = 0 == ret;
+		} else {
+			ret = tm_queue_push(&(*priv)->ready,
+				(void*)(unsigned long)(partition -
+						       (*priv)->partition));
+			partition->ready = 0 == ret;
+		}
+	}
+
+	if (0 != ret) {
+		mtx_unlock(&partition->lock);
+		free(item);
+		return -1;
+	}
+
+	if (NULL == partition->tail) {
+		partition->head = item;
+	} else {
+		partition->tail->next = item;
+	}
+	partition->tail = item;
+	partition->count++;
+
+	mtx_unlock(&partition->lock);
+
+	return 0;
+}
+
+static int tm_partition_queue_internal_acquire(
+				tm_partition_queue_priv_t **priv,
+				unsigned long *partition)
+{
+	void *index;
+	tm_partition_queue_partition_t *p;
+
+	if (NULL == partition) {
+		return -1;
+	}
+
+	while (0 == tm_queue_pop(&(*priv)->ready, &index)) {
+		p = &(*priv)->partition[(unsigned long)index];
+
+		mtx_lock(&p->lock);
+
+		p->ready = false;
+
+		if (!p->leased && 0 != p->count) {
+			p->leased = true;
+			mtx_unlock(&p->lock);
+
+			*partition = (unsigned long)index;
+
+			return 0;
+		}
+
+		mtx_unlock(&p->lock);
+	}
+
+	return -1;
+}
+
+static int tm_partition_queue_internal_pop(tm_partition_queue_priv_t **priv,
+					   unsigned long partition,
+					   void **data)
+{
+	void *element;
+	tm_partition_queue_partition_t *p;
+
+	if (partition >= (*priv)->number) {
+		return -1;
+	}
+
+	p = &(*priv)->partition[partition];
+
+	mtx_lock(&p->lock);
+
+	if (!p->leased || 0 == p->count) {
+		mtx_unlock(&p->lock);
+		return -1;
+	}
+
+	element = tm_partition_queue_internal_take(p);
+
+	mtx_unlock(&p->lock);
+
+	if (NULL != data) {
+		*data = element;
+	}
+
+	return 0;
+}
+
+static int tm_partition_queue_internal_release(
+				tm_partition_queue_priv_t **priv,
+				unsigned long partition)
+{
+	int ret = 0;
+	tm_partition_queue_partition_t *p;
+
+	if (partition >= (*priv)->number) {
+		return -1;
+	}
+
+	p = &(*priv)->partition[partition];
+
+	mtx_lock(&p->lock);
+
+	if (!p->leased) {
+		mtx_unlock(&p->lock);
+		return -1;
+	}
+
+	/* Pushed while leased, give it to the next consumer */
+	if (0 != p->count && !p->ready) {
+		ret = tm_queue_push(&(*priv)->ready, (void*)partition);
+		p->ready = 0 == ret;
+	}
+
+	/* Keep lease on failure, caller may release it again */
+	if (0 == ret) {
+		p->leased = false;
+	}
+
+	mtx_unlock(&p->lock);
+
+	return ret;
+}
+
+
+int tm_partition_queue_init(tm_partition_queue_t *queue,
+			    unsigned long partition_number)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	queue->priv = NULL;
+
+	return tm_partition_queue_internal_init(
+			(tm_partition_queue_priv_t**)&queue->priv,
+			partition_number);
+}
+
+int tm_partition_queue_set_thread_pool(tm_partition_queue_t *queue,
+				       tm_thread_pool_t *thread_pool,
+				       tm_partition_queue_handler_t handler,
+				       void *arg, unsigned long batch)
+{
+	if (NULL == queue || NULL == thread_pool) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_partition_queue_internal_set_thread_pool(
+			(tm_partition_queue_priv_t**)&queue->priv,
+			thread_pool, handler, arg, batch);
+}
+
+int tm_partition_queue_destroy(tm_partition_queue_t *queue)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_partition_queue_internal_destroy(
+			(tm_partition_queue_priv_t**)&queue->priv);
+}
+
+int tm_partition_queue_push(tm_partition_queue_t *queue, unsigned long key,
+			    void *data)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_partition_queue_internal_push(
+			(tm_partition_queue_priv_t**)&queue->priv, key, data);
+}
+
+int tm_partition_queue_acquire(tm_partition_queue_t *queue,
+			       unsigned long *partition)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_partition_queue_internal_acquire(
+			(tm_partition_queue_priv_t**)&queue->priv, partition);
+}
+
+int tm_partition_queue_pop(tm_partition_queue_t *queue,
+			   unsigned long partition, void **data)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_partition_queue_internal_pop(
+			(tm_partition_queue_priv_t**)&queue->priv,
+			partition, data);
+}
+
+int tm_partition_queue_release(tm_partition_queue_t *queue,
+			       unsigned long partition)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_partition_queue_internal_release(
+			(tm_partition_queue_priv_t**)&queue->priv, partition);
+}
@@ -0,0 +1,924 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <threads.h>
+
+#include "tm_pool.h"
+#include "tm_thread_pool.h"
+#include "tm_pipeline.h"
+
+/* Max number of stages of one pipeline */
+#define TM_PIPELINE_STAGE_MAX		16ul
+
+/* Max number of items moved to next stage at once */
+#define TM_PIPELINE_BATCH		32ul
+
+/* Batches done by one task run before it give the worker back */
+#define TM_PIPELINE_ROUND		16ul
+
+/* Stats window is closed and workers are rebalanced every this many batches */
+#define TM_PIPELINE_ADAPT_PERIOD	64ul
+
+/* Nodes per slab of node pool */
+#define TM_PIPELINE_NODE_NUMBER		1024ul
+
+/**
+ * struct tm_pipeline_node_s - Item on its way through stages
+ *
+ * @data: Item
+ *
+ * @time: When it entered queue of current stage, nanoseconds
+ *
+ * @next: Next node in queue or batch
+ * */
+typedef struct tm_pipeline_node_s {
+	void *data;
+	uint64_t time;
+	struct tm_pipeline_node_s *next;
+} tm_pipeline_node_t;
+
+/**
+ * struct tm_pipeline_slot_s - One worker slot of a stage
+ *
+ * @stage: Stage this slot belong to
+ *
+ * @task: Task run on thread pool, committed only when slot is free
+ * */
+typedef struct tm_pipeline_slot_s {
+	struct tm_pipeline_stage_s *stage;
+	tm_thread_pool_task_t task;
+} tm_pipeline_slot_t;
+
+/**
+ * struct tm_pipeline_stage_s - Stage of pipeline
+ *
+ * Room of queue is reserved by previous stage before it take a batch, so
+ * @count plus @reserved never exceed @capacity. Lock order is lock of a
+ * stage, then lock of its next stage.
+ *
+ * @pipeline: Pipeline this stage belong to
+ *
+ * @index: Stage number
+ *
+ * @entry: Stage function
+ *
+ * @arg: Argument of @entry
+ *
+ * @concurrency: Max number of workers
+ *
+ * @capacity: Max number of items in queue
+ *
+ * @lock: Protect fields below until @free_number
+ *
+ * @not_full: tm_pipeline_push wait here when the first stage is full
+ *
+ * @head: First node of queue
+ *
+ * @tail: Last node of queue
+ *
+ * @count: Number of nodes in queue
+ *
+ * @reserved: Room reserved by previous stage
+ *
+ * @waiters: Number of tm_pipeline_push waiting on @not_full
+ *
+ * @limit: Current max number of workers
+ *
+ * @active: Number of committed or running tasks
+ *
+ * @slot: Worker slots, @concurrency of them
+ *
+ * @free_slot: Index of free slots
+ *
+ * @free_number: Number of free slots
+ *
+ * @processed: Number of items done
+ *
+ * @service: Total nanoseconds in @entry
+ *
+ * @latency: Total nanoseconds from entering queue to done
+ *
+ * @window_processed: @processed since last rebalance
+ *
+ * @window_service: @service since last rebalance
+ *
+ * @window_start: When current window started, nanoseconds
+ *
+ * @throughput: Items per second of last closed window
+ * */
+typedef struct tm_pipeline_stage_s {
+	struct tm_pipeline_priv_s *pipeline;
+	unsigned long index;
+	tm_pipeline_stage_entry_t entry;
+	void *arg;
+	unsigned long concurrency;
+	unsigned long capacity;
+
+	_Alignas(64) mtx_t lock;
+	cnd_t not_full;
+	tm_pipeline_node_t *head;
+	tm_pipeline_node_t *tail;
+	unsigned long count;
+	unsigned long reserved;
+	unsigned long waiters;
+	unsigned long limit;
+	unsigned long active;
+	tm_pipeline_slot_t *slot;
+	unsigned long *free_slot;
+	unsigned long free_number;
+
+	_Alignas(64) atomic_ulong processed;
+	atomic_ullong service;
+	atomic_ullong latency;
+	atomic_ulong window_processed;
+	atomic_ullong window_service;
+	atomic_ullong window_start;
+	atomic_ulong throughput;
+} tm_pipeline_stage_t;
+
+/**
+ * struct tm_pipeline_priv_s - Private structure of pipeline
+ *
+ * @thread_pool: Where stages run
+ *
+ * @option: Option of this pipeline
+ *
+ * @budget: Max number of workers of all stages, size of @thread_pool
+ *
+ * @node_pool: Nodes of items
+ *
+ * @stage: Stages
+ *
+ * @number: Number of stages
+ *
+ * @started: Something is pushed, no more stage can be added
+ *
+ * @start: When pipeline is created, nanoseconds
+ *
+ * @lock: Protect @running, serialize rebalance
+ *
+ * @idle: Signaled when nothing is in flight and no task is running
+ *
+ * @running: Number of committed or running tasks of all stages
+ *
+ * @inflight: Number of items in pipeline
+ *
+ * @batches: Number of batches done, drive rebalance
+ * */
+typedef struct tm_pipeline_priv_s {
+	tm_thread_pool_t *thread_pool;
+	unsigned long option;
+	unsigned long budget;
+	tm_pool_t node_pool;
+	tm_pipeline_stage_t *stage[TM_PIPELINE_STAGE_MAX];
+	unsigned long number;
+	atomic_bool started;
+	uint64_t start;
+	mtx_t lock;
+	cnd_t idle;
+	unsigned long running;
+	atomic_ulong inflight;
+	atomic_ulong batches;
+} tm_pipeline_priv_t;
+
+
+static inline uint64_t tm_pipeline_internal_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void tm_pipeline_internal_schedule(tm_pipeline_stage_t *stage);
+
+/* Number of items next stage can take now, caller hold no lock */
+static unsigned long tm_pipeline_internal_room(tm_pipeline_stage_t *stage)
+{
+	unsigned long room;
+
+	mtx_lock(&stage->lock);
+	room = stage->capacity - stage->count - stage->reserved;
+	mtx_unlock(&stage->lock);
+
+	return room;
+}
+
+/*
+ * Commit one more task of @stage if it have work, a free worker and room
+ * in next stage. Called whenever one of these may become true.
+ * */
+static void tm_pipeline_internal_schedule(tm_pipeline_stage_t *stage)
+{
+	tm_pipeline_slot_t *slot;
+	tm_pipeline_priv_t *priv = stage->pipeline;
+
+	mtx_lock(&stage->lock);
+
+	if (0 == stage->count || stage->active >= stage->limit ||
+	    0 == stage->free_number) {
+		mtx_unlock(&stage->lock);
+		return;
+	}
+
+	/* Woken again by next stage once it have room */
+	if (stage->index + 1 < priv->number &&
+	    0 == tm_pipeline_internal_room(priv->stage[stage->index + 1])) {
+		mtx_unlock(&stage->lock);
+		return;
+	}
+
+	stage->active++;
+	slot = &stage->slot[stage->free_slot[--stage->free_number]];
+
+	mtx_unlock(&stage->lock);
+
+	mtx_lock(&priv->lock);
+	priv->running++;
+	mtx_unlock(&priv->lock);
+
+	if (0 != tm_thread_pool_task_commit(priv->thread_pool, &slot->task)) {
+		mtx_lock(&stage->lock);
+		stage->active--;
+		stage->free_slot[stage->free_number++] = slot - stage->slot;
+		mtx_unlock(&stage->lock);
+
+		mtx_lock(&priv->lock);
+		priv->running--;
+		mtx_unlock(&priv->lock);
+	}
+}
+
+/* Caller should hold stage->lock */
+static void tm_pipeline_internal_append(tm_pipeline_stage_t *stage,
+					tm_pipeline_node_t *head,
+					tm_pipeline_node_t *tail,
+					unsigned long number)
+{
+	if (NULL == stage->tail) {
+		stage->head = head;
+	} else {
+		stage->tail->next = head;
+	}
+	stage->tail = tail;
+	stage->count += number;
+}
+
+/*
+ * Close stats window of all stages. For adaptive pipeline also give one
+ * worker to the stage with most pending work, take it from the stage with
+ * least if all workers of pool are used.
+ * */
+static void tm_pipeline_internal_adapt(tm_pipeline_priv_t *priv)
+{
+	uint64_t now;
+	uint64_t start;
+	unsigned long i;
+	unsigned long sum = 0;
+	unsigned long depth;
+	unsigned long processed;
+	unsigned long long service;
+	double load;
+	double hot_load = 0;
+	double cold_load = 0;
+	tm_pipeline_stage_t *stage;
+	tm_pipeline_stage_t *hot = NULL;
+	tm_pipeline_stage_t *cold = NULL;
+
+	/* Someone else is doing it */
+	if (thrd_success != mtx_trylock(&priv->lock)) {
+		return;
+	}
+
+	now = tm_pipeline_internal_now();
+
+	for (i = 0; i < priv->number; i++) {
+		stage = priv->stage[i];
+
+		processed = atomic_exchange(&stage->window_processed, 0);
+		service = atomic_exchange(&stage->window_service, 0);
+		start = atomic_exchange(&stage->window_start, now);
+		if (now > start) {
+			atomic_store(&stage->throughput, (unsigned long)
+				     ((double)processed * 1e9 / (now - start)));
+		}
+
+		if (!(priv->option & TM_PIPELINE_OPTION_ADAPTIVE)) {
+			continue;
+		}
+
+		mtx_lock(&stage->lock);
+		depth = stage->count;
+		sum += stage->limit;
+
+		/* Time needed to drain queue with current workers */
+		load = (double)depth * (processed ? (double)service / processed :
+					1.0) / stage->limit;
+
+		if (stage->limit < stage->concurrency &&
+		    (NULL == hot || load > hot_load)) {
+			hot = stage;
+			hot_load = load;
+		}
+
+		if (stage->limit > 1 && (NULL == cold || load < cold_load)) {
+			cold = stage;
+			cold_load = load;
+		}
+
+		mtx_unlock(&stage->lock);
+	}
+
+	if (!(priv->option & TM_PIPELINE_OPTION_ADAPTIVE) ||
+	    NULL == hot || 0 == hot_load) {
+		mtx_unlock(&priv->lock);
+		return;
+	}
+
+	if (sum >= priv->budget) {
+		/* Only move a worker when it is clearly better */
+		if (NULL == cold || cold == hot || cold_load * 2 >= hot_load) {
+			mtx_unlock(&priv->lock);
+			return;
+		}
+
+		mtx_lock(&cold->lock);
+		cold->limit--;
+		mtx_unlock(&cold->lock);
+	}
+
+	mtx_lock(&hot->lock);
+	hot->limit++;
+	mtx_unlock(&hot->lock);
+
+	mtx_unlock(&priv->lock);
+
+	tm_pipeline_internal_schedule(hot);
+}
+
+/*
+ * Worker of a stage, move batches from this stage to next one until input
+ * is drained, next stage is full or TM_PIPELINE_ROUND batches are done.
+ * */
+static void *tm_pipeline_internal_stage_entry(void *arg)
+{
+	uint64_t now;
+	uint64_t begin;
+	unsigned long n;
+	unsigned long m;
+	unsigned long room;
+	unsigned long round;
+	unsigned long long service;
+	unsigned long long latency;
+	tm_pipeline_node_t *node;
+	tm_pipeline_node_t *next_node;
+	tm_pipeline_node_t *head;
+	tm_pipeline_node_t *out_head;
+	tm_pipeline_node_t *out_tail;
+	tm_pipeline_slot_t *slot = arg;
+	tm_pipeline_stage_t *stage = slot->stage;
+	tm_pipeline_priv_t *priv = stage->pipeline;
+	tm_pipeline_stage_t *next = NULL;
+	void *data;
+
+	if (stage->index + 1 < priv->number) {
+		next = priv->stage[stage->index + 1];
+	}
+
+	for (round = 0; round < TM_PIPELINE_ROUND; round++) {
+		/* Reserve room in next stage first */
+		room = TM_PIPELINE_BATCH;
+		if (NULL != next) {
+			mtx_lock(&next->lock);
+			room = next->capacity - next->count - next->reserved;
+			if (room > TM_PIPELINE_BATCH) {
+				room = TM_PIPELINE_BATCH;
+			}
+			next->reserved += room;
+			mtx_unlock(&next->lock);
+
+			if (0 == room) {
+				break;
+			}
+		}
+
+		/* Take a batch */
+		mtx_lock(&stage->lock);
+
+		head = stage->head;
+		node = NULL;
+		for (n = 0; n < room && NULL != stage->head; n++) {
+			node = stage->head;
+			stage->head = node->next;
+		}
+		if (NULL != node) {
+			node->next = NULL;
+		}
+		if (NULL == stage->head) {
+			stage->tail = NULL;
+		}
+		stage->count -= n;
+
+		if (0 != n && 0 != stage->waiters) {
+			cnd_broadcast(&stage->not_full);
+		}
+
+		mtx_unlock(&stage->lock);
+
+		if (0 == n) {
+			if (NULL != next) {
+				mtx_lock(&next->lock);
+				next->reserved -= room;
+				mtx_unlock(&next->lock);
+			}
+			break;
+		}
+
+		/* Previous stage may wait for room here */
+		if (0 != stage->index) {
+			tm_pipeline_internal_schedule(
+					priv->stage[stage->index - 1]);
+		}
+
+		service = 0;
+		latency = 0;
+		m = 0;
+		out_head = NULL;
+		out_tail = NULL;
+
+		for (node = head; NULL != node; node = next_node) {
+			next_node = node->next;
+
+			begin = tm_pipeline_internal_now();
+			data = stage->entry(node->data, stage->arg);
+			now = tm_pipeline_internal_now();
+
+			service += now - begin;
+			latency += now - node->time;
+
+			if (NULL != next && NULL != data) {
+				node->data = data;
+				node->time = now;
+				node->next = NULL;
+
+				if (NULL == out_tail) {
+					out_head = node;
+				} else {
+					out_tail->next = node;
+				}
+				out_tail = node;
+				m++;
+			} else {
+				/* Dropped or passed the last stage */
+				tm_pool_free(&priv->node_pool, node);
+				atomic_fetch_sub(&priv->inflight, 1);
+			}
+		}
+
+		atomic_fetch_add(&stage->processed, n);
+		atomic_fetch_add(&stage->service, service);
+		atomic_fetch_add(&stage->latency, latency);
+		atomic_fetch_add(&stage->window_processed, n);
+		atomic_fetch_add(&stage->window_service, service);
+
+		/* Hand the whole batch over at once */
+		if (NULL != next) {
+			mtx_lock(&next->lock);
+			if (0 != m) {
+				tm_pipeline_internal_append(next, out_head,
+							    out_tail, m);
+			}
+			next->reserved -= room;
+			mtx_unlock(&next->lock);
+
+			if (0 != m) {
+				tm_pipeline_internal_schedule(next);
+			}
+		}
+
+		if (0 == (atomic_fetch_add(&priv->batches, 1) + 1) %
+			 TM_PIPELINE_ADAPT_PERIOD) {
+			tm_pipeline_internal_adapt(priv);
+		}
+	}
+
+	return slot;
+}
+
+/* Task is done, free its slot and look for more work */
+static void tm_pipeline_internal_stage_event(unsigned long event,
+					     void *task_status)
+{
+	tm_pipeline_slot_t *slot = task_status;
+	tm_pipeline_stage_t *stage;
+	tm_pipeline_priv_t *priv;
+
+	if (TM_THREAD_POOL_EVENT_END != event || NULL == slot) {
+		return;
+	}
+
+	stage = slot->stage;
+	priv = stage->pipeline;
+
+	mtx_lock(&stage->lock);
+	stage->active--;
+	stage->free_slot[stage->free_number++] = slot - stage->slot;
+	mtx_unlock(&stage->lock);
+
+	tm_pipeline_internal_schedule(stage);
+
+	mtx_lock(&priv->lock);
+	priv->running--;
+	if (0 == priv->running && 0 == atomic_load(&priv->inflight)) {
+		cnd_broadcast(&priv->idle);
+	}
+	mtx_unlock(&priv->lock);
+}
+
+static int tm_pipeline_internal_init(tm_pipeline_priv_t **priv,
+				     tm_thread_pool_t *thread_pool,
+				     unsigned long option)
+{
+	int size;
+
+	if (option >= TM_PIPELINE_OPTION_MAX) {
+		return -1;
+	}
+
+	if (0 != tm_thread_pool_get_size(thread_pool, &size)) {
+		return -1;
+	}
+
+	(*priv) = (tm_pipeline_priv_t*)malloc(sizeof(tm_pipeline_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	if (0 != tm_pool_init(&(*priv)->node_pool, sizeof(tm_pipeline_node_t),
+			      TM_PIPELINE_NODE_NUMBER, TM_POOL_OPTION_GROW)) {
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->thread_pool = thread_pool;
+	(*priv)->option = option;
+	(*priv)->budget = size;
+	(*priv)->number = 0;
+	(*priv)->start = tm_pipeline_internal_now();
+	(*priv)->running = 0;
+
+	atomic_init(&(*priv)->started, false);
+	atomic_init(&(*priv)->inflight, 0);
+	atomic_init(&(*priv)->batches, 0);
+
+	mtx_init(&(*priv)->lock, mtx_plain);
+	cnd_init(&(*priv)->idle);
+
+	return 0;
+}
+
+static void tm_pipeline_internal_stage_destroy(tm_pipeline_stage_t *stage)
+{
+	unsigned long i;
+
+	for (i = 0; i < stage->concurrency; i++) {
+		if (NULL != stage->slot[i].task.priv) {
+			tm_thread_pool_task_destroy(&stage->slot[i].task);
+		}
+	}
+
+	cnd_destroy(&stage->not_full);
+	mtx_destroy(&stage->lock);
+
+	free(stage->free_slot);
+	free(stage->slot);
+	free(stage);
+}
+
+static int tm_pipeline_internal_add_stage(tm_pipeline_priv_t **priv,
+					  tm_pipeline_stage_entry_t entry,
+					  void *arg,
+					  unsigned long concurrency,
+					  unsigned long capacity)
+{
+	unsigned long i;
+	tm_pipeline_stage_t *stage;
+
+	if (NULL == entry || 0 == concurrency || 0 == capacity) {
+		return -1;
+	}
+
+	if (atomic_load(&(*priv)->started) ||
+	    TM_PIPELINE_STAGE_MAX == (*priv)->number) {
+		return -1;
+	}
+
+	stage = (tm_pipeline_stage_t*)aligned_alloc(_Alignof(tm_pipeline_stage_t),
+						    sizeof(tm_pipeline_stage_t));
+	if (NULL == stage) {
+		return -1;
+	}
+
+	stage->slot = (tm_pipeline_slot_t*)calloc(concurrency,
+						  sizeof(tm_pipeline_slot_t));
+	stage->free_slot = (unsigned long*)malloc(sizeof(unsigned long) *
+						  concurrency);
+	if (NULL == stage->slot || NULL == stage->free_slot) {
+		free(stage->slot);
+		free(stage->free_slot);
+		free(stage);
+		return -1;
+	}
+
+	stage->pipeline = *priv;
+	stage->index = (*priv)->number;
+	stage->entry = entry;
+	stage->arg = arg;
+	stage->concurrency = concurrency;
+	stage->capacity = capacity;
+
+	mtx_init(&stage->lock, mtx_plain);
+	cnd_init(&stage->not_full);
+
+	stage->head = NULL;
+	stage->tail = NULL;
+	stage->count = 0;
+	stage->reserved = 0;
+	stage->waiters = 0;
+	stage->active = 0;
+	stage->free_number = 0;
+
+	/* Adaptive pipeline share the pool at first push */
+	stage->limit = (*priv)->option & TM_PIPELINE_OPTION_ADAPTIVE ?
+		       1 : concurrency;
+
+	atomic_init(&stage->processed, 0);
+	atomic_init(&stage->service, 0);
+	atomic_init(&stage->latency, 0);
+	atomic_init(&stage->window_processed, 0);
+	atomic_init(&stage->window_service, 0);
+	atomic_init(&stage->window_start, (*priv)->start);
+	atomic_init(&stage->throughput, 0);
+
+	for (i = 0; i < concurrency; i++) {
+		stage->slot[i].stage = stage;
+
+		if (0 != tm_thread_pool_task_init(&stage->slot[i].task,
+					tm_pipeline_internal_stage_entry,
+					&stage->slot[i],
+					tm_pipeline_internal_stage_event, 0)) {
+			tm_pipeline_internal_stage_destroy(stage);
+			return -1;
+		}
+
+		stage->free_slot[stage->free_number++] = i;
+	}
+
+	(*priv)->stage[(*priv)->number++] = stage;
+
+	return 0;
+}
+
+/* Split pool among stages evenly, each capped by its concurrency */
+static void tm_pipeline_internal_share(tm_pipeline_priv_t *priv)
+{
+	unsigned long i;
+	unsigned long limit;
+	tm_pipeline_stage_t *stage;
+
+	for (i = 0; i < priv->number; i++) {
+		stage = priv->stage[i];
+
+		limit = priv->budget / priv->number +
+			(i < priv->budget % priv->number);
+		if (0 == limit) {
+			limit = 1;
+		}
+		if (limit > stage->concurrency) {
+			limit = stage->concurrency;
+		}
+
+		mtx_lock(&stage->lock);
+		stage->limit = limit;
+		mtx_unlock(&stage->lock);
+	}
+}
+
+static int tm_pipeline_internal_push(tm_pipeline_priv_t **priv, void *data,
+				     long timeout)
+{
+	int ret = thrd_success;
+	struct timespec deadline;
+	tm_pipeline_node_t *node;
+	tm_pipeline_stage_t *stage;
+
+	if (0 == (*priv)->number) {
+		return -1;
+	}
+
+	if (!atomic_exchange(&(*priv)->started, true) &&
+	    ((*priv)->option & TM_PIPELINE_OPTION_ADAPTIVE)) {
+		tm_pipeline_internal_share(*priv);
+	}
+
+	stage = (*priv)->stage[0];
+
+	if (0 != tm_pool_alloc(&(*priv)->node_pool, (void**)&node)) {
+		return -1;
+	}
+
+	node->data = data;
+	node->time = tm_pipeline_internal_now();
+	node->next = NULL;
+
+	if (timeout > 0) {
+		timespec_get(&deadline, TIME_UTC);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	mtx_lock(&stage->lock);
+
+	while (stage->count + stage->reserved >= stage->capacity) {
+		if (0 == timeout || thrd_success != ret) {
+			mtx_unlock(&stage->lock);
+			tm_pool_free(&(*priv)->node_pool, node);
+			return -1;
+		}
+
+		stage->waiters++;
+		if (timeout < 0) {
+			ret = cnd_wait(&stage->not_full, &stage->lock);
+		} else {
+			ret = cnd_timedwait(&stage->not_full, &stage->lock,
+					    &deadline);
+		}
+		stage->waiters--;
+	}
+
+	tm_pipeline_internal_append(stage, node, node, 1);
+	atomic_fetch_add(&(*priv)->inflight, 1);
+
+	mtx_unlock(&stage->lock);
+
+	tm_pipeline_internal_schedule(stage);
+
+	return 0;
+}
+
+static int tm_pipeline_internal_get_stats(tm_pipeline_priv_t **priv,
+					  unsigned long index,
+					  tm_pipeline_stats_t *stats)
+{
+	uint64_t elapsed;
+	tm_pipeline_stage_t *stage;
+
+	if (NULL == stats || index >= (*priv)->number) {
+		return -1;
+	}
+
+	stage = (*priv)->stage[index];
+
+	mtx_lock(&stage->lock);
+	stats->depth = stage->count;
+	stats->concurrency = stage->limit;
+	mtx_unlock(&stage->lock);
+
+	stats->processed = atomic_load(&stage->processed);
+
+	/* Average since created until the first window is closed */
+	stats->throughput = atomic_load(&stage->throughput);
+	if ((*priv)->start == atomic_load(&stage->window_start)) {
+		elapsed = tm_pipeline_internal_now() - (*priv)->start;
+		stats->throughput = 0 == elapsed ? 0 :
+			(unsigned long)((double)stats->processed * 1e9 /
+					elapsed);
+	}
+
+	stats->service_time = 0;
+	stats->latency = 0;
+	if (0 != stats->processed) {
+		stats->service_time = atomic_load(&stage->service) /
+				      stats->processed;
+		stats->latency = atomic_load(&stage->latency) /
+				 stats->processed;
+	}
+
+	return 0;
+}
+
+static int tm_pipeline_internal_destroy(tm_pipeline_priv_t **priv)
+{
+	unsigned long i;
+
+	/* Everything pushed must come out of the last stage */
+	mtx_lock(&(*priv)->lock);
+	while (0 != (*priv)->running || 0 != atomic_load(&(*priv)->inflight)) {
+		cnd_wait(&(*priv)->idle, &(*priv)->lock);
+	}
+	mtx_unlock(&(*priv)->lock);
+
+	for (i = 0; i < (*priv)->number; i++) {
+		tm_pipeline_internal_stage_destroy((*priv)->stage[i]);
+	}
+
+	tm_pool_destroy(&(*priv)->node_pool);
+
+	cnd_destroy(&(*priv)->idle);
+	mtx_destroy(&(*priv)->lock);
+
+	free(*priv);
+	*priv = NULL;
+
+	return 0;
+}
+
+
+int tm_pipeline_init(tm_pipeline_t *pipeline, tm_thread_pool_t *thread_pool,
+		     unsigned long option)
+{
+	if (NULL == pipeline || NULL == thread_pool) {
+		return -1;
+	}
+
+	pipeline->priv = NULL;
+
+	return tm_pipeline_internal_init((tm_pipeline_priv_t**)&pipeline->priv,
+					 thread_pool, option);
+}
+
+int tm_pipeline_add_stage(tm_pipeline_t *pipeline,
+			  tm_pipeline_stage_entry_t entry, void *arg,
+			  unsigned long concurrency, unsigned long capacity)
+{
+	if (NULL == pipeline) {
+		return -1;
+	}
+
+	if (NULL == pipeline->priv) {
+		return -1;
+	}
+
+	return tm_pipeline_internal_add_stage(
+			(tm_pipeline_priv_t**)&pipeline->priv,
+			entry, arg, concurrency, capacity);
+}
+
+int tm_pipeline_push(tm_pipeline_t *pipeline, void *data, long timeout)
+{
+	if (NULL == pipeline) {
+		return -1;
+	}
+
+	if (NULL == pipeline->priv) {
+		return -1;
+	}
+
+	return tm_pipeline_internal_push((tm_pipeline_priv_t**)&pipeline->priv,
+					 data, timeout);
+}
+
+int tm_pipeline_get_stats(tm_pipeline_t *pipeline, unsigned long stage,
+			  tm_pipeline_stats_t *stats)
+{
+	if (NULL == pipeline) {
+		return -1;
+	}
+
+	if (NULL == pipeline->priv) {
+		return -1;
+	}
+
+	return tm_pipeline_internal_get_stats(
+			(tm_pipeline_priv_t**)&pipeline->priv, stage, stats);
+}
+
+int tm_pipeline_destroy(tm_pipeline_t *pipeline)
+{
+	if (NULL == pipeline) {
+		return -1;
+	}
+
+	if (NULL == pipeline->priv) {
+		return -1;
+	}
+
+	return tm_pipeline_internal_destroy(
+			(tm_pipeline_priv_t**)&pipeline->priv);
+}
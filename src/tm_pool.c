@@ -0,0 +1,742 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <threads.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tm_pool.h"
+
+/* Objects cached by each thread, half of them move at once */
+#define TM_POOL_CACHE_SIZE	64u
+
+/* Max number of slabs */
+#define TM_POOL_SLAB_MAX	64u
+
+/* Object alignment */
+#define TM_POOL_ALIGN		16ul
+
+#define TM_POOL_HUGEPAGE_SIZE	(2ul << 20)
+
+/**
+ * struct tm_pool_attribute_s - Pool attribute
+ *
+ * @option: Option of this pool
+ *
+ * @lock: Mutex lock for growing and cache list
+ * */
+typedef struct tm_pool_attribute_s {
+	unsigned long option;
+	mtx_t lock;
+} tm_pool_attribute_t;
+
+/**
+ * struct tm_pool_cache_s - Per thread object cache
+ *
+ * @pool: Pool this cache belong to
+ *
+ * @prev: Previous cache of this pool
+ *
+ * @next: Next cache of this pool
+ *
+ * @used: Objects allocated minus freed by this thread, only written by
+ *	  owner thread
+ *
+ * @number: Number of objects in @index
+ *
+ * @index: Cached free objects
+ * */
+typedef struct tm_pool_cache_s {
+	struct tm_pool_priv_s *pool;
+	struct tm_pool_cache_s *prev;
+	struct tm_pool_cache_s *next;
+	atomic_long used;
+	unsigned long number;
+	uint32_t index[TM_POOL_CACHE_SIZE];
+} tm_pool_cache_t;
+
+/**
+ * struct tm_pool_slab_s - One region of objects
+ *
+ * @base: Address of first object
+ *
+ * @size: Mapped size
+ *
+ * @map: One bit per object, set while it is allocated
+ * */
+typedef struct tm_pool_slab_s {
+	char *base;
+	size_t size;
+	atomic_ulong *map;
+} tm_pool_slab_t;
+
+/**
+ * struct tm_pool_priv_s - Private structure of pool
+ *
+ * Objects are numbered across slabs, the shared free list link objects by
+ * "index + 1" saved in their first 4 bytes. Its head keep an ABA tag in the
+ * high 32 bits, so one 64 bits CAS is enough.
+ *
+ * Freed address is mapped back to its slab by a binary search of @order,
+ * which only change when pool grow and is read under @order_sequence, a
+ * sequence lock.
+ *
+ * @attribute: Attribute of this pool
+ *
+ * @object_size: Object size rounded up to TM_POOL_ALIGN
+ *
+ * @object_number: Objects per slab
+ *
+ * @slab: Slabs
+ *
+ * @slab_number: Number of @slab
+ *
+ * @order: Index of slabs sorted by base address
+ *
+ * @order_sequence: Odd while @order is being changed
+ *
+ * @cache_key: Thread specific storage of tm_pool_cache_t
+ *
+ * @cache: All caches of this pool
+ *
+ * @retired_used: Used objects count of exited threads
+ *
+ * @free: Shared free list head, tag << 32 | (index + 1), 0 is empty
+ * */
+typedef struct tm_pool_priv_s {
+	tm_pool_attribute_t *attribute;
+	unsigned long object_size;
+	unsigned long object_number;
+	tm_pool_slab_t slab[TM_POOL_SLAB_MAX];
+	atomic_ulong slab_number;
+	_Atomic(uint8_t) order[TM_POOL_SLAB_MAX];
+	atomic_uint order_sequence;
+	tss_t cache_key;
+	tm_pool_cache_t *cache;
+	long retired_used;
+	_Alignas(64) _Atomic(uint64_t) free;
+} tm_pool_priv_t;
+
+
+static inline void *tm_pool_internal_object(tm_pool_priv_t *priv,
+					    uint32_t index)
+{
+	return priv->slab[index / priv->object_number].base +
+	       (index % priv->object_number) * priv->object_size;
+}
+
+/* Index of @object, -1 if it is not the start of an object of this pool */
+static int tm_pool_internal_index(tm_pool_priv_t *priv, void *object,
+				  uint32_t *index)
+{
+	unsigned int sequence;
+	unsigned long low;
+	unsigned long high;
+	unsigned long middle;
+	unsigned long offset;
+	uint8_t i;
+	uint8_t found;
+	char *p = object;
+
+	do {
+		sequence = atomic_load_explicit(&priv->order_sequence,
+						memory_order_acquire);
+
+		/* Last slab start at or before @p */
+		low = 0;
+		high = atomic_load_explicit(&priv->slab_number,
+					    memory_order_acquire);
+		found = TM_POOL_SLAB_MAX;
+
+		while (low < high) {
+			middle = (low + high) / 2;
+			i = atomic_load_explicit(&priv->order[middle],
+						 memory_order_acquire);
+
+			if (priv->slab[i].base <= p) {
+				found = i;
+				low = middle + 1;
+			} else {
+				high = middle;
+			}
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+	} while ((sequence & 1) ||
+		 sequence != atomic_load_explicit(&priv->order_sequence,
+						  memory_order_relaxed));
+
+	if (TM_POOL_SLAB_MAX == found) {
+		return -1;
+	}
+
+	offset = p - priv->slab[found].base;
+	if (offset >= priv->object_number * priv->object_size ||
+	    0 != offset % priv->object_size) {
+		return -1;
+	}
+
+	*index = found * priv->object_number + offset / priv->object_size;
+
+	return 0;
+}
+
+/* Set or clear allocated bit of @index, false if it was so already */
+static inline bool tm_pool_internal_mark(tm_pool_priv_t *priv, uint32_t index,
+					 bool set)
+{
+	unsigned long bit = index % priv->object_number;
+	unsigned long mask = 1ul << (bit % (8 * sizeof(long)));
+	atomic_ulong *word = &priv->slab[index / priv->object_number].map[
+						bit / (8 * sizeof(long))];
+
+	if (set) {
+		return !(atomic_fetch_or_explicit(word, mask,
+					memory_order_relaxed) & mask);
+	}
+
+	return !!(atomic_fetch_and_explicit(word, ~mask,
+				memory_order_relaxed) & mask);
+}
+
+static inline _Atomic(uint32_t) *tm_pool_internal_link(void *object)
+{
+	return (_Atomic(uint32_t)*)object;
+}
+
+/* Push a chain of objects, already linked from @first to @last */
+static void tm_pool_internal_push(tm_pool_priv_t *priv, uint32_t first,
+				  void *last)
+{
+	uint64_t old;
+	uint64_t new;
+
+	old = atomic_load_explicit(&priv->free, memory_order_relaxed);
+
+	do {
+		atomic_store_explicit(tm_pool_internal_link(last),
+				      (uint32_t)old, memory_order_relaxed);
+
+		new = ((old >> 32) + 1) << 32 | (first + 1);
+	} while (!atomic_compare_exchange_weak_explicit(&priv->free, &old, new,
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+static int tm_pool_internal_pop(tm_pool_priv_t *priv, uint32_t *index)
+{
+	uint64_t old;
+	uint64_t new;
+	uint32_t next;
+	void *p;
+
+	old = atomic_load_explicit(&priv->free, memory_order_acquire);
+
+	do {
+		if (0 == (uint32_t)old) {
+			return -1;
+		}
+
+		/*
+		 * Object may be popped and reused by others at the same time,
+		 * then @next is garbage but tag changed and CAS fail.
+		 * */
+		p = tm_pool_internal_object(priv, (uint32_t)old - 1);
+		next = atomic_load_explicit(tm_pool_internal_link(p),
+					    memory_order_relaxed);
+
+		new = ((old >> 32) + 1) << 32 | next;
+	} while (!atomic_compare_exchange_weak_explicit(&priv->free, &old, new,
+							memory_order_acquire,
+							memory_order_acquire));
+
+	*index = (uint32_t)old - 1;
+
+	return 0;
+}
+
+/* Give @number objects from @index to the shared free list */
+static void tm_pool_internal_spill(tm_pool_priv_t *priv, uint32_t *index,
+				   unsigned long number)
+{
+	unsigned long i;
+	void *last;
+
+	if (0 == number) {
+		return;
+	}
+
+	for (i = 0; i + 1 < number; i++) {
+		atomic_store_explicit(tm_pool_internal_link(
+				tm_pool_internal_object(priv, index[i])),
+				index[i + 1] + 1, memory_order_relaxed);
+	}
+
+	last = tm_pool_internal_object(priv, index[number - 1]);
+
+	tm_pool_internal_push(priv, index[0], last);
+}
+
+static int tm_pool_internal_slab_alloc(tm_pool_priv_t *priv,
+				       tm_pool_slab_t *slab)
+{
+	int flags;
+	size_t size;
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *p = MAP_FAILED;
+
+	size = priv->object_number * priv->object_size;
+
+	if (priv->attribute->option & TM_POOL_OPTION_HUGEPAGE) {
+		size = (size + TM_POOL_HUGEPAGE_SIZE - 1) &
+		       ~(TM_POOL_HUGEPAGE_SIZE - 1);
+
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			 MAP_POPULATE, -1, 0);
+	} else {
+		size = (size + page - 1) & ~(page - 1);
+	}
+
+	if (MAP_FAILED == p) {
+		/* Preallocate, do not page fault in hot path */
+		flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		if (!(priv->attribute->option & TM_POOL_OPTION_HUGEPAGE)) {
+			flags |= MAP_POPULATE;
+		}
+
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (MAP_FAILED == p) {
+			return -1;
+		}
+
+		/* No reserved huge page, try transparent huge page */
+		if (priv->attribute->option & TM_POOL_OPTION_HUGEPAGE) {
+			madvise(p, size, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_WRITE
+			madvise(p, size, MADV_POPULATE_WRITE);
+#endif
+		}
+	}
+
+	slab->map = (atomic_ulong*)calloc(
+			(priv->object_number + 8 * sizeof(long) - 1) /
+			(8 * sizeof(long)), sizeof(atomic_ulong));
+	if (NULL == slab->map) {
+		munmap(p, size);
+		return -1;
+	}
+
+	slab->base = p;
+	slab->size = size;
+
+	return 0;
+}
+
+/* Caller should hold attribute->lock */
+static int tm_pool_internal_grow(tm_pool_priv_t *priv)
+{
+	unsigned long i;
+	unsigned long slab_number;
+	unsigned int sequence;
+	uint8_t slab;
+	uint32_t first;
+	char *p;
+
+	slab_number = atomic_load_explicit(&priv->slab_number,
+					   memory_order_relaxed);
+
+	/* Index must fit in 32 bits */
+	if (slab_number >= TM_POOL_SLAB_MAX ||
+	    (slab_number + 1) * priv->object_number >= UINT32_MAX) {
+		return -1;
+	}
+
+	if (0 != tm_pool_internal_slab_alloc(priv, &priv->slab[slab_number])) {
+		return -1;
+	}
+
+	/* Insert into @order, publish slab before any object is reachable */
+	sequence = atomic_load_explicit(&priv->order_sequence,
+					memory_order_relaxed);
+	atomic_store_explicit(&priv->order_sequence, sequence + 1,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (i = slab_number; i > 0; i--) {
+		slab = atomic_load_explicit(&priv->order[i - 1],
+					    memory_order_relaxed);
+		if (priv->slab[slab].base < priv->slab[slab_number].base) {
+			break;
+		}
+		atomic_store_explicit(&priv->order[i], slab,
+				      memory_order_release);
+	}
+	atomic_store_explicit(&priv->order[i], slab_number,
+			      memory_order_release);
+
+	atomic_store_explicit(&priv->slab_number, slab_number + 1,
+			      memory_order_release);
+	atomic_store_explicit(&priv->order_sequence, sequence + 2,
+			      memory_order_release);
+
+	first = slab_number * priv->object_number;
+
+	for (i = 0; i + 1 < priv->object_number; i++) {
+		p = priv->slab[slab_number].base + i * priv->object_size;
+		atomic_store_explicit(tm_pool_internal_link(p),
+				      first + i + 2, memory_order_relaxed);
+	}
+
+	p = priv->slab[slab_number].base + i * priv->object_size;
+
+	tm_pool_internal_push(priv, first, p);
+
+	return 0;
+}
+
+/* Destructor of thread specific cache, called when thread exit */
+static void tm_pool_internal_cache_release(void *arg)
+{
+	tm_pool_cache_t *cache = arg;
+	tm_pool_priv_t *priv = cache->pool;
+
+	tm_pool_internal_spill(priv, cache->index, cache->number);
+
+	mtx_lock(&priv->attribute->lock);
+
+	priv->retired_used += atomic_load(&cache->used);
+
+	if (NULL != cache->prev) {
+		cache->prev->next = cache->next;
+	} else {
+		priv->cache = cache->next;
+	}
+
+	if (NULL != cache->next) {
+		cache->next->prev = cache->prev;
+	}
+
+	mtx_unlock(&priv->attribute->lock);
+
+	free(cache);
+}
+
+static tm_pool_cache_t *tm_pool_internal_cache(tm_pool_priv_t *priv)
+{
+	tm_pool_cache_t *cache;
+
+	cache = tss_get(priv->cache_key);
+	if (NULL != cache) {
+		return cache;
+	}
+
+	/* First access of this thread */
+	cache = (tm_pool_cache_t*)malloc(sizeof(tm_pool_cache_t));
+	if (NULL == cache) {
+		return NULL;
+	}
+
+	cache->pool = priv;
+	cache->prev = NULL;
+	cache->number = 0;
+	atomic_init(&cache->used, 0);
+
+	if (thrd_success != tss_set(priv->cache_key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	mtx_lock(&priv->attribute->lock);
+
+	cache->next = priv->cache;
+	if (NULL != priv->cache) {
+		priv->cache->prev = cache;
+	}
+	priv->cache = cache;
+
+	mtx_unlock(&priv->attribute->lock);
+
+	return cache;
+}
+
+static int tm_pool_internal_alloc(tm_pool_priv_t **priv, void **object)
+{
+	int ret;
+	uint32_t index;
+	tm_pool_cache_t *cache;
+
+	cache = tm_pool_internal_cache(*priv);
+	if (NULL == cache) {
+		return -1;
+	}
+
+	while (0 == cache->number) {
+		/* Refill half of the cache from shared list */
+		while (cache->number < TM_POOL_CACHE_SIZE / 2) {
+			ret = tm_pool_internal_pop(*priv,
+					&cache->index[cache->number]);
+			if (0 != ret) {
+				break;
+			}
+			cache->number++;
+		}
+
+		if (0 != cache->number) {
+			break;
+		}
+
+		if (!((*priv)->attribute->option & TM_POOL_OPTION_GROW)) {
+			return -1;
+		}
+
+		mtx_lock(&(*priv)->attribute->lock);
+
+		/* Somebody else may have grown or freed meanwhile */
+		ret = 0;
+		if (0 == (uint32_t)atomic_load(&(*priv)->free)) {
+			ret = tm_pool_internal_grow(*priv);
+		}
+
+		mtx_unlock(&(*priv)->attribute->lock);
+
+		if (0 != ret) {
+			return -1;
+		}
+	}
+
+	index = cache->index[--cache->number];
+	tm_pool_internal_mark(*priv, index, true);
+
+	*object = tm_pool_internal_object(*priv, index);
+
+	atomic_store_explicit(&cache->used,
+		atomic_load_explicit(&cache->used, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+
+	return 0;
+}
+
+static int tm_pool_internal_free(tm_pool_priv_t **priv, void *object)
+{
+	uint32_t index;
+	tm_pool_cache_t *cache;
+
+	/* Foreign pointer or double free */
+	if (0 != tm_pool_internal_index(*priv, object, &index) ||
+	    !tm_pool_internal_mark(*priv, index, false)) {
+		return -1;
+	}
+
+	cache = tm_pool_internal_cache(*priv);
+	if (NULL == cache) {
+		tm_pool_internal_mark(*priv, index, true);
+		return -1;
+	}
+
+	if (TM_POOL_CACHE_SIZE == cache->number) {
+		cache->number -= TM_POOL_CACHE_SIZE / 2;
+
+		tm_pool_internal_spill(*priv, &cache->index[cache->number],
+				       TM_POOL_CACHE_SIZE / 2);
+	}
+
+	cache->index[cache->number++] = index;
+
+	atomic_store_explicit(&cache->used,
+		atomic_load_explicit(&cache->used, memory_order_relaxed) - 1,
+		memory_order_relaxed);
+
+	return 0;
+}
+
+static int tm_pool_internal_get_stats(tm_pool_priv_t **priv,
+				      unsigned long *capacity,
+				      unsigned long *used)
+{
+	long sum;
+	tm_pool_cache_t *cache;
+
+	if (NULL != capacity) {
+		*capacity = atomic_load(&(*priv)->slab_number) *
+			    (*priv)->object_number;
+	}
+
+	if (NULL != used) {
+		mtx_lock(&(*priv)->attribute->lock);
+
+		sum = (*priv)->retired_used;
+		for (cache = (*priv)->cache; NULL != cache;
+		     cache = cache->next) {
+			sum += atomic_load_explicit(&cache->used,
+						    memory_order_relaxed);
+		}
+
+		mtx_unlock(&(*priv)->attribute->lock);
+
+		*used = sum;
+	}
+
+	return 0;
+}
+
+static int tm_pool_internal_init(tm_pool_priv_t **priv,
+				 unsigned long object_size,
+				 unsigned long object_number,
+				 unsigned long option)
+{
+	if (0 == object_size || 0 == object_number ||
+	    object_number >= UINT32_MAX || option >= TM_POOL_OPTION_MAX) {
+		return -1;
+	}
+
+	(*priv) = (tm_pool_priv_t*)aligned_alloc(_Alignof(tm_pool_priv_t),
+						 sizeof(tm_pool_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->attribute =
+		(tm_pool_attribute_t*)malloc(sizeof(tm_pool_attribute_t));
+	if (NULL == (*priv)->attribute) {
+		free(*priv);
+		return -1;
+	}
+
+	if (thrd_success != tss_create(&(*priv)->cache_key,
+				       tm_pool_internal_cache_release)) {
+		free((*priv)->attribute);
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->attribute->option = option;
+	mtx_init(&(*priv)->attribute->lock, mtx_plain);
+
+	(*priv)->object_size = (object_size + TM_POOL_ALIGN - 1) &
+			       ~(TM_POOL_ALIGN - 1);
+	(*priv)->object_number = object_number;
+	(*priv)->cache = NULL;
+	(*priv)->retired_used = 0;
+	atomic_init(&(*priv)->slab_number, 0);
+	atomic_init(&(*priv)->order_sequence, 0);
+	atomic_init(&(*priv)->free, 0);
+
+	if (0 != tm_pool_internal_grow(*priv)) {
+		tss_delete((*priv)->cache_key);
+		mtx_destroy(&(*priv)->attribute->lock);
+		free((*priv)->attribute);
+		free(*priv);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tm_pool_internal_destroy(tm_pool_priv_t **priv)
+{
+	unsigned long i;
+	tm_pool_cache_t *cache;
+
+	/* Destructor will not be called any more */
+	tss_delete((*priv)->cache_key);
+
+	while (NULL != (*priv)->cache) {
+		cache = (*priv)->cache;
+		(*priv)->cache = cache->next;
+		free(cache);
+	}
+
+	for (i = 0; i < atomic_load(&(*priv)->slab_number); i++) {
+		munmap((*priv)->slab[i].base, (*priv)->slab[i].size);
+		free((*priv)->slab[i].map);
+	}
+
+	mtx_destroy(&(*priv)->attribute->lock);
+	free((*priv)->attribute);
+	free(*priv);
+
+	(*priv) = NULL;
+
+	return 0;
+}
+
+
+int tm_pool_init(tm_pool_t *pool, unsigned long object_size,
+		 unsigned long object_number, unsigned long option)
+{
+	if (NULL == pool) {
+		return -1;
+	}
+
+	pool->priv = NULL;
+
+	return tm_pool_internal_init((tm_pool_priv_t**)&pool->priv,
+				     object_size, object_number, option);
+}
+
+int tm_pool_destroy(tm_pool_t *pool)
+{
+	if (NULL == pool) {
+		return -1;
+	}
+
+	if (NULL == pool->priv) {
+		return -1;
+	}
+
+	return tm_pool_internal_destroy((tm_pool_priv_t**)&pool->priv);
+}
+
+int tm_pool_alloc(tm_pool_t *pool, void **object)
+{
+	if (NULL == pool || NULL == object) {
+		return -1;
+	}
+
+	if (NULL == pool->priv) {
+		return -1;
+	}
+
+	return tm_pool_internal_alloc((tm_pool_priv_t**)&pool->priv, object);
+}
+
+int tm_pool_free(tm_pool_t *pool, void *object)
+{
+	if (NULL == pool || NULL == object) {
+		return -1;
+	}
+
+	if (NULL == pool->priv) {
+		return -1;
+	}
+
+	return tm_pool_internal_free((tm_pool_priv_t**)&pool->priv, object);
+}
+
+int tm_pool_get_stats(tm_pool_t *pool, unsigned long *capacity,
+		      unsigned long *used)
+{
+	if (NULL == pool) {
+		return -1;
+	}
+
+	if (NULL == pool->priv) {
+		return -1;
+	}
+
+	return tm_pool_internal_get_stats((tm_pool_priv_t**)&pool->priv,
+					  capacity, used);
+}
+
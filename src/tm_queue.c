@@ -3,13 +3,67 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
 
 #include <threads.h>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
 #include "tm_queue.h"
+#include "tm_arena.h"
+
+/* Size of each spill segment file */
+#define TM_QUEUE_SPILL_SEGMENT_SIZE	(64ul << 20)
+
+/* Spill record header and alignment */
+#define TM_QUEUE_SPILL_ALIGN		8ul
+
+/* Journal is compacted once it is this big and twice of snapshot */
+#define TM_QUEUE_JOURNAL_COMPACT_SIZE	(64ul << 20)
+
+/* Snapshot is written in chunks of this size */
+#define TM_QUEUE_JOURNAL_CHUNK_SIZE	(1ul << 20)
+
+/* Journal record alignment */
+#define TM_QUEUE_JOURNAL_ALIGN		8ul
+
+#define TM_QUEUE_JOURNAL_MAGIC		0x6c6e72756f6a6d74ull
+
+#define TM_QUEUE_JOURNAL_RECORD_PUSH	1u
+#define TM_QUEUE_JOURNAL_RECORD_POP	2u
+
+/*
+ * State of eventfd, a push move it from idle to writing and then to ready
+ * after the write, pop find queue empty reset it from ready to idle.
+ * */
+#define TM_QUEUE_EVENT_IDLE		0
+#define TM_QUEUE_EVENT_WRITING		1
+#define TM_QUEUE_EVENT_READY		2
+
+/* What push do when a bounded queue is full */
+#define TM_QUEUE_FULL_FAIL		0
+#define TM_QUEUE_FULL_WAIT		1
+#define TM_QUEUE_FULL_DROP		2
+
+/* Freed MPSC nodes given back by consumer at once */
+#define TM_QUEUE_MPSC_BATCH		64u
+
+/* Batches of MPSC nodes waiting for producers */
+#define TM_QUEUE_MPSC_SLOTS		4u
 
 /**
  * struct tm_queue_attribute_s - Queue attribute
@@ -20,10 +74,13 @@
  * @option: Option of this queue
  *
  * @lock: Mutex lock for push/pop
+ *
+ * @not_full: Producers of a full bounded queue wait here
  * */
 typedef struct tm_queue_attribute_s {
 	unsigned long option;
 	mtx_t lock;
+	cnd_t not_full;
 } tm_queue_attribute_t;
 
 /**
@@ -38,47 +95,1794 @@ typedef struct tm_queue_item_s {
 	struct tm_queue_item_s *next;
 } tm_queue_item_t;
 
+/**
+ * struct tm_queue_spill_segment_s - Spill segment file
+ *
+ * Each record is a 32 bits length followed by encoded element, aligned to
+ * TM_QUEUE_SPILL_ALIGN.
+ *
+ * @fd: File descriptor, file itself is already unlinked
+ *
+ * @base: Mapped address
+ *
+ * @write: Write offset
+ *
+ * @read: Read offset
+ *
+ * @next: Next segment, newer
+ * */
+typedef struct tm_queue_spill_segment_s {
+	int fd;
+	char *base;
+	unsigned long write;
+	unsigned long read;
+	struct tm_queue_spill_segment_s *next;
+} tm_queue_spill_segment_t;
+
+/**
+ * struct tm_queue_spill_s - Spill to disk state
+ *
+ * @directory: Where to create segment files
+ *
+ * @threshold: Max number of elements in memory
+ *
+ * @codec: Element codec
+ *
+ * @head: Oldest segment, read from here
+ *
+ * @tail: Newest segment, write to here
+ *
+ * @count: Number of elements on disk
+ * */
+typedef struct tm_queue_spill_s {
+	char *directory;
+	unsigned long threshold;
+	tm_queue_codec_t codec;
+	tm_queue_spill_segment_t *head;
+	tm_queue_spill_segment_t *tail;
+	unsigned long count;
+} tm_queue_spill_t;
+
+/**
+ * struct tm_queue_journal_record_s - Journal and snapshot record header
+ *
+ * Followed by @length bytes of encoded element, aligned to
+ * TM_QUEUE_JOURNAL_ALIGN.
+ *
+ * @type: TM_QUEUE_JOURNAL_RECORD_PUSH or TM_QUEUE_JOURNAL_RECORD_POP
+ *
+ * @length: Length of encoded element, 0 for pop
+ *
+ * @lsn: Log sequence number, increased by one per record, 0 in snapshot
+ *
+ * @checksum: FNV-1a of fields above and encoded element
+ * */
+typedef struct tm_queue_journal_record_s {
+	uint32_t type;
+	uint32_t length;
+	uint64_t lsn;
+	uint64_t checksum;
+} tm_queue_journal_record_t;
+
+/**
+ * struct tm_queue_journal_snapshot_s - Snapshot file header
+ *
+ * Followed by @count push records.
+ *
+ * @magic: TM_QUEUE_JOURNAL_MAGIC
+ *
+ * @lsn: Last journal record included in this snapshot
+ *
+ * @count: Number of elements
+ *
+ * @checksum: FNV-1a of fields above
+ * */
+typedef struct tm_queue_journal_snapshot_s {
+	uint64_t magic;
+	uint64_t lsn;
+	uint64_t count;
+	uint64_t checksum;
+} tm_queue_journal_snapshot_t;
+
+/**
+ * struct tm_queue_journal_buffer_s - Records not written yet
+ *
+ * @base: Buffer address
+ *
+ * @size: Buffer size
+ *
+ * @used: Bytes of records
+ * */
+typedef struct tm_queue_journal_buffer_s {
+	char *base;
+	unsigned long size;
+	unsigned long used;
+} tm_queue_journal_buffer_t;
+
+/**
+ * struct tm_queue_journal_s - Write-ahead journal state
+ *
+ * Records are appended to @buffer under attribute->lock, so they are in the
+ * same order as queue itself. Whoever flushes swaps @buffer with @spare and
+ * writes it without any lock, operations finished meanwhile are written by
+ * the next flush together. Lock order is attribute->lock, then @lock.
+ *
+ * @sync: See tm_queue_journal_sync_t
+ *
+ * @interval: Records or milliseconds between two flush
+ *
+ * @codec: Element codec
+ *
+ * @dirfd: Journal directory
+ *
+ * @fd: Journal file, opened with O_APPEND
+ *
+ * @size: Bytes written to journal file
+ *
+ * @snapshot_size: Bytes of snapshot file
+ *
+ * @lsn: Sequence number of last record
+ *
+ * @synced: Sequence number of last record on disk
+ *
+ * @pending: Number of records in @buffer
+ *
+ * @error: -1 once journal can not be written
+ *
+ * @flushing: Someone is writing @spare
+ *
+ * @shutdown: Tell flusher thread to exit
+ *
+ * @lock: Protect fields above and buffers
+ *
+ * @cond: Flush or compaction done
+ *
+ * @wake: Wake flusher thread up, compaction needed or shutdown
+ *
+ * @flusher: Flush journal of TM_QUEUE_JOURNAL_SYNC_TIME, compact journal
+ *	     of any sync mode
+ * */
+typedef struct tm_queue_journal_s {
+	unsigned long sync;
+	unsigned long interval;
+	tm_queue_codec_t codec;
+	int dirfd;
+	int fd;
+	unsigned long size;
+	unsigned long snapshot_size;
+	uint64_t lsn;
+	uint64_t synced;
+	unsigned long pending;
+	int error;
+	bool flushing;
+	bool shutdown;
+	tm_queue_journal_buffer_t buffer;
+	tm_queue_journal_buffer_t spare;
+	mtx_t lock;
+	cnd_t cond;
+	cnd_t wake;
+	thrd_t flusher;
+} tm_queue_journal_t;
+
+/**
+ * struct tm_queue_mpsc_cache_s - Free MPSC nodes of one producer thread
+ *
+ * @priv: Queue of this cache
+ *
+ * @prev: Previous cache of the same queue
+ *
+ * @next: Next cache of the same queue
+ *
+ * @first: First free node, linked by arena links and ended by 0
+ * */
+typedef struct tm_queue_mpsc_cache_s {
+	struct tm_queue_priv_s *priv;
+	struct tm_queue_mpsc_cache_s *prev;
+	struct tm_queue_mpsc_cache_s *next;
+	uint32_t first;
+} tm_queue_mpsc_cache_t;
+
 /**
  * struct tm_queue_priv_s - Private structure of queue
  *
  * @attribute: Attribute of this queue
  *
- * @top: Top pointer
+ * @head: Head pointer
+ *
+ * @tail: Tail pointer
+ *
+ * @count: Number of elements in memory, not for TM_QUEUE_OPTION_MPSC
+ *
+ * @capacity: Max number of elements, 0 if not bounded
+ *
+ * @waiters: Number of producers waiting on attribute->not_full, so pop
+ *	     only signal when someone is there
+ *
+ * @spill: Spill to disk state, NULL if disabled
+ *
+ * @journal: Write-ahead journal state, NULL if disabled
+ *
+ * @event_fd: eventfd of TM_QUEUE_OPTION_EVENTFD, -1 otherwise
+ *
+ * @event_state: TM_QUEUE_EVENT_*, only the push which move it out of idle
+ *		 write @event_fd
+ *
+ * @arena: Node arena of TM_QUEUE_OPTION_COMPACT or TM_QUEUE_OPTION_MPSC,
+ *	   NULL otherwise
+ *
+ * @compact_head: Head reference of TM_QUEUE_OPTION_COMPACT, 0 if empty
+ *
+ * @compact_tail: Tail reference of TM_QUEUE_OPTION_COMPACT, 0 if empty
+ *
+ * @mpsc_key: Thread specific storage of tm_queue_mpsc_cache_t
+ *
+ * @mpsc_cache: All producer caches, protected by attribute->lock
+ *
+ * @mpsc_head: Stub node reference of TM_QUEUE_OPTION_MPSC queue, its next
+ *	       node is the first element, only touched by consumer
+ *
+ * @mpsc_spare: Stubs freed by consumer, linked and ended by 0
+ *
+ * @mpsc_spare_last: Last node of @mpsc_spare
+ *
+ * @mpsc_spare_number: Number of nodes in @mpsc_spare
+ *
+ * @mpsc_batch: Batches for producers, 0 if empty. Only consumer fill an
+ *		empty one, producers exchange it back to 0
+ *
+ * @mpsc_tail: Last node reference of TM_QUEUE_OPTION_MPSC queue, exchanged
+ *	       by producers, keep it away from consumer's cache line
  * */
 typedef struct tm_queue_priv_s {
 	tm_queue_attribute_t *attribute;
 	tm_queue_item_t *head;
 	tm_queue_item_t *tail;
+	unsigned long count;
+	unsigned long capacity;
+	unsigned long waiters;
+	tm_queue_spill_t *spill;
+	tm_queue_journal_t *journal;
+	int event_fd;
+	atomic_int event_state;
+	tm_arena_t *arena;
+	uint32_t compact_head;
+	uint32_t compact_tail;
+	tss_t mpsc_key;
+	tm_queue_mpsc_cache_t *mpsc_cache;
+	uint32_t mpsc_head;
+	uint32_t mpsc_spare;
+	uint32_t mpsc_spare_last;
+	unsigned int mpsc_spare_number;
+	_Alignas(64) _Atomic(uint32_t) mpsc_batch[TM_QUEUE_MPSC_SLOTS];
+	_Alignas(64) _Atomic(uint32_t) mpsc_tail;
 } tm_queue_priv_t;
 
 
-static int tm_queue_internal_get_option(tm_queue_priv_t **priv,
-					unsigned long *option)
-{
-	if (NULL == option) {
-		return -1;
+static int tm_queue_internal_get_option(tm_queue_priv_t **priv,
+					unsigned long *option)
+{
+	if (NULL == option) {
+		return -1;
+	}
+
+	*option = (*priv)->attribute->option;
+
+	return 0;
+}
+
+static int tm_queue_internal_set_option(tm_queue_priv_t **priv,
+					unsigned long option)
+{
+	if (option >= TM_QUEUE_OPTION_MAX) {
+		return -1;
+	}
+
+	/* Layout of MPSC queue is different, can not switch on the fly */
+	if ((option ^ (*priv)->attribute->option) &
+	    (TM_QUEUE_OPTION_MPSC | TM_QUEUE_OPTION_EVENTFD |
+	     TM_QUEUE_OPTION_COMPACT)) {
+		return -1;
+	}
+
+	(*priv)->attribute->option = option;
+
+	return 0;
+}
+
+/* Queue may turn non-empty, only the first push since last reset write */
+static void tm_queue_internal_event_notify(tm_queue_priv_t **priv)
+{
+	int state = TM_QUEUE_EVENT_IDLE;
+
+	if (-1 == (*priv)->event_fd) {
+		return;
+	}
+
+	if (atomic_compare_exchange_strong(&(*priv)->event_state, &state,
+					   TM_QUEUE_EVENT_WRITING)) {
+		eventfd_write((*priv)->event_fd, 1);
+		atomic_store(&(*priv)->event_state, TM_QUEUE_EVENT_READY);
+	}
+}
+
+/*
+ * Caller should hold attribute->lock and find queue empty. Drain eventfd
+ * before going idle, so only a push after this can write it again. A push
+ * still writing is left alone, next empty pop reset it.
+ * */
+static void tm_queue_internal_event_reset(tm_queue_priv_t **priv)
+{
+	eventfd_t value;
+
+	if (-1 == (*priv)->event_fd || 0 != (*priv)->count ||
+	    (NULL != (*priv)->spill && 0 != (*priv)->spill->count)) {
+		return;
+	}
+
+	if (TM_QUEUE_EVENT_READY == atomic_load(&(*priv)->event_state)) {
+		eventfd_read((*priv)->event_fd, &value);
+		atomic_store(&(*priv)->event_state, TM_QUEUE_EVENT_IDLE);
+	}
+}
+
+/* Destructor of producer cache, called when thread exit */
+static void tm_queue_internal_mpsc_cache_release(void *arg)
+{
+	uint32_t last;
+	uint32_t next;
+	tm_queue_mpsc_cache_t *cache = arg;
+	tm_queue_priv_t *priv = cache->priv;
+
+	if (0 != cache->first) {
+		last = cache->first;
+		while (0 != (next = atomic_load_explicit(
+					tm_arena_link(priv->arena, last),
+					memory_order_relaxed))) {
+			last = next;
+		}
+
+		tm_arena_release(priv->arena, cache->first, last);
+	}
+
+	mtx_lock(&priv->attribute->lock);
+
+	if (NULL != cache->prev) {
+		cache->prev->next = cache->next;
+	} else {
+		priv->mpsc_cache = cache->next;
+	}
+
+	if (NULL != cache->next) {
+		cache->next->prev = cache->prev;
+	}
+
+	mtx_unlock(&priv->attribute->lock);
+
+	free(cache);
+}
+
+static tm_queue_mpsc_cache_t *tm_queue_internal_mpsc_cache(
+					tm_queue_priv_t *priv)
+{
+	tm_queue_mpsc_cache_t *cache;
+
+	cache = tss_get(priv->mpsc_key);
+	if (NULL != cache) {
+		return cache;
+	}
+
+	/* First push of this thread */
+	cache = (tm_queue_mpsc_cache_t*)malloc(sizeof(tm_queue_mpsc_cache_t));
+	if (NULL == cache) {
+		return NULL;
+	}
+
+	cache->priv = priv;
+	cache->prev = NULL;
+	cache->first = 0;
+
+	if (thrd_success != tss_set(priv->mpsc_key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	mtx_lock(&priv->attribute->lock);
+
+	cache->next = priv->mpsc_cache;
+	if (NULL != priv->mpsc_cache) {
+		priv->mpsc_cache->prev = cache;
+	}
+	priv->mpsc_cache = cache;
+
+	mtx_unlock(&priv->attribute->lock);
+
+	return cache;
+}
+
+/* Take a batch freed by consumer, or all free nodes of arena if none */
+static int tm_queue_internal_mpsc_refill(tm_queue_priv_t *priv,
+					 tm_queue_mpsc_cache_t *cache)
+{
+	unsigned int i;
+	uint32_t first;
+
+	for (i = 0; i < TM_QUEUE_MPSC_SLOTS; i++) {
+		if (0 == atomic_load_explicit(&priv->mpsc_batch[i],
+					      memory_order_relaxed)) {
+			continue;
+		}
+
+		first = atomic_exchange_explicit(&priv->mpsc_batch[i], 0,
+						 memory_order_acquire);
+		if (0 != first) {
+			cache->first = first;
+			return 0;
+		}
+	}
+
+	return tm_arena_take(priv->arena, &cache->first);
+}
+
+/*
+ * Consumer keep freed stubs to itself. A full batch is stored into an empty
+ * slot, only consumer fill slots so no read-modify-write is needed, or goes
+ * back to arena when producers are not taking them.
+ * */
+static void tm_queue_internal_mpsc_recycle(tm_queue_priv_t *priv,
+					   uint32_t stub)
+{
+	unsigned int i;
+
+	atomic_store_explicit(tm_arena_link(priv->arena, stub),
+			      priv->mpsc_spare, memory_order_relaxed);
+	if (0 == priv->mpsc_spare) {
+		priv->mpsc_spare_last = stub;
+	}
+	priv->mpsc_spare = stub;
+
+	if (++priv->mpsc_spare_number < TM_QUEUE_MPSC_BATCH) {
+		return;
+	}
+
+	for (i = 0; i < TM_QUEUE_MPSC_SLOTS; i++) {
+		if (0 == atomic_load_explicit(&priv->mpsc_batch[i],
+					      memory_order_relaxed)) {
+			atomic_store_explicit(&priv->mpsc_batch[i],
+					      priv->mpsc_spare,
+					      memory_order_release);
+			break;
+		}
+	}
+
+	if (TM_QUEUE_MPSC_SLOTS == i) {
+		tm_arena_release(priv->arena, priv->mpsc_spare,
+				 priv->mpsc_spare_last);
+	}
+
+	priv->mpsc_spare = 0;
+	priv->mpsc_spare_number = 0;
+}
+
+/*
+ * Vyukov's MPSC queue, producers only do one atomic exchange on tail and
+ * then link the previous tail to the new node. Nodes come from a per thread
+ * cache, refilled by a batch of nodes the consumer freed.
+ * */
+static int tm_queue_internal_mpsc_push(tm_queue_priv_t **priv, void *data)
+{
+	uint32_t reference;
+	uint32_t prev;
+	tm_arena_t *arena = (*priv)->arena;
+	tm_queue_mpsc_cache_t *cache;
+
+	cache = tm_queue_internal_mpsc_cache(*priv);
+	if (NULL == cache) {
+		return -1;
+	}
+
+	if (0 == cache->first &&
+	    0 != tm_queue_internal_mpsc_refill(*priv, cache)) {
+		return -1;
+	}
+
+	reference = cache->first;
+	cache->first = atomic_load_explicit(tm_arena_link(arena, reference),
+					    memory_order_relaxed);
+
+	/* Save data, no next node */
+	*tm_arena_item(arena, reference) = data;
+	atomic_store_explicit(tm_arena_link(arena, reference), 0,
+			      memory_order_relaxed);
+
+	/* Serialization point of producers */
+	prev = atomic_exchange_explicit(&(*priv)->mpsc_tail, reference,
+					memory_order_acq_rel);
+
+	/* Publish node to consumer */
+	atomic_store_explicit(tm_arena_link(arena, prev), reference,
+			      memory_order_release);
+
+	return 0;
+}
+
+/*
+ * Only one consumer, no atomic read-modify-write here. The first element
+ * become the new stub and the old stub is recycled.
+ * */
+static int tm_queue_internal_mpsc_pop(tm_queue_priv_t **priv, void **data)
+{
+	uint32_t stub;
+	uint32_t next;
+	tm_arena_t *arena = (*priv)->arena;
+
+	stub = (*priv)->mpsc_head;
+
+	next = atomic_load_explicit(tm_arena_link(arena, stub),
+				    memory_order_acquire);
+
+	/* Queue empty, or producer have not linked its node yet */
+	if (0 == next) {
+		return -1;
+	}
+
+	if (NULL != data) {
+		*data = *tm_arena_item(arena, next);
+	}
+
+	(*priv)->mpsc_head = next;
+
+	tm_queue_internal_mpsc_recycle(*priv, stub);
+
+	return 0;
+}
+
+static tm_queue_spill_segment_t *tm_queue_internal_spill_segment(
+					tm_queue_spill_t *spill)
+{
+	char *path;
+	tm_queue_spill_segment_t *segment;
+
+	segment = (tm_queue_spill_segment_t*)malloc(
+					sizeof(tm_queue_spill_segment_t));
+	if (NULL == segment) {
+		return NULL;
+	}
+
+	path = (char*)malloc(strlen(spill->directory) +
+			     sizeof("/tm_queue_XXXXXX"));
+	if (NULL == path) {
+		free(segment);
+		return NULL;
+	}
+
+	strcpy(path, spill->directory);
+	strcat(path, "/tm_queue_XXXXXX");
+
+	segment->fd = mkstemp(path);
+	if (-1 == segment->fd) {
+		free(path);
+		free(segment);
+		return NULL;
+	}
+
+	/* Nobody else need it, space is released when closed */
+	unlink(path);
+	free(path);
+
+	if (0 != ftruncate(segment->fd, TM_QUEUE_SPILL_SEGMENT_SIZE)) {
+		close(segment->fd);
+		free(segment);
+		return NULL;
+	}
+
+	segment->base = mmap(NULL, TM_QUEUE_SPILL_SEGMENT_SIZE,
+			     PROT_READ | PROT_WRITE, MAP_SHARED,
+			     segment->fd, 0);
+	if (MAP_FAILED == segment->base) {
+		close(segment->fd);
+		free(segment);
+		return NULL;
+	}
+
+	madvise(segment->base, TM_QUEUE_SPILL_SEGMENT_SIZE, MADV_SEQUENTIAL);
+
+	segment->write = 0;
+	segment->read = 0;
+	segment->next = NULL;
+
+	return segment;
+}
+
+static void tm_queue_internal_spill_segment_destroy(
+					tm_queue_spill_segment_t *segment)
+{
+	munmap(segment->base, TM_QUEUE_SPILL_SEGMENT_SIZE);
+	close(segment->fd);
+	free(segment);
+}
+
+/* Caller should hold attribute->lock */
+static int tm_queue_internal_spill_push(tm_queue_spill_t *spill, void *data)
+{
+	char *buf;
+	unsigned long size;
+	unsigned long length;
+	tm_queue_spill_segment_t *segment;
+
+	while (true) {
+		segment = spill->tail;
+
+		if (NULL != segment) {
+			buf = segment->base + segment->write + sizeof(uint32_t);
+			size = TM_QUEUE_SPILL_SEGMENT_SIZE - segment->write -
+			       sizeof(uint32_t);
+
+			if (segment->write + sizeof(uint32_t) >
+			    TM_QUEUE_SPILL_SEGMENT_SIZE) {
+				size = 0;
+			}
+
+			length = 0 == size ? (unsigned long)-1 :
+					     spill->codec.encode(data, buf, size);
+			if (length <= size) {
+				break;
+			}
+
+			/* Element bigger than an empty segment */
+			if (0 == segment->write) {
+				return -1;
+			}
+		}
+
+		/* Current segment is full, start a new one */
+		segment = tm_queue_internal_spill_segment(spill);
+		if (NULL == segment) {
+			return -1;
+		}
+
+		if (NULL == spill->tail) {
+			spill->head = segment;
+		} else {
+			spill->tail->next = segment;
+		}
+		spill->tail = segment;
+	}
+
+	*(uint32_t*)(segment->base + segment->write) = length;
+
+	segment->write += (sizeof(uint32_t) + length + TM_QUEUE_SPILL_ALIGN - 1) &
+			  ~(TM_QUEUE_SPILL_ALIGN - 1);
+
+	spill->count++;
+
+	if (NULL != spill->codec.release) {
+		spill->codec.release(data);
+	}
+
+	return 0;
+}
+
+/* Caller should hold attribute->lock and make sure spill->count != 0 */
+static int tm_queue_internal_spill_pop(tm_queue_spill_t *spill, void **data)
+{
+	int ret;
+	uint32_t length;
+	void *element = NULL;
+	tm_queue_spill_segment_t *segment;
+
+	/* Drained segments are released right away, head is never empty */
+	segment = spill->head;
+
+	length = *(uint32_t*)(segment->base + segment->read);
+
+	ret = spill->codec.decode(segment->base + segment->read +
+				  sizeof(uint32_t), length, &element);
+
+	/* A broken element is dropped, it can not be read again anyway */
+	segment->read += (sizeof(uint32_t) + length + TM_QUEUE_SPILL_ALIGN - 1) &
+			 ~(TM_QUEUE_SPILL_ALIGN - 1);
+
+	spill->count--;
+
+	if (segment->read == segment->write) {
+		if (segment == spill->tail) {
+			/* Reuse the last segment from the beginning */
+			segment->read = 0;
+			segment->write = 0;
+			madvise(segment->base, TM_QUEUE_SPILL_SEGMENT_SIZE,
+				MADV_REMOVE);
+		} else {
+			spill->head = segment->next;
+			tm_queue_internal_spill_segment_destroy(segment);
+		}
+	}
+
+	if (0 != ret) {
+		return -1;
+	}
+
+	if (NULL != data) {
+		*data = element;
+	}
+
+	return 0;
+}
+
+static void tm_queue_internal_spill_destroy(tm_queue_spill_t *spill)
+{
+	tm_queue_spill_segment_t *segment;
+
+	while (NULL != spill->head) {
+		segment = spill->head;
+		spill->head = segment->next;
+		tm_queue_internal_spill_segment_destroy(segment);
+	}
+
+	free(spill->directory);
+	free(spill);
+}
+
+static int tm_queue_internal_set_spill(tm_queue_priv_t **priv,
+				       const char *directory,
+				       unsigned long threshold,
+				       const tm_queue_codec_t *codec)
+{
+	int ret = 0;
+	tm_queue_spill_t *spill = NULL;
+
+	if ((*priv)->attribute->option &
+	    (TM_QUEUE_OPTION_MPSC | TM_QUEUE_OPTION_COMPACT) ||
+	    0 != (*priv)->capacity) {
+		return -1;
+	}
+
+	if (NULL != directory) {
+		if (NULL == codec || NULL == codec->encode ||
+		    NULL == codec->decode) {
+			return -1;
+		}
+
+		spill = (tm_queue_spill_t*)malloc(sizeof(tm_queue_spill_t));
+		if (NULL == spill) {
+			return -1;
+		}
+
+		spill->directory = strdup(directory);
+		if (NULL == spill->directory) {
+			free(spill);
+			return -1;
+		}
+
+		spill->threshold = threshold;
+		spill->codec = *codec;
+		spill->head = NULL;
+		spill->tail = NULL;
+		spill->count = 0;
+	}
+
+	mtx_lock(&(*priv)->attribute->lock);
+
+	if (NULL != (*priv)->spill && 0 != (*priv)->spill->count) {
+		/* Elements on disk need the old codec and files */
+		ret = -1;
+	} else if (NULL != (*priv)->journal && NULL != spill) {
+		ret = -1;
+	} else {
+		if (NULL != (*priv)->spill) {
+			tm_queue_internal_spill_destroy((*priv)->spill);
+		}
+		(*priv)->spill = spill;
+		spill = NULL;
+	}
+
+	mtx_unlock(&(*priv)->attribute->lock);
+
+	if (NULL != spill) {
+		free(spill->directory);
+		free(spill);
+	}
+
+	return ret;
+}
+
+static uint64_t tm_queue_internal_journal_checksum(uint64_t hash,
+						   const void *data,
+						   unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= ((const unsigned char*)data)[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static uint64_t tm_queue_internal_journal_record_checksum(
+					const tm_queue_journal_record_t *record)
+{
+	uint64_t hash;
+
+	hash = tm_queue_internal_journal_checksum(0xcbf29ce484222325ull, record,
+					offsetof(tm_queue_journal_record_t,
+						 checksum));
+
+	return tm_queue_internal_journal_checksum(hash, record + 1,
+						  record->length);
+}
+
+/*
+ * Append one record to @buffer, buffer grows until encoded element fits.
+ * */
+static int tm_queue_internal_journal_encode(tm_queue_journal_buffer_t *buffer,
+					    const tm_queue_codec_t *codec,
+					    uint32_t type, uint64_t lsn,
+					    void *data)
+{
+	char *base;
+	unsigned long size;
+	unsigned long need;
+	unsigned long length = 0;
+	tm_queue_journal_record_t *record;
+
+	while (true) {
+		size = buffer->size - buffer->used;
+
+		if (size >= sizeof(tm_queue_journal_record_t)) {
+			if (TM_QUEUE_JOURNAL_RECORD_PUSH == type) {
+				length = codec->encode(data, buffer->base +
+					buffer->used +
+					sizeof(tm_queue_journal_record_t),
+					size - sizeof(tm_queue_journal_record_t));
+			}
+
+			need = (sizeof(tm_queue_journal_record_t) + length +
+				TM_QUEUE_JOURNAL_ALIGN - 1) &
+			       ~(TM_QUEUE_JOURNAL_ALIGN - 1);
+			if (need <= size) {
+				break;
+			}
+		} else {
+			need = sizeof(tm_queue_journal_record_t) + 256;
+		}
+
+		if (length > UINT32_MAX) {
+			return -1;
+		}
+
+		size = buffer->size * 2;
+		if (size < buffer->used + need) {
+			size = buffer->used + need;
+		}
+
+		base = (char*)realloc(buffer->base, size);
+		if (NULL == base) {
+			return -1;
+		}
+
+		buffer->base = base;
+		buffer->size = size;
+	}
+
+	record = (tm_queue_journal_record_t*)(buffer->base + buffer->used);
+	record->type = type;
+	record->length = length;
+	record->lsn = lsn;
+	record->checksum = tm_queue_internal_journal_record_checksum(record);
+
+	/* Keep padding bytes stable on disk */
+	memset((char*)(record + 1) + length, 0,
+	       need - sizeof(tm_queue_journal_record_t) - length);
+
+	buffer->used += need;
+
+	return 0;
+}
+
+/*
+ * Length of a valid record at @offset, 0 if it is torn or broken.
+ * */
+static unsigned long tm_queue_internal_journal_record(const char *base,
+						      unsigned long offset,
+						      unsigned long size)
+{
+	unsigned long length;
+	const tm_queue_journal_record_t *record;
+
+	if (size - offset < sizeof(tm_queue_journal_record_t)) {
+		return 0;
+	}
+
+	record = (const tm_queue_journal_record_t*)(base + offset);
+
+	if (TM_QUEUE_JOURNAL_RECORD_PUSH != record->type &&
+	    TM_QUEUE_JOURNAL_RECORD_POP != record->type) {
+		return 0;
+	}
+
+	length = (sizeof(tm_queue_journal_record_t) + record->length +
+		  TM_QUEUE_JOURNAL_ALIGN - 1) & ~(TM_QUEUE_JOURNAL_ALIGN - 1);
+	if (length > size - offset) {
+		return 0;
+	}
+
+	if (record->checksum !=
+	    tm_queue_internal_journal_record_checksum(record)) {
+		return 0;
+	}
+
+	return length;
+}
+
+static int tm_queue_internal_journal_write(int fd, const char *buf,
+					   unsigned long size)
+{
+	ssize_t ret;
+
+	while (0 != size) {
+		ret = write(fd, buf, size);
+		if (-1 == ret) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+
+		buf += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Caller should hold journal->lock and make sure nobody is flushing, lock is
+ * released while writing.
+ * */
+static int tm_queue_internal_journal_flush(tm_queue_journal_t *journal)
+{
+	int ret;
+	uint64_t lsn;
+	tm_queue_journal_buffer_t buffer;
+
+	/* Journal is broken, a gap would make later records useless */
+	if (0 != journal->error) {
+		journal->buffer.used = 0;
+		journal->pending = 0;
+		return -1;
+	}
+
+	if (0 == journal->buffer.used) {
+		return 0;
+	}
+
+	lsn = journal->lsn;
+
+	/* Operations go on with the spare buffer */
+	buffer = journal->buffer;
+	journal->buffer = journal->spare;
+	journal->buffer.used = 0;
+	journal->pending = 0;
+	journal->flushing = true;
+
+	mtx_unlock(&journal->lock);
+
+	ret = tm_queue_internal_journal_write(journal->fd, buffer.base,
+					      buffer.used);
+	if (0 == ret) {
+		ret = fdatasync(journal->fd);
+	}
+
+	mtx_lock(&journal->lock);
+
+	journal->spare = buffer;
+	journal->flushing = false;
+
+	if (0 == ret) {
+		journal->synced = lsn;
+		journal->size += buffer.used;
+	} else {
+		journal->error = -1;
+	}
+
+	cnd_broadcast(&journal->cond);
+
+	return journal->error;
+}
+
+/* Caller should hold journal->lock */
+static bool tm_queue_internal_journal_need_compact(tm_queue_journal_t *journal)
+{
+	return 0 == journal->error &&
+	       journal->size >= TM_QUEUE_JOURNAL_COMPACT_SIZE &&
+	       journal->size >= 2 * journal->snapshot_size;
+}
+
+/*
+ * Write all elements in memory into a new snapshot, and then journal can be
+ * truncated. Elements are only encoded under attribute->lock, snapshot is
+ * written without any lock, flush is held off meanwhile so nothing newer
+ * than snapshot reach journal before truncate. Records still in buffer are
+ * written after it and skipped by sequence number on replay, a crash before
+ * truncate is fine the same way.
+ * */
+static int tm_queue_internal_journal_compact(tm_queue_priv_t **priv,
+					     bool force)
+{
+	int fd;
+	int ret = 0;
+	tm_queue_item_t *item;
+	tm_queue_journal_t *journal;
+	tm_queue_journal_snapshot_t *snapshot;
+	tm_queue_journal_buffer_t buffer = { NULL, 0, 0 };
+
+	mtx_lock(&(*priv)->attribute->lock);
+
+	journal = (*priv)->journal;
+	if (NULL == journal) {
+		mtx_unlock(&(*priv)->attribute->lock);
+		return -1;
+	}
+
+	mtx_lock(&journal->lock);
+
+	while (journal->flushing) {
+		cnd_wait(&journal->cond, &journal->lock);
+	}
+
+	/* Someone else did it */
+	if (!force && !tm_queue_internal_journal_need_compact(journal)) {
+		mtx_unlock(&journal->lock);
+		mtx_unlock(&(*priv)->attribute->lock);
+		return 0;
+	}
+
+	buffer.base = (char*)malloc(sizeof(tm_queue_journal_snapshot_t));
+	if (NULL == buffer.base) {
+		mtx_unlock(&journal->lock);
+		mtx_unlock(&(*priv)->attribute->lock);
+		return -1;
+	}
+	buffer.size = sizeof(tm_queue_journal_snapshot_t);
+	buffer.used = sizeof(tm_queue_journal_snapshot_t);
+
+	snapshot = (tm_queue_journal_snapshot_t*)buffer.base;
+	snapshot->magic = TM_QUEUE_JOURNAL_MAGIC;
+	snapshot->lsn = journal->lsn;
+	snapshot->count = (*priv)->count;
+	snapshot->checksum = tm_queue_internal_journal_checksum(
+				0xcbf29ce484222325ull, snapshot,
+				offsetof(tm_queue_journal_snapshot_t, checksum));
+
+	for (item = (*priv)->head; NULL != item; item = item->next) {
+		if (0 != tm_queue_internal_journal_encode(&buffer,
+					&journal->codec,
+					TM_QUEUE_JOURNAL_RECORD_PUSH, 0,
+					item->item)) {
+			mtx_unlock(&journal->lock);
+			mtx_unlock(&(*priv)->attribute->lock);
+			free(buffer.base);
+			return -1;
+		}
+	}
+
+	journal->flushing = true;
+
+	mtx_unlock(&journal->lock);
+	mtx_unlock(&(*priv)->attribute->lock);
+
+	fd = openat(journal->dirfd, "snapshot.tmp",
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == fd ||
+	    0 != tm_queue_internal_journal_write(fd, buffer.base,
+						 buffer.used) ||
+	    0 != fdatasync(fd) ||
+	    0 != renameat(journal->dirfd, "snapshot.tmp",
+			  journal->dirfd, "snapshot") ||
+	    0 != fsync(journal->dirfd)) {
+		ret = -1;
+	}
+
+	if (-1 != fd) {
+		close(fd);
+	}
+
+	mtx_lock(&journal->lock);
+
+	/* Snapshot is in place, journal is not needed any more */
+	if (0 == ret) {
+		journal->snapshot_size = buffer.used;
+		if (0 == ftruncate(journal->fd, 0)) {
+			journal->size = 0;
+		}
+	}
+
+	journal->flushing = false;
+	cnd_broadcast(&journal->cond);
+
+	mtx_unlock(&journal->lock);
+
+	free(buffer.base);
+
+	return ret;
+}
+
+/*
+ * Called after attribute->lock is released, wait or flush according to
+ * journal->sync.
+ * */
+static int tm_queue_internal_journal_commit(tm_queue_journal_t *journal,
+					    uint64_t lsn)
+{
+	int ret;
+
+	mtx_lock(&journal->lock);
+
+	switch (journal->sync) {
+	case TM_QUEUE_JOURNAL_SYNC_OPERATION:
+		/* Group commit, one flush for everyone waiting */
+		while (0 == journal->error && journal->synced < lsn) {
+			if (journal->flushing) {
+				cnd_wait(&journal->cond, &journal->lock);
+			} else {
+				tm_queue_internal_journal_flush(journal);
+			}
+		}
+		break;
+	case TM_QUEUE_JOURNAL_SYNC_BATCH:
+		if (!journal->flushing &&
+		    journal->pending >= journal->interval) {
+			tm_queue_internal_journal_flush(journal);
+		}
+		break;
+	default:
+		/* Flusher thread do it */
+		break;
+	}
+
+	ret = journal->error;
+
+	/* Flusher thread of TM_QUEUE_JOURNAL_SYNC_TIME check it itself */
+	if (TM_QUEUE_JOURNAL_SYNC_TIME != journal->sync &&
+	    tm_queue_internal_journal_need_compact(journal)) {
+		cnd_signal(&journal->wake);
+	}
+
+	mtx_unlock(&journal->lock);
+
+	return ret;
+}
+
+/* Caller should hold attribute->lock */
+static int tm_queue_internal_journal_append(tm_queue_journal_t *journal,
+					    uint32_t type, void *data,
+					    uint64_t *lsn)
+{
+	int ret;
+
+	mtx_lock(&journal->lock);
+
+	ret = tm_queue_internal_journal_encode(&journal->buffer,
+					       &journal->codec, type,
+					       journal->lsn + 1, data);
+	if (0 == ret) {
+		*lsn = ++journal->lsn;
+		journal->pending++;
+	}
+
+	mtx_unlock(&journal->lock);
+
+	return ret;
+}
+
+static int tm_queue_internal_journal_flusher(void *arg)
+{
+	tm_queue_priv_t *priv = (tm_queue_priv_t*)arg;
+	tm_queue_journal_t *journal = priv->journal;
+	struct timespec deadline;
+	bool compact;
+
+	mtx_lock(&journal->lock);
+
+	while (!journal->shutdown) {
+		if (TM_QUEUE_JOURNAL_SYNC_TIME != journal->sync) {
+			cnd_wait(&journal->wake, &journal->lock);
+		} else {
+			timespec_get(&deadline, TIME_UTC);
+			deadline.tv_sec += journal->interval / 1000;
+			deadline.tv_nsec += (journal->interval % 1000) *
+					    1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			while (!journal->shutdown &&
+			       thrd_timedout != cnd_timedwait(&journal->wake,
+							&journal->lock,
+							&deadline));
+
+			if (!journal->flushing) {
+				tm_queue_internal_journal_flush(journal);
+			}
+		}
+
+		if (journal->shutdown) {
+			break;
+		}
+
+		compact = tm_queue_internal_journal_need_compact(journal);
+		if (compact) {
+			mtx_unlock(&journal->lock);
+			tm_queue_internal_journal_compact(&priv, false);
+			mtx_lock(&journal->lock);
+		}
+	}
+
+	mtx_unlock(&journal->lock);
+
+	return 0;
+}
+
+/* Append one element in memory without journal */
+static int tm_queue_internal_journal_restore(tm_queue_priv_t **priv,
+					     void *data)
+{
+	tm_queue_item_t *item;
+
+	item = (tm_queue_item_t*)malloc(sizeof(tm_queue_item_t));
+	if (NULL == item) {
+		return -1;
+	}
+
+	item->item = data;
+	item->next = NULL;
+
+	if (NULL == (*priv)->tail) {
+		(*priv)->head = item;
+	} else {
+		(*priv)->tail->next = item;
+	}
+	(*priv)->tail = item;
+	(*priv)->count++;
+
+	return 0;
+}
+
+/* Drop first element in memory without journal */
+static int tm_queue_internal_journal_drop(tm_queue_priv_t **priv,
+					  tm_queue_journal_t *journal)
+{
+	tm_queue_item_t *item;
+
+	item = (*priv)->head;
+	if (NULL == item) {
+		return -1;
+	}
+
+	(*priv)->head = item->next;
+	if (NULL == (*priv)->head) {
+		(*priv)->tail = NULL;
+	}
+	(*priv)->count--;
+
+	if (NULL != journal->codec.release) {
+		journal->codec.release(item->item);
+	}
+	free(item);
+
+	return 0;
+}
+
+/*
+ * Map a file read only, *base is NULL for an empty or missing file.
+ * */
+static int tm_queue_internal_journal_map(int fd, char **base,
+					 unsigned long *size)
+{
+	struct stat st;
+
+	*base = NULL;
+	*size = 0;
+
+	if (-1 == fd) {
+		return 0;
+	}
+
+	if (0 != fstat(fd, &st)) {
+		return -1;
+	}
+
+	if (0 == st.st_size) {
+		return 0;
+	}
+
+	*base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == *base) {
+		*base = NULL;
+		return -1;
+	}
+
+	madvise(*base, st.st_size, MADV_SEQUENTIAL);
+
+	*size = st.st_size;
+
+	return 0;
+}
+
+/*
+ * Load snapshot and then replay journal on top of it, queue is empty and
+ * nobody else can see the journal yet.
+ * */
+static int tm_queue_internal_journal_replay(tm_queue_priv_t **priv,
+					    tm_queue_journal_t *journal)
+{
+	int fd;
+	int ret = 0;
+	char *base;
+	void *data;
+	uint64_t count = 0;
+	unsigned long size;
+	unsigned long offset;
+	unsigned long length;
+	tm_queue_journal_record_t *record;
+	tm_queue_journal_snapshot_t *snapshot;
+
+	fd = openat(journal->dirfd, "snapshot", O_RDONLY | O_CLOEXEC);
+	if (-1 == fd && ENOENT != errno) {
+		return -1;
+	}
+
+	ret = tm_queue_internal_journal_map(fd, &base, &size);
+	if (-1 != fd) {
+		close(fd);
+	}
+	if (0 != ret) {
+		return -1;
+	}
+
+	if (NULL != base) {
+		snapshot = (tm_queue_journal_snapshot_t*)base;
+
+		/* Snapshot is renamed into place, it must be complete */
+		if (size < sizeof(tm_queue_journal_snapshot_t) ||
+		    TM_QUEUE_JOURNAL_MAGIC != snapshot->magic ||
+		    snapshot->checksum != tm_queue_internal_journal_checksum(
+				0xcbf29ce484222325ull, snapshot,
+				offsetof(tm_queue_journal_snapshot_t,
+					 checksum))) {
+			munmap(base, size);
+			return -1;
+		}
+
+		journal->lsn = snapshot->lsn;
+
+		for (offset = sizeof(tm_queue_journal_snapshot_t);
+		     count < snapshot->count; offset += length, count++) {
+			length = tm_queue_internal_journal_record(base, offset,
+								  size);
+			if (0 == length || TM_QUEUE_JOURNAL_RECORD_PUSH !=
+			    ((tm_queue_journal_record_t*)(base + offset))->type) {
+				ret = -1;
+				break;
+			}
+
+			record = (tm_queue_journal_record_t*)(base + offset);
+
+			data = NULL;
+			if (0 != journal->codec.decode(record + 1,
+						       record->length, &data) ||
+			    0 != tm_queue_internal_journal_restore(priv, data)) {
+				ret = -1;
+				break;
+			}
+		}
+
+		journal->snapshot_size = size;
+		munmap(base, size);
+
+		if (0 != ret) {
+			return -1;
+		}
+	}
+
+	if (0 != tm_queue_internal_journal_map(journal->fd, &base, &size)) {
+		return -1;
+	}
+
+	for (offset = 0; NULL != base; offset += length) {
+		length = tm_queue_internal_journal_record(base, offset, size);
+		if (0 == length) {
+			break;
+		}
+
+		record = (tm_queue_journal_record_t*)(base + offset);
+
+		/* Already in snapshot, compaction crashed before truncate */
+		if (record->lsn <= journal->lsn) {
+			continue;
+		}
+
+		if (record->lsn != journal->lsn + 1) {
+			break;
+		}
+
+		if (TM_QUEUE_JOURNAL_RECORD_PUSH == record->type) {
+			data = NULL;
+			ret = journal->codec.decode(record + 1, record->length,
+						    &data);
+			if (0 == ret) {
+				ret = tm_queue_internal_journal_restore(priv,
+									data);
+			}
+		} else {
+			ret = tm_queue_internal_journal_drop(priv, journal);
+		}
+
+		if (0 != ret) {
+			munmap(base, size);
+			return -1;
+		}
+
+		journal->lsn = record->lsn;
+	}
+
+	if (NULL != base) {
+		munmap(base, size);
+	}
+
+	/* Cut off torn tail, new records follow the last good one */
+	if (offset != size) {
+		if (0 != ftruncate(journal->fd, offset) ||
+		    0 != fdatasync(journal->fd)) {
+			return -1;
+		}
+	}
+
+	journal->size = offset;
+	journal->synced = journal->lsn;
+
+	return 0;
+}
+
+static void tm_queue_internal_journal_destroy(tm_queue_journal_t *journal)
+{
+	mtx_lock(&journal->lock);
+	journal->shutdown = true;
+	cnd_signal(&journal->wake);
+	mtx_unlock(&journal->lock);
+
+	thrd_join(journal->flusher, NULL);
+
+	mtx_lock(&journal->lock);
+
+	while (journal->flushing) {
+		cnd_wait(&journal->cond, &journal->lock);
+	}
+
+	tm_queue_internal_journal_flush(journal);
+
+	mtx_unlock(&journal->lock);
+
+	close(journal->fd);
+	close(journal->dirfd);
+
+	free(journal->buffer.base);
+	free(journal->spare.base);
+
+	cnd_destroy(&journal->wake);
+	cnd_destroy(&journal->cond);
+	mtx_destroy(&journal->lock);
+
+	free(journal);
+}
+
+static int tm_queue_internal_set_journal(tm_queue_priv_t **priv,
+					 const char *directory,
+					 unsigned long sync,
+					 unsigned long interval,
+					 const tm_queue_codec_t *codec)
+{
+	tm_queue_journal_t *journal;
+
+	if ((*priv)->attribute->option &
+	    (TM_QUEUE_OPTION_MPSC | TM_QUEUE_OPTION_COMPACT)) {
+		return -1;
+	}
+
+	if (NULL == directory) {
+		mtx_lock(&(*priv)->attribute->lock);
+		journal = (*priv)->journal;
+		(*priv)->journal = NULL;
+		mtx_unlock(&(*priv)->attribute->lock);
+
+		if (NULL == journal) {
+			return -1;
+		}
+
+		tm_queue_internal_journal_destroy(journal);
+
+		return 0;
+	}
+
+	if (sync >= TM_QUEUE_JOURNAL_SYNC_MAX || NULL == codec ||
+	    NULL == codec->encode || NULL == codec->decode) {
+		return -1;
+	}
+
+	if (TM_QUEUE_JOURNAL_SYNC_OPERATION != sync && 0 == interval) {
+		return -1;
+	}
+
+	journal = (tm_queue_journal_t*)calloc(1, sizeof(tm_queue_journal_t));
+	if (NULL == journal) {
+		return -1;
+	}
+
+	journal->sync = sync;
+	journal->interval = interval;
+	journal->codec = *codec;
+
+	if (0 != mkdir(directory, 0755) && EEXIST != errno) {
+		free(journal);
+		return -1;
+	}
+
+	journal->dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (-1 == journal->dirfd) {
+		free(journal);
+		return -1;
+	}
+
+	journal->fd = openat(journal->dirfd, "journal",
+			     O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (-1 == journal->fd) {
+		close(journal->dirfd);
+		free(journal);
+		return -1;
+	}
+
+	/* Make sure journal file itself survives a crash */
+	fsync(journal->dirfd);
+
+	mtx_init(&journal->lock, mtx_plain);
+	cnd_init(&journal->cond);
+	cnd_init(&journal->wake);
+
+	mtx_lock(&(*priv)->attribute->lock);
+
+	/* Restore only into an empty queue */
+	if (NULL != (*priv)->journal || NULL != (*priv)->spill ||
+	    NULL != (*priv)->head) {
+		mtx_unlock(&(*priv)->attribute->lock);
+		goto error;
+	}
+
+	if (0 != tm_queue_internal_journal_replay(priv, journal)) {
+		while (0 == tm_queue_internal_journal_drop(priv, journal));
+		mtx_unlock(&(*priv)->attribute->lock);
+		goto error;
+	}
+
+	/* Flusher thread get journal from priv */
+	(*priv)->journal = journal;
+
+	if (thrd_success != thrd_create(&journal->flusher,
+					tm_queue_internal_journal_flusher,
+					*priv)) {
+		(*priv)->journal = NULL;
+		while (0 == tm_queue_internal_journal_drop(priv, journal));
+		mtx_unlock(&(*priv)->attribute->lock);
+		goto error;
+	}
+
+	mtx_unlock(&(*priv)->attribute->lock);
+
+	/* Restored elements are waiting */
+	if (NULL != (*priv)->head) {
+		tm_queue_internal_event_notify(priv);
+	}
+
+	return 0;
+
+error:
+	cnd_destroy(&journal->wake);
+	cnd_destroy(&journal->cond);
+	mtx_destroy(&journal->lock);
+	close(journal->fd);
+	close(journal->dirfd);
+	free(journal);
+	return -1;
+}
+
+/*
+ * Compact queue is the same list as plain one, but nodes come from arena and
+ * are linked by reference, 0 is NULL. No spill or journal here.
+ * */
+static int tm_queue_internal_compact_push(tm_queue_priv_t **priv, void *data,
+					  int full, long timeout,
+					  const struct timespec *deadline,
+					  void **dropped)
+{
+	int ret;
+	uint32_t reference;
+	uint32_t oldest;
+	tm_arena_t *arena = (*priv)->arena;
+
+	if (0 != tm_arena_alloc(arena, &reference)) {
+		return -1;
+	}
+
+	*tm_arena_item(arena, reference) = data;
+	atomic_store_explicit(tm_arena_link(arena, reference), 0,
+			      memory_order_relaxed);
+
+	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+		mtx_lock(&(*priv)->attribute->lock);
+	}
+
+	/* Bounded queue is full */
+	while (0 != (*priv)->capacity && (*priv)->count >= (*priv)->capacity) {
+		if (TM_QUEUE_FULL_WAIT == full && 0 != timeout) {
+			(*priv)->waiters++;
+
+			if (timeout < 0) {
+				ret = cnd_wait(&(*priv)->attribute->not_full,
+					       &(*priv)->attribute->lock);
+			} else {
+				ret = cnd_timedwait(&(*priv)->attribute->not_full,
+						    &(*priv)->attribute->lock,
+						    deadline);
+			}
+
+			(*priv)->waiters--;
+
+			if (thrd_success == ret) {
+				continue;
+			}
+		} else if (TM_QUEUE_FULL_DROP == full) {
+			/* Make room by the oldest element */
+			oldest = (*priv)->compact_head;
+
+			(*priv)->compact_head = atomic_load_explicit(
+					tm_arena_link(arena, oldest),
+					memory_order_relaxed);
+			if (0 == (*priv)->compact_head) {
+				(*priv)->compact_tail = 0;
+			}
+			(*priv)->count--;
+
+			*dropped = *tm_arena_item(arena, oldest);
+			tm_arena_free(arena, oldest);
+
+			continue;
+		}
+
+		if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+			mtx_unlock(&(*priv)->attribute->lock);
+		}
+
+		tm_arena_free(arena, reference);
+
+		return -1;
+	}
+
+	(*priv)->count++;
+
+	if (0 == (*priv)->compact_tail) {
+		/* Empty queue */
+
+		(*priv)->compact_head = reference;
+	} else {
+		/* None empty queue */
+
+		atomic_store_explicit(tm_arena_link(arena,
+						    (*priv)->compact_tail),
+				      reference, memory_order_relaxed);
+	}
+
+	(*priv)->compact_tail = reference;
+
+	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+		mtx_unlock(&(*priv)->attribute->lock);
+	}
+
+	tm_queue_internal_event_notify(priv);
+
+	return 0;
+}
+
+/* Caller should hold attribute->lock and make sure queue is not empty */
+static void *tm_queue_internal_compact_unlink(tm_queue_priv_t **priv)
+{
+	void *data;
+	uint32_t reference = (*priv)->compact_head;
+	tm_arena_t *arena = (*priv)->arena;
+
+	(*priv)->compact_head = atomic_load_explicit(
+					tm_arena_link(arena, reference),
+					memory_order_relaxed);
+	if (0 == (*priv)->compact_head) {
+		(*priv)->compact_tail = 0;
+	}
+	(*priv)->count--;
+
+	data = *tm_arena_item(arena, reference);
+	tm_arena_free(arena, reference);
+
+	return data;
+}
+
+static int tm_queue_internal_compact_pop(tm_queue_priv_t **priv, void **data,
+					 unsigned long max,
+					 unsigned long *number)
+{
+	void *value;
+	unsigned long i;
+
+	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+		mtx_lock(&(*priv)->attribute->lock);
+	}
+
+	for (i = 0; i < max && 0 != (*priv)->compact_head; i++) {
+		value = tm_queue_internal_compact_unlink(priv);
+		if (NULL != data) {
+			data[i] = value;
+		}
+	}
+
+	if (0 != i && 0 != (*priv)->waiters) {
+		if (1 == i) {
+			cnd_signal(&(*priv)->attribute->not_full);
+		} else {
+			cnd_broadcast(&(*priv)->attribute->not_full);
+		}
+	}
+
+	tm_queue_internal_event_reset(priv);
+
+	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+		mtx_unlock(&(*priv)->attribute->lock);
 	}
 
-	*option = (*priv)->attribute->option;
+	*number = i;
 
 	return 0;
 }
 
-static int tm_queue_internal_set_option(tm_queue_priv_t **priv,
-					unsigned long option)
+static int tm_queue_internal_push(tm_queue_priv_t **priv, void *data,
+				  int full, long timeout, void **dropped)
 {
-	if (option >= TM_QUEUE_OPTION_MAX) {
-		return -1;
+	int ret;
+	uint64_t lsn = 0;
+	struct timespec deadline;
+	tm_queue_item_t *item;
+	tm_queue_item_t *oldest;
+	tm_queue_journal_t *journal;
+
+	if (NULL != dropped) {
+		*dropped = NULL;
 	}
 
-	(*priv)->attribute->option = option;
+	if ((*priv)->attribute->option & TM_QUEUE_OPTION_MPSC) {
+		return tm_queue_internal_mpsc_push(priv, data);
+	}
 
-	return 0;
-}
+	if (TM_QUEUE_FULL_WAIT == full && timeout > 0) {
+		timespec_get(&deadline, TIME_UTC);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
 
-static int tm_queue_internal_push(tm_queue_priv_t **priv, void *data)
-{
-	tm_queue_item_t *item;
+	if ((*priv)->attribute->option & TM_QUEUE_OPTION_COMPACT) {
+		return tm_queue_internal_compact_push(priv, data, full, timeout,
+						      &deadline, dropped);
+	}
 
 	/* Alloc space for data */
 	item = (tm_queue_item_t*)malloc(sizeof(tm_queue_item_t));
@@ -98,6 +1902,91 @@ static int tm_queue_internal_push(tm_queue_priv_t **priv, void *data)
 		mtx_lock(&(*priv)->attribute->lock);
 	}
 
+	/* Once anything is on disk, keep appending there for FIFO */
+	if (NULL != (*priv)->spill &&
+	    (0 != (*priv)->spill->count ||
+	     (*priv)->count >= (*priv)->spill->threshold)) {
+		ret = tm_queue_internal_spill_push((*priv)->spill, data);
+
+		if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+			mtx_unlock(&(*priv)->attribute->lock);
+		}
+
+		free(item);
+
+		if (0 == ret) {
+			tm_queue_internal_event_notify(priv);
+		}
+
+		return ret;
+	}
+
+	journal = (*priv)->journal;
+
+	/* Bounded queue is full */
+	while (0 != (*priv)->capacity && (*priv)->count >= (*priv)->capacity) {
+		if (TM_QUEUE_FULL_WAIT == full && 0 != timeout) {
+			(*priv)->waiters++;
+
+			if (timeout < 0) {
+				ret = cnd_wait(&(*priv)->attribute->not_full,
+					       &(*priv)->attribute->lock);
+			} else {
+				ret = cnd_timedwait(&(*priv)->attribute->not_full,
+						    &(*priv)->attribute->lock,
+						    &deadline);
+			}
+
+			(*priv)->waiters--;
+
+			if (thrd_success == ret) {
+				continue;
+			}
+		} else if (TM_QUEUE_FULL_DROP == full &&
+			   (NULL == journal ||
+			    0 == tm_queue_internal_journal_append(journal,
+					TM_QUEUE_JOURNAL_RECORD_POP,
+					NULL, &lsn))) {
+			/* Make room by the oldest element */
+			oldest = (*priv)->head;
+
+			(*priv)->head = oldest->next;
+			if (NULL == (*priv)->head) {
+				(*priv)->tail = NULL;
+			}
+			(*priv)->count--;
+
+			*dropped = oldest->item;
+			free(oldest);
+
+			continue;
+		}
+
+		if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+			mtx_unlock(&(*priv)->attribute->lock);
+		}
+
+		free(item);
+
+		return -1;
+	}
+
+	/* Record goes first, nothing is changed if it can not be saved */
+	if (NULL != journal &&
+	    0 != tm_queue_internal_journal_append(journal,
+					TM_QUEUE_JOURNAL_RECORD_PUSH,
+					data, &lsn)) {
+		if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+			mtx_unlock(&(*priv)->attribute->lock);
+		}
+
+		free(item);
+
+		return -1;
+	}
+
+	(*priv)->count++;
+
 	if (NULL == (*priv)->tail) {
 		/* Empty queue */
 
@@ -114,12 +2003,32 @@ static int tm_queue_internal_push(tm_queue_priv_t **priv, void *data)
 		mtx_unlock(&(*priv)->attribute->lock);
 	}
 
+	tm_queue_internal_event_notify(priv);
+
+	if (NULL != journal) {
+		return tm_queue_internal_journal_commit(journal, lsn);
+	}
+
 	return 0;
 }
 
 static int tm_queue_internal_pop(tm_queue_priv_t **priv, void **data)
 {
+	int ret;
+	uint64_t lsn = 0;
+	unsigned long number;
 	tm_queue_item_t *item;
+	tm_queue_journal_t *journal;
+
+	if ((*priv)->attribute->option & TM_QUEUE_OPTION_MPSC) {
+		return tm_queue_internal_mpsc_pop(priv, data);
+	}
+
+	if ((*priv)->attribute->option & TM_QUEUE_OPTION_COMPACT) {
+		tm_queue_internal_compact_pop(priv, data, 1, &number);
+
+		return 1 == number ? 0 : -1;
+	}
 
 	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
 		mtx_lock(&(*priv)->attribute->lock);
@@ -127,12 +2036,40 @@ static int tm_queue_internal_pop(tm_queue_priv_t **priv, void **data)
 
 	/* Queue empty */
 	if (NULL == (*priv)->head) {
+		ret = -1;
+
+		/* Memory is drained, continue with elements on disk */
+		if (NULL != (*priv)->spill && 0 != (*priv)->spill->count) {
+			ret = tm_queue_internal_spill_pop((*priv)->spill, data);
+		}
+
+		tm_queue_internal_event_reset(priv);
+
+		if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+			mtx_unlock(&(*priv)->attribute->lock);
+		}
+		return ret;
+	}
+
+	journal = (*priv)->journal;
+	if (NULL != journal &&
+	    0 != tm_queue_internal_journal_append(journal,
+					TM_QUEUE_JOURNAL_RECORD_POP,
+					NULL, &lsn)) {
 		if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
 			mtx_unlock(&(*priv)->attribute->lock);
 		}
+
 		return -1;
 	}
 
+	(*priv)->count--;
+
+	/* One slot for one waiting producer */
+	if (0 != (*priv)->waiters) {
+		cnd_signal(&(*priv)->attribute->not_full);
+	}
+
 	/* Get item */
 	item = (*priv)->head;
 
@@ -149,6 +2086,8 @@ static int tm_queue_internal_pop(tm_queue_priv_t **priv, void **data)
 		(*priv)->head = (*priv)->head->next;
 	}
 
+	tm_queue_internal_event_reset(priv);
+
 	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
 		mtx_unlock(&(*priv)->attribute->lock);
 	}
@@ -158,12 +2097,121 @@ static int tm_queue_internal_pop(tm_queue_priv_t **priv, void **data)
 	}
 	free(item);
 
+	if (NULL != journal) {
+		return tm_queue_internal_journal_commit(journal, lsn);
+	}
+
+	return 0;
+}
+
+static int tm_queue_internal_pop_batch(tm_queue_priv_t **priv, void **data,
+					unsigned long max,
+					unsigned long *number)
+{
+	unsigned long i;
+	tm_queue_item_t *item;
+	tm_queue_item_t *next;
+	tm_queue_item_t *batch;
+
+	if (NULL == data || NULL == number) {
+		return -1;
+	}
+
+	*number = 0;
+
+	if ((*priv)->attribute->option & TM_QUEUE_OPTION_COMPACT) {
+		return tm_queue_internal_compact_pop(priv, data, max, number);
+	}
+
+	/* Records and disk elements go one by one */
+	if (((*priv)->attribute->option & TM_QUEUE_OPTION_MPSC) ||
+	    NULL != (*priv)->spill || NULL != (*priv)->journal) {
+		while (*number < max &&
+		       0 == tm_queue_internal_pop(priv, &data[*number])) {
+			(*number)++;
+		}
+
+		return 0;
+	}
+
+	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+		mtx_lock(&(*priv)->attribute->lock);
+	}
+
+	/* Cut the first @max items off at once */
+	batch = (*priv)->head;
+	item = NULL;
+	for (i = 0; i < max && NULL != (*priv)->head; i++) {
+		item = (*priv)->head;
+		(*priv)->head = item->next;
+	}
+	if (NULL == (*priv)->head) {
+		(*priv)->tail = NULL;
+	}
+	(*priv)->count -= i;
+
+	if (0 != i && 0 != (*priv)->waiters) {
+		cnd_broadcast(&(*priv)->attribute->not_full);
+	}
+
+	tm_queue_internal_event_reset(priv);
+
+	if ((*priv)->attribute->option | TM_QUEUE_OPTION_MULTI_THREAD) {
+		mtx_unlock(&(*priv)->attribute->lock);
+	}
+
+	if (NULL != item) {
+		item->next = NULL;
+	}
+
+	for (item = batch; NULL != item; item = next) {
+		next = item->next;
+		data[(*number)++] = item->item;
+		free(item);
+	}
+
+	return 0;
+}
+
+static int tm_queue_internal_get_fd(tm_queue_priv_t **priv, int *fd)
+{
+	if (NULL == fd || -1 == (*priv)->event_fd) {
+		return -1;
+	}
+
+	*fd = (*priv)->event_fd;
+
 	return 0;
 }
 
-static int tm_queue_internal_init(tm_queue_priv_t **priv, unsigned long option)
+static int tm_queue_internal_init(tm_queue_priv_t **priv, unsigned long option,
+				  unsigned long capacity)
 {
-	(*priv) = (tm_queue_priv_t*)malloc(sizeof(tm_queue_priv_t));
+	unsigned int i;
+
+	if (option >= TM_QUEUE_OPTION_MAX) {
+		return -1;
+	}
+
+	/* MPSC producers never look at each other */
+	if (0 != capacity && (option & TM_QUEUE_OPTION_MPSC)) {
+		return -1;
+	}
+
+	/* MPSC consumer take no lock to reset eventfd under */
+	if ((option & TM_QUEUE_OPTION_MPSC) &&
+	    (option & TM_QUEUE_OPTION_EVENTFD)) {
+		return -1;
+	}
+
+	/* MPSC nodes always come from an arena, linked without lock */
+	if ((option & TM_QUEUE_OPTION_MPSC) &&
+	    (option & TM_QUEUE_OPTION_COMPACT)) {
+		return -1;
+	}
+
+	(*priv) = (tm_queue_priv_t*)aligned_alloc(_Alignof(tm_queue_priv_t),
+						  sizeof(tm_queue_priv_t));
 	if (NULL == (*priv)) {
 		return -1;
 	}
@@ -178,9 +2226,74 @@ static int tm_queue_internal_init(tm_queue_priv_t **priv, unsigned long option)
 	(*priv)->attribute->option = option;
 
 	mtx_init(&(*priv)->attribute->lock, mtx_plain);
+	cnd_init(&(*priv)->attribute->not_full);
 
 	(*priv)->head = NULL;
 	(*priv)->tail = NULL;
+	(*priv)->count = 0;
+	(*priv)->capacity = capacity;
+	(*priv)->waiters = 0;
+	(*priv)->spill = NULL;
+	(*priv)->journal = NULL;
+	(*priv)->event_fd = -1;
+	atomic_init(&(*priv)->event_state, TM_QUEUE_EVENT_IDLE);
+	(*priv)->arena = NULL;
+	(*priv)->compact_head = 0;
+	(*priv)->compact_tail = 0;
+
+	(*priv)->mpsc_cache = NULL;
+	(*priv)->mpsc_head = 0;
+	(*priv)->mpsc_spare = 0;
+	(*priv)->mpsc_spare_last = 0;
+	(*priv)->mpsc_spare_number = 0;
+	for (i = 0; i < TM_QUEUE_MPSC_SLOTS; i++) {
+		atomic_init(&(*priv)->mpsc_batch[i], 0);
+	}
+	atomic_init(&(*priv)->mpsc_tail, 0);
+
+	if (option & TM_QUEUE_OPTION_EVENTFD) {
+		(*priv)->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (-1 == (*priv)->event_fd) {
+			cnd_destroy(&(*priv)->attribute->not_full);
+			mtx_destroy(&(*priv)->attribute->lock);
+			free((*priv)->attribute);
+			free(*priv);
+			return -1;
+		}
+	}
+
+	if (option & (TM_QUEUE_OPTION_COMPACT | TM_QUEUE_OPTION_MPSC)) {
+		(*priv)->arena = tm_arena_create();
+		if (NULL == (*priv)->arena) {
+			if (-1 != (*priv)->event_fd) {
+				close((*priv)->event_fd);
+			}
+			cnd_destroy(&(*priv)->attribute->not_full);
+			mtx_destroy(&(*priv)->attribute->lock);
+			free((*priv)->attribute);
+			free(*priv);
+			return -1;
+		}
+	}
+
+	if (option & TM_QUEUE_OPTION_MPSC) {
+		/* Stub node, never carry data */
+		if (0 != tm_arena_alloc((*priv)->arena,
+					&(*priv)->mpsc_head) ||
+		    thrd_success != tss_create(&(*priv)->mpsc_key,
+					tm_queue_internal_mpsc_cache_release)) {
+			tm_arena_destroy((*priv)->arena);
+			cnd_destroy(&(*priv)->attribute->not_full);
+			mtx_destroy(&(*priv)->attribute->lock);
+			free((*priv)->attribute);
+			free(*priv);
+			return -1;
+		}
+
+		atomic_init(tm_arena_link((*priv)->arena, (*priv)->mpsc_head),
+			    0);
+		atomic_init(&(*priv)->mpsc_tail, (*priv)->mpsc_head);
+	}
 
 	return 0;
 }
@@ -188,16 +2301,50 @@ static int tm_queue_internal_init(tm_queue_priv_t **priv, unsigned long option)
 static int tm_queue_internal_destroy(tm_queue_priv_t **priv)
 {
 	int ret;
+	tm_queue_mpsc_cache_t *cache;
 
-	mtx_destroy(&(*priv)->attribute->lock);
+	/* Elements left in memory stay in journal for next run */
+	if (NULL != (*priv)->journal) {
+		tm_queue_internal_journal_destroy((*priv)->journal);
+		(*priv)->journal = NULL;
+	}
 
-	free((*priv)->attribute);
+	/* Elements on disk are dropped, do not decode them */
+	if (NULL != (*priv)->spill) {
+		tm_queue_internal_spill_destroy((*priv)->spill);
+		(*priv)->spill = NULL;
+	}
 
-	/* Remove all item */
+	/* Remove all item, pop need attribute so do it first */
 	do {
 		ret = tm_queue_internal_pop(priv, NULL);
 	} while (ret == 0);
 
+	if ((*priv)->attribute->option & TM_QUEUE_OPTION_MPSC) {
+		tss_delete((*priv)->mpsc_key);
+
+		/* Cached nodes go with the arena */
+		while (NULL != (*priv)->mpsc_cache) {
+			cache = (*priv)->mpsc_cache;
+			(*priv)->mpsc_cache = cache->next;
+			free(cache);
+		}
+	}
+
+	/* Only MPSC stub node left, it go with the arena */
+	if (NULL != (*priv)->arena) {
+		tm_arena_destroy((*priv)->arena);
+	}
+
+	if (-1 != (*priv)->event_fd) {
+		close((*priv)->event_fd);
+	}
+
+	cnd_destroy(&(*priv)->attribute->not_full);
+	mtx_destroy(&(*priv)->attribute->lock);
+
+	free((*priv)->attribute);
+
 	free(*priv);
 
 	return 0;
@@ -238,7 +2385,69 @@ int tm_queue_init(tm_queue_t *queue, unsigned long option)
 
 	queue->priv = NULL;
 
-	return tm_queue_internal_init((tm_queue_priv_t**)&queue->priv, option);
+	return tm_queue_internal_init((tm_queue_priv_t**)&queue->priv, option, 0);
+}
+
+int tm_queue_init_bounded(tm_queue_t *queue, unsigned long option,
+			  unsigned long capacity)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (0 == capacity) {
+		return -1;
+	}
+
+	queue->priv = NULL;
+
+	return tm_queue_internal_init((tm_queue_priv_t**)&queue->priv, option,
+				      capacity);
+}
+
+int tm_queue_set_spill(tm_queue_t *queue, const char *directory,
+		       unsigned long threshold, const tm_queue_codec_t *codec)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_queue_internal_set_spill((tm_queue_priv_t**)&queue->priv,
+					   directory, threshold, codec);
+}
+
+int tm_queue_set_journal(tm_queue_t *queue, const char *directory,
+			 unsigned long sync, unsigned long interval,
+			 const tm_queue_codec_t *codec)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_queue_internal_set_journal((tm_queue_priv_t**)&queue->priv,
+					     directory, sync, interval, codec);
+}
+
+int tm_queue_compact_journal(tm_queue_t *queue)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_queue_internal_journal_compact(
+				(tm_queue_priv_t**)&queue->priv, true);
 }
 
 int tm_queue_destroy(tm_queue_t *queue)
@@ -264,7 +2473,40 @@ int tm_queue_push(tm_queue_t *queue, void *data)
 		return -1;
 	}
 
-	return tm_queue_internal_push((tm_queue_priv_t**)&queue->priv, data);
+	return tm_queue_internal_push((tm_queue_priv_t**)&queue->priv, data,
+				      TM_QUEUE_FULL_FAIL, 0, NULL);
+}
+
+int tm_queue_push_timeout(tm_queue_t *queue, void *data, long timeout)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_queue_internal_push((tm_queue_priv_t**)&queue->priv, data,
+				      TM_QUEUE_FULL_WAIT, timeout, NULL);
+}
+
+int tm_queue_push_drop(tm_queue_t *queue, void *data, void **dropped)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	if (NULL == dropped) {
+		return -1;
+	}
+
+	return tm_queue_internal_push((tm_queue_priv_t**)&queue->priv, data,
+				      TM_QUEUE_FULL_DROP, 0, dropped);
 }
 
 int tm_queue_pop(tm_queue_t *queue, void **data)
@@ -280,3 +2522,30 @@ int tm_queue_pop(tm_queue_t *queue, void **data)
 	return tm_queue_internal_pop((tm_queue_priv_t**)&queue->priv, data);
 }
 
+int tm_queue_pop_batch(tm_queue_t *queue, void **data, unsigned long max,
+		       unsigned long *number)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_queue_internal_pop_batch((tm_queue_priv_t**)&queue->priv,
+					   data, max, number);
+}
+
+int tm_queue_get_fd(tm_queue_t *queue, int *fd)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_queue_internal_get_fd((tm_queue_priv_t**)&queue->priv, fd);
+}
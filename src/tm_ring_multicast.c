@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <threads.h>
+
+#include "tm_ring_multicast.h"
+
+/**
+ * struct tm_ring_multicast_sequence_s - Sequence on its own cache line
+ *
+ * Sequence is the number of elements passed, so slot of element "n" is
+ * "n & mask" and it is free again when all consumers have sequence > n.
+ *
+ * @value: Sequence value
+ * */
+typedef struct tm_ring_multicast_sequence_s {
+	_Alignas(64) atomic_ulong value;
+} tm_ring_multicast_sequence_t;
+
+/**
+ * struct tm_ring_multicast_consumer_s - Consumer of ring
+ *
+ * @committed: Elements processed, read by producer and dependents
+ *
+ * @read: Elements returned by tm_ring_multicast_consume, consumer only
+ *
+ * @depend: Consumers this consumer depend on
+ *
+ * @depend_number: Number of @depend
+ * */
+typedef struct tm_ring_multicast_consumer_s {
+	tm_ring_multicast_sequence_t committed;
+	unsigned long read;
+	int *depend;
+	int depend_number;
+} tm_ring_multicast_consumer_t;
+
+/**
+ * struct tm_ring_multicast_attribute_s - Ring attribute
+ *
+ * @option: Option of this ring
+ *
+ * @lock: Mutex for TM_RING_MULTICAST_OPTION_WAIT_BLOCK
+ *
+ * @cond: Condition for TM_RING_MULTICAST_OPTION_WAIT_BLOCK
+ *
+ * @waiter: Number of thread blocked on @cond
+ * */
+typedef struct tm_ring_multicast_attribute_s {
+	unsigned long option;
+	mtx_t lock;
+	cnd_t cond;
+	atomic_int waiter;
+} tm_ring_multicast_attribute_t;
+
+/**
+ * struct tm_ring_multicast_priv_s - Private structure of ring
+ *
+ * @attribute: Attribute of this ring
+ *
+ * @slot: Element slots
+ *
+ * @mask: Number of slots - 1
+ *
+ * @consumer: Consumers
+ *
+ * @consumer_number: Number of @consumer
+ *
+ * @claim: Next sequence to be claimed by producers
+ *
+ * @cursor: Published sequence, all elements before it are readable
+ *
+ * @gating: Cached minimal committed sequence of all consumers
+ * */
+typedef struct tm_ring_multicast_priv_s {
+	tm_ring_multicast_attribute_t *attribute;
+	void **slot;
+	unsigned long mask;
+	tm_ring_multicast_consumer_t *consumer;
+	int consumer_number;
+	tm_ring_multicast_sequence_t claim;
+	tm_ring_multicast_sequence_t cursor;
+	tm_ring_multicast_sequence_t gating;
+} tm_ring_multicast_priv_t;
+
+/* Condition of a wait, "true" means go ahead */
+typedef bool (*tm_ring_multicast_cond_t)(tm_ring_multicast_priv_t *priv,
+					 int consumer, unsigned long sequence);
+
+
+static inline void tm_ring_multicast_internal_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void tm_ring_multicast_internal_wait(tm_ring_multicast_priv_t *priv,
+					    tm_ring_multicast_cond_t cond,
+					    int consumer,
+					    unsigned long sequence)
+{
+	tm_ring_multicast_attribute_t *attribute = priv->attribute;
+
+	while (!cond(priv, consumer, sequence)) {
+		if (attribute->option & TM_RING_MULTICAST_OPTION_WAIT_BLOCK) {
+			mtx_lock(&attribute->lock);
+
+			/*
+			 * Waiter is counted before the condition is checked
+			 * again, so a waker which miss this waiter have not
+			 * updated its sequence yet.
+			 * */
+			atomic_fetch_add(&attribute->waiter, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (!cond(priv, consumer, sequence)) {
+				cnd_wait(&attribute->cond, &attribute->lock);
+			}
+			atomic_fetch_sub(&attribute->waiter, 1);
+
+			mtx_unlock(&attribute->lock);
+		} else if (attribute->option &
+			   TM_RING_MULTICAST_OPTION_WAIT_YIELD) {
+			thrd_yield();
+		} else {
+			tm_ring_multicast_internal_relax();
+		}
+	}
+}
+
+static void tm_ring_multicast_internal_wake(tm_ring_multicast_priv_t *priv)
+{
+	tm_ring_multicast_attribute_t *attribute = priv->attribute;
+
+	if (!(attribute->option & TM_RING_MULTICAST_OPTION_WAIT_BLOCK)) {
+		return;
+	}
+
+	/* Order sequence update before reading waiter */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (0 == atomic_load(&attribute->waiter)) {
+		return;
+	}
+
+	mtx_lock(&attribute->lock);
+	cnd_broadcast(&attribute->cond);
+	mtx_unlock(&attribute->lock);
+}
+
+static unsigned long tm_ring_multicast_internal_gating(
+					tm_ring_multicast_priv_t *priv)
+{
+	int i;
+	unsigned long value;
+	unsigned long min;
+
+	min = atomic_load_explicit(&priv->cursor.value, memory_order_acquire);
+
+	for (i = 0; i < priv->consumer_number; i++) {
+		value = atomic_load_explicit(&priv->consumer[i].committed.value,
+					     memory_order_acquire);
+		if (value < min) {
+			min = value;
+		}
+	}
+
+	atomic_store_explicit(&priv->gating.value, min, memory_order_relaxed);
+
+	return min;
+}
+
+/* Slot of @sequence is no longer used by any consumer */
+static bool tm_ring_multicast_internal_cond_slot(tm_ring_multicast_priv_t *priv,
+						 int consumer,
+						 unsigned long sequence)
+{
+	unsigned long gating;
+
+	(void)consumer;
+
+	gating = atomic_load_explicit(&priv->gating.value,
+				      memory_order_relaxed);
+	if (sequence - gating <= priv->mask) {
+		return true;
+	}
+
+	/* Cached value is too old, scan all consumers */
+	gating = tm_ring_multicast_internal_gating(priv);
+
+	return sequence - gating <= priv->mask;
+}
+
+/* All elements before @sequence are published */
+static bool tm_ring_multicast_internal_cond_cursor(
+					tm_ring_multicast_priv_t *priv,
+					int consumer, unsigned long sequence)
+{
+	(void)consumer;
+
+	return atomic_load_explicit(&priv->cursor.value,
+				    memory_order_acquire) == sequence;
+}
+
+static unsigned long tm_ring_multicast_internal_available(
+					tm_ring_multicast_priv_t *priv,
+					int consumer)
+{
+	int i;
+	unsigned long value;
+	unsigned long available;
+	tm_ring_multicast_consumer_t *c = &priv->consumer[consumer];
+
+	available = atomic_load_explicit(&priv->cursor.value,
+					 memory_order_acquire);
+
+	/* Sequence barrier */
+	for (i = 0; i < c->depend_number; i++) {
+		value = atomic_load_explicit(
+				&priv->consumer[c->depend[i]].committed.value,
+				memory_order_acquire);
+		if (value < available) {
+			available = value;
+		}
+	}
+
+	return available;
+}
+
+/* Element @sequence is readable by @consumer */
+static bool tm_ring_multicast_internal_cond_available(
+					tm_ring_multicast_priv_t *priv,
+					int consumer, unsigned long sequence)
+{
+	return tm_ring_multicast_internal_available(priv, consumer) > sequence;
+}
+
+static int tm_ring_multicast_internal_init(tm_ring_multicast_priv_t **priv,
+					   unsigned long size,
+					   unsigned long option)
+{
+	if (option >= TM_RING_MULTICAST_OPTION_MAX) {
+		return -1;
+	}
+
+	/* Power of 2 so "&" can be used instead of "%" */
+	if (0 == size || 0 != (size & (size - 1))) {
+		return -1;
+	}
+
+	(*priv) = (tm_ring_multicast_priv_t*)aligned_alloc(
+					_Alignof(tm_ring_multicast_priv_t),
+					sizeof(tm_ring_multicast_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->attribute = (tm_ring_multicast_attribute_t*)malloc(
+					sizeof(tm_ring_multicast_attribute_t));
+	if (NULL == (*priv)->attribute) {
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->slot = (void**)malloc(sizeof(void*) * size);
+	if (NULL == (*priv)->slot) {
+		free((*priv)->attribute);
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->attribute->option = option;
+	mtx_init(&(*priv)->attribute->lock, mtx_plain);
+	cnd_init(&(*priv)->attribute->cond);
+	atomic_init(&(*priv)->attribute->waiter, 0);
+
+	(*priv)->mask = size - 1;
+	(*priv)->consumer = NULL;
+	(*priv)->consumer_number = 0;
+
+	atomic_init(&(*priv)->claim.value, 0);
+	atomic_init(&(*priv)->cursor.value, 0);
+	atomic_init(&(*priv)->gating.value, 0);
+
+	return 0;
+}
+
+static int tm_ring_multicast_internal_destroy(tm_ring_multicast_priv_t **priv)
+{
+	int i;
+
+	for (i = 0; i < (*priv)->consumer_number; i++) {
+		free((*priv)->consumer[i].depend);
+	}
+	free((*priv)->consumer);
+
+	cnd_destroy(&(*priv)->attribute->cond);
+	mtx_destroy(&(*priv)->attribute->lock);
+	free((*priv)->attribute);
+
+	free((*priv)->slot);
+
+	free(*priv);
+
+	(*priv) = NULL;
+
+	return 0;
+}
+
+static int tm_ring_multicast_internal_add_consumer(
+					tm_ring_multicast_priv_t **priv,
+					const int *depend, int depend_number,
+					int *consumer)
+{
+	int i;
+	tm_ring_multicast_consumer_t *array;
+	tm_ring_multicast_consumer_t *c;
+
+	if (depend_number < 0 || (depend_number > 0 && NULL == depend)) {
+		return -1;
+	}
+
+	/* Can only depend on consumers already exist */
+	for (i = 0; i < depend_number; i++) {
+		if (depend[i] < 0 || depend[i] >= (*priv)->consumer_number) {
+			return -1;
+		}
+	}
+
+	/* Too late, producer may have passed consumer's start point */
+	if (0 != atomic_load(&(*priv)->claim.value)) {
+		return -1;
+	}
+
+	array = (tm_ring_multicast_consumer_t*)aligned_alloc(
+				_Alignof(tm_ring_multicast_consumer_t),
+				sizeof(tm_ring_multicast_consumer_t) *
+				((*priv)->consumer_number + 1));
+	if (NULL == array) {
+		return -1;
+	}
+
+	/* Move existing consumers, all sequences are 0 here */
+	for (i = 0; i < (*priv)->consumer_number; i++) {
+		atomic_init(&array[i].committed.value, 0);
+		array[i].read = 0;
+		array[i].depend = (*priv)->consumer[i].depend;
+		array[i].depend_number = (*priv)->consumer[i].depend_number;
+	}
+
+	c = &array[(*priv)->consumer_number];
+
+	atomic_init(&c->committed.value, 0);
+	c->read = 0;
+	c->depend = NULL;
+	c->depend_number = depend_number;
+
+	if (depend_number > 0) {
+		c->depend = (int*)malloc(sizeof(int) * depend_number);
+		if (NULL == c->depend) {
+			free(array);
+			return -1;
+		}
+
+		for (i = 0; i < depend_number; i++) {
+			c->depend[i] = depend[i];
+		}
+	}
+
+	free((*priv)->consumer);
+
+	(*priv)->consumer = array;
+
+	*consumer = (*priv)->consumer_number++;
+
+	return 0;
+}
+
+static int tm_ring_multicast_internal_publish(tm_ring_multicast_priv_t **priv,
+					      void *data)
+{
+	unsigned long sequence;
+	tm_ring_multicast_priv_t *p = *priv;
+
+	/* Claim a sequence */
+	if (p->attribute->option & TM_RING_MULTICAST_OPTION_MULTI_PRODUCER) {
+		sequence = atomic_fetch_add_explicit(&p->claim.value, 1,
+						     memory_order_relaxed);
+	} else {
+		sequence = atomic_load_explicit(&p->claim.value,
+						memory_order_relaxed);
+		atomic_store_explicit(&p->claim.value, sequence + 1,
+				      memory_order_relaxed);
+	}
+
+	/* Wait slowest consumer release this slot */
+	tm_ring_multicast_internal_wait(p, tm_ring_multicast_internal_cond_slot,
+					0, sequence);
+
+	p->slot[sequence & p->mask] = data;
+
+	/* Publish in claim order */
+	if (p->attribute->option & TM_RING_MULTICAST_OPTION_MULTI_PRODUCER) {
+		tm_ring_multicast_internal_wait(p,
+				tm_ring_multicast_internal_cond_cursor,
+				0, sequence);
+	}
+
+	atomic_store_explicit(&p->cursor.value, sequence + 1,
+			      memory_order_release);
+
+	tm_ring_multicast_internal_wake(p);
+
+	return 0;
+}
+
+static int tm_ring_multicast_internal_consume(tm_ring_multicast_priv_t **priv,
+					      int consumer, void **data,
+					      unsigned long max,
+					      unsigned long *number)
+{
+	unsigned long i;
+	unsigned long available;
+	tm_ring_multicast_priv_t *p = *priv;
+	tm_ring_multicast_consumer_t *c;
+
+	if (consumer < 0 || consumer >= p->consumer_number) {
+		return -1;
+	}
+
+	if (NULL == data || 0 == max || NULL == number) {
+		return -1;
+	}
+
+	c = &p->consumer[consumer];
+
+	tm_ring_multicast_internal_wait(p,
+			tm_ring_multicast_internal_cond_available,
+			consumer, c->read);
+
+	/* Batch read up to the available sequence */
+	available = tm_ring_multicast_internal_available(p, consumer);
+	if (available - c->read > max) {
+		available = c->read + max;
+	}
+
+	for (i = 0; c->read != available; i++, c->read++) {
+		data[i] = p->slot[c->read & p->mask];
+	}
+
+	*number = i;
+
+	return 0;
+}
+
+static int tm_ring_multicast_internal_commit(tm_ring_multicast_priv_t **priv,
+					     int consumer,
+					     unsigned long number)
+{
+	unsigned long committed;
+	tm_ring_multicast_priv_t *p = *priv;
+	tm_ring_multicast_consumer_t *c;
+
+	if (consumer < 0 || consumer >= p->consumer_number) {
+		return -1;
+	}
+
+	c = &p->consumer[consumer];
+
+	committed = atomic_load_explicit(&c->committed.value,
+					 memory_order_relaxed);
+	if (number > c->read - committed) {
+		return -1;
+	}
+
+	atomic_store_explicit(&c->committed.value, committed + number,
+			      memory_order_release);
+
+	tm_ring_multicast_internal_wake(p);
+
+	return 0;
+}
+
+
+int tm_ring_multicast_init(tm_ring_multicast_t *ring, unsigned long size,
+			   unsigned long option)
+{
+	if (NULL == ring) {
+		return -1;
+	}
+
+	ring->priv = NULL;
+
+	return tm_ring_multicast_internal_init(
+			(tm_ring_multicast_priv_t**)&ring->priv, size, option);
+}
+
+int tm_ring_multicast_destroy(tm_ring_multicast_t *ring)
+{
+	if (NULL == ring) {
+		return -1;
+	}
+
+	if (NULL == ring->priv) {
+		return -1;
+	}
+
+	return tm_ring_multicast_internal_destroy(
+			(tm_ring_multicast_priv_t**)&ring->priv);
+}
+
+int tm_ring_multicast_add_consumer(tm_ring_multicast_t *ring,
+				   const int *depend, int depend_number,
+				   int *consumer)
+{
+	if (NULL == ring || NULL == consumer) {
+		return -1;
+	}
+
+	if (NULL == ring->priv) {
+		return -1;
+	}
+
+	return tm_ring_multicast_internal_add_consumer(
+			(tm_ring_multicast_priv_t**)&ring->priv,
+			depend, depend_number, consumer);
+}
+
+int tm_ring_multicast_publish(tm_ring_multicast_t *ring, void *data)
+{
+	if (NULL == ring) {
+		return -1;
+	}
+
+	if (NULL == ring->priv) {
+		return -1;
+	}
+
+	return tm_ring_multicast_internal_publish(
+			(tm_ring_multicast_priv_t**)&ring->priv, data);
+}
+
+int tm_ring_multicast_consume(tm_ring_multicast_t *ring, int consumer,
+			      void **data, unsigned long max,
+			      unsigned long *number)
+{
+	if (NULL == ring) {
+		return -1;
+	}
+
+	if (NULL == ring->priv) {
+		return -1;
+	}
+
+	return tm_ring_multicast_internal_consume(
+			(tm_ring_multicast_priv_t**)&ring->priv,
+			consumer, data, max, number);
+}
+
+int tm_ring_multicast_commit(tm_ring_multicast_t *ring, int consumer,
+			     unsigned long number)
+{
+	if (NULL == ring) {
+		return -1;
+	}
+
+	if (NULL == ring->priv) {
+		return -1;
+	}
+
+	return tm_ring_multicast_internal_commit(
+			(tm_ring_multicast_priv_t**)&ring->priv,
+			consumer, number);
+}
+
@@ -0,0 +1,706 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tm_shm_queue.h"
+
+#define TM_SHM_QUEUE_MAGIC		0x71736d74u
+#define TM_SHM_QUEUE_VERSION		2u
+
+/* Record alignment, also the size of record header */
+#define TM_SHM_QUEUE_ALIGN		16ul
+
+#define TM_SHM_QUEUE_CAPACITY_MIN	4096ul
+
+/* Producers copying at the same time, more of them fail like queue full */
+#define TM_SHM_QUEUE_OWNER_MAX		64u
+
+/* State of record */
+#define TM_SHM_QUEUE_RECORD_BUSY	1u
+#define TM_SHM_QUEUE_RECORD_READY	2u
+#define TM_SHM_QUEUE_RECORD_PAD		3u
+
+/**
+ * struct tm_shm_queue_owner_s - Liveness token of a producer
+ *
+ * A producer hold @lock from claim until the record is ready. The lock is
+ * robust, so the consumer learn a producer died only from EOWNERDEAD, pid
+ * reuse or pid namespace can not fool it.
+ *
+ * @lock: Robust process shared mutex
+ *
+ * @sequence: Bumped by each holder, tell records of previous holders apart
+ * */
+typedef struct tm_shm_queue_owner_s {
+	pthread_mutex_t lock;
+	_Atomic(uint32_t) sequence;
+} tm_shm_queue_owner_t;
+
+/**
+ * struct tm_shm_queue_header_s - Header of the shared region
+ *
+ * Everything in the region is position independent, positions are byte
+ * offsets into the ring which only grow, "& (capacity - 1)" give the place.
+ *
+ * @magic: TM_SHM_QUEUE_MAGIC, written last when create
+ *
+ * @version: Layout version
+ *
+ * @capacity: Size of ring, power of 2
+ *
+ * @option: Option when create
+ *
+ * @lock: Robust process shared mutex, serialize producers when claim space
+ *
+ * @reserve: End of claimed space, record header before it is valid
+ *
+ * @head: Position of consumer
+ *
+ * @owner: Liveness tokens of producers
+ * */
+typedef struct tm_shm_queue_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	uint64_t option;
+	pthread_mutex_t lock;
+	_Alignas(64) _Atomic(uint64_t) reserve;
+	_Alignas(64) _Atomic(uint64_t) head;
+	_Alignas(64) tm_shm_queue_owner_t owner[TM_SHM_QUEUE_OWNER_MAX];
+} tm_shm_queue_header_t;
+
+/**
+ * struct tm_shm_queue_record_s - Header of each record in ring
+ *
+ * @state: TM_SHM_QUEUE_RECORD_*
+ *
+ * @length: Length of data follow this header
+ *
+ * @owner: Index of producer liveness token
+ *
+ * @sequence: Sequence of @owner when claim
+ * */
+typedef struct tm_shm_queue_record_s {
+	_Atomic(uint32_t) state;
+	uint32_t length;
+	uint32_t owner;
+	uint32_t sequence;
+} tm_shm_queue_record_t;
+
+/**
+ * struct tm_shm_queue_attribute_s - Queue attribute
+ *
+ * @option: Option of this queue
+ * */
+typedef struct tm_shm_queue_attribute_s {
+	unsigned long option;
+} tm_shm_queue_attribute_t;
+
+/**
+ * struct tm_shm_queue_priv_s - Private structure of queue
+ *
+ * @attribute: Attribute of this queue
+ *
+ * @fd: File descriptor of region
+ *
+ * @name: Name to unlink on destroy, only for creator
+ *
+ * @header: Mapped region
+ *
+ * @ring: Ring right after @header
+ *
+ * @map_size: Size of mapping
+ * */
+typedef struct tm_shm_queue_priv_s {
+	tm_shm_queue_attribute_t *attribute;
+	int fd;
+	char *name;
+	tm_shm_queue_header_t *header;
+	char *ring;
+	size_t map_size;
+} tm_shm_queue_priv_t;
+
+/* Where this thread start to look for a free owner */
+static thread_local uint32_t tm_shm_queue_owner_hint;
+
+static inline unsigned long tm_shm_queue_internal_total(unsigned long length)
+{
+	return (sizeof(tm_shm_queue_record_t) + length + TM_SHM_QUEUE_ALIGN - 1) &
+	       ~(TM_SHM_QUEUE_ALIGN - 1);
+}
+
+static inline tm_shm_queue_record_t *tm_shm_queue_internal_record(
+					tm_shm_queue_priv_t *priv,
+					uint64_t position)
+{
+	return (tm_shm_queue_record_t*)(priv->ring +
+			(position & (priv->header->capacity - 1)));
+}
+
+static int tm_shm_queue_internal_map(tm_shm_queue_priv_t *priv, size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, priv->fd, 0);
+	if (MAP_FAILED == p) {
+		return -1;
+	}
+
+	priv->header = p;
+	priv->ring = (char*)p + sizeof(tm_shm_queue_header_t);
+	priv->map_size = size;
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_create(tm_shm_queue_priv_t *priv,
+					unsigned long capacity)
+{
+	unsigned long size = TM_SHM_QUEUE_CAPACITY_MIN;
+	uint32_t i;
+	pthread_mutexattr_t attr;
+	tm_shm_queue_header_t *header;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	if (0 != ftruncate(priv->fd, sizeof(tm_shm_queue_header_t) + size)) {
+		return -1;
+	}
+
+	if (0 != tm_shm_queue_internal_map(priv,
+				sizeof(tm_shm_queue_header_t) + size)) {
+		return -1;
+	}
+
+	header = priv->header;
+
+	header->version = TM_SHM_QUEUE_VERSION;
+	header->capacity = size;
+	header->option = priv->attribute->option;
+	atomic_init(&header->reserve, 0);
+	atomic_init(&header->head, 0);
+
+	/* Survive a producer died with the lock held */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&header->lock, &attr);
+	for (i = 0; i < TM_SHM_QUEUE_OWNER_MAX; i++) {
+		pthread_mutex_init(&header->owner[i].lock, &attr);
+		atomic_init(&header->owner[i].sequence, 0);
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	/* Attacher check magic, so write it last */
+	atomic_thread_fence(memory_order_release);
+	header->magic = TM_SHM_QUEUE_MAGIC;
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_attach(tm_shm_queue_priv_t *priv)
+{
+	struct stat st;
+	tm_shm_queue_header_t *header;
+
+	if (0 != fstat(priv->fd, &st) ||
+	    (size_t)st.st_size < sizeof(tm_shm_queue_header_t) +
+				 TM_SHM_QUEUE_CAPACITY_MIN) {
+		return -1;
+	}
+
+	if (0 != tm_shm_queue_internal_map(priv, st.st_size)) {
+		return -1;
+	}
+
+	header = priv->header;
+
+	if (TM_SHM_QUEUE_MAGIC != header->magic ||
+	    TM_SHM_QUEUE_VERSION != header->version ||
+	    sizeof(tm_shm_queue_header_t) + header->capacity > priv->map_size) {
+		munmap(priv->header, priv->map_size);
+		return -1;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	priv->attribute->option = header->option & ~TM_SHM_QUEUE_OPTION_CREATE;
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_alloc(tm_shm_queue_priv_t **priv,
+				       unsigned long option)
+{
+	(*priv) = (tm_shm_queue_priv_t*)malloc(sizeof(tm_shm_queue_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->attribute = (tm_shm_queue_attribute_t*)malloc(
+					sizeof(tm_shm_queue_attribute_t));
+	if (NULL == (*priv)->attribute) {
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->attribute->option = option;
+	(*priv)->fd = -1;
+	(*priv)->name = NULL;
+	(*priv)->header = NULL;
+	(*priv)->ring = NULL;
+	(*priv)->map_size = 0;
+
+	return 0;
+}
+
+static void tm_shm_queue_internal_free(tm_shm_queue_priv_t **priv)
+{
+	if (-1 != (*priv)->fd) {
+		close((*priv)->fd);
+	}
+
+	if (NULL != (*priv)->name) {
+		shm_unlink((*priv)->name);
+		free((*priv)->name);
+	}
+
+	free((*priv)->attribute);
+	free(*priv);
+
+	(*priv) = NULL;
+}
+
+static int tm_shm_queue_internal_init(tm_shm_queue_priv_t **priv,
+				      const char *name,
+				      unsigned long capacity,
+				      unsigned long option)
+{
+	int ret;
+	bool create = option & TM_SHM_QUEUE_OPTION_CREATE;
+
+	if (option >= TM_SHM_QUEUE_OPTION_MAX) {
+		return -1;
+	}
+
+	/* Anonymous region can not be found by others */
+	if (NULL == name && !create) {
+		return -1;
+	}
+
+	if (0 != tm_shm_queue_internal_alloc(priv, option)) {
+		return -1;
+	}
+
+	if (NULL == name) {
+		(*priv)->fd = memfd_create("tm_shm_queue", MFD_CLOEXEC);
+	} else if (create) {
+		(*priv)->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (-1 != (*priv)->fd) {
+			(*priv)->name = strdup(name);
+			if (NULL == (*priv)->name) {
+				shm_unlink(name);
+				tm_shm_queue_internal_free(priv);
+				return -1;
+			}
+		}
+	} else {
+		(*priv)->fd = shm_open(name, O_RDWR, 0);
+	}
+
+	if (-1 == (*priv)->fd) {
+		tm_shm_queue_internal_free(priv);
+		return -1;
+	}
+
+	if (create) {
+		ret = tm_shm_queue_internal_create(*priv, capacity);
+	} else {
+		ret = tm_shm_queue_internal_attach(*priv);
+	}
+
+	if (0 != ret) {
+		tm_shm_queue_internal_free(priv);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_init_fd(tm_shm_queue_priv_t **priv, int fd)
+{
+	if (0 != tm_shm_queue_internal_alloc(priv, 0)) {
+		return -1;
+	}
+
+	(*priv)->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (-1 == (*priv)->fd) {
+		tm_shm_queue_internal_free(priv);
+		return -1;
+	}
+
+	if (0 != tm_shm_queue_internal_attach(*priv)) {
+		tm_shm_queue_internal_free(priv);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_destroy(tm_shm_queue_priv_t **priv)
+{
+	munmap((*priv)->header, (*priv)->map_size);
+
+	tm_shm_queue_internal_free(priv);
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_lock(tm_shm_queue_priv_t *priv)
+{
+	int ret;
+
+	if (priv->attribute->option & TM_SHM_QUEUE_OPTION_SINGLE_PRODUCER) {
+		return 0;
+	}
+
+	ret = pthread_mutex_lock(&priv->header->lock);
+	if (EOWNERDEAD == ret) {
+		/*
+		 * Previous owner died, reserve is moved as the last step of
+		 * claim so shared state is still consistent.
+		 * */
+		ret = pthread_mutex_consistent(&priv->header->lock);
+	}
+
+	return 0 == ret ? 0 : -1;
+}
+
+static void tm_shm_queue_internal_unlock(tm_shm_queue_priv_t *priv)
+{
+	if (priv->attribute->option & TM_SHM_QUEUE_OPTION_SINGLE_PRODUCER) {
+		return;
+	}
+
+	pthread_mutex_unlock(&priv->header->lock);
+}
+
+static int tm_shm_queue_internal_own(tm_shm_queue_priv_t *priv,
+				     uint32_t *index, uint32_t *sequence)
+{
+	int ret;
+	uint32_t i;
+	tm_shm_queue_owner_t *owner;
+
+	for (i = 0; i < TM_SHM_QUEUE_OWNER_MAX; i++) {
+		*index = (tm_shm_queue_owner_hint + i) % TM_SHM_QUEUE_OWNER_MAX;
+		owner = &priv->header->owner[*index];
+
+		ret = pthread_mutex_trylock(&owner->lock);
+		if (EOWNERDEAD == ret) {
+			/* Records of the dead one are told apart by sequence */
+			ret = pthread_mutex_consistent(&owner->lock);
+			if (0 != ret) {
+				pthread_mutex_unlock(&owner->lock);
+			}
+		}
+
+		if (0 == ret) {
+			break;
+		}
+	}
+
+	if (TM_SHM_QUEUE_OWNER_MAX == i) {
+		return -1;
+	}
+
+	tm_shm_queue_owner_hint = *index;
+
+	/* Consumer saw the new sequence also see previous holder's record ready */
+	*sequence = atomic_load_explicit(&owner->sequence,
+					 memory_order_relaxed) + 1;
+	atomic_store_explicit(&owner->sequence, *sequence,
+			      memory_order_release);
+
+	return 0;
+}
+
+static void tm_shm_queue_internal_disown(tm_shm_queue_priv_t *priv,
+					 uint32_t index)
+{
+	pthread_mutex_unlock(&priv->header->owner[index].lock);
+}
+
+/*
+ * Whether the producer of a busy record is still writing. False means it
+ * finished or died, caller should read state again to tell which.
+ * */
+static bool tm_shm_queue_internal_alive(tm_shm_queue_priv_t *priv,
+					tm_shm_queue_record_t *record)
+{
+	int ret;
+	tm_shm_queue_owner_t *owner;
+
+	owner = &priv->header->owner[record->owner % TM_SHM_QUEUE_OWNER_MAX];
+
+	ret = pthread_mutex_trylock(&owner->lock);
+	if (EBUSY == ret) {
+		/* Held, but maybe by someone took it after our producer */
+		return record->sequence ==
+		       atomic_load_explicit(&owner->sequence,
+					    memory_order_acquire);
+	}
+
+	if (EOWNERDEAD == ret) {
+		ret = pthread_mutex_consistent(&owner->lock);
+	}
+
+	if (0 == ret) {
+		pthread_mutex_unlock(&owner->lock);
+	}
+
+	return false;
+}
+
+static int tm_shm_queue_internal_push(tm_shm_queue_priv_t **priv,
+				      const void *data,
+				      unsigned long length)
+{
+	uint64_t pad;
+	uint64_t head;
+	uint64_t position;
+	unsigned long total;
+	unsigned long offset;
+	unsigned long capacity = (*priv)->header->capacity;
+	uint32_t owner;
+	uint32_t sequence;
+	tm_shm_queue_record_t *record;
+
+	total = tm_shm_queue_internal_total(length);
+	if (total > capacity / 4) {
+		return -1;
+	}
+
+	/* Held until record ready, so a busy record always has a live owner */
+	if (0 != tm_shm_queue_internal_own(*priv, &owner, &sequence)) {
+		return -1;
+	}
+
+	if (0 != tm_shm_queue_internal_lock(*priv)) {
+		tm_shm_queue_internal_disown(*priv, owner);
+		return -1;
+	}
+
+	position = atomic_load_explicit(&(*priv)->header->reserve,
+					memory_order_relaxed);
+	head = atomic_load_explicit(&(*priv)->header->head,
+				    memory_order_acquire);
+
+	/* Record never wrap, skip the tail of ring instead */
+	offset = position & (capacity - 1);
+	pad = offset + total > capacity ? capacity - offset : 0;
+
+	if (position + pad + total - head > capacity) {
+		tm_shm_queue_internal_unlock(*priv);
+		tm_shm_queue_internal_disown(*priv, owner);
+		return -1;
+	}
+
+	if (0 != pad) {
+		record = tm_shm_queue_internal_record(*priv, position);
+		record->length = pad - sizeof(tm_shm_queue_record_t);
+		record->owner = owner;
+		record->sequence = sequence;
+		atomic_store_explicit(&record->state, TM_SHM_QUEUE_RECORD_PAD,
+				      memory_order_relaxed);
+	}
+
+	record = tm_shm_queue_internal_record(*priv, position + pad);
+	record->length = length;
+	record->owner = owner;
+	record->sequence = sequence;
+	atomic_store_explicit(&record->state, TM_SHM_QUEUE_RECORD_BUSY,
+			      memory_order_relaxed);
+
+	/* Last step of claim, record headers are visible with it */
+	atomic_store_explicit(&(*priv)->header->reserve,
+			      position + pad + total, memory_order_release);
+
+	tm_shm_queue_internal_unlock(*priv);
+
+	/* Copy without lock */
+	memcpy(record + 1, data, length);
+
+	atomic_store_explicit(&record->state, TM_SHM_QUEUE_RECORD_READY,
+			      memory_order_release);
+
+	tm_shm_queue_internal_disown(*priv, owner);
+
+	return 0;
+}
+
+static int tm_shm_queue_internal_pop(tm_shm_queue_priv_t **priv, void *data,
+				     unsigned long *length)
+{
+	uint32_t state;
+	uint64_t head;
+	uint64_t reserve;
+	tm_shm_queue_record_t *record;
+
+	head = atomic_load_explicit(&(*priv)->header->head,
+				    memory_order_relaxed);
+
+	while (true) {
+		reserve = atomic_load_explicit(&(*priv)->header->reserve,
+					       memory_order_acquire);
+
+		/* Queue empty */
+		if (head == reserve) {
+			*length = 0;
+			return -1;
+		}
+
+		record = tm_shm_queue_internal_record(*priv, head);
+		state = atomic_load_explicit(&record->state,
+					     memory_order_acquire);
+
+		if (TM_SHM_QUEUE_RECORD_BUSY == state) {
+			/* Still writing */
+			if (tm_shm_queue_internal_alive(*priv, record)) {
+				*length = 0;
+				return -1;
+			}
+
+			/*
+			 * Owner is gone, ready if it finished right now,
+			 * otherwise it died holding this record, skip it.
+			 * */
+			state = atomic_load_explicit(&record->state,
+						     memory_order_acquire);
+		}
+
+		if (TM_SHM_QUEUE_RECORD_READY == state) {
+			if (record->length > *length) {
+				*length = record->length;
+				return -1;
+			}
+
+			memcpy(data, record + 1, record->length);
+			*length = record->length;
+		}
+
+		head += tm_shm_queue_internal_total(record->length);
+
+		atomic_store_explicit(&(*priv)->header->head, head,
+				      memory_order_release);
+
+		if (TM_SHM_QUEUE_RECORD_READY == state) {
+			return 0;
+		}
+	}
+}
+
+
+int tm_shm_queue_init(tm_shm_queue_t *queue, const char *name,
+		      unsigned long capacity, unsigned long option)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	queue->priv = NULL;
+
+	return tm_shm_queue_internal_init((tm_shm_queue_priv_t**)&queue->priv,
+					  name, capacity, option);
+}
+
+int tm_shm_queue_init_fd(tm_shm_queue_t *queue, int fd)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	queue->priv = NULL;
+
+	return tm_shm_queue_internal_init_fd(
+			(tm_shm_queue_priv_t**)&queue->priv, fd);
+}
+
+int tm_shm_queue_get_fd(tm_shm_queue_t *queue, int *fd)
+{
+	if (NULL == queue || NULL == fd) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	*fd = ((tm_shm_queue_priv_t*)queue->priv)->fd;
+
+	return 0;
+}
+
+int tm_shm_queue_destroy(tm_shm_queue_t *queue)
+{
+	if (NULL == queue) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_shm_queue_internal_destroy(
+			(tm_shm_queue_priv_t**)&queue->priv);
+}
+
+int tm_shm_queue_push(tm_shm_queue_t *queue, const void *data,
+		      unsigned long length)
+{
+	if (NULL == queue || (NULL == data && 0 != length)) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_shm_queue_internal_push((tm_shm_queue_priv_t**)&queue->priv,
+					  data, length);
+}
+
+int tm_shm_queue_pop(tm_shm_queue_t *queue, void *data,
+		     unsigned long *length)
+{
+	if (NULL == queue || NULL == length) {
+		return -1;
+	}
+
+	if (NULL == queue->priv) {
+		return -1;
+	}
+
+	return tm_shm_queue_internal_pop((tm_shm_queue_priv_t**)&queue->priv,
+					 data, length);
+}
+
@@ -0,0 +1,868 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <threads.h>
+
+#include "tm_pool.h"
+#include "tm_skiplist.h"
+
+/* Max tower height, each level is kept with 1/4 chance */
+#define TM_SKIPLIST_LEVEL_MAX		16u
+
+/* Node pools, for towers of 1, 2, 4, 8 and 16 levels */
+#define TM_SKIPLIST_CLASS_MAX		5u
+
+/* Objects per slab of one level towers, 1/4 for each class above */
+#define TM_SKIPLIST_POOL_OBJECTS	65536ul
+
+/* Erased nodes between two attempts to reclaim */
+#define TM_SKIPLIST_RECLAIM_BATCH	64ul
+
+/* Low bit of next pointer, node is erased from this level */
+#define TM_SKIPLIST_MARK		((uintptr_t)1)
+
+/* Data of an erased node, taken by erase so a later update can not be lost */
+static char tm_skiplist_tombstone;
+#define TM_SKIPLIST_ERASED_DATA		((void*)&tm_skiplist_tombstone)
+
+/* Node may only go back to pool after both insert and erase are done */
+#define TM_SKIPLIST_NODE_INSERTED	0x1u
+#define TM_SKIPLIST_NODE_ERASED		0x2u
+
+/**
+ * struct tm_skiplist_node_s - Node with its tower
+ *
+ * Key and lower levels of tower share the first cache line.
+ *
+ * @key: Key of element
+ *
+ * @data: Data of element, TM_SKIPLIST_ERASED_DATA once erase took it
+ *
+ * @retired: Link in limbo list
+ *
+ * @state: TM_SKIPLIST_NODE_*
+ *
+ * @height: Number of levels
+ *
+ * @next: Next node of each level, TM_SKIPLIST_MARK once erased
+ * */
+typedef struct tm_skiplist_node_s {
+	unsigned long key;
+	_Atomic(void*) data;
+	struct tm_skiplist_node_s *retired;
+	atomic_uint state;
+	unsigned int height;
+	_Atomic(uintptr_t) next[];
+} tm_skiplist_node_t;
+
+/**
+ * struct tm_skiplist_reader_s - Record of a running operation
+ *
+ * Records are only added to a list and freed with it. Each operation take
+ * any idle one, or register a new one when all are busy, so it never wait.
+ *
+ * @epoch: Epoch when operation started, 0 if record is idle
+ *
+ * @next: Next record of the same list
+ * */
+typedef struct tm_skiplist_reader_s {
+	_Alignas(64) atomic_ulong epoch;
+	struct tm_skiplist_reader_s *next;
+} tm_skiplist_reader_t;
+
+/**
+ * struct tm_skiplist_priv_s - Private structure of skip list
+ *
+ * Erased nodes are put on limbo list of current epoch. Epoch only move on
+ * when every running operation started in it, then nodes erased two epochs
+ * before can not be seen by anyone and go back to pool.
+ *
+ * @head: Head node with full tower, key is not used
+ *
+ * @id: Unique number of this list, never reused
+ *
+ * @size: Number of elements
+ *
+ * @epoch: Global epoch, start from 1
+ *
+ * @retired_number: Number of nodes ever put on limbo lists
+ *
+ * @limbo: Erased nodes by epoch % 3
+ *
+ * @reclaim_lock: Only one thread move epoch at a time, others skip
+ *
+ * @reader: Records of operations, registered on demand
+ * */
+typedef struct tm_skiplist_priv_s {
+	tm_skiplist_node_t *head;
+	unsigned long id;
+	_Alignas(64) atomic_ulong size;
+	_Alignas(64) atomic_ulong epoch;
+	atomic_ulong retired_number;
+	_Atomic(tm_skiplist_node_t *) limbo[3];
+	mtx_t reclaim_lock;
+	_Atomic(tm_skiplist_reader_t *) reader;
+} tm_skiplist_priv_t;
+
+/*
+ * Node pools by tower class, shared by all lists of the process. Each pool
+ * take one thread specific storage key, so the number of lists is not
+ * limited by keys. Slabs are kept until process exit.
+ * */
+static tm_pool_t tm_skiplist_pool[TM_SKIPLIST_CLASS_MAX];
+static once_flag tm_skiplist_pool_once = ONCE_FLAG_INIT;
+static bool tm_skiplist_pool_ready;
+
+/* Source of list id */
+static atomic_ulong tm_skiplist_id;
+
+/* Seed of tower height */
+static thread_local uint32_t tm_skiplist_seed;
+
+/* Record used last time and id of its list, 0 if none yet */
+static thread_local unsigned long tm_skiplist_cache_id;
+static thread_local tm_skiplist_reader_t *tm_skiplist_cache;
+
+
+static inline bool tm_skiplist_internal_marked(uintptr_t next)
+{
+	return next & TM_SKIPLIST_MARK;
+}
+
+static inline tm_skiplist_node_t *tm_skiplist_internal_node(uintptr_t next)
+{
+	return (tm_skiplist_node_t*)(next & ~TM_SKIPLIST_MARK);
+}
+
+static inline unsigned int tm_skiplist_internal_class(unsigned int height)
+{
+	return 1 == height ? 0 : 32 - __builtin_clz(height - 1);
+}
+
+static unsigned int tm_skiplist_internal_height(void)
+{
+	uint32_t seed = tm_skiplist_seed;
+
+	/* xorshift, seeded by address of per thread variable */
+	if (0 == seed) {
+		seed = (uint32_t)(uintptr_t)&tm_skiplist_seed | 1;
+	}
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	tm_skiplist_seed = seed;
+
+	/* One more level for each two zero bits */
+	return 1 + __builtin_ctz(seed | 1u << 30) / 2;
+}
+
+static void tm_skiplist_internal_pool_init(void)
+{
+	unsigned int i;
+	unsigned int j;
+	unsigned long number;
+
+	for (i = 0; i < TM_SKIPLIST_CLASS_MAX; i++) {
+		number = TM_SKIPLIST_POOL_OBJECTS >> (2 * i);
+		if (number < 64) {
+			number = 64;
+		}
+
+		if (0 != tm_pool_init(&tm_skiplist_pool[i],
+				      sizeof(tm_skiplist_node_t) +
+				      sizeof(uintptr_t) * (1u << i),
+				      number, TM_POOL_OPTION_GROW)) {
+			for (j = 0; j < i; j++) {
+				tm_pool_destroy(&tm_skiplist_pool[j]);
+			}
+			return;
+		}
+	}
+
+	tm_skiplist_pool_ready = true;
+}
+
+static void tm_skiplist_internal_node_free(tm_skiplist_node_t *node)
+{
+	tm_pool_free(&tm_skiplist_pool[tm_skiplist_internal_class(
+							node->height)], node);
+}
+
+static bool tm_skiplist_internal_claim(tm_skiplist_priv_t *priv,
+				       tm_skiplist_reader_t *reader)
+{
+	unsigned long idle = 0;
+
+	return atomic_compare_exchange_strong(&reader->epoch, &idle,
+					      atomic_load(&priv->epoch));
+}
+
+/* Take an idle record, register a new one if all busy, NULL if no memory */
+static tm_skiplist_reader_t *tm_skiplist_internal_enter(
+					tm_skiplist_priv_t *priv)
+{
+	tm_skiplist_reader_t *reader = NULL;
+
+	/* Id is never reused, so cached record is of this list */
+	if (priv->id == tm_skiplist_cache_id &&
+	    tm_skiplist_internal_claim(priv, tm_skiplist_cache)) {
+		return tm_skiplist_cache;
+	}
+
+	for (reader = atomic_load(&priv->reader); NULL != reader;
+	     reader = reader->next) {
+		if (tm_skiplist_internal_claim(priv, reader)) {
+			break;
+		}
+	}
+
+	if (NULL == reader) {
+		reader = (tm_skiplist_reader_t*)aligned_alloc(
+					_Alignof(tm_skiplist_reader_t),
+					sizeof(tm_skiplist_reader_t));
+		if (NULL == reader) {
+			return NULL;
+		}
+
+		/* Busy from the moment it is reachable by reclaim */
+		atomic_init(&reader->epoch, atomic_load(&priv->epoch));
+		reader->next = atomic_load(&priv->reader);
+		while (!atomic_compare_exchange_weak(&priv->reader,
+						     &reader->next, reader));
+	}
+
+	tm_skiplist_cache_id = priv->id;
+	tm_skiplist_cache = reader;
+
+	return reader;
+}
+
+static void tm_skiplist_internal_leave(tm_skiplist_reader_t *reader)
+{
+	atomic_store(&reader->epoch, 0);
+}
+
+static void tm_skiplist_internal_free_list(tm_skiplist_node_t *node)
+{
+	tm_skiplist_node_t *next;
+
+	for (; NULL != node; node = next) {
+		next = node->retired;
+		tm_skiplist_internal_node_free(node);
+	}
+}
+
+/*
+ * Move epoch on if every running operation is in current epoch. Limbo list
+ * of epoch - 2 is taken before the new epoch is published, so nothing new is
+ * put on it while we take it.
+ * */
+static void tm_skiplist_internal_reclaim(tm_skiplist_priv_t *priv)
+{
+	unsigned long epoch;
+	unsigned long started;
+	tm_skiplist_reader_t *reader;
+	tm_skiplist_node_t *node;
+
+	if (thrd_success != mtx_trylock(&priv->reclaim_lock)) {
+		return;
+	}
+
+	epoch = atomic_load(&priv->epoch);
+
+	for (reader = atomic_load(&priv->reader); NULL != reader;
+	     reader = reader->next) {
+		started = atomic_load(&reader->epoch);
+		if (0 != started && epoch != started) {
+			mtx_unlock(&priv->reclaim_lock);
+			return;
+		}
+	}
+
+	node = atomic_exchange(&priv->limbo[(epoch + 1) % 3], NULL);
+	atomic_store(&priv->epoch, epoch + 1);
+
+	mtx_unlock(&priv->reclaim_lock);
+
+	tm_skiplist_internal_free_list(node);
+}
+
+/* Caller should be in an operation and @node should be unreachable */
+static void tm_skiplist_internal_retire(tm_skiplist_priv_t *priv,
+					tm_skiplist_node_t *node)
+{
+	_Atomic(tm_skiplist_node_t *) *limbo;
+
+	limbo = &priv->limbo[atomic_load(&priv->epoch) % 3];
+
+	node->retired = atomic_load(limbo);
+	while (!atomic_compare_exchange_weak(limbo, &node->retired, node));
+
+	if (0 == (atomic_fetch_add(&priv->retired_number, 1) + 1) %
+		 TM_SKIPLIST_RECLAIM_BATCH) {
+		tm_skiplist_internal_reclaim(priv);
+	}
+}
+
+/* The second of insert and erase to finish retire the node */
+static void tm_skiplist_internal_done(tm_skiplist_priv_t *priv,
+				      tm_skiplist_node_t *node,
+				      unsigned int state)
+{
+	if ((TM_SKIPLIST_NODE_INSERTED | TM_SKIPLIST_NODE_ERASED) ==
+	    (atomic_fetch_or(&node->state, state) | state)) {
+		tm_skiplist_internal_retire(priv, node);
+	}
+}
+
+/*
+ * Find predecessors and successors of @key on each level, unlink erased
+ * nodes on the way. Erased nodes are unlinked even when they have the same
+ * key, so an erased node is unreachable once this return after it is fully
+ * marked.
+ * */
+static bool tm_skiplist_internal_search(tm_skiplist_priv_t *priv,
+					unsigned long key,
+					tm_skiplist_node_t **preds,
+					tm_skiplist_node_t **succs)
+{
+	int level;
+	bool retry;
+	uintptr_t next;
+	uintptr_t expected;
+	tm_skiplist_node_t *pred;
+	tm_skiplist_node_t *curr = NULL;
+
+	do {
+		retry = false;
+		pred = priv->head;
+
+		for (level = TM_SKIPLIST_LEVEL_MAX - 1; level >= 0 && !retry;
+		     level--) {
+			curr = tm_skiplist_internal_node(
+					atomic_load(&pred->next[level]));
+
+			while (NULL != curr) {
+				next = atomic_load(&curr->next[level]);
+
+				if (tm_skiplist_internal_marked(next)) {
+					/* Fail if pred is changed or erased */
+					expected = (uintptr_t)curr;
+					if (!atomic_compare_exchange_strong(
+						&pred->next[level], &expected,
+						next & ~TM_SKIPLIST_MARK)) {
+						retry = true;
+						break;
+					}
+
+					curr = tm_skiplist_internal_node(next);
+					continue;
+				}
+
+				if (curr->key >= key) {
+					break;
+				}
+
+				pred = curr;
+				curr = tm_skiplist_internal_node(next);
+			}
+
+			preds[level] = pred;
+			succs[level] = curr;
+		}
+	} while (retry);
+
+	return NULL != curr && key == curr->key;
+}
+
+/* First node not less than @key, never write */
+static tm_skiplist_node_t *tm_skiplist_internal_lower_bound(
+					tm_skiplist_priv_t *priv,
+					unsigned long key)
+{
+	int level;
+	uintptr_t next;
+	tm_skiplist_node_t *pred = priv->head;
+	tm_skiplist_node_t *curr = NULL;
+
+	for (level = TM_SKIPLIST_LEVEL_MAX - 1; level >= 0; level--) {
+		curr = tm_skiplist_internal_node(
+				atomic_load(&pred->next[level]));
+
+		while (NULL != curr) {
+			next = atomic_load(&curr->next[level]);
+
+			/* Step over erased nodes, never stand on one */
+			while (tm_skiplist_internal_marked(next)) {
+				curr = tm_skiplist_internal_node(next);
+				if (NULL == curr) {
+					break;
+				}
+				next = atomic_load(&curr->next[level]);
+			}
+
+			if (NULL == curr || curr->key >= key) {
+				break;
+			}
+
+			pred = curr;
+			curr = tm_skiplist_internal_node(next);
+		}
+	}
+
+	return curr;
+}
+
+/* Link upper levels of @node, stop once it is erased */
+static void tm_skiplist_internal_link(tm_skiplist_priv_t *priv,
+				      tm_skiplist_node_t *node,
+				      tm_skiplist_node_t **preds,
+				      tm_skiplist_node_t **succs)
+{
+	unsigned int i;
+	uintptr_t next;
+	uintptr_t expected;
+
+	for (i = 1; i < node->height; i++) {
+		while (true) {
+			/* Erase mark upper levels first, do not undo it */
+			next = atomic_load(&node->next[i]);
+			if (tm_skiplist_internal_marked(next) ||
+			    (next != (uintptr_t)succs[i] &&
+			     !atomic_compare_exchange_strong(&node->next[i],
+						&next, (uintptr_t)succs[i]))) {
+				return;
+			}
+
+			expected = (uintptr_t)succs[i];
+			if (atomic_compare_exchange_strong(&preds[i]->next[i],
+							   &expected,
+							   (uintptr_t)node)) {
+				break;
+			}
+
+			/* Neighbours changed, look again */
+			if (!tm_skiplist_internal_search(priv, node->key, preds,
+							 succs) ||
+			    succs[0] != node) {
+				return;
+			}
+		}
+	}
+}
+
+static int tm_skiplist_internal_insert(tm_skiplist_priv_t **priv,
+				       unsigned long key, void *data)
+{
+	int ret = 0;
+	unsigned int i;
+	unsigned int height;
+	uintptr_t expected;
+	bool linked = false;
+	void *old;
+	tm_skiplist_node_t *node = NULL;
+	tm_skiplist_node_t *preds[TM_SKIPLIST_LEVEL_MAX];
+	tm_skiplist_node_t *succs[TM_SKIPLIST_LEVEL_MAX];
+	tm_skiplist_reader_t *reader;
+
+	reader = tm_skiplist_internal_enter(*priv);
+	if (NULL == reader) {
+		return -1;
+	}
+
+	while (true) {
+		if (tm_skiplist_internal_search(*priv, key, preds, succs)) {
+			/* Already there, update data unless erase took it */
+			old = atomic_load(&succs[0]->data);
+			while (TM_SKIPLIST_ERASED_DATA != old &&
+			       !atomic_compare_exchange_weak(&succs[0]->data,
+							     &old, data));
+			if (TM_SKIPLIST_ERASED_DATA != old) {
+				break;
+			}
+
+			/* Erased meanwhile, it is marked so search skip it */
+			continue;
+		}
+
+		if (NULL == node) {
+			height = tm_skiplist_internal_height();
+
+			if (0 != tm_pool_alloc(&tm_skiplist_pool[
+					tm_skiplist_internal_class(height)],
+					(void**)&node)) {
+				ret = -1;
+				node = NULL;
+				break;
+			}
+
+			node->key = key;
+			atomic_init(&node->data, data);
+			node->retired = NULL;
+			atomic_init(&node->state, 0);
+			node->height = height;
+		}
+
+		for (i = 0; i < node->height; i++) {
+			atomic_init(&node->next[i], (uintptr_t)succs[i]);
+		}
+
+		/* Element exist once linked on level 0 */
+		expected = (uintptr_t)succs[0];
+		if (atomic_compare_exchange_strong(&preds[0]->next[0],
+						   &expected,
+						   (uintptr_t)node)) {
+			linked = true;
+			break;
+		}
+	}
+
+	if (linked) {
+		atomic_fetch_add(&(*priv)->size, 1);
+
+		tm_skiplist_internal_link(*priv, node, preds, succs);
+
+		/* Erased while linking, unlink levels linked after its search */
+		if (tm_skiplist_internal_marked(atomic_load(&node->next[0]))) {
+			tm_skiplist_internal_search(*priv, key, preds, succs);
+		}
+
+		tm_skiplist_internal_done(*priv, node,
+					  TM_SKIPLIST_NODE_INSERTED);
+	} else if (NULL != node) {
+		/* Never seen by others */
+		tm_skiplist_internal_node_free(node);
+	}
+
+	tm_skiplist_internal_leave(reader);
+
+	return ret;
+}
+
+static int tm_skiplist_internal_find(tm_skiplist_priv_t **priv,
+				     unsigned long key, void **data)
+{
+	int ret = -1;
+	void *value;
+	tm_skiplist_node_t *node;
+	tm_skiplist_reader_t *reader;
+
+	reader = tm_skiplist_internal_enter(*priv);
+	if (NULL == reader) {
+		return -1;
+	}
+
+	node = tm_skiplist_internal_lower_bound(*priv, key);
+	if (NULL != node && key == node->key) {
+		value = atomic_load(&node->data);
+		if (TM_SKIPLIST_ERASED_DATA != value) {
+			if (NULL != data) {
+				*data = value;
+			}
+			ret = 0;
+		}
+	}
+
+	tm_skiplist_internal_leave(reader);
+
+	return ret;
+}
+
+static int tm_skiplist_internal_erase(tm_skiplist_priv_t **priv,
+				      unsigned long key, void **data)
+{
+	int ret = -1;
+	unsigned int i;
+	uintptr_t next;
+	void *value;
+	tm_skiplist_node_t *node;
+	tm_skiplist_node_t *preds[TM_SKIPLIST_LEVEL_MAX];
+	tm_skiplist_node_t *succs[TM_SKIPLIST_LEVEL_MAX];
+	tm_skiplist_reader_t *reader;
+
+	reader = tm_skiplist_internal_enter(*priv);
+	if (NULL == reader) {
+		return -1;
+	}
+
+	if (!tm_skiplist_internal_search(*priv, key, preds, succs)) {
+		tm_skiplist_internal_leave(reader);
+		return -1;
+	}
+
+	node = succs[0];
+
+	/* Top down, level 0 last */
+	for (i = node->height - 1; i > 0; i--) {
+		next = atomic_load(&node->next[i]);
+		while (!tm_skiplist_internal_marked(next) &&
+		       !atomic_compare_exchange_weak(&node->next[i], &next,
+						     next | TM_SKIPLIST_MARK));
+	}
+
+	/* Whoever mark level 0 erased it */
+	next = atomic_load(&node->next[0]);
+	while (!tm_skiplist_internal_marked(next)) {
+		if (atomic_compare_exchange_weak(&node->next[0], &next,
+						 next | TM_SKIPLIST_MARK)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if (0 == ret) {
+		/* Any update after this see the tombstone and insert anew */
+		value = atomic_exchange(&node->data, TM_SKIPLIST_ERASED_DATA);
+		if (NULL != data) {
+			*data = value;
+		}
+
+		atomic_fetch_sub(&(*priv)->size, 1);
+
+		/* Unlink it from all levels */
+		tm_skiplist_internal_search(*priv, key, preds, succs);
+
+		tm_skiplist_internal_done(*priv, node, TM_SKIPLIST_NODE_ERASED);
+	}
+
+	tm_skiplist_internal_leave(reader);
+
+	return ret;
+}
+
+static int tm_skiplist_internal_scan(tm_skiplist_priv_t **priv,
+				     unsigned long first, unsigned long last,
+				     tm_skiplist_scan_entry_t entry, void *arg)
+{
+	uintptr_t next;
+	void *value;
+	tm_skiplist_node_t *node;
+	tm_skiplist_reader_t *reader;
+
+	if (NULL == entry || first > last) {
+		return -1;
+	}
+
+	reader = tm_skiplist_internal_enter(*priv);
+	if (NULL == reader) {
+		return -1;
+	}
+
+	node = tm_skiplist_internal_lower_bound(*priv, first);
+
+	while (NULL != node && node->key <= last) {
+		next = atomic_load(&node->next[0]);
+		value = atomic_load(&node->data);
+
+		if (!tm_skiplist_internal_marked(next) &&
+		    TM_SKIPLIST_ERASED_DATA != value &&
+		    0 != entry(node->key, value, arg)) {
+			break;
+		}
+
+		node = tm_skiplist_internal_node(next);
+	}
+
+	tm_skiplist_internal_leave(reader);
+
+	return 0;
+}
+
+static int tm_skiplist_internal_get_size(tm_skiplist_priv_t **priv,
+					 unsigned long *size)
+{
+	if (NULL == size) {
+		return -1;
+	}
+
+	*size = atomic_load(&(*priv)->size);
+
+	return 0;
+}
+
+static int tm_skiplist_internal_init(tm_skiplist_priv_t **priv)
+{
+	unsigned int i;
+
+	call_once(&tm_skiplist_pool_once, tm_skiplist_internal_pool_init);
+	if (!tm_skiplist_pool_ready) {
+		return -1;
+	}
+
+	(*priv) = (tm_skiplist_priv_t*)aligned_alloc(_Alignof(tm_skiplist_priv_t),
+						    sizeof(tm_skiplist_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->head = (tm_skiplist_node_t*)aligned_alloc(64,
+				(sizeof(tm_skiplist_node_t) +
+				 sizeof(uintptr_t) * TM_SKIPLIST_LEVEL_MAX +
+				 63) & ~63ul);
+	if (NULL == (*priv)->head) {
+		free(*priv);
+		return -1;
+	}
+
+	(*priv)->head->key = 0;
+	atomic_init(&(*priv)->head->data, NULL);
+	(*priv)->head->retired = NULL;
+	atomic_init(&(*priv)->head->state, 0);
+	(*priv)->head->height = TM_SKIPLIST_LEVEL_MAX;
+	for (i = 0; i < TM_SKIPLIST_LEVEL_MAX; i++) {
+		atomic_init(&(*priv)->head->next[i], 0);
+	}
+
+	(*priv)->id = atomic_fetch_add(&tm_skiplist_id, 1) + 1;
+	atomic_init(&(*priv)->size, 0);
+	atomic_init(&(*priv)->epoch, 1);
+	atomic_init(&(*priv)->retired_number, 0);
+	for (i = 0; i < 3; i++) {
+		atomic_init(&(*priv)->limbo[i], NULL);
+	}
+	mtx_init(&(*priv)->reclaim_lock, mtx_plain);
+	atomic_init(&(*priv)->reader, NULL);
+
+	return 0;
+}
+
+static int tm_skiplist_internal_destroy(tm_skiplist_priv_t **priv)
+{
+	unsigned int i;
+	uintptr_t next;
+	tm_skiplist_node_t *node;
+	tm_skiplist_reader_t *reader;
+
+	/* Nothing is running, erased nodes are all unlinked and in limbo */
+	node = tm_skiplist_internal_node(atomic_load(&(*priv)->head->next[0]));
+	while (NULL != node) {
+		next = atomic_load(&node->next[0]);
+		if (!tm_skiplist_internal_marked(next)) {
+			tm_skiplist_internal_node_free(node);
+		}
+		node = tm_skiplist_internal_node(next);
+	}
+
+	for (i = 0; i < 3; i++) {
+		tm_skiplist_internal_free_list(atomic_load(&(*priv)->limbo[i]));
+	}
+
+	while (NULL != (reader = atomic_load(&(*priv)->reader))) {
+		atomic_store(&(*priv)->reader, reader->next);
+		free(reader);
+	}
+
+	mtx_destroy(&(*priv)->reclaim_lock);
+
+	free((*priv)->head);
+	free(*priv);
+
+	(*priv) = NULL;
+
+	return 0;
+}
+
+
+int tm_skiplist_init(tm_skiplist_t *list)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	list->priv = NULL;
+
+	return tm_skiplist_internal_init((tm_skiplist_priv_t**)&list->priv);
+}
+
+int tm_skiplist_destroy(tm_skiplist_t *list)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	if (NULL == list->priv) {
+		return -1;
+	}
+
+	return tm_skiplist_internal_destroy((tm_skiplist_priv_t**)&list->priv);
+}
+
+int tm_skiplist_insert(tm_skiplist_t *list, unsigned long key, void *data)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	if (NULL == list->priv) {
+		return -1;
+	}
+
+	return tm_skiplist_internal_insert((tm_skiplist_priv_t**)&list->priv,
+					   key, data);
+}
+
+int tm_skiplist_find(tm_skiplist_t *list, unsigned long key, void **data)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	if (NULL == list->priv) {
+		return -1;
+	}
+
+	return tm_skiplist_internal_find((tm_skiplist_priv_t**)&list->priv,
+					 key, data);
+}
+
+int tm_skiplist_erase(tm_skiplist_t *list, unsigned long key, void **data)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	if (NULL == list->priv) {
+		return -1;
+	}
+
+	return tm_skiplist_internal_erase((tm_skiplist_priv_t**)&list->priv,
+					  key, data);
+}
+
+int tm_skiplist_scan(tm_skiplist_t *list, unsigned long first,
+		     unsigned long last, tm_skiplist_scan_entry_t entry,
+		     void *arg)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	if (NULL == list->priv) {
+		return -1;
+	}
+
+	return tm_skiplist_internal_scan((tm_skiplist_priv_t**)&list->priv,
+					 first, last, entry, arg);
+}
+
+int tm_skiplist_get_size(tm_skiplist_t *list, unsigned long *size)
+{
+	if (NULL == list) {
+		return -1;
+	}
+
+	if (NULL == list->priv) {
+		return -1;
+	}
+
+	return tm_skiplist_internal_get_size((tm_skiplist_priv_t**)&list->priv,
+					     size);
+}
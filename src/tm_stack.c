@@ -6,10 +6,62 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #include <threads.h>
 
 #include "tm_stack.h"
+#include "tm_arena.h"
+
+/* Max width of collision array */
+#define TM_STACK_ELIMINATION_SLOTS	16u
+
+/* Spins an offer wait in collision array for its partner */
+#define TM_STACK_ELIMINATION_SPIN	256u
+
+/* Failed eliminations before waiting on the lock */
+#define TM_STACK_ELIMINATION_ROUNDS	8u
+
+/**
+ * enum tm_stack_slot_state_e - State of a collision slot
+ *
+ * An offer is made by the thread which turn a free slot into waiting, a
+ * partner take it by moving it into taking and then done. Only the offering
+ * thread set the slot free again.
+ *
+ * @TM_STACK_SLOT_FREE: Nobody is here
+ *
+ * @TM_STACK_SLOT_LOCKED: Push is writing its data before it offer
+ *
+ * @TM_STACK_SLOT_PUSH: Push offer waiting for a pop
+ *
+ * @TM_STACK_SLOT_POP: Pop offer waiting for a push
+ *
+ * @TM_STACK_SLOT_TAKING: Partner is moving data
+ *
+ * @TM_STACK_SLOT_DONE: Exchange done, waiting for offer to see it
+ * */
+typedef enum tm_stack_slot_state_e {
+	TM_STACK_SLOT_FREE = 0,
+	TM_STACK_SLOT_LOCKED = 1,
+	TM_STACK_SLOT_PUSH = 2,
+	TM_STACK_SLOT_POP = 3,
+	TM_STACK_SLOT_TAKING = 4,
+	TM_STACK_SLOT_DONE = 5,
+} tm_stack_slot_state_t;
+
+/**
+ * struct tm_stack_slot_s - Collision slot of elimination
+ *
+ * @state: See tm_stack_slot_state_t
+ *
+ * @data: Element being exchanged
+ * */
+typedef struct tm_stack_slot_s {
+	_Alignas(64) atomic_int state;
+	void *data;
+} tm_stack_slot_t;
 
 /**
  * struct tm_stack_attribute_s - Stack attribute
@@ -44,12 +96,28 @@ typedef struct tm_stack_item_s {
  * @attribute: Attribute of this stack
  *
  * @top: Top pointer
+ *
+ * @width: Number of collision slots in use, grow when slots are busy and
+ *	   shrink when offers time out
+ *
+ * @slot: Collision array of TM_STACK_OPTION_ELIMINATION, NULL otherwise
+ *
+ * @arena: Node arena of TM_STACK_OPTION_COMPACT, NULL otherwise
+ *
+ * @compact_top: Top of TM_STACK_OPTION_COMPACT, tag << 32 | reference
  * */
 typedef struct tm_stack_priv_s {
 	tm_stack_attribute_t *attribute;
 	tm_stack_item_t *top;
+	atomic_uint width;
+	tm_stack_slot_t *slot;
+	tm_arena_t *arena;
+	_Alignas(64) _Atomic(uint64_t) compact_top;
 } tm_stack_priv_t;
 
+/* Seed of slot choice */
+static thread_local uint32_t tm_stack_seed;
+
 
 static int tm_stack_internal_get_option(tm_stack_priv_t **priv,
 					unsigned long *option)
@@ -70,15 +138,289 @@ static int tm_stack_internal_set_option(tm_stack_priv_t **priv,
 		return -1;
 	}
 
+	/* Collision array and arena are only allocated at init */
+	if ((option ^ (*priv)->attribute->option) &
+	    (TM_STACK_OPTION_ELIMINATION | TM_STACK_OPTION_COMPACT)) {
+		return -1;
+	}
+
 	(*priv)->attribute->option = option;
 
 	return 0;
 }
 
+static inline void tm_stack_internal_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void tm_stack_internal_width_grow(tm_stack_priv_t **priv)
+{
+	unsigned int width = atomic_load_explicit(&(*priv)->width,
+						  memory_order_relaxed);
+
+	if (width < TM_STACK_ELIMINATION_SLOTS) {
+		atomic_compare_exchange_weak_explicit(&(*priv)->width, &width,
+						      width + 1,
+						      memory_order_relaxed,
+						      memory_order_relaxed);
+	}
+}
+
+static void tm_stack_internal_width_shrink(tm_stack_priv_t **priv)
+{
+	unsigned int width = atomic_load_explicit(&(*priv)->width,
+						  memory_order_relaxed);
+
+	if (width > 1) {
+		atomic_compare_exchange_weak_explicit(&(*priv)->width, &width,
+						      width - 1,
+						      memory_order_relaxed,
+						      memory_order_relaxed);
+	}
+}
+
+/* Wait for partner of an offer, false if nobody came */
+static bool tm_stack_internal_offer_wait(tm_stack_slot_t *slot, int offer)
+{
+	int state;
+	unsigned int i;
+
+	for (i = 0; i < TM_STACK_ELIMINATION_SPIN; i++) {
+		if (TM_STACK_SLOT_DONE == atomic_load(&slot->state)) {
+			return true;
+		}
+		tm_stack_internal_relax();
+	}
+
+	/* Withdraw, unless a partner is taking it right now */
+	state = offer;
+	if (atomic_compare_exchange_strong(&slot->state, &state,
+					   TM_STACK_SLOT_FREE)) {
+		return false;
+	}
+
+	while (TM_STACK_SLOT_DONE != atomic_load(&slot->state)) {
+		tm_stack_internal_relax();
+	}
+
+	return true;
+}
+
+/*
+ * Try to cancel out with an opposite operation in collision array. @data is
+ * the element of a push, or where to save the element of a pop.
+ * */
+static bool tm_stack_internal_eliminate(tm_stack_priv_t **priv, bool push,
+					void **data)
+{
+	int state;
+	uint32_t seed = tm_stack_seed;
+	tm_stack_slot_t *slot;
+	int offer = push ? TM_STACK_SLOT_PUSH : TM_STACK_SLOT_POP;
+	int wanted = push ? TM_STACK_SLOT_POP : TM_STACK_SLOT_PUSH;
+
+	/* xorshift, seeded by address of per thread variable */
+	if (0 == seed) {
+		seed = (uint32_t)(uintptr_t)&tm_stack_seed | 1;
+	}
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	tm_stack_seed = seed;
+
+	slot = &(*priv)->slot[seed % atomic_load_explicit(&(*priv)->width,
+							 memory_order_relaxed)];
+
+	state = atomic_load(&slot->state);
+
+	/* Partner is waiting here */
+	if (wanted == state) {
+		if (!atomic_compare_exchange_strong(&slot->state, &state,
+						    TM_STACK_SLOT_TAKING)) {
+			tm_stack_internal_width_grow(priv);
+			return false;
+		}
+
+		if (push) {
+			slot->data = *data;
+		} else {
+			*data = slot->data;
+		}
+
+		atomic_store(&slot->state, TM_STACK_SLOT_DONE);
+
+		return true;
+	}
+
+	/* Slot is used by someone else */
+	if (TM_STACK_SLOT_FREE != state) {
+		tm_stack_internal_width_grow(priv);
+		return false;
+	}
+
+	if (push) {
+		if (!atomic_compare_exchange_strong(&slot->state, &state,
+						    TM_STACK_SLOT_LOCKED)) {
+			tm_stack_internal_width_grow(priv);
+			return false;
+		}
+		slot->data = *data;
+		atomic_store(&slot->state, TM_STACK_SLOT_PUSH);
+	} else if (!atomic_compare_exchange_strong(&slot->state, &state,
+						   TM_STACK_SLOT_POP)) {
+		tm_stack_internal_width_grow(priv);
+		return false;
+	}
+
+	if (!tm_stack_internal_offer_wait(slot, offer)) {
+		/* Too wide for current contention */
+		tm_stack_internal_width_shrink(priv);
+		return false;
+	}
+
+	if (!push) {
+		*data = slot->data;
+	}
+
+	atomic_store(&slot->state, TM_STACK_SLOT_FREE);
+
+	return true;
+}
+
+/*
+ * Take the stack lock, false if the operation is eliminated on the way.
+ * Only used by TM_STACK_OPTION_ELIMINATION.
+ * */
+static bool tm_stack_internal_lock_or_eliminate(tm_stack_priv_t **priv,
+						bool push, void **data)
+{
+	unsigned int round;
+
+	for (round = 0; round < TM_STACK_ELIMINATION_ROUNDS; round++) {
+		if (thrd_success == mtx_trylock(&(*priv)->attribute->lock)) {
+			return true;
+		}
+
+		if (tm_stack_internal_eliminate(priv, push, data)) {
+			return false;
+		}
+	}
+
+	mtx_lock(&(*priv)->attribute->lock);
+
+	return true;
+}
+
+/*
+ * Compact stack is a Treiber stack over arena references. Reading link of a
+ * node which is poped and reused by others at the same time is harmless,
+ * arena memory stay valid and the tag of top make the CAS fail.
+ * */
+static int tm_stack_internal_compact_push(tm_stack_priv_t **priv, void *data)
+{
+	uint32_t reference;
+	uint64_t old;
+	uint64_t new;
+	bool elimination = (*priv)->attribute->option &
+			   TM_STACK_OPTION_ELIMINATION;
+
+	if (0 != tm_arena_alloc((*priv)->arena, &reference)) {
+		return -1;
+	}
+
+	*tm_arena_item((*priv)->arena, reference) = data;
+
+	old = atomic_load_explicit(&(*priv)->compact_top,
+				   memory_order_relaxed);
+
+	while (true) {
+		atomic_store_explicit(tm_arena_link((*priv)->arena, reference),
+				      (uint32_t)old, memory_order_relaxed);
+
+		new = ((old >> 32) + 1) << 32 | reference;
+
+		if (atomic_compare_exchange_weak_explicit(&(*priv)->compact_top,
+							  &old, new,
+							  memory_order_release,
+							  memory_order_relaxed)) {
+			return 0;
+		}
+
+		if (elimination &&
+		    tm_stack_internal_eliminate(priv, true, &data)) {
+			/* A pop took it directly */
+			tm_arena_free((*priv)->arena, reference);
+			return 0;
+		}
+
+		old = atomic_load_explicit(&(*priv)->compact_top,
+					   memory_order_relaxed);
+	}
+}
+
+static int tm_stack_internal_compact_pop(tm_stack_priv_t **priv, void **data)
+{
+	void *value;
+	uint32_t next;
+	uint64_t old;
+	uint64_t new;
+	bool elimination = (*priv)->attribute->option &
+			   TM_STACK_OPTION_ELIMINATION;
+
+	old = atomic_load_explicit(&(*priv)->compact_top,
+				   memory_order_acquire);
+
+	while (true) {
+		/* Stack empty */
+		if (0 == (uint32_t)old) {
+			return -1;
+		}
+
+		next = atomic_load_explicit(tm_arena_link((*priv)->arena,
+							  (uint32_t)old),
+					    memory_order_relaxed);
+
+		new = ((old >> 32) + 1) << 32 | next;
+
+		if (atomic_compare_exchange_weak_explicit(&(*priv)->compact_top,
+							  &old, new,
+							  memory_order_acquire,
+							  memory_order_acquire)) {
+			break;
+		}
+
+		if (elimination &&
+		    tm_stack_internal_eliminate(priv, false, &value)) {
+			/* Got it from a push directly */
+			if (NULL != data) {
+				*data = value;
+			}
+			return 0;
+		}
+
+		old = atomic_load_explicit(&(*priv)->compact_top,
+					   memory_order_acquire);
+	}
+
+	if (NULL != data) {
+		*data = *tm_arena_item((*priv)->arena, (uint32_t)old);
+	}
+	tm_arena_free((*priv)->arena, (uint32_t)old);
+
+	return 0;
+}
+
 static int tm_stack_internal_push(tm_stack_priv_t **priv, void *data)
 {
 	tm_stack_item_t *item;
 
+	if ((*priv)->attribute->option & TM_STACK_OPTION_COMPACT) {
+		return tm_stack_internal_compact_push(priv, data);
+	}
+
 	/* Alloc space for data */
 	item = (tm_stack_item_t*)malloc(sizeof(tm_stack_item_t));
 	if (NULL == item) {
@@ -90,7 +432,13 @@ static int tm_stack_internal_push(tm_stack_priv_t **priv, void *data)
 
 	/* Push item to stack */
 
-	if ((*priv)->attribute->option | TM_STACK_OPTION_MULTI_THREAD) {
+	if ((*priv)->attribute->option & TM_STACK_OPTION_ELIMINATION) {
+		if (!tm_stack_internal_lock_or_eliminate(priv, true, &data)) {
+			/* A pop took it directly */
+			free(item);
+			return 0;
+		}
+	} else if ((*priv)->attribute->option | TM_STACK_OPTION_MULTI_THREAD) {
 		mtx_lock(&(*priv)->attribute->lock);
 	}
 
@@ -117,9 +465,23 @@ static int tm_stack_internal_push(tm_stack_priv_t **priv, void *data)
 
 static int tm_stack_internal_pop(tm_stack_priv_t **priv, void **data)
 {
+	void *value;
 	tm_stack_item_t *item;
 
-	if ((*priv)->attribute->option | TM_STACK_OPTION_MULTI_THREAD) {
+	if ((*priv)->attribute->option & TM_STACK_OPTION_COMPACT) {
+		return tm_stack_internal_compact_pop(priv, data);
+	}
+
+	if ((*priv)->attribute->option & TM_STACK_OPTION_ELIMINATION) {
+		if (!tm_stack_internal_lock_or_eliminate(priv, false,
+							 &value)) {
+			/* Got it from a push directly */
+			if (NULL != data) {
+				*data = value;
+			}
+			return 0;
+		}
+	} else if ((*priv)->attribute->option | TM_STACK_OPTION_MULTI_THREAD) {
 		mtx_lock(&(*priv)->attribute->lock);
 	}
 
@@ -160,14 +522,58 @@ static int tm_stack_internal_pop(tm_stack_priv_t **priv, void **data)
 
 static int tm_stack_internal_init(tm_stack_priv_t **priv, unsigned long option)
 {
-	(*priv) = (tm_stack_priv_t*)malloc(sizeof(tm_stack_priv_t));
+	unsigned int i;
+
+	if (option >= TM_STACK_OPTION_MAX) {
+		return -1;
+	}
+
+	(*priv) = (tm_stack_priv_t*)aligned_alloc(_Alignof(tm_stack_priv_t),
+						  sizeof(tm_stack_priv_t));
 	if (NULL == (*priv)) {
 		return -1;
 	}
 
+	(*priv)->slot = NULL;
+	(*priv)->arena = NULL;
+	atomic_init(&(*priv)->width, 1);
+	atomic_init(&(*priv)->compact_top, 0);
+
+	if (option & TM_STACK_OPTION_COMPACT) {
+		(*priv)->arena = tm_arena_create();
+		if (NULL == (*priv)->arena) {
+			free(*priv);
+			return -1;
+		}
+	}
+
+	if (option & TM_STACK_OPTION_ELIMINATION) {
+		(*priv)->slot = (tm_stack_slot_t*)aligned_alloc(
+				_Alignof(tm_stack_slot_t),
+				sizeof(tm_stack_slot_t) *
+				TM_STACK_ELIMINATION_SLOTS);
+		if (NULL == (*priv)->slot) {
+			if (NULL != (*priv)->arena) {
+				tm_arena_destroy((*priv)->arena);
+			}
+			free(*priv);
+			return -1;
+		}
+
+		for (i = 0; i < TM_STACK_ELIMINATION_SLOTS; i++) {
+			atomic_init(&(*priv)->slot[i].state,
+				    TM_STACK_SLOT_FREE);
+			(*priv)->slot[i].data = NULL;
+		}
+	}
+
 	(*priv)->attribute =
 		(tm_stack_attribute_t*)malloc(sizeof(tm_stack_attribute_t));
 	if (NULL == (*priv)->attribute) {
+		if (NULL != (*priv)->arena) {
+			tm_arena_destroy((*priv)->arena);
+		}
+		free((*priv)->slot);
 		free(*priv);
 		return -1;
 	}
@@ -185,15 +591,20 @@ static int tm_stack_internal_destroy(tm_stack_priv_t **priv)
 {
 	int ret;
 
+	/* Remove all item, pop need attribute so do it first */
+	do {
+		ret = tm_stack_internal_pop(priv, NULL);
+	} while (ret == 0);
+
 	mtx_destroy(&(*priv)->attribute->lock);
 
 	free((*priv)->attribute);
 
-	/* Remove all item */
-	do {
-		ret = tm_stack_internal_pop(priv, NULL);
-	} while (ret == 0);
+	if (NULL != (*priv)->arena) {
+		tm_arena_destroy((*priv)->arena);
+	}
 
+	free((*priv)->slot);
 	free(*priv);
 
 	(*priv) = NULL;
@@ -3,11 +3,38 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 #include <threads.h>
 
-#include "thrd_pool.h"
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+
+#include "tm_queue.h"
+#include "tm_thread_pool.h"
+
+/* Submission queue depth of io_uring */
+#define TM_THREAD_POOL_IO_RING_ENTRIES	256u
+
+/* Milliseconds between enqueues of a completion the task queue refused */
+#define TM_THREAD_POOL_IO_RETRY_INTERVAL	1
+
+/* Polls of an idle worker searching for task before it park */
+#define TM_THREAD_POOL_SEARCH_SPIN	1024u
 
 /**
  * struct tm_thread_pool_attribute_s - Thread pool attribute
@@ -22,59 +49,894 @@ typedef struct tm_thread_pool_attribute_s {
 } tm_thread_pool_attribute_t;
 
 /**
- * struct tm_thread_pool_task_s - Thread pool task
+ * struct tm_thread_pool_cq_slot_s - One entry of completion queue
+ *
+ * @sequence: Position this slot is ready for, equal to position when free
+ *	      for worker, position + 1 when filled for reaper
+ *
+ * @entry: Finished task
+ * */
+typedef struct tm_thread_pool_cq_slot_s {
+	atomic_ulong sequence;
+	tm_thread_pool_cq_entry_t entry;
+} tm_thread_pool_cq_slot_t;
+
+/**
+ * struct tm_thread_pool_cq_priv_s - Private structure of completion queue
+ *
+ * Bounded multi producer single consumer ring. A worker claim a position by
+ * moving @tail, fill the slot then publish it by @sequence. Reaper and a
+ * worker waiting for room both park on an eventcount like idle workers do.
+ *
+ * @mask: Number of slots - 1
+ *
+ * @slot: Ring of entries
+ *
+ * @tail: Next position for worker
+ *
+ * @head: Next position for reaper
  *
- * @entry_func: User specified thread entry function, this is typedef of
- *		"int (*)(void*)"
+ * @ready: Eventcount futex word of reaper
  *
- * @entry_func_arg: User specified thread argument
+ * @reaping: Reaper is parked or about to park
  *
- * @event_cb: Event callback
+ * @room: Eventcount futex word of workers waiting on a full ring
+ *
+ * @waiters: Number of workers parked or about to park on @room
  * */
-typedef struct tm_thread_pool_task_s {
-	tm_thread_pool_task_entry_t entry_func;
-	void *entry_func_arg;
-	tm_thread_pool_task_event_t event_cb;
-} tm_thread_pool_task_t;
+typedef struct tm_thread_pool_cq_priv_s {
+	unsigned long mask;
+	tm_thread_pool_cq_slot_t *slot;
+	_Alignas(64) atomic_ulong tail;
+	_Alignas(64) unsigned long head;
+	atomic_uint ready;
+	atomic_int reaping;
+	_Alignas(64) atomic_uint room;
+	atomic_int waiters;
+} tm_thread_pool_cq_priv_t;
 
+/**
+ * struct tm_thread_pool_task_priv_s - Private structure of task
+ *
+ * @option: Option of this task
+ *
+ * @entry: User specified task entry function
+ *
+ * @arg: User specified task argument
+ *
+ * @event: Event callback
+ *
+ * @io: File operation to do before @entry, only used when io_uring is not
+ *	available or its completion queue is full
+ *
+ * @cq: Completion queue replacing TM_THREAD_POOL_EVENT_END, can be NULL
+ *
+ * @tag: User tag of entries in @cq
+ *
+ * @next: Next one in retry list of io_uring reaper
+ * */
+typedef struct tm_thread_pool_task_priv_s {
+	unsigned long option;
+	tm_thread_pool_task_entry_t entry;
+	void *arg;
+	tm_thread_pool_task_event_t event;
+	tm_thread_pool_io_t *io;
+	tm_thread_pool_cq_priv_t *cq;
+	void *tag;
+	struct tm_thread_pool_task_priv_s *next;
+} tm_thread_pool_task_priv_t;
+
+/**
+ * struct tm_thread_pool_io_ring_s - io_uring instance of thread pool
+ *
+ * @fd: io_uring file descriptor, -1 if io_uring is not available
+ *
+ * @sq_ptr: Mapped submission queue ring
+ *
+ * @sq_size: Size of @sq_ptr
+ *
+ * @cq_ptr: Mapped completion queue ring
+ *
+ * @cq_size: Size of @cq_ptr
+ *
+ * @sqes: Mapped submission queue entries
+ *
+ * @sqes_size: Size of @sqes
+ *
+ * @sq_*, @cq_*: Pointers into shared rings
+ *
+ * @cq_entries: Size of completion queue, @inflight never exceed it so
+ *		completions do not overflow the ring
+ *
+ * @lock: Serialize submitters
+ *
+ * @reaper: Thread which drive the completion queue
+ *
+ * @inflight: Number of submitted operations whose continuation is not in
+ *	      task queue yet
+ *
+ * @retry: Continuations task queue refused, only touched by @reaper
+ *
+ * @stop_fd: eventfd polled by @reaper together with @fd, written once by
+ *	     tm_thread_pool_destroy
+ *
+ * @stop: Reaper should exit once nothing is in flight
+ * */
+typedef struct tm_thread_pool_io_ring_s {
+	int fd;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned cq_entries;
+
+	mtx_t lock;
+	thrd_t reaper;
+	atomic_ulong inflight;
+	tm_thread_pool_task_priv_t *retry;
+	int stop_fd;
+	atomic_bool stop;
+} tm_thread_pool_io_ring_t;
+
+/**
+ * struct tm_thread_pool_task_excutor_s - Worker thread
+ *
+ * @thread_id: Thread id
+ *
+ * @thread_pool: Thread pool this worker belong to
+ * */
 typedef struct tm_thread_pool_task_excutor_s {
 	thrd_t thread_id;
-	unsigned long status;
+	struct tm_thread_pool_priv_s *thread_pool;
 } tm_thread_pool_task_excutor_t;
 
-typedef struct tm_thread_pool_task_excutor_list_s {
-	tm_thread_pool_task_excutor_t thread;
-}
-
+/**
+ * struct tm_thread_pool_priv_s - Private structure of thread pool
+ *
+ * @attribute: Attribute of this thread pool
+ *
+ * @task_queue: Committed tasks, tm_thread_pool_task_priv_t
+ *
+ * Idle workers first search, polling @pending for a short while, at most
+ * @searching_max of them at a time. The rest park on @epoch, an eventcount:
+ * a worker count itself in @sleepers, read @epoch, check @pending once more
+ * and only then futex wait on the value it read. Commit bump @pending before
+ * it look at @searching and @sleepers, so either the worker see the task or
+ * commit see the worker and move @epoch, nothing is lost in between. One
+ * commit wake at most one worker, and only when nobody is searching.
+ *
+ * @pending: Number of task in @task_queue not claimed by a worker yet
+ *
+ * @epoch: Eventcount futex word, bumped to wake parked workers
+ *
+ * @sleepers: Number of workers parked or about to park
+ *
+ * @searching: Number of workers searching
+ *
+ * @searching_max: Max number of searching workers
+ *
+ * @shutdown: Pool is about to destroy
+ *
+ * @excutor_number: Number of worker threads
+ *
+ * @excutor: Worker threads
+ *
+ * @io_ring: io_uring of this pool
+ * */
 typedef struct tm_thread_pool_priv_s {
-	tm_thread_pool_attribute_t attribute
+	tm_thread_pool_attribute_t attribute;
 	tm_queue_t task_queue;
+	_Alignas(64) atomic_ulong pending;
+	_Alignas(64) atomic_uint epoch;
+	atomic_int sleepers;
+	atomic_int searching;
+	int searching_max;
+	atomic_bool shutdown;
+	int excutor_number;
+	tm_thread_pool_task_excutor_t *excutor;
+	tm_thread_pool_io_ring_t io_ring;
 } tm_thread_pool_priv_t;
 
-typedef struct tm_thread_pool_task_att_s {
-	unsigned long option;
+
+static inline void tm_thread_pool_internal_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
 }
 
-typedef struct tm_thread_pool_task_priv_s {
-	tm_thread_pool_task_option_t *option;
-	tm_thread_pool_task_entry_t entry;
-	tm_thread_pool_task_event_t event;
+/* Move eventcount @word and wake up to @number threads parked on it */
+static void tm_thread_pool_internal_futex_wake(atomic_uint *word,
+					       int number)
+{
+	atomic_fetch_add(word, 1);
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, number, NULL, NULL, 0);
+}
+
+/* Wake up to @number parked workers */
+static void tm_thread_pool_internal_unpark(tm_thread_pool_priv_t *priv,
+					   int number)
+{
+	tm_thread_pool_internal_futex_wake(&priv->epoch, number);
+}
+
+/* New work is there, make sure someone is coming for it */
+static void tm_thread_pool_internal_notify(tm_thread_pool_priv_t *priv)
+{
+	/* A searcher will find it, and wake another one when it does */
+	if (0 != atomic_load(&priv->searching)) {
+		return;
+	}
+
+	if (0 != atomic_load(&priv->sleepers)) {
+		tm_thread_pool_internal_unpark(priv, 1);
+	}
+}
+
+static int tm_thread_pool_internal_enqueue(tm_thread_pool_priv_t *priv,
+					   tm_thread_pool_task_priv_t *task)
+{
+	int ret;
+
+	ret = tm_queue_push(&priv->task_queue, task);
+	if (0 != ret) {
+		return -1;
+	}
+
+	/* Pairs with the check of @pending after @sleepers++ in park */
+	atomic_fetch_add(&priv->pending, 1);
+
+	tm_thread_pool_internal_notify(priv);
+
+	return 0;
+}
+
+static bool tm_thread_pool_internal_claim(tm_thread_pool_priv_t *priv)
+{
+	unsigned long pending = atomic_load(&priv->pending);
+
+	while (0 != pending) {
+		if (atomic_compare_exchange_weak(&priv->pending, &pending,
+						 pending - 1)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Poll for a while, false if nothing came or too many are searching */
+static bool tm_thread_pool_internal_search(tm_thread_pool_priv_t *priv)
+{
+	int searching = atomic_load(&priv->searching);
+	unsigned int i;
+	bool found = false;
+
+	do {
+		if (searching >= priv->searching_max) {
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak(&priv->searching, &searching,
+					       searching + 1));
+
+	for (i = 0; i < TM_THREAD_POOL_SEARCH_SPIN; i++) {
+		if (tm_thread_pool_internal_claim(priv)) {
+			found = true;
+			break;
+		}
+
+		if (atomic_load_explicit(&priv->shutdown,
+					 memory_order_relaxed)) {
+			break;
+		}
+
+		tm_thread_pool_internal_relax();
+	}
+
+	/* Last searcher leave with work, hand searching over to another */
+	if (1 == atomic_fetch_sub(&priv->searching, 1) && found &&
+	    0 != atomic_load(&priv->pending)) {
+		tm_thread_pool_internal_notify(priv);
+	}
+
+	return found;
+}
+
+/* Something finished, let workers parked during shutdown exit */
+static void tm_thread_pool_internal_drained(tm_thread_pool_priv_t *priv)
+{
+	if (atomic_load(&priv->shutdown) &&
+	    0 == atomic_load(&priv->io_ring.inflight) &&
+	    0 == atomic_load(&priv->pending) &&
+	    0 != atomic_load(&priv->sleepers)) {
+		tm_thread_pool_internal_unpark(priv, INT_MAX);
+	}
+}
+
+/* Wait for a task, false when pool shutdown and all tasks are claimed */
+static bool tm_thread_pool_internal_wait(tm_thread_pool_priv_t *priv)
+{
+	unsigned int epoch;
+
+	while (true) {
+		if (tm_thread_pool_internal_claim(priv) ||
+		    tm_thread_pool_internal_search(priv)) {
+			return true;
+		}
+
+		atomic_fetch_add(&priv->sleepers, 1);
+		epoch = atomic_load(&priv->epoch);
+
+		/* Last check, a commit after this move @epoch */
+		if (tm_thread_pool_internal_claim(priv)) {
+			atomic_fetch_sub(&priv->sleepers, 1);
+			return true;
+		}
+
+		/*
+		 * Only exit when all committed task is done, reaper bump
+		 * @pending before it drop @inflight. Otherwise park as well,
+		 * the worker finishing the last task wake everyone up.
+		 * */
+		if (atomic_load(&priv->shutdown) &&
+		    0 == atomic_load(&priv->io_ring.inflight) &&
+		    0 == atomic_load(&priv->pending)) {
+			atomic_fetch_sub(&priv->sleepers, 1);
+			return false;
+		}
+
+		syscall(SYS_futex, &priv->epoch, FUTEX_WAIT_PRIVATE, epoch,
+			NULL, NULL, 0);
+
+		atomic_fetch_sub(&priv->sleepers, 1);
+	}
+}
+
+/* Add one entry, wait while ring is full, task is not touched after */
+static void tm_thread_pool_internal_cq_post(tm_thread_pool_cq_priv_t *cq,
+					    void *tag, void *status)
+{
+	long diff;
+	unsigned int room;
+	unsigned long position;
+	unsigned long sequence;
+	tm_thread_pool_cq_slot_t *slot;
+
+	position = atomic_load(&cq->tail);
+
+	while (true) {
+		slot = &cq->slot[position & cq->mask];
+		sequence = atomic_load(&slot->sequence);
+		diff = (long)(sequence - position);
+
+		if (0 == diff) {
+			if (atomic_compare_exchange_weak(&cq->tail, &position,
+							 position + 1)) {
+				break;
+			}
+			continue;
+		}
+
+		if (diff < 0) {
+			/* Full, park until reaper free this slot */
+			atomic_fetch_add(&cq->waiters, 1);
+			room = atomic_load(&cq->room);
+			if ((long)(atomic_load(&slot->sequence) - position) < 0) {
+				syscall(SYS_futex, &cq->room,
+					FUTEX_WAIT_PRIVATE, room, NULL, NULL,
+					0);
+			}
+			atomic_fetch_sub(&cq->waiters, 1);
+		}
+
+		position = atomic_load(&cq->tail);
+	}
+
+	slot->entry.tag = tag;
+	slot->entry.status = status;
+
+	/* Pairs with the check of this slot after @reaping is set */
+	atomic_store(&slot->sequence, position + 1);
+
+	if (0 != atomic_load(&cq->reaping)) {
+		tm_thread_pool_internal_futex_wake(&cq->ready, 1);
+	}
+}
+
+static void tm_thread_pool_internal_io_do(tm_thread_pool_io_t *io)
+{
+	ssize_t ret;
+
+	switch (io->opcode) {
+	case TM_THREAD_POOL_IO_OPCODE_READ:
+		ret = pread(io->fd, io->buf, io->length, io->offset);
+		break;
+	case TM_THREAD_POOL_IO_OPCODE_WRITE:
+		ret = pwrite(io->fd, io->buf, io->length, io->offset);
+		break;
+	case TM_THREAD_POOL_IO_OPCODE_FSYNC:
+		ret = fsync(io->fd);
+		break;
+	default:
+		ret = -1;
+		errno = EINVAL;
+		break;
+	}
+
+	io->result = ret < 0 ? -errno : ret;
 }
 
 static int tm_thread_pool_internal_task_excutor_entry(void *arg)
 {
+	void *status;
+	tm_thread_pool_task_priv_t *task;
+	tm_thread_pool_task_excutor_t *excutor = arg;
+	tm_thread_pool_priv_t *priv = excutor->thread_pool;
+
+	while (tm_thread_pool_internal_wait(priv)) {
+		if (0 != tm_queue_pop(&priv->task_queue, (void**)&task)) {
+			continue;
+		}
+
+		/* Fallback path of tm_thread_pool_io_commit */
+		if (NULL != task->io) {
+			tm_thread_pool_internal_io_do(task->io);
+			task->io = NULL;
+		}
+
+		if (NULL != task->event) {
+			task->event(TM_THREAD_POOL_EVENT_START, NULL);
+		}
+
+		status = task->entry(task->arg);
+
+		if (task->option & TM_THREAD_POOL_TASK_OPTION_NO_RETURN) {
+			status = NULL;
+		}
+
+		if (NULL != task->cq) {
+			tm_thread_pool_internal_cq_post(task->cq, task->tag,
+							status);
+		} else if (NULL != task->event) {
+			task->event(TM_THREAD_POOL_EVENT_END, status);
+		}
+
+		tm_thread_pool_internal_drained(priv);
+	}
+
 	return 0;
 }
 
-static int tm_thread_pool_internal_init(tm_thread_pool_priv_t **priv, int number)
+static int tm_thread_pool_internal_io_enter(tm_thread_pool_io_ring_t *ring,
+					    unsigned to_submit,
+					    unsigned min_complete,
+					    unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/* Caller should hold ring->lock */
+static int tm_thread_pool_internal_io_submit(tm_thread_pool_io_ring_t *ring,
+					     unsigned char opcode,
+					     tm_thread_pool_io_t *io)
 {
 	int ret;
+	unsigned tail;
+	unsigned index;
+	struct io_uring_sqe *sqe;
 
-	(*priv) = (tm_thread_pool_priv_t*)malloc(sizeof(tm_thread_pool_priv_t));
-	if (NULL == priv) {
+	tail = *ring->sq_tail;
+
+	/* Kernel consume all entries on each enter, should never be full */
+	if (tail - atomic_load_explicit((_Atomic unsigned*)ring->sq_head,
+					memory_order_acquire) >=
+	    TM_THREAD_POOL_IO_RING_ENTRIES) {
 		return -1;
 	}
 
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = (unsigned long)io;
+	sqe->fd = io->fd;
+
+	if (IORING_OP_FSYNC != opcode) {
+		sqe->addr = (unsigned long)io->buf;
+		sqe->len = io->length;
+		sqe->off = io->offset;
+	}
+
+	ring->sq_array[index] = index;
+
+	atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail + 1,
+			      memory_order_release);
+
+	while (true) {
+		ret = tm_thread_pool_internal_io_enter(ring, 1, 0, 0);
+		if (ret >= 0 || (EINTR != errno && EBUSY != errno &&
+				 EAGAIN != errno)) {
+			break;
+		}
+
+		/* Completion backlog or short of memory, reaper make room */
+		if (EINTR != errno) {
+			thrd_yield();
+		}
+	}
+
+	if (1 != ret) {
+		/* Take back this entry, kernel did not see it */
+		atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail,
+				      memory_order_release);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Hand a continuation to workers, false if task queue refused it */
+static bool tm_thread_pool_internal_io_dispatch(tm_thread_pool_priv_t *priv,
+					tm_thread_pool_task_priv_t *task)
+{
+	if (0 != tm_thread_pool_internal_enqueue(priv, task)) {
+		return false;
+	}
+
+	atomic_fetch_sub(&priv->io_ring.inflight, 1);
+	tm_thread_pool_internal_drained(priv);
+
+	return true;
+}
+
+/* Enqueue refused continuations again, in the order they completed */
+static void tm_thread_pool_internal_io_retry(tm_thread_pool_priv_t *priv)
+{
+	tm_thread_pool_io_ring_t *ring = &priv->io_ring;
+
+	while (NULL != ring->retry &&
+	       tm_thread_pool_internal_io_dispatch(priv, ring->retry)) {
+		ring->retry = ring->retry->next;
+	}
+}
+
+static int tm_thread_pool_internal_io_reaper_entry(void *arg)
+{
+	unsigned head;
+	unsigned tail;
+	struct io_uring_cqe *cqe;
+	tm_thread_pool_io_t *io;
+	tm_thread_pool_task_priv_t *task;
+	tm_thread_pool_task_priv_t **last;
+	tm_thread_pool_priv_t *priv = arg;
+	tm_thread_pool_io_ring_t *ring = &priv->io_ring;
+	struct pollfd pfd[2] = {
+		{ .fd = ring->fd, .events = POLLIN },
+		{ .fd = ring->stop_fd, .events = POLLIN },
+	};
+
+	while (true) {
+		tm_thread_pool_internal_io_retry(priv);
+
+		head = *ring->cq_head;
+		tail = atomic_load_explicit((_Atomic unsigned*)ring->cq_tail,
+					    memory_order_acquire);
+
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			io = (tm_thread_pool_io_t*)(unsigned long)cqe->user_data;
+			io->result = cqe->res;
+			task = io->priv;
+
+			/* Free the slot before @inflight drop and let more in */
+			atomic_store_explicit((_Atomic unsigned*)ring->cq_head,
+					      head + 1, memory_order_release);
+
+			/* Dispatch continuation back onto a worker */
+			if (NULL == ring->retry &&
+			    tm_thread_pool_internal_io_dispatch(priv, task)) {
+				continue;
+			}
+
+			/* Keep order, and @inflight, until it is enqueued */
+			for (last = &ring->retry; NULL != *last;
+			     last = &(*last)->next) {
+			}
+			task->next = NULL;
+			*last = task;
+		}
+
+		if (atomic_load(&ring->stop) &&
+		    0 == atomic_load(&ring->inflight)) {
+			break;
+		}
+
+		/* Ring fd is readable while completion queue is not empty */
+		poll(pfd, 2, NULL == ring->retry ?
+			     -1 : TM_THREAD_POOL_IO_RETRY_INTERVAL);
+
+		/*
+		 * Readable with nothing in ring, completions overflowed into
+		 * kernel. Only an enter with GETEVENTS flush them back.
+		 * */
+		if (*ring->cq_head ==
+		    atomic_load_explicit((_Atomic unsigned*)ring->cq_tail,
+					 memory_order_acquire)) {
+			tm_thread_pool_internal_io_enter(ring, 0, 0,
+						IORING_ENTER_GETEVENTS);
+		}
+	}
+
+	return 0;
+}
+
+static void tm_thread_pool_internal_io_unmap(tm_thread_pool_io_ring_t *ring)
+{
+	if (NULL != ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (NULL != ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+
+	if (NULL != ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_size);
+	}
+
+	if (-1 != ring->stop_fd) {
+		close(ring->stop_fd);
+		ring->stop_fd = -1;
+	}
+
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+static int tm_thread_pool_internal_io_init(tm_thread_pool_priv_t *priv)
+{
+	int ret;
+	struct io_uring_params params;
+	tm_thread_pool_io_ring_t *ring = &priv->io_ring;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	ring->stop_fd = -1;
+	atomic_init(&ring->inflight, 0);
+	atomic_init(&ring->stop, false);
+
+	if (!(priv->attribute.option & TM_THREAD_POOL_OPTION_INTENSIVE_IO)) {
+		return 0;
+	}
+
+	memset(&params, 0, sizeof(params));
+
+	ret = syscall(__NR_io_uring_setup, TM_THREAD_POOL_IO_RING_ENTRIES,
+		      &params);
+	if (ret < 0) {
+		/* No io_uring, fallback to worker threads */
+		return 0;
+	}
+	ring->fd = ret;
+
+	/*
+	 * Need IORING_OP_READ/IORING_OP_WRITE (5.6) and never drop completion
+	 * events, fallback to worker threads on older kernel.
+	 * */
+	if (!(params.features & IORING_FEAT_NODROP) ||
+	    !(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		ring->fd = -1;
+		return 0;
+	}
+
+	ring->sq_size = params.sq_off.array +
+			params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ptr) {
+		ring->sq_ptr = NULL;
+		goto error;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ptr) {
+			ring->cq_ptr = NULL;
+			goto error;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes) {
+		ring->sqes = NULL;
+		goto error;
+	}
+
+	ring->sq_head = (unsigned*)((char*)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ptr +
+				    params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ptr + params.sq_off.array);
+
+	ring->cq_head = (unsigned*)((char*)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ptr +
+				    params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr +
+					    params.cq_off.cqes);
+	ring->cq_entries = params.cq_entries;
+
+	ring->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (-1 == ring->stop_fd) {
+		goto error;
+	}
+
+	mtx_init(&ring->lock, mtx_plain);
+
+	if (thrd_success != thrd_create(&ring->reaper,
+					tm_thread_pool_internal_io_reaper_entry,
+					priv)) {
+		mtx_destroy(&ring->lock);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	/* Still usable with worker threads */
+	tm_thread_pool_internal_io_unmap(ring);
+	return 0;
+}
+
+/* Workers should be joined, so nothing can be submitted any more */
+static void tm_thread_pool_internal_io_destroy(tm_thread_pool_priv_t *priv)
+{
+	uint64_t value = 1;
+	tm_thread_pool_io_ring_t *ring = &priv->io_ring;
+
+	if (-1 == ring->fd) {
+		return;
+	}
+
+	/* Never fail short of a counter overflow, which still wake poll */
+	atomic_store(&ring->stop, true);
+	while (-1 == write(ring->stop_fd, &value, sizeof(value)) &&
+	       EINTR == errno) {
+	}
+
+	thrd_join(ring->reaper, NULL);
+
+	mtx_destroy(&ring->lock);
+
+	tm_thread_pool_internal_io_unmap(ring);
+}
+
+/* Worker do this operation before start the continuation */
+static int tm_thread_pool_internal_io_fallback(tm_thread_pool_priv_t *priv,
+					tm_thread_pool_io_t *io,
+					tm_thread_pool_task_priv_t *task)
+{
+	task->io = io;
+
+	if (0 != tm_thread_pool_internal_enqueue(priv, task)) {
+		task->io = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_io_commit(tm_thread_pool_priv_t **priv,
+					     tm_thread_pool_io_t *io,
+					     tm_thread_pool_task_priv_t *task)
+{
+	int ret;
+	unsigned long inflight;
+	unsigned char opcode;
+	tm_thread_pool_io_ring_t *ring = &(*priv)->io_ring;
+
+	switch (io->opcode) {
+	case TM_THREAD_POOL_IO_OPCODE_READ:
+		opcode = IORING_OP_READ;
+		break;
+	case TM_THREAD_POOL_IO_OPCODE_WRITE:
+		opcode = IORING_OP_WRITE;
+		break;
+	case TM_THREAD_POOL_IO_OPCODE_FSYNC:
+		opcode = IORING_OP_FSYNC;
+		break;
+	default:
+		return -1;
+	}
+
+	if (-1 == ring->fd) {
+		return tm_thread_pool_internal_io_fallback(*priv, io, task);
+	}
+
+	/* Completion queue is full of others, do not overflow it */
+	inflight = atomic_load(&ring->inflight);
+	do {
+		if (inflight >= ring->cq_entries) {
+			return tm_thread_pool_internal_io_fallback(*priv, io,
+								   task);
+		}
+	} while (!atomic_compare_exchange_weak(&ring->inflight, &inflight,
+					       inflight + 1));
+
+	io->priv = task;
+
+	mtx_lock(&ring->lock);
+	ret = tm_thread_pool_internal_io_submit(ring, opcode, io);
+	mtx_unlock(&ring->lock);
+
+	if (0 != ret) {
+		atomic_fetch_sub(&ring->inflight, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_init(tm_thread_pool_priv_t **priv,
+					int number, unsigned long option)
+{
+	int i;
+	int ret;
+
+	if (number <= 0 || option >= TM_THREAD_POOL_OPTION_MAX) {
+		return -1;
+	}
+
+	(*priv) = (tm_thread_pool_priv_t*)aligned_alloc(
+				_Alignof(tm_thread_pool_priv_t),
+				sizeof(tm_thread_pool_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->attribute.option = option;
+	atomic_init(&(*priv)->pending, 0);
+	atomic_init(&(*priv)->epoch, 0);
+	atomic_init(&(*priv)->sleepers, 0);
+	atomic_init(&(*priv)->searching, 0);
+	(*priv)->searching_max = number / 2 > 0 ? number / 2 : 1;
+	atomic_init(&(*priv)->shutdown, false);
+	(*priv)->excutor_number = 0;
+
 	ret = tm_queue_init(&(*priv)->task_queue, TM_QUEUE_OPTION_MULTI_THREAD);
 	if (0 != ret) {
 		free(*priv);
@@ -82,51 +944,244 @@ static int tm_thread_pool_internal_init(tm_thread_pool_priv_t **priv, int number
 		return -1;
 	}
 
+	(*priv)->excutor = (tm_thread_pool_task_excutor_t*)malloc(
+				sizeof(tm_thread_pool_task_excutor_t) * number);
+	if (NULL == (*priv)->excutor) {
+		tm_queue_destroy(&(*priv)->task_queue);
+		free(*priv);
+		*priv = NULL;
+		return -1;
+	}
+
+	tm_thread_pool_internal_io_init(*priv);
+
+	for (i = 0; i < number; i++) {
+		(*priv)->excutor[i].thread_pool = *priv;
+
+		ret = thrd_create(&(*priv)->excutor[i].thread_id,
+				  tm_thread_pool_internal_task_excutor_entry,
+				  &(*priv)->excutor[i]);
+		if (thrd_success != ret) {
+			break;
+		}
+
+		(*priv)->excutor_number++;
+	}
+
+	/* Have at least one worker is fine */
+	if (0 == (*priv)->excutor_number) {
+		tm_thread_pool_internal_io_destroy(*priv);
+		free((*priv)->excutor);
+		tm_queue_destroy(&(*priv)->task_queue);
+		free(*priv);
+		*priv = NULL;
+		return -1;
+	}
+
 	return 0;
 }
 
-static int tm_thread_pool_internal_task_commit(
-					tm_thread_pool_priv_t **priv,
-					tm_thread_pool_task_entry_t entry_func,
-					tm_thread_pool_task_event_t event_cb)
+static int tm_thread_pool_internal_task_init(tm_thread_pool_task_priv_t **priv,
+					     tm_thread_pool_task_entry_t entry,
+					     void *arg,
+					     tm_thread_pool_task_event_t event,
+					     unsigned long option)
 {
-	int ret;
+	if (NULL == entry || option >= TM_THREAD_POOL_TASK_OPTION_MAX) {
+		return -1;
+	}
 
-	tm_thread_pool_task_t *task;
+	(*priv) = (tm_thread_pool_task_priv_t*)malloc(
+					sizeof(tm_thread_pool_task_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
 
-	task = (tm_thread_pool_task_t*)malloc(sizeof(tm_thread_pool_task_t));
-	if (NULL == task) {
+	(*priv)->option = option;
+	(*priv)->entry = entry;
+	(*priv)->arg = arg;
+	(*priv)->event = event;
+	(*priv)->io = NULL;
+	(*priv)->cq = NULL;
+	(*priv)->tag = NULL;
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_task_set_cq(
+					tm_thread_pool_task_priv_t **priv,
+					tm_thread_pool_cq_priv_t *cq,
+					void *tag)
+{
+	(*priv)->cq = cq;
+	(*priv)->tag = tag;
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_task_destroy(
+					tm_thread_pool_task_priv_t **priv)
+{
+	free(*priv);
+	*priv = NULL;
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_get_size(tm_thread_pool_priv_t **priv,
+					    int *size)
+{
+	*size = (*priv)->excutor_number;
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_cq_init(tm_thread_pool_cq_priv_t **priv,
+					   unsigned long entries)
+{
+	unsigned long i;
+	unsigned long number = 1;
+
+	if (0 == entries || entries > (ULONG_MAX >> 2) + 1) {
 		return -1;
 	}
 
-	task->entry_func = entry_func;
-	task->event_cb = event_cb;
+	while (number < entries) {
+		number <<= 1;
+	}
 
-	ret = tm_queue_push(&(*priv)->task_queue, task);
-	if (0 != ret) {
-		free(task);
+	(*priv) = (tm_thread_pool_cq_priv_t*)aligned_alloc(
+				_Alignof(tm_thread_pool_cq_priv_t),
+				sizeof(tm_thread_pool_cq_priv_t));
+	if (NULL == (*priv)) {
+		return -1;
+	}
+
+	(*priv)->slot = (tm_thread_pool_cq_slot_t*)malloc(
+				sizeof(tm_thread_pool_cq_slot_t) * number);
+	if (NULL == (*priv)->slot) {
+		free(*priv);
+		*priv = NULL;
+		return -1;
+	}
+
+	for (i = 0; i < number; i++) {
+		atomic_init(&(*priv)->slot[i].sequence, i);
+	}
+
+	(*priv)->mask = number - 1;
+	atomic_init(&(*priv)->tail, 0);
+	(*priv)->head = 0;
+	atomic_init(&(*priv)->ready, 0);
+	atomic_init(&(*priv)->reaping, 0);
+	atomic_init(&(*priv)->room, 0);
+	atomic_init(&(*priv)->waiters, 0);
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_cq_reap(tm_thread_pool_cq_priv_t **priv,
+					   tm_thread_pool_cq_entry_t *entries,
+					   unsigned long max,
+					   unsigned long min_wait,
+					   unsigned long *number)
+{
+	unsigned int ready;
+	unsigned long head;
+	tm_thread_pool_cq_slot_t *slot;
+	tm_thread_pool_cq_priv_t *cq = *priv;
+
+	if (min_wait > max) {
 		return -1;
 	}
 
+	*number = 0;
+	head = cq->head;
+
+	while (true) {
+		while (*number < max) {
+			slot = &cq->slot[head & cq->mask];
+			if (atomic_load(&slot->sequence) != head + 1) {
+				break;
+			}
+
+			entries[(*number)++] = slot->entry;
+
+			/* Hand this slot to the worker one lap later */
+			atomic_store(&slot->sequence, head + cq->mask + 1);
+			head++;
+		}
+
+		cq->head = head;
+
+		/* Pairs with the check of slot after @waiters++ in post */
+		if (0 != *number && 0 != atomic_load(&cq->waiters)) {
+			tm_thread_pool_internal_futex_wake(&cq->room, INT_MAX);
+		}
+
+		if (*number >= min_wait) {
+			break;
+		}
+
+		atomic_store(&cq->reaping, 1);
+		ready = atomic_load(&cq->ready);
+
+		/* Last check, a post after this move @ready */
+		slot = &cq->slot[head & cq->mask];
+		if (atomic_load(&slot->sequence) != head + 1) {
+			syscall(SYS_futex, &cq->ready, FUTEX_WAIT_PRIVATE,
+				ready, NULL, NULL, 0);
+		}
+
+		atomic_store(&cq->reaping, 0);
+	}
+
+	return 0;
+}
+
+static int tm_thread_pool_internal_cq_destroy(tm_thread_pool_cq_priv_t **priv)
+{
+	free((*priv)->slot);
+	free(*priv);
+	*priv = NULL;
+
 	return 0;
 }
 
 static int tm_thread_pool_internal_destroy(tm_thread_pool_priv_t **priv)
 {
+	int i;
 	int ret;
 
+	/*
+	 * Workers stay until continuations of in flight operations are done,
+	 * tasks may still commit file operations meanwhile, so the ring go
+	 * away last.
+	 * */
+	atomic_store(&(*priv)->shutdown, true);
+	tm_thread_pool_internal_unpark(*priv, INT_MAX);
+
+	for (i = 0; i < (*priv)->excutor_number; i++) {
+		thrd_join((*priv)->excutor[i].thread_id, NULL);
+	}
+
+	tm_thread_pool_internal_io_destroy(*priv);
+
 	ret = tm_queue_destroy(&(*priv)->task_queue);
 	if (0 != ret) {
 		return -1;
 	}
 
+	free((*priv)->excutor);
 	free(*priv);
 	*priv = NULL;
 
 	return 0;
 }
 
-int tm_thread_pool_init(tm_thread_pool_t *thread_pool, unsigned long number)
+
+int tm_thread_pool_init(tm_thread_pool_t *thread_pool, int thread_pool_size,
+			unsigned long option)
 {
 	if (NULL == thread_pool) {
 		return -1;
@@ -135,14 +1190,136 @@ int tm_thread_pool_init(tm_thread_pool_t *thread_pool, unsigned long number)
 	thread_pool->priv = NULL;
 
 	return tm_thread_pool_internal_init(
-			(tm_thread_pool_priv_t**)&thread_pool->priv, number);
+			(tm_thread_pool_priv_t**)&thread_pool->priv,
+			thread_pool_size, option);
+}
+
+int tm_thread_pool_task_init(tm_thread_pool_task_t *task,
+			     tm_thread_pool_task_entry_t entry,
+			     void *arg,
+			     tm_thread_pool_task_event_t event,
+			     unsigned long option)
+{
+	if (NULL == task) {
+		return -1;
+	}
+
+	task->priv = NULL;
+
+	return tm_thread_pool_internal_task_init(
+			(tm_thread_pool_task_priv_t**)&task->priv,
+			entry, arg, event, option);
 }
 
 int tm_thread_pool_task_commit(tm_thread_pool_t *thread_pool,
-			       tm_thread_pool_task_entry_t entry_func,
-			       tm_thread_pool_task_event_t event_cb)
+			       tm_thread_pool_task_t *task)
 {
-	if (NULL == thread_pool) {
+	if (NULL == thread_pool || NULL == task) {
+		return -1;
+	}
+
+	if (NULL == thread_pool->priv || NULL == task->priv) {
+		return -1;
+	}
+
+	return tm_thread_pool_internal_enqueue(
+			(tm_thread_pool_priv_t*)thread_pool->priv, task->priv);
+}
+
+int tm_thread_pool_task_set_cq(tm_thread_pool_task_t *task,
+			       tm_thread_pool_cq_t *cq, void *tag)
+{
+	if (NULL == task) {
+		return -1;
+	}
+
+	if (NULL == task->priv || (NULL != cq && NULL == cq->priv)) {
+		return -1;
+	}
+
+	return tm_thread_pool_internal_task_set_cq(
+			(tm_thread_pool_task_priv_t**)&task->priv,
+			NULL == cq ? NULL : cq->priv, tag);
+}
+
+int tm_thread_pool_task_destroy(tm_thread_pool_task_t *task)
+{
+	if (NULL == task) {
+		return -1;
+	}
+
+	if (NULL == task->priv) {
+		return -1;
+	}
+
+	return tm_thread_pool_internal_task_destroy(
+			(tm_thread_pool_task_priv_t**)&task->priv);
+}
+
+int tm_thread_pool_io_commit(tm_thread_pool_t *thread_pool,
+			     tm_thread_pool_io_t *io,
+			     tm_thread_pool_task_t *task)
+{
+	if (NULL == thread_pool || NULL == io || NULL == task) {
+		return -1;
+	}
+
+	if (NULL == thread_pool->priv || NULL == task->priv) {
+		return -1;
+	}
+
+	return tm_thread_pool_internal_io_commit(
+			(tm_thread_pool_priv_t**)&thread_pool->priv,
+			io, task->priv);
+}
+
+int tm_thread_pool_cq_init(tm_thread_pool_cq_t *cq, unsigned long entries)
+{
+	if (NULL == cq) {
+		return -1;
+	}
+
+	cq->priv = NULL;
+
+	return tm_thread_pool_internal_cq_init(
+			(tm_thread_pool_cq_priv_t**)&cq->priv, entries);
+}
+
+int tm_thread_pool_cq_reap(tm_thread_pool_cq_t *cq,
+			   tm_thread_pool_cq_entry_t *entries,
+			   unsigned long max, unsigned long min_wait,
+			   unsigned long *number)
+{
+	if (NULL == cq || NULL == entries || NULL == number) {
+		return -1;
+	}
+
+	if (NULL == cq->priv) {
+		return -1;
+	}
+
+	return tm_thread_pool_internal_cq_reap(
+			(tm_thread_pool_cq_priv_t**)&cq->priv, entries, max,
+			min_wait, number);
+}
+
+int tm_thread_pool_cq_destroy(tm_thread_pool_cq_t *cq)
+{
+	if (NULL == cq) {
+		return -1;
+	}
+
+	if (NULL == cq->priv) {
+		return -1;
+	}
+
+	return tm_thread_pool_internal_cq_destroy(
+			(tm_thread_pool_cq_priv_t**)&cq->priv);
+}
+
+int tm_thread_pool_get_size(tm_thread_pool_t *thread_pool, int *size)
+{
+	if (NULL == thread_pool || NULL == size) {
 		return -1;
 	}
 
@@ -150,9 +1327,8 @@ int tm_thread_pool_task_commit(tm_thread_pool_t *thread_pool,
 		return -1;
 	}
 
-	return tm_thread_pool_internal_task_commit(
-			(tm_thread_pool_priv**)&thread_pool->priv,
-			entry_func, event_cb);
+	return tm_thread_pool_internal_get_size(
+			(tm_thread_pool_priv_t**)&thread_pool->priv, size);
 }
 
 int tm_thread_pool_destroy(tm_thread_pool_t *thread_pool)
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <threads.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "tm_stack.h"
+#include "tm_queue.h"
+#include "tm_pool.h"
+
+/*
+ * Benchmark of libteemo modes. Each thread count its own hardware counters
+ * around the measured region only, figures are per operation, one push, pop,
+ * alloc or free. Counters the kernel refuse are shown as "-", with none of
+ * them it is timing only.
+ *
+ * Usage: tm_bench [threads] [iterations per thread]
+ * */
+
+#define BENCH_THREAD_MAX	64
+
+/**
+ * enum bench_counter_e - Counters read around measured region
+ * */
+typedef enum bench_counter_e {
+	BENCH_COUNTER_CYCLES = 0,
+	BENCH_COUNTER_INSTRUCTIONS,
+	BENCH_COUNTER_CACHE_MISSES,
+	BENCH_COUNTER_LLC_MISSES,
+	BENCH_COUNTER_BRANCH_MISSES,
+	BENCH_COUNTER_CONTEXT_SWITCHES,
+
+	BENCH_COUNTER_MAX,
+} bench_counter_t;
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} bench_counter[BENCH_COUNTER_MAX] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "llc-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "ctx-sw", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+/**
+ * struct bench_case_s - One mode to measure
+ *
+ * @name: Shown in report
+ *
+ * @init: Create the object, 0 on success
+ *
+ * @run: Do @iterations rounds on object, return number of operations
+ *
+ * @destroy: Destroy the object
+ * */
+typedef struct bench_case_s {
+	const char *name;
+	int (*init)(void *object);
+	unsigned long (*run)(void *object, unsigned long iterations);
+	void (*destroy)(void *object);
+} bench_case_t;
+
+/**
+ * struct bench_thread_s - Result of one thread
+ *
+ * @value: Counter values, scaled when counters were multiplexed
+ *
+ * @valid: Counter opened
+ *
+ * @ops: Operations done
+ *
+ * @ns: Nanoseconds of measured region
+ * */
+typedef struct bench_thread_s {
+	uint64_t value[BENCH_COUNTER_MAX];
+	bool valid[BENCH_COUNTER_MAX];
+	unsigned long ops;
+	uint64_t ns;
+} bench_thread_t;
+
+static union {
+	tm_stack_t stack;
+	tm_queue_t queue;
+	tm_pool_t pool;
+} bench_object;
+
+static const bench_case_t *bench_current;
+static unsigned long bench_iterations;
+static atomic_int bench_ready;
+static atomic_bool bench_go;
+
+static int bench_stack_init(void *object)
+{
+	return tm_stack_init(object, TM_STACK_OPTION_MULTI_THREAD);
+}
+
+static int bench_stack_elimination_init(void *object)
+{
+	return tm_stack_init(object, TM_STACK_OPTION_MULTI_THREAD |
+				     TM_STACK_OPTION_ELIMINATION);
+}
+
+static int bench_stack_compact_init(void *object)
+{
+	return tm_stack_init(object, TM_STACK_OPTION_MULTI_THREAD |
+				     TM_STACK_OPTION_COMPACT);
+}
+
+static unsigned long bench_stack_run(void *object, unsigned long iterations)
+{
+	unsigned long i;
+	unsigned long done = 0;
+	void *data;
+
+	for (i = 0; i < iterations; i++) {
+		done += 0 == tm_stack_push(object, (void*)i);
+		done += 0 == tm_stack_pop(object, &data);
+	}
+
+	return done;
+}
+
+static void bench_stack_destroy(void *object)
+{
+	tm_stack_destroy(object);
+}
+
+static int bench_queue_init(void *object)
+{
+	return tm_queue_init(object, TM_QUEUE_OPTION_MULTI_THREAD);
+}
+
+static int bench_queue_compact_init(void *object)
+{
+	return tm_queue_init(object, TM_QUEUE_OPTION_MULTI_THREAD |
+				     TM_QUEUE_OPTION_COMPACT);
+}
+
+static unsigned long bench_queue_run(void *object, unsigned long iterations)
+{
+	unsigned long i;
+	unsigned long done = 0;
+	void *data;
+
+	for (i = 0; i < iterations; i++) {
+		done += 0 == tm_queue_push(object, (void*)i);
+		done += 0 == tm_queue_pop(object, &data);
+	}
+
+	return done;
+}
+
+static void bench_queue_destroy(void *object)
+{
+	tm_queue_destroy(object);
+}
+
+static int bench_pool_init(void *object)
+{
+	return tm_pool_init(object, 64, 4096, TM_POOL_OPTION_GROW);
+}
+
+static unsigned long bench_pool_run(void *object, unsigned long iterations)
+{
+	unsigned long i;
+	unsigned long done = 0;
+	void *data;
+
+	/* Only pairs really done count */
+	for (i = 0; i < iterations; i++) {
+		if (0 == tm_pool_alloc(object, &data) &&
+		    0 == tm_pool_free(object, data)) {
+			done += 2;
+		}
+	}
+
+	return done;
+}
+
+static void bench_pool_destroy(void *object)
+{
+	tm_pool_destroy(object);
+}
+
+static const bench_case_t bench_case[] = {
+	{ "stack", bench_stack_init, bench_stack_run, bench_stack_destroy },
+	{ "stack elimination", bench_stack_elimination_init, bench_stack_run,
+	  bench_stack_destroy },
+	{ "stack compact", bench_stack_compact_init, bench_stack_run,
+	  bench_stack_destroy },
+	{ "queue", bench_queue_init, bench_queue_run, bench_queue_destroy },
+	{ "queue compact", bench_queue_compact_init, bench_queue_run,
+	  bench_queue_destroy },
+	{ "pool", bench_pool_init, bench_pool_run, bench_pool_destroy },
+};
+
+/* Count calling thread only, on any CPU, created disabled */
+static int bench_counter_open(bench_counter_t counter)
+{
+	int fd;
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = bench_counter[counter].type;
+	attr.config = bench_counter[counter].config;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (-1 == fd) {
+		/* perf_event_paranoid may only allow user space */
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	return fd;
+}
+
+/* Value scaled by the time it was really counting */
+static bool bench_counter_read(int fd, uint64_t *value)
+{
+	uint64_t buf[3];
+
+	if (sizeof(buf) != read(fd, buf, sizeof(buf)) || 0 == buf[2]) {
+		return false;
+	}
+
+	*value = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+
+	return true;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_worker(void *arg)
+{
+	int i;
+	int fd[BENCH_COUNTER_MAX];
+	uint64_t begin;
+	bench_thread_t *result = arg;
+
+	for (i = 0; i < BENCH_COUNTER_MAX; i++) {
+		fd[i] = bench_counter_open(i);
+	}
+
+	atomic_fetch_add(&bench_ready, 1);
+	while (!atomic_load(&bench_go)) {
+		thrd_yield();
+	}
+
+	for (i = 0; i < BENCH_COUNTER_MAX; i++) {
+		if (-1 != fd[i]) {
+			ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	begin = bench_now();
+	result->ops = bench_current->run(&bench_object, bench_iterations);
+	result->ns = bench_now() - begin;
+
+	for (i = 0; i < BENCH_COUNTER_MAX; i++) {
+		if (-1 != fd[i]) {
+			ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+
+	for (i = 0; i < BENCH_COUNTER_MAX; i++) {
+		result->valid[i] = -1 != fd[i] &&
+				   bench_counter_read(fd[i], &result->value[i]);
+		if (-1 != fd[i]) {
+			close(fd[i]);
+		}
+	}
+
+	return 0;
+}
+
+static void bench_report_line(const char *name, const bench_thread_t *result,
+			      uint64_t ns)
+{
+	int i;
+
+	printf("  %-8s %12.0f", name,
+	       0 == ns ? 0.0 : result->ops * 1e9 / ns);
+
+	for (i = 0; i < BENCH_COUNTER_MAX; i++) {
+		if (result->valid[i] && 0 != result->ops) {
+			printf(" %10.3f", (double)result->value[i] / result->ops);
+		} else {
+			printf(" %10s", "-");
+		}
+	}
+
+	printf("\n");
+}
+
+static int bench_case_run(const bench_case_t *c, int threads)
+{
+	int i;
+	int j;
+	char name[16];
+	uint64_t wall;
+	thrd_t thread[BENCH_THREAD_MAX];
+	bench_thread_t result[BENCH_THREAD_MAX];
+	bench_thread_t total;
+
+	if (0 != c->init(&bench_object)) {
+		printf("%s: init error\n", c->name);
+		return -1;
+	}
+
+	memset(result, 0, sizeof(result));
+	bench_current = c;
+	atomic_store(&bench_ready, 0);
+	atomic_store(&bench_go, false);
+
+	for (i = 0; i < threads; i++) {
+		if (thrd_success != thrd_create(&thread[i], bench_worker,
+						&result[i])) {
+			printf("%s: thread error\n", c->name);
+			exit(-1);
+		}
+	}
+
+	/* Start together, counters are already open */
+	while (threads != atomic_load(&bench_ready)) {
+		thrd_yield();
+	}
+	atomic_store(&bench_go, true);
+
+	for (i = 0; i < threads; i++) {
+		thrd_join(thread[i], NULL);
+	}
+
+	c->destroy(&bench_object);
+
+	/* A counter is combined only if every thread got it */
+	memset(&total, 0, sizeof(total));
+	wall = 0;
+	for (j = 0; j < BENCH_COUNTER_MAX; j++) {
+		total.valid[j] = true;
+	}
+	for (i = 0; i < threads; i++) {
+		total.ops += result[i].ops;
+		if (result[i].ns > wall) {
+			wall = result[i].ns;
+		}
+		for (j = 0; j < BENCH_COUNTER_MAX; j++) {
+			total.value[j] += result[i].value[j];
+			total.valid[j] = total.valid[j] && result[i].valid[j];
+		}
+	}
+
+	printf("%s\n", c->name);
+	for (i = 0; i < threads; i++) {
+		snprintf(name, sizeof(name), "t%d", i);
+		bench_report_line(name, &result[i], result[i].ns);
+	}
+	bench_report_line("all", &total, wall);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int threads = 4;
+	int fd;
+
+	if (argc > 1) {
+		threads = atoi(argv[1]);
+	}
+	bench_iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+
+	if (threads < 1 || threads > BENCH_THREAD_MAX) {
+		printf("usage: %s [threads 1-%d] [iterations]\n", argv[0],
+		       BENCH_THREAD_MAX);
+		return -1;
+	}
+
+	fd = bench_counter_open(BENCH_COUNTER_CYCLES);
+	if (-1 == fd) {
+		printf("hardware counters unavailable, timing only\n");
+	} else {
+		close(fd);
+	}
+
+	printf("%d threads, %lu iterations each, figures per operation\n",
+	       threads, bench_iterations);
+	printf("  %-8s %12s", "thread", "ops/s");
+	for (i = 0; i < BENCH_COUNTER_MAX; i++) {
+		printf(" %10s", bench_counter[i].name);
+	}
+	printf("\n");
+
+	for (i = 0; i < (int)(sizeof(bench_case) / sizeof(bench_case[0]));
+	     i++) {
+		if (0 != bench_case_run(&bench_case[i], threads)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -3,11 +3,491 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <threads.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
 
 #include "tm_stack.h"
 #include "tm_queue.h"
+#include "tm_thread_pool.h"
+#include "tm_ring_multicast.h"
+#include "tm_hashmap.h"
+#include "tm_pool.h"
+#include "tm_shm_queue.h"
+#include "tm_value.h"
+#include "tm_partition_queue.h"
+#include "tm_pipeline.h"
+#include "tm_coroutine.h"
+#include "tm_parallel.h"
+#include "tm_skiplist.h"
+
+static atomic_long task_sum;
+static atomic_int task_end_cnt;
+
+static void *test_task_entry(void *arg)
+{
+	atomic_fetch_add(&task_sum, (long)arg);
+
+	return arg;
+}
+
+static void test_task_event(unsigned long event, void *task_status)
+{
+	if (TM_THREAD_POOL_EVENT_END == event) {
+		atomic_fetch_add(&task_end_cnt, 1);
+	}
+}
+
+static void *test_sleep_entry(void *arg)
+{
+	thrd_sleep(&(struct timespec){ .tv_nsec = (long)arg * 1000000 }, NULL);
+
+	return NULL;
+}
+
+static tm_queue_t mpsc_queue;
+
+static long partition_expect[64];
+static atomic_int partition_error;
+static atomic_int partition_done;
+
+static void test_partition_handler(void *data, void *arg)
+{
+	long key = (long)data >> 32;
+
+	/* Only one worker at a time per key, so no atomic needed */
+	if (((long)data & 0xffffffff) != partition_expect[key]++) {
+		atomic_fetch_add(&partition_error, 1);
+	}
+
+	atomic_fetch_add(&partition_done, 1);
+}
+
+static atomic_long pipeline_sum;
+
+static void *test_pipeline_double(void *data, void *arg)
+{
+	return (void*)((long)data * 2);
+}
+
+/* Drop multiples of 3 */
+static void *test_pipeline_filter(void *data, void *arg)
+{
+	return 0 == (long)data % 3 ? NULL : data;
+}
+
+static void *test_pipeline_sum(void *data, void *arg)
+{
+	atomic_fetch_add(&pipeline_sum, (long)data);
+
+	return NULL;
+}
+
+static tm_coroutine_scheduler_t coroutine_scheduler;
+static tm_coroutine_queue_t coroutine_queue;
+static tm_coroutine_group_t coroutine_group;
+static atomic_long coroutine_sum;
+static long coroutine_seen;
+
+/* Wait on empty queue */
+static void test_coroutine_consumer(void *arg)
+{
+	int i;
+	void *data;
+
+	for (i = 0; i < 10; i++) {
+		tm_coroutine_queue_pop(&coroutine_queue, &data);
+		atomic_fetch_add(&coroutine_sum, (long)data);
+		tm_coroutine_yield();
+	}
+}
+
+/* Wait on timer */
+static void test_coroutine_producer(void *arg)
+{
+	tm_coroutine_sleep(&coroutine_scheduler, (long)arg % 5);
+	tm_coroutine_queue_push(&coroutine_queue, arg);
+}
+
+/* Wait on group */
+static void test_coroutine_waiter(void *arg)
+{
+	tm_coroutine_group_wait(&coroutine_group);
+	coroutine_seen = atomic_load(&coroutine_sum);
+}
+
+static unsigned char parallel_visit[1000000];
+static atomic_int parallel_error;
+
+static void test_parallel_for_entry(unsigned long begin, unsigned long end,
+				    void *ctx)
+{
+	unsigned long i;
+
+	for (i = begin; i < end; i++) {
+		parallel_visit[i]++;
+	}
+}
+
+static void *test_parallel_reduce_entry(unsigned long begin,
+					unsigned long end, void *ctx)
+{
+	unsigned long i;
+	long sum = 0;
+
+	for (i = begin; i < end; i++) {
+		sum += i;
+	}
+
+	return (void*)sum;
+}
+
+static void *test_parallel_combine(void *left, void *right, void *ctx)
+{
+	return (void*)((long)left + (long)right);
+}
+
+/* Nested call from a worker of the same pool */
+static void *test_parallel_task_entry(void *arg)
+{
+	void *result = NULL;
+
+	tm_parallel_reduce(arg, 0, 100000, 0, test_parallel_reduce_entry,
+			   test_parallel_combine, NULL, &result);
+	if (99999l * 100000 / 2 != (long)result) {
+		atomic_fetch_add(&parallel_error, 1);
+	}
+
+	return result;
+}
+
+typedef struct test_value_s {
+	long key;
+	long value;
+} test_value_t;
+
+TM_QUEUE_DEFINE(test_value_queue, test_value_t)
+TM_STACK_DEFINE(test_value_stack, test_value_t)
+
+static tm_queue_t bounded_queue;
+
+static int test_bounded_consumer(void *arg)
+{
+	void *data;
+
+	/* Let producer block first */
+	thrd_sleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+
+	return tm_queue_pop(&bounded_queue, &data);
+}
+
+static tm_stack_t elimination_stack;
+static atomic_long elimination_sum;
+
+/* Matched push and pop storm */
+static int test_elimination_worker(void *arg)
+{
+	long i;
+	void *data;
+
+	for (i = 1; i <= 20000; i++) {
+		if (tm_stack_push(&elimination_stack, (void*)((long)arg + i))) {
+			return -1;
+		}
+		if (0 == tm_stack_pop(&elimination_stack, &data)) {
+			atomic_fetch_add(&elimination_sum, (long)data);
+		}
+	}
+
+	return 0;
+}
+
+static tm_queue_t event_queue;
+
+/* Bursts of push from another thread */
+static int test_event_producer(void *arg)
+{
+	long i;
+	int ret = 0;
+
+	for (i = 0; i < 10000; i++) {
+		ret |= tm_queue_push(&event_queue, (void*)i);
+		if (0 == i % 100) {
+			thrd_yield();
+		}
+	}
+
+	return ret;
+}
+
+static unsigned long test_codec_encode(void *data, void *buf,
+				       unsigned long size)
+{
+	if (size >= sizeof(int)) {
+		memcpy(buf, data, sizeof(int));
+	}
+
+	return sizeof(int);
+}
+
+static int test_codec_decode(const void *buf, unsigned long size, void **data)
+{
+	if (sizeof(int) != size) {
+		return -1;
+	}
+
+	*data = malloc(sizeof(int));
+	if (NULL == *data) {
+		return -1;
+	}
+	memcpy(*data, buf, sizeof(int));
+
+	return 0;
+}
+
+static const tm_queue_codec_t test_codec = {
+	.encode = test_codec_encode,
+	.decode = test_codec_decode,
+	.release = free,
+};
+
+static int test_mpsc_producer(void *arg)
+{
+	long i;
+
+	/* Encode producer id in high bits so order can be checked */
+	for (i = 0; i < 10000; i++) {
+		while (tm_queue_push(&mpsc_queue, (void*)(((long)arg << 32) | i)));
+	}
+
+	return 0;
+}
+
+static tm_ring_multicast_t ring;
+static atomic_long ring_commit[2];
+static int ring_err_cnt[2];
+
+static int test_ring_consumer(void *arg)
+{
+	int consumer = (int)(long)arg;
+	long expect = 0;
+	unsigned long i;
+	unsigned long number;
+	void *batch[16];
+
+	while (expect < 10000) {
+		if (tm_ring_multicast_consume(&ring, consumer, batch, 16,
+					      &number)) {
+			ring_err_cnt[consumer]++;
+			break;
+		}
+
+		for (i = 0; i < number; i++, expect++) {
+			if ((long)batch[i] != expect) {
+				ring_err_cnt[consumer]++;
+			}
+
+			/* Barrier, never pass the consumer we depend on */
+			if (1 == consumer &&
+			    expect >= atomic_load(&ring_commit[0])) {
+				ring_err_cnt[consumer]++;
+			}
+		}
+
+		atomic_store(&ring_commit[consumer], expect);
+		tm_ring_multicast_commit(&ring, consumer, number);
+	}
+
+	return 0;
+}
+
+static tm_hashmap_t map;
+
+static int test_hashmap_insert(void *arg)
+{
+	long i;
+
+	for (i = (long)arg; i < 100000; i += 4) {
+		if (tm_hashmap_insert(&map, i, (void*)(i * 3))) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static tm_skiplist_t skiplist;
+static tm_skiplist_t skiplist_many[300];
+static atomic_int skiplist_stop;
+static atomic_int skiplist_error;
+
+/* Own keys of thread plus churn on keys shared by all */
+static int test_skiplist_worker(void *arg)
+{
+	long i;
+	long key;
+	void *data;
+
+	for (i = 0; i < 5000; i++) {
+		key = (long)arg + 4 * i;
+		if (tm_skiplist_insert(&skiplist, key, (void*)(key * 3))) {
+			return -1;
+		}
+		if ((key & 1) && (tm_skiplist_erase(&skiplist, key, &data) ||
+				  (long)data != key * 3)) {
+			return -1;
+		}
+
+		key = 1000000 + (i * 7 + (long)arg) % 256;
+		if (tm_skiplist_insert(&skiplist, key, NULL)) {
+			return -1;
+		}
+		tm_skiplist_erase(&skiplist, key, NULL);
+	}
+
+	return 0;
+}
+
+static int test_skiplist_order(unsigned long key, void *data, void *arg)
+{
+	unsigned long *next = arg;
+
+	if (key < *next) {
+		atomic_fetch_add(&skiplist_error, 1);
+	}
+	*next = key + 1;
+
+	return 0;
+}
+
+/* Scan while others modify, keys must stay in order */
+/* Values of one key come back from erase in increasing order, never twice */
+static int test_skiplist_eraser(void *arg)
+{
+	long last = 0;
+	void *data;
+
+	while (!atomic_load(&skiplist_stop)) {
+		if (0 == tm_skiplist_erase(&skiplist, 7, &data)) {
+			if ((long)data <= last) {
+				atomic_fetch_add(&skiplist_error, 1);
+			}
+			last = (long)data;
+		}
+	}
+
+	return (int)(last & 0x7fffffff);
+}
+
+static int test_skiplist_scanner(void *arg)
+{
+	unsigned long next;
+
+	while (!atomic_load(&skiplist_stop)) {
+		next = 0;
+		tm_skiplist_scan(&skiplist, 0, ~0ul, test_skiplist_order,
+				 &next);
+		thrd_yield();
+	}
+
+	return 0;
+}
+
+static int test_skiplist_count(unsigned long key, void *data, void *arg)
+{
+	return 10 == ++*(unsigned long*)arg;
+}
+
+/* Erase from callback */
+static int test_skiplist_erase(unsigned long key, void *data, void *arg)
+{
+	return tm_skiplist_erase(&skiplist, key, NULL);
+}
+
+static tm_pool_t pool;
+
+static int test_pool_worker(void *arg)
+{
+	int i;
+	int j;
+	long *object[100];
+
+	for (i = 0; i < 1000; i++) {
+		for (j = 0; j < 100; j++) {
+			if (tm_pool_alloc(&pool, (void**)&object[j])) {
+				return -1;
+			}
+			object[j][0] = (long)arg;
+			object[j][1] = j;
+		}
+
+		/* Nobody else own these objects */
+		for (j = 0; j < 100; j++) {
+			if (object[j][0] != (long)arg || object[j][1] != j) {
+				return -1;
+			}
+			tm_pool_free(&pool, object[j]);
+		}
+	}
+
+	return 0;
+}
+
+static tm_thread_pool_t io_pool;
+static tm_thread_pool_task_t io_next;
+static tm_thread_pool_io_t io_chain;
+
+/* Commit a file operation from a task, while pool is destroyed */
+static void *test_io_chain_entry(void *arg)
+{
+	return (void*)(long)tm_thread_pool_io_commit(&io_pool, &io_chain,
+						     &io_next);
+}
+
+static int test_io(int fd, unsigned long option, unsigned long opcode,
+		   void *buf, unsigned long length)
+{
+	int ret;
+	tm_thread_pool_t thread_pool;
+	tm_thread_pool_task_t task;
+	tm_thread_pool_io_t io;
+
+	ret = tm_thread_pool_init(&thread_pool, 2, option);
+	if (ret) {
+		return -1;
+	}
+
+	tm_thread_pool_task_init(&task, test_task_entry, (void*)1l,
+				 test_task_event, 0);
+
+	memset(&io, 0, sizeof(io));
+	io.opcode = opcode;
+	io.fd = fd;
+	io.buf = buf;
+	io.length = length;
+	io.offset = 0;
+
+	ret = tm_thread_pool_io_commit(&thread_pool, &io, &task);
+
+	/* Wait continuation finished */
+	tm_thread_pool_destroy(&thread_pool);
+	tm_thread_pool_task_destroy(&task);
+
+	if (ret || io.result != (long)length) {
+		return -1;
+	}
+
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -16,6 +496,44 @@ int main(int argc, char *argv[])
 	void *data;
 	tm_stack_t stack;
 	tm_queue_t queue;
+	tm_thread_pool_t thread_pool;
+	tm_thread_pool_task_t task[100];
+	tm_thread_pool_cq_t cq;
+	tm_thread_pool_cq_entry_t cqe[8];
+	int requeued = 0;
+	char path[] = "/tmp/tm_test_XXXXXX";
+	tm_thread_pool_io_t *io_many;
+	tm_thread_pool_task_t *io_task;
+	char wbuf[4096];
+	char rbuf[4096];
+	int fd;
+	thrd_t producer[5];
+	struct pollfd pfd;
+	void *batch[64];
+	unsigned long number;
+	long event_expect;
+	int consumer[2];
+	unsigned long size;
+	unsigned long used;
+	tm_shm_queue_t shm_queue;
+	pid_t pid;
+	int shm_fd;
+	char journal_dir[] = "/tmp/tm_queue_journal_XXXXXX";
+	char journal_path[64];
+	test_value_t value;
+	tm_partition_queue_t partition_queue;
+	unsigned long partition;
+	tm_pipeline_t pipeline;
+	tm_pipeline_stats_t stats[3];
+	struct timespec ts;
+	struct timespec now;
+	tm_coroutine_group_t group;
+	void *result;
+	long sum;
+	test_value_queue_t value_queue;
+	test_value_stack_t value_stack;
+	int j;
+	long expect[4] = { 0 };
 	int err_cnt = 0;
 
 	/* Test stack */
@@ -60,48 +578,1385 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	/* Test queue */
-	ret = tm_queue_init(&queue, 0);
+	/* Test stack with elimination */
+	atomic_store(&elimination_sum, 0);
+	ret = tm_stack_init(&elimination_stack,
+			    TM_STACK_OPTION_MULTI_THREAD |
+			    TM_STACK_OPTION_ELIMINATION);
 	if (ret) {
 		printf("init error @%d\n", __LINE__);
 		exit(-1);
 	}
 
-	for (i = 0; i < 100; i++) {
-		data = malloc(sizeof(int));
-		if (NULL == data) {
-			printf("malloc error @%d\n", __LINE__);
-			exit(-1);
-		}
-		*((int*)data) = i;
-
-		ret = tm_queue_push(&queue, data);
-		if (ret) {
-			printf("push error @%d\n", __LINE__);
-			exit(-1);
-		}
+	err_cnt = 0;
+	if (0 == tm_stack_set_option(&elimination_stack,
+				     TM_STACK_OPTION_MULTI_THREAD)) {
+		err_cnt++;
 	}
 
-	err_cnt = 0;
-	for (i = 0; i < 100; i++) {
-		ret = tm_queue_pop(&queue, &data);
+	for (i = 0; i < 4; i++) {
+		thrd_create(&producer[i], test_elimination_worker,
+			    (void*)(i * 1000000l));
+	}
+	for (i = 0; i < 4; i++) {
+		thrd_join(producer[i], &ret);
 		if (ret) {
-			printf("pop error @%d\n", __LINE__);
-			exit(-1);
-		}
-		if (*((int*)data) != i) {
 			err_cnt++;
 		}
-		free(data);
+	}
+
+	/* Every element come out exactly once */
+	while (0 == tm_stack_pop(&elimination_stack, &data)) {
+		atomic_fetch_add(&elimination_sum, (long)data);
+	}
+	if (4l * 20000 * 20001 / 2 + 20000l * (0 + 1 + 2 + 3) * 1000000 !=
+	    atomic_load(&elimination_sum)) {
+		err_cnt++;
 	}
 	printf("ERR_CNT = %d\n", err_cnt);
 
-	ret = tm_queue_destroy(&queue);
+	tm_stack_destroy(&elimination_stack);
+
+	/* Test compact lock free stack, same storm across arena growth */
+	atomic_store(&elimination_sum, 0);
+	ret = tm_stack_init(&elimination_stack,
+			    TM_STACK_OPTION_MULTI_THREAD |
+			    TM_STACK_OPTION_ELIMINATION |
+			    TM_STACK_OPTION_COMPACT);
 	if (ret) {
-		printf("destory error @%d\n", __LINE__);
+		printf("init error @%d\n", __LINE__);
 		exit(-1);
 	}
 
+	err_cnt = 0;
+	if (0 == tm_stack_set_option(&elimination_stack,
+				     TM_STACK_OPTION_MULTI_THREAD |
+				     TM_STACK_OPTION_ELIMINATION)) {
+		err_cnt++;
+	}
+
+	for (i = 0; i < 5000; i++) {
+		tm_stack_push(&elimination_stack, (void*)(long)i);
+	}
+	for (i = 4999; i >= 0; i--) {
+		if (tm_stack_pop(&elimination_stack, &data) ||
+		    i != (long)data) {
+			err_cnt++;
+		}
+	}
+	if (0 == tm_stack_pop(&elimination_stack, &data)) {
+		err_cnt++;
+	}
+
+	for (i = 0; i < 4; i++) {
+		thrd_create(&producer[i], test_elimination_worker,
+			    (void*)(i * 1000000l));
+	}
+	for (i = 0; i < 4; i++) {
+		thrd_join(producer[i], &ret);
+		if (ret) {
+			err_cnt++;
+		}
+	}
+
+	while (0 == tm_stack_pop(&elimination_stack, &data)) {
+		atomic_fetch_add(&elimination_sum, (long)data);
+	}
+	if (4l * 20000 * 20001 / 2 + 20000l * (0 + 1 + 2 + 3) * 1000000 !=
+	    atomic_load(&elimination_sum)) {
+		err_cnt++;
+	}
+
+	/* Elements left are released by destroy */
+	tm_stack_push(&elimination_stack, NULL);
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	tm_stack_destroy(&elimination_stack);
+
+	/* Test queue */
+	ret = tm_queue_init(&queue, 0);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 100; i++) {
+		data = malloc(sizeof(int));
+		if (NULL == data) {
+			printf("malloc error @%d\n", __LINE__);
+			exit(-1);
+		}
+		*((int*)data) = i;
+
+		ret = tm_queue_push(&queue, data);
+		if (ret) {
+			printf("push error @%d\n", __LINE__);
+			exit(-1);
+		}
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 100; i++) {
+		ret = tm_queue_pop(&queue, &data);
+		if (ret) {
+			printf("pop error @%d\n", __LINE__);
+			exit(-1);
+		}
+		if (*((int*)data) != i) {
+			err_cnt++;
+		}
+		free(data);
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_queue_destroy(&queue);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test queue spill to disk */
+	ret = tm_queue_init(&queue, TM_QUEUE_OPTION_MULTI_THREAD);
+	ret |= tm_queue_set_spill(&queue, "/tmp", 10, &test_codec);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	for (j = 0, i = 0; i < 1000; i++) {
+		data = malloc(sizeof(int));
+		if (NULL == data) {
+			printf("malloc error @%d\n", __LINE__);
+			exit(-1);
+		}
+		*((int*)data) = i;
+
+		ret = tm_queue_push(&queue, data);
+		if (ret) {
+			printf("push error @%d\n", __LINE__);
+			exit(-1);
+		}
+
+		/* Consumer is slower than producer */
+		if (i % 3 == 0) {
+			if (tm_queue_pop(&queue, &data) || *((int*)data) != j++) {
+				err_cnt++;
+			}
+			free(data);
+		}
+	}
+
+	while (0 == tm_queue_pop(&queue, &data)) {
+		if (*((int*)data) != j++) {
+			err_cnt++;
+		}
+		free(data);
+	}
+
+	if (1000 != j) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_queue_destroy(&queue);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test value queue and stack */
+	ret = test_value_queue_init(&value_queue, TM_QUEUE_OPTION_MULTI_THREAD);
+	ret |= test_value_stack_init(&value_stack, 0);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	for (j = 0, i = 0; i < 1000; i++) {
+		value.key = i;
+		value.value = -i;
+
+		if (test_value_queue_push(&value_queue, &value) ||
+		    test_value_stack_push(&value_stack, &value)) {
+			err_cnt++;
+		}
+
+		/* Cross segment boundary in both direction */
+		if (i % 3 == 0) {
+			if (test_value_queue_pop(&value_queue, &value) ||
+			    value.key != j || value.value != -j) {
+				err_cnt++;
+			}
+			j++;
+		}
+	}
+
+	while (0 == test_value_queue_pop(&value_queue, &value)) {
+		if (value.key != j || value.value != -j) {
+			err_cnt++;
+		}
+		j++;
+	}
+
+	for (i = 999; 0 == test_value_stack_pop(&value_stack, &value); i--) {
+		if (value.key != i || value.value != -i) {
+			err_cnt++;
+		}
+	}
+
+	if (1000 != j || -1 != i ||
+	    test_value_queue_get_size(&value_queue, &size) || 0 != size) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	test_value_queue_destroy(&value_queue);
+	test_value_stack_destroy(&value_stack);
+
+	/* Test bounded queue */
+	ret = tm_queue_init_bounded(&bounded_queue,
+				    TM_QUEUE_OPTION_MULTI_THREAD, 4);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 4; i++) {
+		if (tm_queue_push(&bounded_queue, (void*)(long)i)) {
+			err_cnt++;
+		}
+	}
+
+	/* Full, fail at once or after timeout */
+	if (0 == tm_queue_push(&bounded_queue, (void*)4l) ||
+	    0 == tm_queue_push_timeout(&bounded_queue, (void*)4l, 10)) {
+		err_cnt++;
+	}
+
+	/* Oldest one is dropped */
+	if (tm_queue_push_drop(&bounded_queue, (void*)4l, &data) ||
+	    0l != (long)data) {
+		err_cnt++;
+	}
+
+	/* Wait until consumer pop element 1 */
+	thrd_create(&producer[0], test_bounded_consumer, NULL);
+
+	if (tm_queue_push_timeout(&bounded_queue, (void*)5l, -1)) {
+		err_cnt++;
+	}
+
+	thrd_join(producer[0], &ret);
+	if (ret) {
+		err_cnt++;
+	}
+
+	for (i = 2; i < 6; i++) {
+		if (tm_queue_pop(&bounded_queue, &data) || (long)data != i) {
+			err_cnt++;
+		}
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_queue_destroy(&bounded_queue);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test queue readiness by eventfd */
+	err_cnt = 0;
+	if (0 == tm_queue_init(&queue, TM_QUEUE_OPTION_MPSC |
+				       TM_QUEUE_OPTION_EVENTFD)) {
+		err_cnt++;
+		tm_queue_destroy(&queue);
+	}
+
+	ret = tm_queue_init(&event_queue, TM_QUEUE_OPTION_MULTI_THREAD |
+					  TM_QUEUE_OPTION_EVENTFD);
+	ret |= tm_queue_get_fd(&event_queue, &pfd.fd);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+	pfd.events = POLLIN;
+
+	if (0 != poll(&pfd, 1, 0)) {
+		err_cnt++;
+	}
+
+	for (i = 0; i < 100; i++) {
+		tm_queue_push(&event_queue, (void*)(long)i);
+	}
+	if (1 != poll(&pfd, 1, 0)) {
+		err_cnt++;
+	}
+
+	/* Still readable until a pop find it empty */
+	if (tm_queue_pop_batch(&event_queue, batch, 64, &number) ||
+	    64 != number || 63 != (long)batch[63] || 1 != poll(&pfd, 1, 0)) {
+		err_cnt++;
+	}
+	if (tm_queue_pop_batch(&event_queue, batch, 64, &number) ||
+	    36 != number || 64 != (long)batch[0] || 0 != poll(&pfd, 1, 0)) {
+		err_cnt++;
+	}
+
+	/* Event loop consumer */
+	thrd_create(&producer[0], test_event_producer, NULL);
+
+	event_expect = 0;
+	while (event_expect < 10000) {
+		if (1 != poll(&pfd, 1, 1000)) {
+			err_cnt++;
+			break;
+		}
+
+		do {
+			tm_queue_pop_batch(&event_queue, batch, 64, &number);
+			for (j = 0; j < (int)number; j++) {
+				if (event_expect++ != (long)batch[j]) {
+					err_cnt++;
+				}
+			}
+		} while (0 != number);
+	}
+
+	thrd_join(producer[0], &ret);
+	if (ret || 0 != poll(&pfd, 1, 0)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	tm_queue_destroy(&event_queue);
+
+	/* Test compact queue */
+	err_cnt = 0;
+	if (0 == tm_queue_init(&queue, TM_QUEUE_OPTION_MPSC |
+				       TM_QUEUE_OPTION_COMPACT)) {
+		err_cnt++;
+		tm_queue_destroy(&queue);
+	}
+
+	ret = tm_queue_init(&queue, TM_QUEUE_OPTION_MULTI_THREAD |
+				    TM_QUEUE_OPTION_COMPACT);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	if (0 == tm_queue_set_option(&queue, TM_QUEUE_OPTION_MULTI_THREAD) ||
+	    0 == tm_queue_set_spill(&queue, "/tmp", 1, &test_codec)) {
+		err_cnt++;
+	}
+
+	/* Grow over several chunks, then reuse freed nodes */
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < 5000; i++) {
+			tm_queue_push(&queue, (void*)(long)i);
+		}
+		for (i = 0; i < 4000; i++) {
+			if (tm_queue_pop(&queue, &data) || i != (long)data) {
+				err_cnt++;
+			}
+		}
+		if (tm_queue_pop_batch(&queue, batch, 64, &number) ||
+		    64 != number || 4000 != (long)batch[0] ||
+		    4063 != (long)batch[63]) {
+			err_cnt++;
+		}
+		while (0 == tm_queue_pop(&queue, &data)) {
+			i++;
+		}
+		if (5000 - 64 != i) {
+			err_cnt++;
+		}
+	}
+
+	tm_queue_push(&queue, NULL);
+	tm_queue_destroy(&queue);
+
+	ret = tm_queue_init_bounded(&queue, TM_QUEUE_OPTION_MULTI_THREAD |
+					    TM_QUEUE_OPTION_COMPACT, 2);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	tm_queue_push(&queue, (void*)1l);
+	tm_queue_push(&queue, (void*)2l);
+	if (0 == tm_queue_push(&queue, (void*)3l) ||
+	    tm_queue_push_drop(&queue, (void*)3l, &data) || 1 != (long)data ||
+	    tm_queue_pop(&queue, &data) || 2 != (long)data ||
+	    tm_queue_pop(&queue, &data) || 3 != (long)data ||
+	    0 == tm_queue_pop(&queue, &data)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	tm_queue_destroy(&queue);
+
+	/* Test queue journal and restore */
+	if (NULL == mkdtemp(journal_dir)) {
+		printf("mkdtemp error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	ret = tm_queue_init(&queue, TM_QUEUE_OPTION_MULTI_THREAD);
+	ret |= tm_queue_set_journal(&queue, journal_dir,
+				    TM_QUEUE_JOURNAL_SYNC_OPERATION, 0,
+				    &test_codec);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 100; i++) {
+		data = malloc(sizeof(int));
+		if (NULL == data) {
+			printf("malloc error @%d\n", __LINE__);
+			exit(-1);
+		}
+		*((int*)data) = i;
+
+		ret = tm_queue_push(&queue, data);
+		if (ret) {
+			printf("push error @%d\n", __LINE__);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < 30; i++) {
+		if (tm_queue_pop(&queue, &data) || *((int*)data) != i) {
+			err_cnt++;
+		}
+		free(data);
+	}
+
+	/* Pop after detach is not recorded, just like a crash */
+	if (tm_queue_set_journal(&queue, NULL, 0, 0, NULL)) {
+		err_cnt++;
+	}
+	while (0 == tm_queue_pop(&queue, &data)) {
+		free(data);
+	}
+	tm_queue_destroy(&queue);
+
+	/* Restart and compact in the middle */
+	ret = tm_queue_init(&queue, TM_QUEUE_OPTION_MULTI_THREAD);
+	ret |= tm_queue_set_journal(&queue, journal_dir,
+				    TM_QUEUE_JOURNAL_SYNC_BATCH, 7,
+				    &test_codec);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 30; i < 40; i++) {
+		if (tm_queue_pop(&queue, &data) || *((int*)data) != i) {
+			err_cnt++;
+		}
+		free(data);
+	}
+
+	if (tm_queue_compact_journal(&queue)) {
+		err_cnt++;
+	}
+
+	for (i = 100; i < 105; i++) {
+		data = malloc(sizeof(int));
+		if (NULL == data) {
+			printf("malloc error @%d\n", __LINE__);
+			exit(-1);
+		}
+		*((int*)data) = i;
+
+		ret = tm_queue_push(&queue, data);
+		if (ret) {
+			printf("push error @%d\n", __LINE__);
+			exit(-1);
+		}
+	}
+
+	if (tm_queue_set_journal(&queue, NULL, 0, 0, NULL)) {
+		err_cnt++;
+	}
+	while (0 == tm_queue_pop(&queue, &data)) {
+		free(data);
+	}
+	tm_queue_destroy(&queue);
+
+	/* Restart from snapshot and journal tail */
+	ret = tm_queue_init(&queue, TM_QUEUE_OPTION_MULTI_THREAD);
+	ret |= tm_queue_set_journal(&queue, journal_dir,
+				    TM_QUEUE_JOURNAL_SYNC_TIME, 10,
+				    &test_codec);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 40; i < 105; i++) {
+		if (tm_queue_pop(&queue, &data) || *((int*)data) != i) {
+			err_cnt++;
+		}
+		free(data);
+	}
+
+	if (0 == tm_queue_pop(&queue, &data)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_queue_destroy(&queue);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	unlinkat(AT_FDCWD, strcat(strcpy(journal_path, journal_dir), "/journal"), 0);
+	unlinkat(AT_FDCWD, strcat(strcpy(journal_path, journal_dir), "/snapshot"), 0);
+	rmdir(journal_dir);
+
+	/* Test MPSC queue */
+	ret = tm_queue_init(&mpsc_queue, TM_QUEUE_OPTION_MPSC);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 4; i++) {
+		thrd_create(&producer[i], test_mpsc_producer, (void*)(long)i);
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 40000; i++) {
+		while (tm_queue_pop(&mpsc_queue, &data));
+
+		/* FIFO per producer */
+		if (((long)data & 0xffffffff) != expect[(long)data >> 32]++) {
+			err_cnt++;
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		thrd_join(producer[i], NULL);
+	}
+
+	if (0 == tm_queue_pop(&mpsc_queue, &data)) {
+		err_cnt++;
+	}
+
+	/* Nothing dropped from a queue not bounded, left one for destroy */
+	data = &data;
+	if (tm_queue_push_drop(&mpsc_queue, (void*)1l, &data) ||
+	    NULL != data) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_queue_destroy(&mpsc_queue);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test multicast ring */
+	ret = tm_ring_multicast_init(&ring, 64,
+				     TM_RING_MULTICAST_OPTION_MULTI_PRODUCER |
+				     TM_RING_MULTICAST_OPTION_WAIT_BLOCK);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	ret = tm_ring_multicast_add_consumer(&ring, NULL, 0, &consumer[0]);
+	ret |= tm_ring_multicast_add_consumer(&ring, &consumer[0], 1,
+					      &consumer[1]);
+	if (ret) {
+		printf("add consumer error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 2; i++) {
+		thrd_create(&producer[i], test_ring_consumer,
+			    (void*)(long)consumer[i]);
+	}
+
+	for (i = 0; i < 10000; i++) {
+		ret = tm_ring_multicast_publish(&ring, (void*)(long)i);
+		if (ret) {
+			printf("publish error @%d\n", __LINE__);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		thrd_join(producer[i], NULL);
+	}
+
+	err_cnt = ring_err_cnt[0] + ring_err_cnt[1];
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_ring_multicast_destroy(&ring);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test hash map */
+	ret = tm_hashmap_init(&map, TM_HASHMAP_OPTION_MULTI_THREAD);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 4; i++) {
+		thrd_create(&producer[i], test_hashmap_insert, (void*)(long)i);
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 4; i++) {
+		thrd_join(producer[i], &ret);
+		if (ret) {
+			err_cnt++;
+		}
+	}
+
+	/* Erase odd keys */
+	for (i = 1; i < 100000; i += 2) {
+		if (tm_hashmap_erase(&map, i, &data) || (long)data != i * 3) {
+			err_cnt++;
+		}
+	}
+
+	for (i = 0; i < 100000; i++) {
+		ret = tm_hashmap_find(&map, i, &data);
+		if ((i & 1) ? !ret : (ret || (long)data != i * 3)) {
+			err_cnt++;
+		}
+	}
+
+	if (tm_hashmap_get_size(&map, &size) || 50000 != size) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_hashmap_destroy(&map);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test skip list */
+	ret = tm_skiplist_init(&skiplist);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	atomic_store(&skiplist_stop, 0);
+	thrd_create(&producer[4], test_skiplist_scanner, NULL);
+	for (i = 0; i < 4; i++) {
+		thrd_create(&producer[i], test_skiplist_worker, (void*)(long)i);
+	}
+	for (i = 0; i < 4; i++) {
+		thrd_join(producer[i], &ret);
+		if (ret) {
+			err_cnt++;
+		}
+	}
+	atomic_store(&skiplist_stop, 1);
+	thrd_join(producer[4], NULL);
+
+	/* Churn keys left over */
+	tm_skiplist_scan(&skiplist, 1000000, ~0ul, test_skiplist_erase, NULL);
+
+	for (i = 0; i < 20000; i++) {
+		ret = tm_skiplist_find(&skiplist, i, &data);
+		if ((i & 1) ? !ret : (ret || (long)data != i * 3)) {
+			err_cnt++;
+		}
+	}
+
+	if (tm_skiplist_get_size(&skiplist, &size) || 10000 != size ||
+	    0 != atomic_load(&skiplist_error)) {
+		err_cnt++;
+	}
+
+	/* Update in place, then scan stop early */
+	number = 0;
+	if (tm_skiplist_insert(&skiplist, 100, (void*)1l) ||
+	    tm_skiplist_find(&skiplist, 100, &data) || 1 != (long)data ||
+	    tm_skiplist_scan(&skiplist, 100, 199, test_skiplist_count,
+			     &number) || 10 != number) {
+		err_cnt++;
+	}
+
+	tm_skiplist_destroy(&skiplist);
+
+	/* Update race with erase, last value is erased or still there */
+	tm_skiplist_init(&skiplist);
+	atomic_store(&skiplist_stop, 0);
+	thrd_create(&producer[0], test_skiplist_eraser, NULL);
+	for (i = 1; i <= 100000; i++) {
+		if (tm_skiplist_insert(&skiplist, 7, (void*)(long)i)) {
+			err_cnt++;
+		}
+	}
+	atomic_store(&skiplist_stop, 1);
+	thrd_join(producer[0], &ret);
+	if (0 != atomic_load(&skiplist_error) ||
+	    (100000 != ret && (tm_skiplist_find(&skiplist, 7, &data) ||
+			       100000 != (long)data))) {
+		err_cnt++;
+	}
+	tm_skiplist_destroy(&skiplist);
+
+	/* Lists share pools, more lists than thread specific storage keys */
+	for (i = 0; i < 300; i++) {
+		if (tm_skiplist_init(&skiplist_many[i]) ||
+		    tm_skiplist_insert(&skiplist_many[i], i, (void*)1l)) {
+			err_cnt++;
+			break;
+		}
+	}
+	for (i--; i >= 0; i--) {
+		if (tm_skiplist_find(&skiplist_many[i], i, &data) ||
+		    tm_skiplist_destroy(&skiplist_many[i])) {
+			err_cnt++;
+		}
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	/* Test object pool */
+	ret = tm_pool_init(&pool, 2 * sizeof(long), 128, TM_POOL_OPTION_GROW);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 4; i++) {
+		thrd_create(&producer[i], test_pool_worker, (void*)(long)i);
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 4; i++) {
+		thrd_join(producer[i], &ret);
+		if (ret) {
+			err_cnt++;
+		}
+	}
+
+	/* All objects back */
+	if (tm_pool_get_stats(&pool, &size, &used) || used) {
+		err_cnt++;
+	}
+
+	/* Grow beyond first slab */
+	for (i = 0; i < 200; i++) {
+		if (tm_pool_alloc(&pool, &data)) {
+			err_cnt++;
+		}
+	}
+
+	if (tm_pool_get_stats(&pool, &size, &used) || size < 256 ||
+	    200 != used) {
+		err_cnt++;
+	}
+
+	/* Double free, foreign and interior pointer are refused */
+	if (tm_pool_free(&pool, data) || !tm_pool_free(&pool, data) ||
+	    !tm_pool_free(&pool, &size) ||
+	    !tm_pool_free(&pool, (char*)data + 8) ||
+	    tm_pool_get_stats(&pool, &size, &used) || 199 != used) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_pool_destroy(&pool);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test shared memory queue, producer in another process */
+	ret = tm_shm_queue_init(&shm_queue, NULL, 4096,
+				TM_SHM_QUEUE_OPTION_CREATE);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	tm_shm_queue_get_fd(&shm_queue, &shm_fd);
+
+	pid = fork();
+	if (0 == pid) {
+		tm_shm_queue_t child_queue;
+
+		if (tm_shm_queue_init_fd(&child_queue, shm_fd)) {
+			_exit(1);
+		}
+
+		for (i = 0; i < 1000; i++) {
+			memset(wbuf, i & 0xff, i % 200);
+			while (tm_shm_queue_push(&child_queue, wbuf, i % 200));
+		}
+
+		tm_shm_queue_destroy(&child_queue);
+		_exit(0);
+	}
+
+	err_cnt = 0;
+	for (i = 0; i < 1000; i++) {
+		do {
+			size = sizeof(rbuf);
+			ret = tm_shm_queue_pop(&shm_queue, rbuf, &size);
+		} while (ret && 0 == size);
+
+		if (ret || size != (unsigned long)(i % 200)) {
+			err_cnt++;
+			continue;
+		}
+
+		for (j = 0; j < (int)size; j++) {
+			if (rbuf[j] != (char)(i & 0xff)) {
+				err_cnt++;
+				break;
+			}
+		}
+	}
+
+	waitpid(pid, &ret, 0);
+	if (ret) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	ret = tm_shm_queue_destroy(&shm_queue);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	/* Test thread pool */
+	ret = tm_thread_pool_init(&thread_pool, 4,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 100; i++) {
+		ret = tm_thread_pool_task_init(&task[i], test_task_entry,
+					       (void*)(long)i, test_task_event,
+					       0);
+		if (ret) {
+			printf("task init error @%d\n", __LINE__);
+			exit(-1);
+		}
+
+		ret = tm_thread_pool_task_commit(&thread_pool, &task[i]);
+		if (ret) {
+			printf("commit error @%d\n", __LINE__);
+			exit(-1);
+		}
+	}
+
+	ret = tm_thread_pool_destroy(&thread_pool);
+	if (ret) {
+		printf("destory error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 100; i++) {
+		tm_thread_pool_task_destroy(&task[i]);
+	}
+
+	err_cnt = 0;
+	if (4950 != atomic_load(&task_sum) || 100 != atomic_load(&task_end_cnt)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	/* Test thread pool parking, one task at a time to parked workers */
+	ret = tm_thread_pool_init(&thread_pool, 4,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	ret |= tm_thread_pool_task_init(&task[0], test_task_entry, (void*)1l,
+					test_task_event, 0);
+	ret |= tm_thread_pool_task_init(&task[1], test_sleep_entry,
+					(void*)200l, NULL, 0);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	atomic_store(&task_end_cnt, 0);
+	for (i = 0; i < 2000 && 0 == err_cnt; i++) {
+		/* Let searching workers give up and park */
+		if (0 == i % 100) {
+			thrd_sleep(&(struct timespec){ .tv_nsec = 2000000 },
+				   NULL);
+		}
+
+		tm_thread_pool_task_commit(&thread_pool, &task[0]);
+
+		/* A lost wakeup leave it waiting here */
+		timespec_get(&ts, TIME_UTC);
+		ts.tv_sec += 2;
+		while (i + 1 != atomic_load(&task_end_cnt)) {
+			timespec_get(&now, TIME_UTC);
+			if (now.tv_sec > ts.tv_sec) {
+				err_cnt++;
+				break;
+			}
+			thrd_yield();
+		}
+	}
+
+	/* Idle workers park while destroy wait for a long task */
+	tm_thread_pool_task_commit(&thread_pool, &task[1]);
+	thrd_sleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	used = clock();
+	tm_thread_pool_destroy(&thread_pool);
+	if (clock() - used > CLOCKS_PER_SEC / 20) {
+		err_cnt++;
+	}
+
+	tm_thread_pool_task_destroy(&task[0]);
+	tm_thread_pool_task_destroy(&task[1]);
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	/* Test completion queue, smaller than tasks in flight */
+	ret = tm_thread_pool_init(&thread_pool, 4,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	ret |= tm_thread_pool_cq_init(&cq, 10);
+	for (i = 0; i < 100; i++) {
+		ret |= tm_thread_pool_task_init(&task[i], test_task_entry,
+						(void*)(long)i, test_task_event,
+						99 == i ?
+					TM_THREAD_POOL_TASK_OPTION_NO_RETURN : 0);
+		ret |= tm_thread_pool_task_set_cq(&task[i], &cq, &task[i]);
+	}
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	atomic_store(&task_sum, 0);
+	atomic_store(&task_end_cnt, 0);
+	for (i = 0; i < 100; i++) {
+		tm_thread_pool_task_commit(&thread_pool, &task[i]);
+	}
+
+	/* Reaped task 0 is committed again once */
+	sum = 0;
+	j = 0;
+	while (j < 101) {
+		if (tm_thread_pool_cq_reap(&cq, cqe, 8, 101 - j < 3 ?
+					   101 - j : 3, &number) ||
+		    number < (101 - j < 3 ? 101 - j : 3)) {
+			err_cnt++;
+			break;
+		}
+
+		for (i = 0; i < (int)number; i++) {
+			ret = (tm_thread_pool_task_t*)cqe[i].tag - task;
+			if (ret < 0 || ret >= 100 ||
+			    (long)cqe[i].status != (99 == ret ? 0 : ret)) {
+				err_cnt++;
+			}
+			sum += ret;
+			if (0 == ret && 0 == requeued++) {
+				tm_thread_pool_task_commit(&thread_pool,
+							   &task[0]);
+			}
+		}
+		j += number;
+	}
+
+	if (4950 != sum || 4950 != atomic_load(&task_sum) ||
+	    0 != atomic_load(&task_end_cnt) ||
+	    0 == tm_thread_pool_cq_reap(&cq, cqe, 2, 3, &number) ||
+	    tm_thread_pool_cq_reap(&cq, cqe, 8, 0, &number) || 0 != number) {
+		err_cnt++;
+	}
+
+	tm_thread_pool_destroy(&thread_pool);
+	for (i = 0; i < 100; i++) {
+		tm_thread_pool_task_destroy(&task[i]);
+	}
+	tm_thread_pool_cq_destroy(&cq);
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	/* Test partitioned queue with manual lease */
+	ret = tm_partition_queue_init(&partition_queue, 8);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 10; i++) {
+		for (j = 0; j < 64; j++) {
+			ret = tm_partition_queue_push(&partition_queue, j,
+						(void*)(((long)j << 32) | i));
+			if (ret) {
+				printf("push error @%d\n", __LINE__);
+				exit(-1);
+			}
+		}
+	}
+
+	err_cnt = 0;
+	i = 0;
+	while (0 == tm_partition_queue_acquire(&partition_queue, &partition)) {
+		/* Leased partition is not given again */
+		if (0 == tm_partition_queue_acquire(&partition_queue, &size)) {
+			if (size == partition) {
+				err_cnt++;
+			}
+			tm_partition_queue_release(&partition_queue, size);
+		}
+
+		for (j = 0; j < 3; j++) {
+			if (tm_partition_queue_pop(&partition_queue, partition,
+						   &data)) {
+				break;
+			}
+			test_partition_handler(data, NULL);
+			i++;
+		}
+
+		tm_partition_queue_release(&partition_queue, partition);
+	}
+
+	if (640 != i || 0 != atomic_load(&partition_error)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	tm_partition_queue_destroy(&partition_queue);
+
+	/* Test partitioned queue drained by thread pool */
+	memset(partition_expect, 0, sizeof(partition_expect));
+	atomic_store(&partition_done, 0);
+
+	ret = tm_thread_pool_init(&thread_pool, 4,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	ret |= tm_partition_queue_init(&partition_queue, 16);
+	ret |= tm_partition_queue_set_thread_pool(&partition_queue,
+						  &thread_pool,
+						  test_partition_handler,
+						  NULL, 8);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	for (i = 0; i < 100; i++) {
+		for (j = 0; j < 64; j++) {
+			ret = tm_partition_queue_push(&partition_queue, j,
+						(void*)(((long)j << 32) | i));
+			if (ret) {
+				printf("push error @%d\n", __LINE__);
+				exit(-1);
+			}
+		}
+	}
+
+	/* All drain tasks are done before pool exit */
+	tm_thread_pool_destroy(&thread_pool);
+
+	err_cnt = 0;
+	if (6400 != atomic_load(&partition_done) ||
+	    0 != atomic_load(&partition_error)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	tm_partition_queue_destroy(&partition_queue);
+
+	/* Test staged pipeline */
+	atomic_store(&pipeline_sum, 0);
+
+	ret = tm_thread_pool_init(&thread_pool, 4,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	ret |= tm_pipeline_init(&pipeline, &thread_pool,
+				TM_PIPELINE_OPTION_ADAPTIVE);
+	ret |= tm_pipeline_add_stage(&pipeline, test_pipeline_double, NULL,
+				     4, 64);
+	ret |= tm_pipeline_add_stage(&pipeline, test_pipeline_filter, NULL,
+				     4, 16);
+	ret |= tm_pipeline_add_stage(&pipeline, test_pipeline_sum, NULL,
+				     1, 16);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	sum = 0;
+	for (i = 1; i <= 10000; i++) {
+		ret = tm_pipeline_push(&pipeline, (void*)(long)i, -1);
+		if (ret) {
+			printf("push error @%d\n", __LINE__);
+			exit(-1);
+		}
+		if (0 != (i * 2) % 3) {
+			sum += i * 2;
+		}
+
+		/* Even share of 4 workers, capped by concurrency */
+		if (1 == i) {
+			tm_pipeline_get_stats(&pipeline, 0, &stats[0]);
+			tm_pipeline_get_stats(&pipeline, 2, &stats[2]);
+		}
+	}
+
+	err_cnt = 0;
+	if (2 != stats[0].concurrency || 1 != stats[2].concurrency) {
+		err_cnt++;
+	}
+
+	/* No stage can be added once started */
+	if (0 == tm_pipeline_add_stage(&pipeline, test_pipeline_sum, NULL,
+				       1, 16)) {
+		err_cnt++;
+	}
+
+	/* Wait for all items, multiples of 3 are dropped by stage 1 */
+	do {
+		thrd_yield();
+		tm_pipeline_get_stats(&pipeline, 2, &stats[2]);
+	} while (6667 != stats[2].processed);
+
+	tm_pipeline_get_stats(&pipeline, 0, &stats[0]);
+	tm_pipeline_get_stats(&pipeline, 1, &stats[1]);
+	if (10000 != stats[0].processed || 10000 != stats[1].processed ||
+	    0 != stats[0].depth || 0 == stats[0].concurrency ||
+	    0 == stats[0].throughput) {
+		err_cnt++;
+	}
+
+	tm_pipeline_destroy(&pipeline);
+	tm_thread_pool_destroy(&thread_pool);
+
+	if (sum != atomic_load(&pipeline_sum)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	/* Test coroutines, 1100 of them on 2 workers */
+	atomic_store(&coroutine_sum, 0);
+	coroutine_seen = 0;
+
+	ret = tm_thread_pool_init(&thread_pool, 2,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	ret |= tm_coroutine_scheduler_init(&coroutine_scheduler, &thread_pool,
+					   0);
+	ret |= tm_coroutine_queue_init(&coroutine_queue);
+	ret |= tm_coroutine_group_init(&coroutine_group);
+	ret |= tm_coroutine_group_init(&group);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	ret = 0;
+	for (i = 0; i < 100; i++) {
+		ret |= tm_coroutine_spawn(&coroutine_scheduler,
+					  &coroutine_group,
+					  test_coroutine_consumer, NULL);
+	}
+	for (i = 0; i < 1000; i++) {
+		ret |= tm_coroutine_spawn(&coroutine_scheduler,
+					  &coroutine_group,
+					  test_coroutine_producer,
+					  (void*)(long)i);
+	}
+	ret |= tm_coroutine_spawn(&coroutine_scheduler, &group,
+				  test_coroutine_waiter, NULL);
+	if (ret) {
+		printf("spawn error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	tm_coroutine_group_wait(&group);
+
+	err_cnt = 0;
+	if (499500 != coroutine_seen) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	tm_coroutine_scheduler_destroy(&coroutine_scheduler);
+	tm_coroutine_group_destroy(&group);
+	tm_coroutine_group_destroy(&coroutine_group);
+	tm_coroutine_queue_destroy(&coroutine_queue);
+	tm_thread_pool_destroy(&thread_pool);
+
+	/* Test parallel for and reduce */
+	ret = tm_thread_pool_init(&thread_pool, 4,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_CPU);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	err_cnt = 0;
+	memset(parallel_visit, 0, sizeof(parallel_visit));
+	ret = tm_parallel_for(&thread_pool, 0, sizeof(parallel_visit), 0,
+			      test_parallel_for_entry, NULL);
+	ret |= tm_parallel_for(&thread_pool, 10, sizeof(parallel_visit), 7,
+			       test_parallel_for_entry, NULL);
+	for (i = 0; i < (int)sizeof(parallel_visit); i++) {
+		if (parallel_visit[i] != (i < 10 ? 1 : 2)) {
+			err_cnt++;
+			break;
+		}
+	}
+
+	ret |= tm_parallel_reduce(&thread_pool, 0, 1000000, 1000,
+				  test_parallel_reduce_entry,
+				  test_parallel_combine, NULL, &result);
+	if (999999l * 1000000 / 2 != (long)result) {
+		err_cnt++;
+	}
+
+	ret |= tm_parallel_reduce(&thread_pool, 5, 5, 0,
+				  test_parallel_reduce_entry,
+				  test_parallel_combine, NULL, &result);
+	if (NULL != result) {
+		err_cnt++;
+	}
+
+	for (i = 0; i < 8; i++) {
+		ret |= tm_thread_pool_task_init(&task[i],
+						test_parallel_task_entry,
+						&thread_pool, NULL, 0);
+		ret |= tm_thread_pool_task_commit(&thread_pool, &task[i]);
+	}
+
+	tm_thread_pool_destroy(&thread_pool);
+	if (ret || 0 != atomic_load(&parallel_error)) {
+		err_cnt++;
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	for (i = 0; i < 8; i++) {
+		tm_thread_pool_task_destroy(&task[i]);
+	}
+
+	/* Test thread pool asynchronous file operation */
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("mkstemp error @%d\n", __LINE__);
+		exit(-1);
+	}
+	unlink(path);
+
+	for (i = 0; i < (int)sizeof(wbuf); i++) {
+		wbuf[i] = (char)i;
+	}
+	memset(rbuf, 0, sizeof(rbuf));
+
+	err_cnt = 0;
+	/* io_uring if available */
+	if (test_io(fd, TM_THREAD_POOL_OPTION_INTENSIVE_IO,
+		    TM_THREAD_POOL_IO_OPCODE_WRITE, wbuf, sizeof(wbuf))) {
+		err_cnt++;
+	}
+	if (test_io(fd, TM_THREAD_POOL_OPTION_INTENSIVE_IO,
+		    TM_THREAD_POOL_IO_OPCODE_FSYNC, NULL, 0)) {
+		err_cnt++;
+	}
+	/* Worker thread fallback */
+	if (test_io(fd, TM_THREAD_POOL_OPTION_INTENSIVE_CPU,
+		    TM_THREAD_POOL_IO_OPCODE_READ, rbuf, sizeof(rbuf))) {
+		err_cnt++;
+	}
+	if (memcmp(wbuf, rbuf, sizeof(wbuf))) {
+		err_cnt++;
+	}
+
+	/* Continuation of an operation committed during destroy still run */
+	ret = tm_thread_pool_init(&io_pool, 2,
+				  TM_THREAD_POOL_OPTION_INTENSIVE_IO);
+	ret |= tm_thread_pool_task_init(&task[0], test_io_chain_entry, NULL,
+					test_task_event, 0);
+	ret |= tm_thread_pool_task_init(&io_next, test_task_entry, NULL,
+					test_task_event, 0);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	memset(&io_chain, 0, sizeof(io_chain));
+	io_chain.opcode = TM_THREAD_POOL_IO_OPCODE_READ;
+	io_chain.fd = fd;
+	io_chain.buf = rbuf;
+	io_chain.length = sizeof(rbuf);
+
+	atomic_store(&task_end_cnt, 0);
+	tm_thread_pool_task_commit(&io_pool, &task[0]);
+	tm_thread_pool_destroy(&io_pool);
+	tm_thread_pool_task_destroy(&task[0]);
+	tm_thread_pool_task_destroy(&io_next);
+
+	if (2 != atomic_load(&task_end_cnt) ||
+	    (long)sizeof(rbuf) != io_chain.result) {
+		err_cnt++;
+	}
+
+	/* Far more operations than io_uring completion queue can hold */
+	io_many = (tm_thread_pool_io_t*)calloc(4096, sizeof(*io_many));
+	io_task = (tm_thread_pool_task_t*)malloc(4096 * sizeof(*io_task));
+	ret = NULL == io_many || NULL == io_task;
+	ret |= tm_thread_pool_init(&io_pool, 2,
+				   TM_THREAD_POOL_OPTION_INTENSIVE_IO);
+	if (ret) {
+		printf("init error @%d\n", __LINE__);
+		exit(-1);
+	}
+
+	atomic_store(&task_end_cnt, 0);
+	for (i = 0; i < 4096; i++) {
+		tm_thread_pool_task_init(&io_task[i], test_task_entry, NULL,
+					 test_task_event, 0);
+		io_many[i].opcode = TM_THREAD_POOL_IO_OPCODE_READ;
+		io_many[i].fd = fd;
+		io_many[i].buf = rbuf + i % 4032;
+		io_many[i].length = 64;
+		io_many[i].offset = i % 4032;
+		if (tm_thread_pool_io_commit(&io_pool, &io_many[i],
+					     &io_task[i])) {
+			err_cnt++;
+		}
+	}
+
+	tm_thread_pool_destroy(&io_pool);
+	if (4096 != atomic_load(&task_end_cnt)) {
+		err_cnt++;
+	}
+
+	for (i = 0; i < 4096; i++) {
+		if (64 != io_many[i].result) {
+			err_cnt++;
+		}
+		tm_thread_pool_task_destroy(&io_task[i]);
+	}
+	free(io_many);
+	free(io_task);
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	close(fd);
+
 
 	return 0;
 }
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019 Ding Tao <i@dingtao.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "tm_value.hpp"
+
+int main(void)
+{
+	int i;
+	int err_cnt;
+
+	/* Test move only values across segments */
+	err_cnt = 0;
+	{
+		teemo::value_queue<std::unique_ptr<int>> queue(
+						TM_QUEUE_OPTION_MULTI_THREAD);
+		std::unique_ptr<int> value;
+
+		for (i = 0; i < 2000; i++) {
+			if (queue.push(std::unique_ptr<int>(new int(i)))) {
+				err_cnt++;
+			}
+		}
+
+		for (i = 0; i < 1000; i++) {
+			if (queue.pop(&value) || nullptr == value ||
+			    i != *value) {
+				err_cnt++;
+			}
+		}
+
+		if (1000 != queue.size()) {
+			err_cnt++;
+		}
+
+		/* Rest are released by destructor */
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	/* Test non trivial values, LIFO */
+	err_cnt = 0;
+	{
+		teemo::value_stack<std::string> stack;
+		std::string value;
+
+		for (i = 0; i < 2000; i++) {
+			if (stack.emplace(std::to_string(i) +
+					  " long enough to be on heap")) {
+				err_cnt++;
+			}
+		}
+
+		for (i = 1999; i >= 1000; i--) {
+			if (stack.pop(&value) ||
+			    std::to_string(i) + " long enough to be on heap" !=
+			    value) {
+				err_cnt++;
+			}
+		}
+
+		if (1000 != stack.size() || 0 != stack.pop(nullptr) ||
+		    999 != stack.size()) {
+			err_cnt++;
+		}
+	}
+	printf("ERR_CNT = %d\n", err_cnt);
+
+	return 0;
+}